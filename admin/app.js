@@ -4,6 +4,8 @@
 
 // Use relative URL - served from same origin via Nginx, no CORS issues
 const API_BASE = '/db-admin';
+// Read snapshot of the database (plugin_opt_snapshot_dir) for heavy custom queries
+const SNAPSHOT_API_BASE = '/db-snapshot';
 
 // =============================================================================
 // State Variables
@@ -19,7 +21,16 @@ let mqttClient = null;
 let mqttMessagesMap = new Map();
 const MAX_TOPICS = 5000;
 const MAX_DB_RESULTS = 5000;  // Maximum rows to return from database queries
-const MQTT_TOPIC = '#';  // Subscribe to all topics
+const MQTT_TOPIC = '#';  // Live-only fallback when the topic tree is unavailable
+// Topic tree served by the SQL plugin (plugin_opt_topic_tree)
+const TOPIC_TREE_TOPIC = '$CONTROL/libsql/v1/tree';
+const TOPIC_TREE_RESPONSE_TOPIC = '$CONTROL/libsql/v1/tree/response';
+const TOPIC_TREE_TIMEOUT_MS = 3000;
+const TOPIC_TREE_PAGE_SIZE = 200;
+let topicTreeResponseTopic = null;
+let topicTreePending = new Map();  // correlation id -> { resolve, reject, timer }
+let topicTreeRequestId = 0;
+let topicTreeSelection = null;  // Subscribed filter of the selected node
 
 // =============================================================================
 // Utility Functions
@@ -364,7 +375,7 @@ function performLogout() {
     }
 }
 
-async function executeSQL(sql) {
+async function executeSQL(sql, apiBase = API_BASE) {
     try {
         const headers = {
             'Content-Type': 'application/json',
@@ -377,7 +388,7 @@ async function executeSQL(sql) {
             headers['Authorization'] = authHeader;
         }
         
-        const response = await fetch(`${API_BASE}/v1/execute`, {
+        const response = await fetch(`${apiBase}/v1/execute`, {
             method: 'POST',
             headers: headers,
             body: JSON.stringify({
@@ -524,7 +535,9 @@ async function executeCustomQuery() {
     showLoading();
     
     try {
-        const result = await executeSQL(query);
+        // Heavy queries can run on the snapshot so they don't hold up ingest
+        const useSnapshot = document.getElementById('snapshotQuery').checked;
+        const result = await executeSQL(query, useSnapshot ? SNAPSHOT_API_BASE : API_BASE);
         displayResults(result, limitEnforced);
     } catch (error) {
         showMessage(`Error: ${error.message}`, 'error');
@@ -1435,22 +1448,26 @@ async function initMqttConnection() {
         mqttClient.on('connect', () => {
             console.log('MQTT connected');
             
-            // Subscribe to topic with:
-            // - rap: Retain As Published - preserve retain flag on forwarded messages
-            // - rh: Retain Handling 0 - send retained messages at subscribe time
-            // - qos: Quality of Service level
-            mqttClient.subscribe(MQTT_TOPIC, { rap: true, rh: 0, qos: 1 }, (err, granted) => {
+            // Tree responses come back on a per-connection topic; the retained messages of
+            // the whole broker are no longer pulled at connect time
+            topicTreeResponseTopic = `${TOPIC_TREE_RESPONSE_TOPIC}/${mqttClient.options.clientId}`;
+            mqttClient.subscribe(topicTreeResponseTopic, { qos: 1 }, (err) => {
                 if (err) {
                     console.error('Subscribe error:', err);
                     updateMqttStatus('Error', '❌', 'var(--ctp-red)');
-                } else {
-                    console.log('Subscribed to:', MQTT_TOPIC, 'granted:', granted);
-                    updateMqttStatus(`Connected`, '🟢', 'var(--ctp-green)');
+                    return;
                 }
+                updateMqttStatus(`Connected`, '🟢', 'var(--ctp-green)');
+                loadTopicTree();
             });
         });
 
         mqttClient.on('message', (topic, payload, packet) => {
+            if (topic === topicTreeResponseTopic) {
+                handleTopicTreeResponse(payload, packet);
+                return;
+            }
+            
             const payloadStr = payload.toString();
             
             // Empty payload with retain flag means the retained message is being cleared
@@ -1554,6 +1571,195 @@ function updateMqttStatus(text, icon, color) {
     }
 }
 
+// =============================================================================
+// Topic Tree Functions
+// =============================================================================
+
+// Ask the SQL plugin for one level of the topic tree. path null = the top level; after
+// continues a level after the child of that name. Resolves with the parsed summary
+function requestTopicTree(path, after) {
+    return new Promise((resolve, reject) => {
+        const id = String(++topicTreeRequestId);
+        const lines = [];
+        if (path !== null) lines.push(`path ${path}`);
+        if (after) lines.push(`after ${after}`);
+        lines.push(`limit ${TOPIC_TREE_PAGE_SIZE}`);
+        
+        const timer = setTimeout(() => {
+            topicTreePending.delete(id);
+            reject(new Error('No response from the topic tree'));
+        }, TOPIC_TREE_TIMEOUT_MS);
+        topicTreePending.set(id, { resolve, reject, timer });
+        
+        const properties = { responseTopic: topicTreeResponseTopic, correlationData: id };
+        mqttClient.publish(TOPIC_TREE_TOPIC, lines.join('\n'), { qos: 1, properties: properties }, (err) => {
+            if (err) {
+                clearTimeout(timer);
+                topicTreePending.delete(id);
+                reject(err);
+            }
+        });
+    });
+}
+
+function handleTopicTreeResponse(payload, packet) {
+    const correlation = packet.properties && packet.properties.correlationData;
+    const id = correlation ? correlation.toString() : null;
+    const pending = id !== null ? topicTreePending.get(id) : null;
+    if (!pending) return;
+    
+    clearTimeout(pending.timer);
+    topicTreePending.delete(id);
+    try {
+        const summary = JSON.parse(payload.toString());
+        if (summary.error) {
+            pending.reject(new Error(summary.error));
+        } else {
+            pending.resolve(summary);
+        }
+    } catch (err) {
+        pending.reject(err);
+    }
+}
+
+// Load the top level of the tree, or fall back to live messages of all topics (without
+// the retained ones) when the plugin does not serve it
+async function loadTopicTree() {
+    const container = document.getElementById('topic-tree');
+    const status = document.getElementById('topicTreeStatus');
+    if (!container || !mqttClient || !mqttClient.connected) return;
+    
+    try {
+        const summary = await requestTopicTree(null, null);
+        container.innerHTML = '';
+        renderTopicTreeLevel(container, null, summary);
+        if (status) {
+            status.textContent = `${summary.topics} topics, ${summary.messages} messages, ${summary.retained} retained` +
+                (summary.loaded ? '' : ' (counting stored messages…)');
+        }
+        if (topicTreeSelection) {
+            mqttClient.subscribe(topicTreeSelection, { rap: true, rh: 0, qos: 1 });
+        }
+    } catch (err) {
+        console.warn('Topic tree unavailable:', err.message);
+        container.innerHTML = '';
+        if (status) status.textContent = 'Topic tree unavailable (plugin_opt_topic_tree), showing live messages';
+        // Retain Handling 2: no retained messages at subscribe time
+        mqttClient.subscribe(MQTT_TOPIC, { rap: true, rh: 2, qos: 1 }, (subErr) => {
+            if (subErr) {
+                console.error('Subscribe error:', subErr);
+                updateMqttStatus('Error', '❌', 'var(--ctp-red)');
+            }
+        });
+    }
+}
+
+// Append the children in summary to container, plus a "more" entry if the level has more
+function renderTopicTreeLevel(container, path, summary) {
+    summary.nodes.forEach(node => {
+        const nodePath = path === null ? node.name : `${path}/${node.name}`;
+        const item = document.createElement('div');
+        item.className = 'tree-node';
+        
+        const row = document.createElement('div');
+        row.className = 'tree-row';
+        row.dataset.path = nodePath;
+        
+        const toggle = document.createElement('span');
+        toggle.className = 'tree-toggle';
+        toggle.textContent = node.children > 0 ? '▸' : '';
+        
+        const name = document.createElement('span');
+        name.className = 'tree-name';
+        name.textContent = node.name === '' ? '(empty)' : node.name;
+        name.title = nodePath;
+        
+        const counts = document.createElement('span');
+        counts.className = 'tree-counts';
+        counts.textContent = node.children > 0
+            ? `${node.topics} topics, ${node.messages} msgs`
+            : `${node.count} msgs`;
+        
+        row.appendChild(toggle);
+        row.appendChild(name);
+        if (node.retain || node.retained > 0) {
+            const retain = document.createElement('span');
+            retain.className = 'retain-check';
+            retain.textContent = '✓';
+            retain.title = `${node.retained} retained`;
+            row.appendChild(retain);
+        }
+        row.appendChild(counts);
+        item.appendChild(row);
+        
+        const children = document.createElement('div');
+        children.className = 'tree-children';
+        item.appendChild(children);
+        
+        toggle.addEventListener('click', () => toggleTopicTreeNode(nodePath, toggle, children));
+        name.addEventListener('click', () => selectTopicTreeNode(nodePath, row));
+        container.appendChild(item);
+    });
+    
+    if (summary.more && summary.nodes.length > 0) {
+        const more = document.createElement('div');
+        more.className = 'tree-more';
+        more.textContent = 'more…';
+        const after = summary.nodes[summary.nodes.length - 1].name;
+        more.addEventListener('click', async () => {
+            more.remove();
+            try {
+                renderTopicTreeLevel(container, path, await requestTopicTree(path, after));
+            } catch (err) {
+                showMessage(`Failed to load topics: ${err.message}`, 'error');
+            }
+        });
+        container.appendChild(more);
+    }
+}
+
+// Expand a node by requesting its children (again on every expand, so counts are fresh)
+async function toggleTopicTreeNode(path, toggle, children) {
+    if (toggle.textContent === '▾') {
+        toggle.textContent = '▸';
+        children.innerHTML = '';
+        return;
+    }
+    toggle.textContent = '▾';
+    try {
+        const summary = await requestTopicTree(path, null);
+        children.innerHTML = '';
+        renderTopicTreeLevel(children, path, summary);
+    } catch (err) {
+        toggle.textContent = '▸';
+        showMessage(`Failed to load topics: ${err.message}`, 'error');
+    }
+}
+
+// Show the messages of a node and everything below it: only that subtree is subscribed to,
+// so only its retained messages are sent
+function selectTopicTreeNode(path, row) {
+    const filter = `${path}/#`;
+    if (filter === topicTreeSelection) return;
+    
+    if (topicTreeSelection) {
+        mqttClient.unsubscribe(topicTreeSelection);
+    }
+    topicTreeSelection = filter;
+    mqttMessagesMap.clear();
+    displayMqttMessages();
+    
+    document.querySelectorAll('#topic-tree .tree-row.selected').forEach(el => el.classList.remove('selected'));
+    row.classList.add('selected');
+    
+    mqttClient.subscribe(filter, { rap: true, rh: 0, qos: 1 }, (err) => {
+        if (err) {
+            console.error('Subscribe error:', err);
+            showMessage(`Failed to subscribe to ${filter}: ${err.message}`, 'error');
+        }
+    });
+}
+
 // Publish a message to the MQTT broker
 function publishMessage() {
     // Check if user is logged in
@@ -7,7 +7,7 @@ MAX_RESTART_ATTEMPTS=3
 # Function to handle shutdown
 shutdown() {
     echo "Shutting down services..."
-    kill $NGINX_PID $SQLD_PID $MOSQUITTO_PID 2>/dev/null || true
+    kill $NGINX_PID $SQLD_PID $SNAPSHOT_SQLD_PID $MOSQUITTO_PID 2>/dev/null || true
     exit 0
 }
 
@@ -38,6 +38,15 @@ restart_service() {
                     return 0
                 fi
                 ;;
+            sqld-snapshot)
+                sqld $SNAPSHOT_SQLD_ARGS &
+                SNAPSHOT_SQLD_PID=$!
+                sleep 2
+                if kill -0 $SNAPSHOT_SQLD_PID 2>/dev/null; then
+                    echo "$service_name restarted successfully"
+                    return 0
+                fi
+                ;;
             mosquitto)
                 /usr/sbin/mosquitto -c /mosquitto/config/mosquitto.conf &
                 MOSQUITTO_PID=$!
@@ -69,6 +78,10 @@ if [ ! -w /mosquitto/data ]; then
     exit 1
 fi
 
+# Payload file store of the SQL plugin (plugin_opt_offload_dir), served by nginx under /payloads/
+OFFLOAD_DIR=$(sed -n 's/^[[:space:]]*plugin_opt_offload_dir[[:space:]]\{1,\}//p' /mosquitto/config/mosquitto.conf | tail -n 1 | xargs)
+echo "alias ${OFFLOAD_DIR:-/mosquitto/data/payloads}/;" > /tmp/nginx-payloads.conf
+
 # Start nginx for serving admin interface
 echo "Starting nginx..."
 nginx &
@@ -92,6 +105,11 @@ fi
 LIBSQL_CONF="/mosquitto/config/libsql.conf"
 SQLD_ARGS="-d /mosquitto/data"
 
+# SQLite extensions built with the SQL plugin (msg_bucket_expand)
+if [ -f /usr/lib/sqld-extensions/trusted.lst ]; then
+    SQLD_ARGS="$SQLD_ARGS --extensions-path=/usr/lib/sqld-extensions"
+fi
+
 if [ -f "$LIBSQL_CONF" ]; then
     echo "Reading libsql configuration from $LIBSQL_CONF"
     
@@ -194,6 +212,21 @@ if ! kill -0 $SQLD_PID 2>/dev/null; then
     exit 1
 fi
 
+# Read snapshot written by the SQL plugin (plugin_opt_snapshot_dir), served by a second
+# sqld on a local port for heavy admin queries (/db-snapshot/)
+SNAPSHOT_DIR=$(sed -n 's/^[[:space:]]*plugin_opt_snapshot_dir[[:space:]]\{1,\}//p' /mosquitto/config/mosquitto.conf | tail -n 1 | xargs)
+SNAPSHOT_SQLD_PID=""
+if [ -n "$SNAPSHOT_DIR" ]; then
+    mkdir -p "$SNAPSHOT_DIR/dbs/default"
+    SNAPSHOT_SQLD_ARGS="-d $SNAPSHOT_DIR --http-listen-addr=127.0.0.1:8001"
+    if [ -f /usr/lib/sqld-extensions/trusted.lst ]; then
+        SNAPSHOT_SQLD_ARGS="$SNAPSHOT_SQLD_ARGS --extensions-path=/usr/lib/sqld-extensions"
+    fi
+    echo "Starting snapshot sqld with args: $SNAPSHOT_SQLD_ARGS"
+    sqld $SNAPSHOT_SQLD_ARGS &
+    SNAPSHOT_SQLD_PID=$!
+fi
+
 # Start mosquitto in foreground as the main process
 echo "Starting mosquitto..."
 # Fix permissions on mosquitto.db if it exists (prevent world-readable warning)
@@ -215,6 +248,12 @@ while true; do
             shutdown
         fi
     fi
+    if [ -n "$SNAPSHOT_SQLD_PID" ] && ! kill -0 $SNAPSHOT_SQLD_PID 2>/dev/null; then
+        echo "WARNING: snapshot sqld died unexpectedly"
+        if ! restart_service sqld-snapshot; then
+            shutdown
+        fi
+    fi
     if ! kill -0 $MOSQUITTO_PID 2>/dev/null; then
         echo "WARNING: mosquitto died unexpectedly"
         if ! restart_service mosquitto; then
@@ -3,14 +3,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdatomic.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
 #include <unistd.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <errno.h>
+#include <dirent.h>
+#include <zlib.h>
 
 #include "mosquitto_broker.h"
 #include "mosquitto_plugin.h"
@@ -18,6 +31,8 @@
 #include "mqtt_protocol.h"
 
 #include "sqlite3.h"
+#include "msg_bucket.h"
+#include "sparkplug.h"
 
 // Conditional debug logging - compiles to nothing in release builds
 // Enable with -DDEBUG_LOGGING in CFLAGS for verbose output
@@ -31,6 +46,7 @@
 #define ULID_RELAXED   (1 << 0)
 #define ULID_PARANOID  (1 << 1)
 #define ULID_SECURE    (1 << 2)
+#define ULID_MONOTONIC (1 << 3)  // Hybrid logical clock: timestamps never go backwards
 
 // Maximum number of exclusion patterns
 #define MAX_EXCLUDE_PATTERNS 64
@@ -39,24 +55,484 @@
 // Batch insert configuration (defaults, can be overridden via config)
 #define DEFAULT_BATCH_SIZE 100           // Flush when queue reaches this size
 #define DEFAULT_FLUSH_INTERVAL_MS 50     // Flush at least every 50ms
-#define MAX_QUEUE_SIZE 15000             // Maximum queue size before blocking
+#define DB_PATH "/mosquitto/data/dbs/default/data"
+
+// Startup: the database is opened, migrated and indexed on the worker thread, so the broker
+// accepts clients right away; messages are queued (up to startup_queue_size) until db_ready
+#define DEFAULT_STARTUP_QUEUE_SIZE 100000
+static int startup_queue_size = DEFAULT_STARTUP_QUEUE_SIZE;
+static atomic_int db_ready = 0;
+static atomic_ullong db_init_ms = 0;     // Time from plugin init to db_ready
+static unsigned long long plugin_init_ms = 0;
 
 // Data retention configuration
 #define DEFAULT_RETENTION_DAYS 0         // 0 = disabled (keep all messages)
 #define RETENTION_CHECK_INTERVAL_SEC 86400 // Check every day
+#define RETENTION_SLICE 1000             // Rows per retention delete statement
+#define RETENTION_BUDGET_MS 50           // Longest retention run per worker iteration
 
-// Configurable batch parameters
-static int batch_size = DEFAULT_BATCH_SIZE;
-static int flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
-
-// Data retention parameters
-static int retention_days = DEFAULT_RETENTION_DAYS;
+// Data retention parameters (retention_days is part of the runtime config)
 static time_t last_retention_check = 0;
+static int retention_pending = 0;        // Rows before retention_cutoff may be left (worker thread)
+static char retention_cutoff[11];
+static unsigned long long retention_cutoff_ms = 0;
+static unsigned long long retention_deleted = 0;
+
+// Free-page reclamation: databases with auto_vacuum=INCREMENTAL give free pages back to the
+// file system with PRAGMA incremental_vacuum, in short slices while the queue is empty
+#define AUTO_VACUUM_NONE        0        // plugin_opt_auto_vacuum none: leave the database as is
+#define AUTO_VACUUM_INCREMENTAL 1        // incremental (default): new databases
+#define AUTO_VACUUM_STARTUP     2        // vacuum_at_startup: also convert an existing database with a blocking VACUUM
+#define VACUUM_SLICE_PAGES 256           // Pages released per incremental_vacuum call
+#define VACUUM_KEEP_FREE_PAGES 256       // Free pages kept for upcoming inserts
+#define VACUUM_BUDGET_MS 20              // Longest reclamation run per idle worker iteration
+#define VACUUM_CHECK_INTERVAL_SEC 60     // Free-page check without preceding deletes
+static int auto_vacuum_option = AUTO_VACUUM_INCREMENTAL;
+static int auto_vacuum_incremental = 0;  // The database runs with auto_vacuum=INCREMENTAL (worker thread)
+static int vacuum_pending = 0;           // Deletes happened since the last reclamation (worker thread)
+static time_t last_vacuum_check = 0;
+static atomic_ullong db_page_count = 0;
+static atomic_ullong db_free_pages = 0;
+static atomic_ullong vacuum_pages_released = 0;
+
+// Query planner maintenance: PRAGMA optimize keeps sqlite_stat1 current for the planner (ours
+// and sqld's), then the plans of the canonical admin queries are compared with query_plan
+#define DEFAULT_OPTIMIZE_INTERVAL_SEC 3600
+#define OPTIMIZE_ANALYSIS_LIMIT 1000     // Rows sampled per index by ANALYZE (PRAGMA analysis_limit)
+#define OPTIMIZE_BUDGET_MS 200           // ANALYZE is interrupted after this long
+#define OPTIMIZE_RETRY_SEC 300           // Next attempt after an interrupted or busy run
+static long long optimize_interval_sec = DEFAULT_OPTIMIZE_INTERVAL_SEC; // 0 = disabled
+static time_t next_optimize = 0;         // Worker thread, 0 = right after the database is ready
+static atomic_ullong optimize_runs = 0;
+static atomic_ullong optimize_duration_ms = 0;   // Last completed run
+static atomic_ullong plan_changes = 0;
+
+// Page cache arena: with page_cache_size, SQLite's page cache (SQLITE_CONFIG_PCACHE2) is served
+// from one preallocated mapping instead of malloc, optionally on huge pages, and recycled in
+// LRU order; the footprint stays fixed however long the broker runs
+#define PAGE_CACHE_HUGE_PAGE (2 * 1024 * 1024)  // Huge page size the arena is rounded up to
+#define PAGE_CACHE_MIN_HASH 64                  // Initial hash buckets per cache
+static unsigned long long page_cache_size = 0;  // Arena bytes, 0 = SQLite's own page cache
+static int page_cache_huge_pages = 0;
+static int page_cache_installed = 0;            // The arena methods are configured in SQLite
+static atomic_ullong pcache_hits = 0;
+static atomic_ullong pcache_misses = 0;          // Pages loaded into the cache
+static atomic_ullong pcache_evictions = 0;       // Unpinned pages recycled for another page
+static atomic_ullong pcache_overflow = 0;        // Pages allocated outside a full arena
+
+// Dedicated SQLite heap: with sqlite_heap_size, SQLite allocates statements, schema, sorter and
+// temporary b-tree memory from a buddy heap in its own mapping instead of the broker's malloc,
+// and large free blocks are given back to the OS; allocations that do not fit fall back to malloc
+#define SQLITE_HEAP_ATOM 32                      // Smallest block, a power of two
+#define SQLITE_HEAP_LOGMAX 25                    // Largest block is SQLITE_HEAP_ATOM << SQLITE_HEAP_LOGMAX (1 GiB)
+#define SQLITE_HEAP_SOFT_LIMIT_PCT 90            // sqlite3_soft_heap_limit64 in percent of the heap
+#define SQLITE_HEAP_TRIM_MIN (1024 * 1024)       // Free blocks at least this large are trimmed
+#define SQLITE_HEAP_TRIM_INTERVAL_SEC 60
+static unsigned long long sqlite_heap_size = 0;  // 0 = SQLite allocates with malloc
+static int sqlite_heap_installed = 0;            // The heap methods are configured in SQLite
+static atomic_ullong heap_fallbacks = 0;         // Allocations served by malloc because the heap was full
+
+// Per-topic persistence policies (evaluated in order, first matching pattern wins)
+#define POLICY_ALL      0   // Persist every message (default)
+#define POLICY_SKIP     1   // Never persist
+#define POLICY_EVERY    2   // Persist every Nth message
+#define POLICY_INTERVAL 3   // Persist at most once per interval
+#define POLICY_CHANGED  4   // Persist only if the payload changed
+#define POLICY_DEADBAND 5   // Persist only if a numeric value moved by more than the deadband
+
+#define MAX_PERSIST_POLICIES 64
+#define POLICY_STATE_INITIAL_CAPACITY 1024
+#define MAX_POLICY_STATES (1 << 21)       // Upper bound on table slots (~120MB plus topic names); beyond 3/4 of it policies fail open
+#define POLICY_STATE_IDLE_MS 3600000ULL   // States unused for longer are evicted (at least the longest policy interval)
+#define POLICY_STATE_SWEEP_INTERVAL_SEC 600
+
+struct persist_policy {
+    char *pattern;
+    int type;
+    unsigned int every_n;
+    unsigned long long interval_ms;
+    char *field;        // JSON member for deadband (NULL = payload is a plain number)
+    double deadband;
+};
+
+// Compact per-topic policy state, keyed by topic hash in an open-addressing table. States of
+// topics idle for POLICY_STATE_IDLE_MS are dropped when the table grows and by a periodic sweep
+#define POLICY_STATE_SEEN (1 << 0)
+
+struct policy_state {
+    uint64_t topic_hash;                // 0 = empty slot
+    char *topic;
+    unsigned long long last_seen_ms;    // Last message on the topic (idle eviction)
+    uint64_t payload_hash;              // Last seen payload (changed)
+    unsigned long long last_persist_ms; // Last persisted message (interval)
+    double last_value;                  // Last persisted value (deadband)
+    uint32_t count;                     // Messages seen (every)
+    uint32_t flags;
+};
+
+static struct persist_policy persist_policies[MAX_PERSIST_POLICIES];
+static int persist_policy_count = 0;
+static struct policy_state *policy_states = NULL;
+static size_t policy_state_capacity = 0;
+static size_t policy_state_count = 0;
+static time_t last_policy_sweep = 0;
+static atomic_ullong policy_states_evicted = 0;
+
+// Ingest quotas: token buckets per client id (client_quota) and per topic pattern
+// (topic_quotas, one bucket shared by all topics matching the pattern). A bucket is kept as
+// its theoretical arrival time (GCRA), a single word updated with compare-and-swap, so the
+// state table needs no lock. Over-quota messages are only queued while the queue is less
+// than QUOTA_QUEUE_SHARE_PCT full and never evict queued messages
+#define MAX_TOPIC_QUOTAS 64
+#define QUOTA_CLIENT_SLOTS 65536          // Fixed client table (1MB), never resized
+#define QUOTA_PROBE_LIMIT 16              // Slots probed per client before failing open
+#define QUOTA_QUEUE_SHARE_PCT 50
+
+struct quota_rate {
+    unsigned long long interval_us;     // Time for one token, 0 = no quota
+    unsigned long long tolerance_us;    // interval_us * (burst - 1)
+};
+
+struct topic_quota {
+    char *pattern;
+    struct quota_rate rate;
+    atomic_ullong tat_us;
+};
+
+struct quota_slot {
+    atomic_ullong client_hash;          // 0 = empty slot
+    atomic_ullong tat_us;               // Theoretical arrival time of the next message
+};
+
+static struct quota_rate client_quota = { 0, 0 };
+static struct quota_slot *quota_clients = NULL;
+static struct topic_quota topic_quotas[MAX_TOPIC_QUOTAS];
+static int topic_quota_count = 0;
+static atomic_ullong quota_clients_tracked = 0;
+static atomic_ullong quota_over_limit = 0;
+static atomic_ullong quota_shed = 0;
+
+// Storage layouts. Readers always query msg; in the blob and split layouts it is a view
+#define LAYOUT_INLINE 0   // msg table holds everything
+#define LAYOUT_BLOB   1   // msg_data table + payload_blob, msg is a view
+#define LAYOUT_SPLIT  2   // narrow msg_meta + wide msg_payload (+ payload_blob), msg is a view
+
+static int requested_layout = LAYOUT_INLINE;  // plugin_opt_storage_layout (applies to new databases)
+static int storage_layout = LAYOUT_INLINE;    // Layout of the opened database
+static const char *msg_table = "msg";         // Table holding topic/ulid rows written by the plugin
+
+// Online schema migrations, recorded in the schema_version table. A migration copies the
+// rows of its source table in ULID order while triggers mirror new writes (backfill), swaps
+// the msg view over in one transaction and then deletes the source table in slices (drain).
+// Every step is its own transaction, so a restart resumes where the last one stopped
+#define MIGRATION_BACKFILL 1
+#define MIGRATION_DRAIN    2
+#define MIGRATION_CHUNK 1000              // Rows copied or drained per transaction
+#define MIGRATION_BUDGET_MS 25            // Longest migration run per worker iteration
+#define MIGRATION_RETRY_SEC 60            // Pause after a failed migration step
+static const struct schema_migration *migration = NULL; // Migration in progress (worker thread)
+static int migration_phase = 0;
+static char migration_cursor[27];         // Last copied ULID ("" before the first chunk)
+static atomic_ullong migration_rows = 0;  // Rows copied by the migration in progress
+static atomic_int current_schema_version = 0; // Newest completed migration
+static atomic_int migration_running = 0;
+static time_t migration_paused_until = 0;
+
+// Payload deduplication: payloads of at least dedup_min_size bytes are stored once in
+// payload_blob and referenced by hash (requires the blob or split layout)
+#define PAYLOAD_HASH_LEN 16
+#define PAYLOAD_GC_BATCH 500              // Unreferenced blobs removed per worker iteration
+static int dedup_min_size = 0;            // 0 = disabled
+
+// Large payload offload: payloads of at least offload_min_size bytes are written to a
+// content-addressed file store (<offload_dir>/<hh>/<hash>) by the spool thread as soon as they
+// are queued, so the queue keeps only their hash; the worker writes any the spool has not
+// reached by the time of the batch. The row references the file by hash; payload_blob keeps
+// the reference count and file location
+#define DEFAULT_OFFLOAD_DIR "/mosquitto/data/payloads"
+#define OFFLOAD_GC_GRACE_SEC 3600         // Files touched this recently are never collected
+static long long offload_min_size = 0;    // 0 = disabled
+static char *offload_dir = NULL;
+static time_t payload_gc_retry_at = 0;    // Earliest retry for blobs deferred by the grace period
+static int payload_gc_pending = 0;        // Deletes happened since the last complete GC pass (worker thread only)
+
+// Bucketed time-series rows: non-retained messages on matching topics are packed per topic
+// into msg_bucket rows (see msg_bucket.h) instead of one msg row each. Open buckets live on
+// the worker thread. Every batch commit adds the messages a bucket received since the last
+// commit as a segment row; once the bucket closes (bucket_window_ms or bucket_max_points
+// messages) its segments are replaced by one compressed row
+#define MAX_BUCKET_PATTERNS 64
+#define BUCKET_TABLE_SIZE 1024            // Hash chains for open buckets
+#define MAX_OPEN_BUCKETS 65536            // Further topics are stored as plain rows
+#define DEFAULT_BUCKET_WINDOW_MS 60000
+#define DEFAULT_BUCKET_MAX_POINTS 1000
+
+struct ts_bucket {
+    char *topic;
+    uint64_t topic_hash;
+    char start_ulid[27];                // First message, key together with topic
+    char end_ulid[27];                  // Last message, used by retention
+    unsigned long long start_ms;
+    unsigned long long last_ms;         // ULID timestamp of the last message (delta base)
+    int count;
+    unsigned char *data;                // All messages of the bucket, written when it closes
+    size_t seg_offset;                  // Messages from here on are not in a segment row yet
+    int seg_count;
+    int seg_written;                    // The open transaction writes the pending segment
+    int closed;                         // The open transaction writes the closed bucket
+    char seg_ulid[27];                  // First message of the pending segment
+    unsigned long long seg_first_ms;
+    size_t len;
+    size_t cap;
+    struct ts_bucket *next;
+};
+
+static char *bucket_patterns[MAX_BUCKET_PATTERNS];
+static int bucket_pattern_count = 0;
+static unsigned long long bucket_window_ms = DEFAULT_BUCKET_WINDOW_MS;
+static int bucket_max_points = DEFAULT_BUCKET_MAX_POINTS;
+static struct ts_bucket *open_buckets[BUCKET_TABLE_SIZE]; // Worker thread only
+static int open_bucket_count = 0;
+
+// Message expiry: the MQTT v5 message-expiry-interval is stored as absolute time (ms) in
+// expires_at, indexed by a partial index, and expired rows are deleted by a sweeper on the
+// worker thread that stops after EXPIRY_SWEEP_BUDGET_MS per run
+#define EXPIRY_SWEEP_INTERVAL_MS 1000
+#define EXPIRY_SWEEP_BUDGET_MS 20
+#define EXPIRY_SWEEP_SLICE 256            // Rows per sweep transaction
+static int message_expiry = 0;
+static unsigned long long last_expiry_sweep_ms = 0;
+static atomic_ullong expired_deleted = 0;
+
+// Publisher identity: with store_client every message row gets a client_key referencing
+// msg_client, where each (client id, username) pair is stored once. The worker keeps the
+// keys of recent publishers in a direct-mapped cache, so only new pairs cost a lookup
+#define CLIENT_CACHE_SIZE 4096
+struct client_cache_slot {
+    uint64_t hash;
+    sqlite3_int64 key;
+    char *client_id;    // NULL = empty slot
+    char *username;
+};
+static int store_client = 0;
+static struct client_cache_slot client_cache[CLIENT_CACHE_SIZE];  // Worker thread only
+static sqlite3_stmt *client_select_stmt = NULL;
+static sqlite3_stmt *client_insert_stmt = NULL;
+static atomic_ullong client_cache_misses = 0;
+static atomic_ullong clients_added = 0;
+
+// Sparkplug B: with plugin_opt_sparkplug, NBIRTH, DBIRTH, NDATA and DDATA payloads published
+// under spBv1.0/ are decoded on the worker thread, in the transaction that stores the message,
+// and every metric becomes a row of the metric table. Edge nodes, devices and metric names are
+// dictionary-encoded; aliases announced in a BIRTH are resolved from a per-node alias map
+#define SPARKPLUG_NAMESPACE "spBv1.0/"
+#define SPARKPLUG_NODE_TABLE_SIZE 1024      // Hash buckets of known edge nodes
+#define SPARKPLUG_NAME_CACHE_SIZE 8192      // Direct-mapped caches of metric and device ids
+#define SPARKPLUG_ALIAS_MIN 64              // Initial alias map capacity per node
+struct sparkplug_alias {
+    uint64_t alias;
+    char *name;                             // NULL = empty slot
+    uint32_t datatype;
+};
+struct sparkplug_node {
+    char *group_id;
+    char *edge_node;
+    uint64_t hash;
+    sqlite3_int64 node_id;                  // metric_node key, 0 until looked up
+    struct sparkplug_alias *aliases;        // Open addressing, capacity is a power of two
+    size_t alias_capacity;
+    size_t alias_count;
+    struct sparkplug_node *next;
+};
+struct sparkplug_name_slot {
+    uint64_t hash;
+    sqlite3_int64 id;
+    char *name;                             // NULL = empty slot
+};
+static int sparkplug_enabled = 0;
+static struct sparkplug_node *sparkplug_nodes[SPARKPLUG_NODE_TABLE_SIZE];     // Worker thread only
+static struct sparkplug_name_slot metric_name_cache[SPARKPLUG_NAME_CACHE_SIZE];
+static struct sparkplug_name_slot metric_device_cache[SPARKPLUG_NAME_CACHE_SIZE];
+static sqlite3_stmt *metric_insert_stmt = NULL;
+static sqlite3_stmt *metric_retention_stmt = NULL;
+static sqlite3_stmt *metric_node_select_stmt = NULL;
+static sqlite3_stmt *metric_node_insert_stmt = NULL;
+static sqlite3_stmt *metric_device_select_stmt = NULL;
+static sqlite3_stmt *metric_device_insert_stmt = NULL;
+static sqlite3_stmt *metric_name_select_stmt = NULL;
+static sqlite3_stmt *metric_name_insert_stmt = NULL;
+static atomic_ullong sparkplug_payloads = 0;    // Payloads decoded
+static atomic_ullong sparkplug_metrics = 0;     // Metric rows written
+static atomic_ullong sparkplug_malformed = 0;   // Payloads that are not valid Sparkplug B
+static atomic_ullong sparkplug_unresolved = 0;  // Metrics with an alias no BIRTH announced
+static atomic_ullong sparkplug_skipped = 0;     // Bytes, DataSet and Template values
+
+// Topic tree: with plugin_opt_topic_tree the plugin keeps the stored topics in an in-memory
+// tree with message counts, the newest ULID and retained flags per level. The copy thread
+// seeds it once with the rows stored before startup, new messages and deletes are counted
+// once the worker commits them; levels left without messages, retained message or children
+// are removed. Requests on TOPIC_TREE_TOPIC return the summary of one level, so
+// the admin UI expands it lazily instead of subscribing to #
+#define TOPIC_TREE_TOPIC CONTROL_TOPIC "/tree"
+#define TOPIC_TREE_RESPONSE_TOPIC TOPIC_TREE_TOPIC "/response"
+#define TOPIC_TREE_MAX_CHILDREN 1000      // Children per response; requests may ask for fewer
+#define TOPIC_TREE_CHILDREN_MIN 8         // Initial child table capacity of a level
+#define TOPIC_TREE_LOAD_BATCH 1024        // Database rows merged per lock while seeding
+struct topic_node {
+    char *name;                           // Topic level, NULL for the root
+    struct topic_node *parent;
+    struct topic_node **children;         // Open addressing by name hash, capacity is a power of two
+    uint32_t child_capacity;
+    uint32_t child_count;
+    uint64_t messages;                    // Messages on exactly this topic
+    uint64_t subtree_messages;            // Messages on this topic and below
+    uint32_t subtree_topics;              // Topics with messages, this one included
+    uint32_t subtree_retained;            // Topics holding a retained message
+    unsigned char retained;               // This topic holds a retained message
+    unsigned char retained_live;          // retained was set by a write since startup, the database load keeps it
+    char last_ulid[27];                   // Newest message on this topic or below
+};
+static int topic_tree_enabled = 0;
+static struct topic_node topic_tree_root;                       // Guarded by topic_tree_mutex
+static pthread_mutex_t topic_tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char topic_tree_watermark[27];     // Messages from this ULID on are counted as they are written
+static atomic_int topic_tree_loaded = 0;
+static atomic_ullong topic_tree_nodes = 0;
+static atomic_ullong topic_tree_requests = 0;
+struct topic_change {
+    char *topic;
+    int64_t count;                        // Messages added, or taken off if negative
+    char ulid[27];                        // Newest message added
+    int retained;                         // Retained flag to set, -1 leaves it
+};
+static struct topic_change *topic_changes = NULL;  // Changes of the open write transaction (worker thread)
+static int topic_change_count = 0;
+static int topic_change_capacity = 0;
+static sqlite3_stmt *retention_topics_stmt = NULL;         // Topics of the next retention slice
+static sqlite3_stmt *bucket_retention_topics_stmt = NULL;  // Topics of the next bucket retention slice
+
+// Writer coordination with sqld, which serves the same database file: a busy handler backs
+// off exponentially for up to busy_timeout_ms, batch transactions take the write lock up
+// front (BEGIN IMMEDIATE), and a batch that still finds the database locked is put back
+// into the queue and retried with growing delays instead of being dropped. With
+// handoff_socket set, write transactions are sent to sqld as SQL over its HTTP API on a
+// local Unix socket, so sqld is the only writer of the file
+#define DEFAULT_BUSY_TIMEOUT_MS 1000
+#define BUSY_SLEEP_MAX_MS 50              // Longest single busy handler sleep
+#define BATCH_RETRY_MIN_MS 20             // Delay before the first retry of a requeued batch
+#define BATCH_RETRY_MAX_MS 2000
+#define SHUTDOWN_FLUSH_ATTEMPTS 5
+#define HANDOFF_TIMEOUT_SEC 5
+#define HANDOFF_RESPONSE_MAX 16384
+static int busy_timeout_ms = DEFAULT_BUSY_TIMEOUT_MS;
+static int batch_retry_delay_ms = 0;      // Current backoff, 0 = last flush succeeded (worker thread)
+static char *handoff_socket = NULL;       // plugin_opt_sqld_socket
+static sqlite3_str *handoff_script = NULL; // Open handoff transaction (worker thread)
+static atomic_ullong busy_waits = 0;      // Busy handler sleeps
+static atomic_ullong busy_wait_ms = 0;    // Time spent in the busy handler
+static atomic_ullong batch_retries = 0;   // Batches put back into the queue
+static atomic_ullong batch_failures = 0;  // Batches rejected by sqld with a permanent error
+static atomic_ullong flush_max_us = 0;    // Longest flush since the last metrics publish
+
+// Failed operations: an insert or delete that fails on its own (constraint, SQLITE_FULL, ...)
+// or with its whole batch (failed commit) moves to the worker's retry queue and is tried
+// again with growing delays. After retry_attempts failures it is stored in msg_deadletter,
+// from where the "replay" control command puts it back into the queue
+#define DEFAULT_RETRY_ATTEMPTS 5
+#define RETRY_MIN_MS 1000                 // Delay before the first retry of a failed operation
+#define RETRY_MAX_MS 60000
+#define MAX_RETRY_QUEUE 10000             // Failed operations beyond this are dropped
+#define REPLAY_SLICE 1000                 // Dead letters moved back into the queue per worker iteration
+#define CONTROL_REPLAY "replay"
+static int retry_attempts = DEFAULT_RETRY_ATTEMPTS;
+static struct msg_entry *retry_queue = NULL;    // Worker thread, newest failure first
+static int retry_queue_size = 0;
+static sqlite3_stmt *deadletter_insert_stmt = NULL;
+static atomic_int replay_requested = 0;
+static long long replay_max_id = 0;       // Replay in progress up to this msg_deadletter id (worker thread)
+static atomic_int retry_queued = 0;
+static atomic_ullong operations_retried = 0;
+static atomic_ullong operations_dropped = 0;
+static atomic_ullong deadletters_stored = 0;
+static atomic_ullong deadletters_replayed = 0;
+static atomic_llong deadletter_rows = -1; // Rows in msg_deadletter, -1 = no table
+
+// Database copies: a background copy thread copies the database with the online backup API,
+// COPY_STEP_PAGES pages per step with a pause in between. The backup reads one snapshot
+// through its own read-only connection, so commits during a copy (the worker's, or sqld's
+// with the handoff) neither restart it nor wait for it; checkpoints stop at that snapshot
+// until the copy is done
+#define COPY_STEP_PAGES 128
+#define COPY_STEP_PAUSE_MS 10
+#define COPY_MAX_BUSY_STEPS 500           // Give up a copy after ~5s of busy steps
+#define COPY_IDLE_WAIT_SEC 3600           // Longest sleep of the copy thread without requests
+#define COPY_READY_POLL_MS 100            // Copy thread poll while the database is initialized
+static pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t copy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t copy_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t copy_thread;
+static atomic_int copy_thread_running = 0;
+
+// Read snapshot: a copy in snapshot_dir/dbs/default/data (the layout a second, read-only
+// sqld serves), refreshed every snapshot_interval_sec
+#define DEFAULT_SNAPSHOT_INTERVAL_SEC 300
+#define SNAPSHOT_DB_PATH "/dbs/default/data"
+static char *snapshot_dir = NULL;         // plugin_opt_snapshot_dir, NULL = disabled
+static int snapshot_interval_sec = DEFAULT_SNAPSHOT_INTERVAL_SEC;
+static atomic_ullong snapshot_refreshes = 0;
+static atomic_ullong snapshot_failures = 0;
+static atomic_ullong snapshot_duration_ms = 0;  // Last complete refresh
+static atomic_ullong snapshot_pages = 0;        // Size of the last complete refresh
+static atomic_llong snapshot_completed_at = 0;  // Unix time of the last complete refresh
+
+// Backups: on request (control topic) or every backup_interval_sec, a copy is gzipped to
+// backup_dir/mqbase-<UTC time>.db.gz, keeping the newest backup_keep files
+#define DEFAULT_BACKUP_DIR "/mosquitto/data/backups"
+#define DEFAULT_BACKUP_KEEP 7
+#define BACKUP_PREFIX "mqbase-"
+#define BACKUP_SUFFIX ".db.gz"
+#define BACKUP_GZIP_LEVEL "6"
+#define BACKUP_CHUNK_SIZE (256 * 1024)
+#define BACKUP_COPY_PCT 90                // Share of the progress taken by the copy, the rest is compression
+static char *backup_dir = NULL;
+static long long backup_interval_sec = 0; // 0 = only on request
+static int backup_keep = DEFAULT_BACKUP_KEEP;
+static atomic_int backup_requested = 0;
+static atomic_int backup_running = 0;
+static atomic_int backup_progress_pct = 0;
+static atomic_ullong backups_completed = 0;
+static atomic_ullong backups_failed = 0;
+static atomic_ullong backup_duration_ms = 0;     // Last completed backup
+static atomic_ullong backup_size_bytes = 0;
+static atomic_ullong backup_throughput_kb_s = 0; // Database size over duration
+
+// Retained message store: msg_retained mirrors the broker's retained state and
+// is replayed into the broker at startup, so mosquitto.db autosave can be relaxed
+static int restore_retained = 0;
+
+// Plugin metrics, published as retained $SYS/broker/sql/... messages from the broker tick
+#define DEFAULT_STATS_INTERVAL_SEC 10
+static int stats_interval_sec = DEFAULT_STATS_INTERVAL_SEC;  // 0 = disabled
+static time_t last_stats_publish = 0;
+
+// ULID clock: with ULID_MONOTONIC a wall clock step backwards keeps the last timestamp and
+// advances the random field instead, so inserts stay on the right edge of the ULID index
+#define ULID_SEED_MAX_AHEAD_MS 3600000ULL  // Ignore stored ULIDs further in the future at startup
+static int ulid_clock_hlc = 1;                      // plugin_opt_ulid_clock hlc (default) or wall
+static atomic_ullong ulid_clock_corrections = 0;    // ULIDs issued with a corrected timestamp
+static atomic_ullong ulid_clock_max_step_back_ms = 0; // Largest backwards step observed
+
+// Node id: the first 16 bits of the ULID random field identify the broker node that
+// issued the ULID, so per-node databases can be merged without collisions
+#define ULID_NODE_NONE -1
+#define ULID_NODE_ENV "MQBASE_NODE_ID"      // Fallback when plugin_opt_node_id is not set
+static int ulid_node_id = ULID_NODE_NONE;
 
 struct ulid_generator {
     unsigned char last[16];
     unsigned long long last_ts;
     int flags;
+    int node_id;  // 0-65535 or ULID_NODE_NONE
     unsigned char i, j;
     unsigned char s[256];
 };
@@ -69,16 +545,59 @@ static sqlite3 *msg_db = NULL;
 static sqlite3_stmt *insert_stmt = NULL;
 static sqlite3_stmt *delete_stmt = NULL;
 static sqlite3_stmt *find_latest_stmt = NULL;    // For fallback delete (find most recent ULID)
+static sqlite3_stmt *delete_latest_stmt = NULL;  // Fallback delete resolved by sqld (handoff)
 static sqlite3_stmt *retention_delete_stmt = NULL; // For retention cleanup
+static sqlite3_stmt *retained_upsert_stmt = NULL;  // Replace retained message for topic
+static sqlite3_stmt *retained_delete_stmt = NULL;  // Clear retained message for topic
+static sqlite3_stmt *blob_upsert_stmt = NULL;      // Store payload blob or bump its refcount
+static sqlite3_stmt *blob_release_stmt = NULL;     // Drop a reference taken for a failed insert
+static sqlite3_stmt *file_upsert_stmt = NULL;      // Register an offloaded payload file or bump its refcount
+static sqlite3_stmt *payload_gc_delete_stmt = NULL; // Delete one unreferenced blob by hash
+static sqlite3_stmt *payload_insert_stmt = NULL;   // Split layout: payload half of a message
+static sqlite3_stmt *payload_delete_stmt = NULL;   // Split layout: delete payload by ULID
+static sqlite3_stmt *payload_retention_stmt = NULL; // Split layout: retention cleanup of payloads
+static sqlite3_stmt *payload_gc_stmt = NULL;       // Delete a slice of unreferenced payload blobs
+static sqlite3_stmt *expiry_select_stmt = NULL;    // Next slice of expired ULIDs
+static sqlite3_stmt *expiry_delete_stmt = NULL;    // Delete one expired row by ULID
+static sqlite3_stmt *bucket_upsert_stmt = NULL;    // Write a bucket segment or a closed bucket
+static sqlite3_stmt *bucket_segment_delete_stmt = NULL; // Drop the segments of a closed bucket
+static sqlite3_stmt *bucket_retention_stmt = NULL; // Retention cleanup of buckets
+
+// Compiled topic pattern list: exact topics are found by binary search, only patterns
+// with wildcards are matched one by one
+struct topic_matcher {
+    char *exact[MAX_EXCLUDE_PATTERNS];      // Sorted with strcmp
+    int exact_count;
+    char *wildcard[MAX_EXCLUDE_PATTERNS];
+    int wildcard_count;
+};
 
-// Topic exclusion patterns
-static char *exclude_patterns[MAX_EXCLUDE_PATTERNS];
-static int exclude_pattern_count = 0;
+// Runtime configuration: the options that can be changed without a broker restart.
+// A reload (MOSQ_EVT_RELOAD after SIGHUP, or a message on CONTROL_TOPIC) builds a new
+// immutable runtime_config and publishes it with an atomic pointer swap, so the broker
+// and worker threads read it without locks. A replaced config is retired and freed once
+// the worker thread has picked up a newer generation
+#define CONTROL_TOPIC "$CONTROL/libsql/v1"
+#define CONTROL_RESPONSE_TOPIC CONTROL_TOPIC "/response"
+#define CONTROL_BACKUP "backup"
 
-// Header exclusion list (user property names to exclude from storage)
-static char *exclude_headers[MAX_EXCLUDE_HEADERS];
-static int exclude_header_count = 0;
-static int headers_disabled = 0;  // Set to 1 if exclude_headers contains '#'
+struct runtime_config {
+    unsigned long long generation;
+    int batch_size;
+    int flush_interval_ms;
+    int retention_days;
+    char *exclude_topics;                   // Option values as given (NULL = not set)
+    char *exclude_headers;
+    struct topic_matcher topic_exclusions;
+    char *header_exclusions[MAX_EXCLUDE_HEADERS];
+    int header_exclusion_count;
+    int headers_disabled;                   // exclude_headers contains '#'
+    struct runtime_config *retired_next;
+};
+
+static _Atomic(struct runtime_config *) active_config = NULL;
+static struct runtime_config *retired_configs = NULL;   // Broker thread only
+static atomic_ullong worker_config_generation = 0;      // Generation the worker thread is using
 
 // ULID generator mutex for thread safety
 static pthread_mutex_t ulid_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -87,31 +606,98 @@ static pthread_mutex_t ulid_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define OP_INSERT 0
 #define OP_DELETE 1
 #define OP_DELETE_FALLBACK 2  // Delete most recent for topic (no specific ULID)
+#define OP_RETAINED 3         // Update retained store only (excluded or skipped message; empty payload = clear)
 
 // Message queue entry for batch inserts and deletes
 struct msg_entry {
-    int operation;      // OP_INSERT, OP_DELETE, or OP_DELETE_FALLBACK
+    int operation;      // OP_INSERT, OP_DELETE, OP_DELETE_FALLBACK or OP_RETAINED
     char ulid[27];
     char *topic;
     char *payload;
+    size_t payloadlen;  // Exact payload length (payload is also NUL-terminated)
+    int offloaded;      // Payload was written to the file store; only its hash is queued
+    unsigned char payload_hash[PAYLOAD_HASH_LEN];
     char *headers;
     int retain;
     int qos;
+    unsigned long long expires_at;  // MQTT v5 message expiry as absolute time in ms, 0 = none
+    char *client_id;                // Publisher (only with store_client)
+    char *username;
+    int attempts;                   // Failed writes so far
+    int retained_stored;            // A committed transaction wrote it to msg_retained
+    int spool;                      // SPOOL_NONE, SPOOL_WAITING or SPOOL_WRITING (queue_mutex)
+    struct msg_entry *spool_next;   // Next entry waiting for the spool thread
+    unsigned long long retry_at_ms; // Next attempt while in the retry queue
+    char *error;                    // Last write error (retry queue)
+    unsigned long long seq;         // Arrival order across the queue lanes
     struct msg_entry *next;
 };
 
-// Message queue for batch processing
-static struct msg_entry *msg_queue_head = NULL;
-static struct msg_entry *msg_queue_tail = NULL;
-static int msg_queue_size = 0;
+// Message queue for batch processing, split into lanes: deletes and each QoS level are
+// queued separately with their own capacity and drop policy, so a QoS 0 burst cannot evict
+// QoS 1/2 messages or retained clears. flush_batch() takes weighted shares of backed-up
+// lanes (at most LANE_DRAIN_MAX entries per transaction) and writes them in arrival order
+#define LANE_DELETE 0
+#define LANE_QOS2   1
+#define LANE_QOS1   2
+#define LANE_QOS0   3
+#define LANE_COUNT  4
+#define LANE_DROP_OLDEST 0               // A full lane drops its oldest entry
+#define LANE_DROP_NEWEST 1               // A full lane rejects the incoming entry
+#define LANE_DRAIN_MAX 5000              // Entries per batch while the lanes are backed up
+#define LANE_QUANTUM 64                  // Entries per weight unit and draining round
+#define LANE_QOS0_DEFAULT_CAPACITY 15000 // Default capacity of the QoS 0 lane, the largest one
+
+struct msg_lane {
+    const char *name;
+    int capacity;                        // Entries once the database is ready (scaled up before)
+    int drop_policy;
+    int weight;
+    struct msg_entry *head;
+    struct msg_entry *tail;
+    int size;
+    atomic_ullong dropped;
+    int full;                            // Dropping entries; logged once until the lane has room again
+    unsigned long long full_dropped;     // dropped when the lane filled up
+};
+
+static struct msg_lane msg_lanes[LANE_COUNT] = {
+    [LANE_DELETE] = { .name = "delete", .capacity = 5000, .drop_policy = LANE_DROP_NEWEST, .weight = 4 },
+    [LANE_QOS2]   = { .name = "qos2", .capacity = 5000, .drop_policy = LANE_DROP_NEWEST, .weight = 4 },
+    [LANE_QOS1]   = { .name = "qos1", .capacity = 10000, .drop_policy = LANE_DROP_OLDEST, .weight = 2 },
+    [LANE_QOS0]   = { .name = "qos0", .capacity = LANE_QOS0_DEFAULT_CAPACITY, .drop_policy = LANE_DROP_OLDEST, .weight = 1 },
+};
+static int msg_queue_size = 0;                   // Entries in all lanes
+static unsigned long long msg_queue_seq = 0;
 static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
 static pthread_t batch_thread;
 static atomic_int batch_thread_running = 0;
 
+// Spool thread: writes the large payloads of queued entries to the file store, which then
+// only hold their hash. Entries stay in their lane meanwhile; one that leaves it is taken off
+// the spool, or waited for while it is being written (all guarded by queue_mutex)
+#define SPOOL_NONE 0
+#define SPOOL_WAITING 1
+#define SPOOL_WRITING 2
+static struct msg_entry *spool_head = NULL;
+static struct msg_entry *spool_tail = NULL;
+static int spool_orphaned = 0;            // The entry being written was dropped, the spool thread frees it
+static pthread_cond_t spool_cond = PTHREAD_COND_INITIALIZER;       // Entries to spool
+static pthread_cond_t spool_done_cond = PTHREAD_COND_INITIALIZER;  // A spool write finished
+static pthread_mutex_t payload_file_mutex = PTHREAD_MUTEX_INITIALIZER;  // File store writes and GC removals
+static pthread_t spool_thread;
+static atomic_int spool_thread_running = 0;
+
 // Forward declarations
-static void flush_batch(void);
+static int flush_batch(void);
+static void free_entries(struct msg_entry *entry);
+static long long pragma_int(const char *sql);
 static void *batch_worker(void *arg);
+static int table_has_column(const char *table, const char *column);
+static int load_schema_version(void);
+static void run_schema_migration(void);
+static int init_database(void);
 
 // MQTT topic matching with wildcards (+ and #)
 // Returns 1 if topic matches pattern, 0 otherwise
@@ -156,18 +742,27 @@ static int topic_matches_pattern(const char *pattern, const char *topic) {
     return 0;
 }
 
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
 // Check if topic should be excluded from persistence
-static int is_topic_excluded(const char *topic) {
-    for (int i = 0; i < exclude_pattern_count; i++) {
-        if (topic_matches_pattern(exclude_patterns[i], topic)) {
+static int is_topic_excluded(const struct runtime_config *cfg, const char *topic) {
+    const struct topic_matcher *m = &cfg->topic_exclusions;
+    if (m->exact_count > 0 && 
+        bsearch(&topic, m->exact, m->exact_count, sizeof(char *), compare_strings) != NULL) {
+        return 1;
+    }
+    for (int i = 0; i < m->wildcard_count; i++) {
+        if (topic_matches_pattern(m->wildcard[i], topic)) {
             return 1;
         }
     }
     return 0;
 }
 
-// Parse comma-separated exclusion patterns
-static void parse_exclude_patterns(const char *patterns_str) {
+// Parse comma-separated exclusion patterns into the config's topic matcher
+static void parse_exclude_patterns(struct runtime_config *cfg, const char *patterns_str) {
     if (patterns_str == NULL || *patterns_str == '\0') {
         return;
     }
@@ -177,8 +772,10 @@ static void parse_exclude_patterns(const char *patterns_str) {
         return;
     }
     
-    char *token = strtok(patterns_copy, ",");
-    while (token != NULL && exclude_pattern_count < MAX_EXCLUDE_PATTERNS) {
+    struct topic_matcher *m = &cfg->topic_exclusions;
+    char *saveptr = NULL;
+    char *token = strtok_r(patterns_copy, ",", &saveptr);
+    while (token != NULL && m->exact_count + m->wildcard_count < MAX_EXCLUDE_PATTERNS) {
         // Trim leading whitespace
         while (*token == ' ') token++;
         // Trim trailing whitespace
@@ -189,37 +786,97 @@ static void parse_exclude_patterns(const char *patterns_str) {
         }
         
         if (*token != '\0') {
-            exclude_patterns[exclude_pattern_count] = strdup(token);
-            if (exclude_patterns[exclude_pattern_count] != NULL) {
-                mosquitto_log_printf(MOSQ_LOG_INFO, "Excluding topic pattern: %s", exclude_patterns[exclude_pattern_count]);
-                exclude_pattern_count++;
+            char *pattern = strdup(token);
+            if (pattern != NULL) {
+                if (strpbrk(pattern, "+#") != NULL) {
+                    m->wildcard[m->wildcard_count++] = pattern;
+                } else {
+                    m->exact[m->exact_count++] = pattern;
+                }
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Excluding topic pattern: %s", pattern);
             }
         }
-        token = strtok(NULL, ",");
+        token = strtok_r(NULL, ",", &saveptr);
     }
     
+    qsort(m->exact, m->exact_count, sizeof(char *), compare_strings);
     free(patterns_copy);
 }
 
 // Free exclusion patterns
-static void free_exclude_patterns(void) {
-    for (int i = 0; i < exclude_pattern_count; i++) {
-        free(exclude_patterns[i]);
-        exclude_patterns[i] = NULL;
+static void free_exclude_patterns(struct runtime_config *cfg) {
+    struct topic_matcher *m = &cfg->topic_exclusions;
+    for (int i = 0; i < m->exact_count; i++) {
+        free(m->exact[i]);
+    }
+    for (int i = 0; i < m->wildcard_count; i++) {
+        free(m->wildcard[i]);
+    }
+    m->exact_count = 0;
+    m->wildcard_count = 0;
+}
+
+// Parse comma-separated topic patterns stored in msg_bucket rows
+static void parse_bucket_patterns(const char *patterns_str) {
+    if (patterns_str == NULL || *patterns_str == '\0') {
+        return;
+    }
+    
+    char *patterns_copy = strdup(patterns_str);
+    if (patterns_copy == NULL) {
+        return;
+    }
+    
+    char *saveptr = NULL;
+    char *token = strtok_r(patterns_copy, ",", &saveptr);
+    while (token != NULL && bucket_pattern_count < MAX_BUCKET_PATTERNS) {
+        while (*token == ' ') token++;
+        char *end = token + strlen(token) - 1;
+        while (end > token && *end == ' ') {
+            *end = '\0';
+            end--;
+        }
+        
+        if (*token != '\0') {
+            bucket_patterns[bucket_pattern_count] = strdup(token);
+            if (bucket_patterns[bucket_pattern_count] != NULL) {
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Bucketed topic pattern: %s", bucket_patterns[bucket_pattern_count]);
+                bucket_pattern_count++;
+            }
+        }
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    
+    free(patterns_copy);
+}
+
+static void free_bucket_patterns(void) {
+    for (int i = 0; i < bucket_pattern_count; i++) {
+        free(bucket_patterns[i]);
+        bucket_patterns[i] = NULL;
+    }
+    bucket_pattern_count = 0;
+}
+
+static int is_topic_bucketed(const char *topic) {
+    for (int i = 0; i < bucket_pattern_count; i++) {
+        if (topic_matches_pattern(bucket_patterns[i], topic)) {
+            return 1;
+        }
     }
-    exclude_pattern_count = 0;
+    return 0;
 }
 
 // Parse comma-separated header exclusion list
 // Special value '#' disables header storage completely
-static void parse_exclude_headers(const char *headers_str) {
+static void parse_exclude_headers(struct runtime_config *cfg, const char *headers_str) {
     if (headers_str == NULL || *headers_str == '\0') {
         return;
     }
     
     // Check for special '#' value to disable all header storage
     if (strcmp(headers_str, "#") == 0) {
-        headers_disabled = 1;
+        cfg->headers_disabled = 1;
         mosquitto_log_printf(MOSQ_LOG_INFO, "Header storage disabled (exclude_headers=#)");
         return;
     }
@@ -229,8 +886,9 @@ static void parse_exclude_headers(const char *headers_str) {
         return;
     }
     
-    char *token = strtok(headers_copy, ",");
-    while (token != NULL && exclude_header_count < MAX_EXCLUDE_HEADERS) {
+    char *saveptr = NULL;
+    char *token = strtok_r(headers_copy, ",", &saveptr);
+    while (token != NULL && cfg->header_exclusion_count < MAX_EXCLUDE_HEADERS) {
         // Trim leading whitespace
         while (*token == ' ') token++;
         // Trim trailing whitespace
@@ -242,29 +900,29 @@ static void parse_exclude_headers(const char *headers_str) {
         
         // Check for '#' in the list
         if (strcmp(token, "#") == 0) {
-            headers_disabled = 1;
+            cfg->headers_disabled = 1;
             mosquitto_log_printf(MOSQ_LOG_INFO, "Header storage disabled (exclude_headers contains #)");
             free(headers_copy);
             return;
         }
         
         if (*token != '\0') {
-            exclude_headers[exclude_header_count] = strdup(token);
-            if (exclude_headers[exclude_header_count] != NULL) {
-                mosquitto_log_printf(MOSQ_LOG_INFO, "Excluding header: %s", exclude_headers[exclude_header_count]);
-                exclude_header_count++;
+            char *header = strdup(token);
+            if (header != NULL) {
+                cfg->header_exclusions[cfg->header_exclusion_count++] = header;
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Excluding header: %s", header);
             }
         }
-        token = strtok(NULL, ",");
+        token = strtok_r(NULL, ",", &saveptr);
     }
     
     free(headers_copy);
 }
 
 // Check if a header name should be excluded
-static int is_header_excluded(const char *header_name) {
-    for (int i = 0; i < exclude_header_count; i++) {
-        if (strcmp(exclude_headers[i], header_name) == 0) {
+static int is_header_excluded(const struct runtime_config *cfg, const char *header_name) {
+    for (int i = 0; i < cfg->header_exclusion_count; i++) {
+        if (strcmp(cfg->header_exclusions[i], header_name) == 0) {
             return 1;
         }
     }
@@ -272,690 +930,7347 @@ static int is_header_excluded(const char *header_name) {
 }
 
 // Free header exclusion list
-static void free_exclude_headers(void) {
-    for (int i = 0; i < exclude_header_count; i++) {
-        free(exclude_headers[i]);
-        exclude_headers[i] = NULL;
+static void free_exclude_headers(struct runtime_config *cfg) {
+    for (int i = 0; i < cfg->header_exclusion_count; i++) {
+        free(cfg->header_exclusions[i]);
     }
-    exclude_header_count = 0;
+    cfg->header_exclusion_count = 0;
+    cfg->headers_disabled = 0;
 }
 
-// Returns unix epoch microseconds.
-static unsigned long long platform_utime(int coarse) {
-	// CLOCK_REALTIME_COARSE has a resolution of 1ms, which is sufficient for this purpose. It's also much faster.
-	struct timespec tv[1];
-	clock_gettime(coarse ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, tv);
-	return tv->tv_sec * 1000000ULL + tv->tv_nsec / 1000ULL;
+// Current runtime config; valid until the calling thread's next quiescent point
+// (broker thread: end of the callback, worker thread: next loop iteration)
+static inline const struct runtime_config *runtime_config_get(void) {
+    return atomic_load_explicit(&active_config, memory_order_acquire);
 }
 
-// Gather entropy from the operating system. Returns 0 on success.
-static int platform_entropy(void *buf, int len) {
-    return syscall(SYS_getrandom, buf, len, 0) != len;
+// New config with defaults, or a copy of base (compiled by runtime_config_compile)
+static struct runtime_config *runtime_config_new(const struct runtime_config *base) {
+    struct runtime_config *cfg = calloc(1, sizeof(*cfg));
+    if (cfg == NULL) {
+        return NULL;
+    }
+    if (base == NULL) {
+        cfg->batch_size = DEFAULT_BATCH_SIZE;
+        cfg->flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
+        cfg->retention_days = DEFAULT_RETENTION_DAYS;
+        return cfg;
+    }
+    cfg->batch_size = base->batch_size;
+    cfg->flush_interval_ms = base->flush_interval_ms;
+    cfg->retention_days = base->retention_days;
+    cfg->exclude_topics = base->exclude_topics ? strdup(base->exclude_topics) : NULL;
+    cfg->exclude_headers = base->exclude_headers ? strdup(base->exclude_headers) : NULL;
+    return cfg;
 }
 
-int ulid_generator_init(struct ulid_generator *g, int flags) {
-    g->last_ts = 0;
-    g->flags = flags;
-    g->i = g->j = 0;
-    for (int i = 0; i < 256; i++) {
-        g->s[i] = i;
+static void runtime_config_free(struct runtime_config *cfg) {
+    if (cfg == NULL) {
+        return;
     }
+    free_exclude_patterns(cfg);
+    free_exclude_headers(cfg);
+    free(cfg->exclude_topics);
+    free(cfg->exclude_headers);
+    free(cfg);
+}
 
-    /* RC4 is used to fill the random segment of ULIDs. It's tiny,
-     * simple, perfectly sufficient for the task (assuming it's seeded
-     * properly), and doesn't require fixed-width integers. It's not the
-     * fastest option, but it's plenty fast for the task.
-     *
-     * Besides, when we're in a serious hurry in normal operation (not
-     * in "relaxed" mode), we're incrementing the random field much more
-     * often than generating fresh random bytes.
-     */
+// Apply one option to a config that has not been published yet
+// Returns 1 if applied, 0 if key is not a runtime option, -1 if the value is invalid
+static int runtime_config_set(struct runtime_config *cfg, const char *key, const char *value) {
+    char **field = NULL;
+    if (strcmp(key, "exclude_topics") == 0) {
+        field = &cfg->exclude_topics;
+    } else if (strcmp(key, "exclude_headers") == 0) {
+        field = &cfg->exclude_headers;
+    }
+    if (field != NULL) {
+        free(*field);
+        *field = (value != NULL && *value != '\0') ? strdup(value) : NULL;
+        return 1;
+    }
+    
+    // Numeric options: the whole value must be a decimal number ("abc" or "10x" is invalid)
+    int val = -1;
+    if (value != NULL && *value != '\0') {
+        char *end = NULL;
+        errno = 0;
+        long num = strtol(value, &end, 10);
+        while (*end == ' ' || *end == '\t') end++;
+        if (errno == 0 && *end == '\0' && num >= INT_MIN && num <= INT_MAX) {
+            val = (int)num;
+        }
+    }
+    if (strcmp(key, "batch_size") == 0) {
+        if (val <= 0 || val > LANE_QOS0_DEFAULT_CAPACITY) {
+            return -1;
+        }
+        cfg->batch_size = val;
+    } else if (strcmp(key, "flush_interval") == 0) {
+        if (val <= 0 || val > 10000) {
+            return -1;
+        }
+        cfg->flush_interval_ms = val;
+    } else if (strcmp(key, "retention_days") == 0) {
+        if (val < 0 || val > 3650) {  // Max 10 years
+            return -1;
+        }
+        cfg->retention_days = val;
+    } else {
+        return 0;
+    }
+    return 1;
+}
 
-    int initstyle = 1;
-    unsigned char key[256] = {0};
-    if (!platform_entropy(key, 256)) {
-        // Mix entropy into the RC4 state.
-        for (int i = 0, j = 0; i < 256; i++) {
-            j = (j + g->s[i] + key[i]) & 0xff;
-            int tmp = g->s[i];
-            g->s[i] = g->s[j];
-            g->s[j] = tmp;
+// Build the matchers from the option strings
+static void runtime_config_compile(struct runtime_config *cfg) {
+    parse_exclude_patterns(cfg, cfg->exclude_topics);
+    parse_exclude_headers(cfg, cfg->exclude_headers);
+}
+
+// Free retired configs the worker thread can no longer see (all = 1 after it has stopped)
+static void reclaim_retired_configs(int all) {
+    unsigned long long in_use = atomic_load(&worker_config_generation);
+    struct runtime_config **prev = &retired_configs;
+    while (*prev != NULL) {
+        struct runtime_config *cfg = *prev;
+        if (all || cfg->generation < in_use) {
+            *prev = cfg->retired_next;
+            runtime_config_free(cfg);
+        } else {
+            prev = &cfg->retired_next;
         }
-        initstyle = 0;
-    } else if (!(flags & ULID_SECURE)) {
-        // Failed to read entropy from OS, so generate some.
-        unsigned long n = 0;
-        unsigned long long now;
-        unsigned long long start = platform_utime(0);
-        do {
-            struct {
-                clock_t clk;
-                unsigned long long ts;
-                long n;
-                void *stackgap;
-            } noise;
-            noise.ts = now = platform_utime(0);
-            noise.clk = clock();
-            noise.stackgap = &noise;
-            noise.n = n;
-            unsigned char *k = (unsigned char *)&noise;
-            for (int i = 0, j = 0; i < 256; i++) {
-                j = (j + g->s[i] + k[i % sizeof(noise)]) & 0xff;
-                int tmp = g->s[i];
-                g->s[i] = g->s[j];
-                g->s[j] = tmp;
-            }
-        } while (n++ < 1UL << 16 || now - start < 500000ULL);
     }
-    return initstyle;
 }
 
-void ulid_encode(char str[27], const unsigned char ulid[16]) {
-    static const char set[256] = {
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
-        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
-        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
-        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
-        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a
-    };
-    str[ 0] = set[ ulid[ 0] >> 5];
-    str[ 1] = set[ ulid[ 0] >> 0];
-    str[ 2] = set[ ulid[ 1] >> 3];
-    str[ 3] = set[(ulid[ 1] << 2 | ulid[ 2] >> 6) & 0x1f];
-    str[ 4] = set[ ulid[ 2] >> 1];
-    str[ 5] = set[(ulid[ 2] << 4 | ulid[ 3] >> 4) & 0x1f];
-    str[ 6] = set[(ulid[ 3] << 1 | ulid[ 4] >> 7) & 0x1f];
-    str[ 7] = set[ ulid[ 4] >> 2];
-    str[ 8] = set[(ulid[ 4] << 3 | ulid[ 5] >> 5) & 0x1f];
-    str[ 9] = set[ ulid[ 5] >> 0];
-    str[10] = set[ ulid[ 6] >> 3];
-    str[11] = set[(ulid[ 6] << 2 | ulid[ 7] >> 6) & 0x1f];
-    str[12] = set[ ulid[ 7] >> 1];
-    str[13] = set[(ulid[ 7] << 4 | ulid[ 8] >> 4) & 0x1f];
-    str[14] = set[(ulid[ 8] << 1 | ulid[ 9] >> 7) & 0x1f];
-    str[15] = set[ ulid[ 9] >> 2];
-    str[16] = set[(ulid[ 9] << 3 | ulid[10] >> 5) & 0x1f];
-    str[17] = set[ ulid[10] >> 0];
-    str[18] = set[ ulid[11] >> 3];
-    str[19] = set[(ulid[11] << 2 | ulid[12] >> 6) & 0x1f];
-    str[20] = set[ ulid[12] >> 1];
-    str[21] = set[(ulid[12] << 4 | ulid[13] >> 4) & 0x1f];
-    str[22] = set[(ulid[13] << 1 | ulid[14] >> 7) & 0x1f];
-    str[23] = set[ ulid[14] >> 2];
-    str[24] = set[(ulid[14] << 3 | ulid[15] >> 5) & 0x1f];
-    str[25] = set[ ulid[15] >> 0];
-    str[26] = 0;
+// Make cfg the active config (broker thread only); the previous one is retired
+static void runtime_config_publish(struct runtime_config *cfg) {
+    struct runtime_config *old = atomic_load(&active_config);
+    cfg->generation = old != NULL ? old->generation + 1 : 1;
+    atomic_store_explicit(&active_config, cfg, memory_order_release);
+    
+    if (old != NULL) {
+        old->retired_next = retired_configs;
+        retired_configs = old;
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Runtime configuration %llu active: batch_size=%d, flush_interval=%dms, retention_days=%d", 
+                            cfg->generation, cfg->batch_size, cfg->flush_interval_ms, cfg->retention_days);
+        // Wake the worker so new batch and flush settings apply right away
+        pthread_cond_signal(&queue_cond);
+    }
+    reclaim_retired_configs(0);
 }
 
-int ulid_decode(unsigned char ulid[16], const char *s) {
-    static const signed char v[] = {
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-        0x08, 0x09,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
-        0x11, 0x01, 0x12, 0x13, 0x01, 0x14, 0x15, 0x00,
-        0x16, 0x17, 0x18, 0x19, 0x1a,   -1, 0x1b, 0x1c,
-        0x1d, 0x1e, 0x1f,   -1,   -1,   -1,   -1,   -1,
-          -1, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
-        0x11, 0x01, 0x12, 0x13, 0x01, 0x14, 0x15, 0x00,
-        0x16, 0x17, 0x18, 0x19, 0x1a,   -1, 0x1b, 0x1c,
-        0x1d, 0x1e, 0x1f,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
-          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1
-    };
-    if (v[(int)s[0]] > 7)
-        return 1;
-    for (int i = 0; i < 26; i++)
-        if (v[(int)s[i]] == -1)
-            return 2;
-    ulid[ 0] = v[(int)s[ 0]] << 5 | v[(int)s[ 1]] >> 0;
-    ulid[ 1] = v[(int)s[ 2]] << 3 | v[(int)s[ 3]] >> 2;
-    ulid[ 2] = v[(int)s[ 3]] << 6 | v[(int)s[ 4]] << 1 | v[(int)s[ 5]] >> 4;
-    ulid[ 3] = v[(int)s[ 5]] << 4 | v[(int)s[ 6]] >> 1;
-    ulid[ 4] = v[(int)s[ 6]] << 7 | v[(int)s[ 7]] << 2 | v[(int)s[ 8]] >> 3;
-    ulid[ 5] = v[(int)s[ 8]] << 5 | v[(int)s[ 9]] >> 0;
-    ulid[ 6] = v[(int)s[10]] << 3 | v[(int)s[11]] >> 2;
-    ulid[ 7] = v[(int)s[11]] << 6 | v[(int)s[12]] << 1 | v[(int)s[13]] >> 4;
-    ulid[ 8] = v[(int)s[13]] << 4 | v[(int)s[14]] >> 1;
-    ulid[ 9] = v[(int)s[14]] << 7 | v[(int)s[15]] << 2 | v[(int)s[16]] >> 3;
-    ulid[10] = v[(int)s[16]] << 5 | v[(int)s[17]] >> 0;
-    ulid[11] = v[(int)s[18]] << 3 | v[(int)s[19]] >> 2;
-    ulid[12] = v[(int)s[19]] << 6 | v[(int)s[20]] << 1 | v[(int)s[21]] >> 4;
-    ulid[13] = v[(int)s[21]] << 4 | v[(int)s[22]] >> 1;
-    ulid[14] = v[(int)s[22]] << 7 | v[(int)s[23]] << 2 | v[(int)s[24]] >> 3;
-    ulid[15] = v[(int)s[24]] << 5 | v[(int)s[25]] >> 0;
+// Parse a duration with optional unit suffix (ms, s, m, h); a bare number is milliseconds
+// Returns 0 on parse error
+static unsigned long long parse_duration_ms(const char *value) {
+    char *end = NULL;
+    double num = strtod(value, &end);
+    if (end == value || num <= 0) {
+        return 0;
+    }
+    if (*end == '\0' || strcmp(end, "ms") == 0) {
+        return (unsigned long long)num;
+    } else if (strcmp(end, "s") == 0) {
+        return (unsigned long long)(num * 1000.0);
+    } else if (strcmp(end, "m") == 0) {
+        return (unsigned long long)(num * 60000.0);
+    } else if (strcmp(end, "h") == 0) {
+        return (unsigned long long)(num * 3600000.0);
+    }
     return 0;
 }
 
-unsigned long long ulid_generate(struct ulid_generator *g, char str[27]) {
-    unsigned long long ts = platform_utime(1) / 1000;
+// Parse a size with optional unit suffix (k, M, G as powers of 1024); a bare number is bytes
+// Returns 0 on parse error
+static unsigned long long parse_size_bytes(const char *value) {
+    char *end = NULL;
+    double num = strtod(value, &end);
+    if (end == value || num <= 0) {
+        return 0;
+    }
+    if (*end == '\0') {
+        return (unsigned long long)num;
+    } else if (strcasecmp(end, "k") == 0) {
+        return (unsigned long long)(num * 1024.0);
+    } else if (strcasecmp(end, "m") == 0) {
+        return (unsigned long long)(num * 1024.0 * 1024.0);
+    } else if (strcasecmp(end, "g") == 0) {
+        return (unsigned long long)(num * 1024.0 * 1024.0 * 1024.0);
+    }
+    return 0;
+}
 
-    if (!(g->flags & ULID_RELAXED) && g->last_ts == ts) {
-        // Chance of 80-bit overflow is so small that it's not considered.
-        for (int i = 15; i > 5; i--) {
-            if (++g->last[i]) {
-                break;
-            }
+// 64-bit XXH64 hash, used for topic keys in the policy state table and payload change detection
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxh_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t hash64_seeded(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+    
+    if (len >= 32) {
+        const unsigned char *limit = end - 32;
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        do {
+            v1 = xxh_round(v1, xxh_read64(p)); p += 8;
+            v2 = xxh_round(v2, xxh_read64(p)); p += 8;
+            v3 = xxh_round(v3, xxh_read64(p)); p += 8;
+            v4 = xxh_round(v4, xxh_read64(p)); p += 8;
+        } while (p <= limit);
+        h = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+        h = xxh_merge_round(h, v1);
+        h = xxh_merge_round(h, v2);
+        h = xxh_merge_round(h, v3);
+        h = xxh_merge_round(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    
+    h += (uint64_t)len;
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+    
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t hash64(const void *data, size_t len) {
+    return hash64_seeded(data, len, 0);
+}
+
+// 128-bit content hash for payload deduplication: two independently seeded XXH64 lanes,
+// stored big-endian so the key sorts and prints consistently
+#define PAYLOAD_HASH_SEED 0x6D71426173655F31ULL
+
+static void payload_hash128(const void *data, size_t len, unsigned char out[PAYLOAD_HASH_LEN]) {
+    uint64_t lanes[2] = { hash64_seeded(data, len, 0), hash64_seeded(data, len, PAYLOAD_HASH_SEED) };
+    for (int i = 0; i < 2; i++) {
+        for (int b = 0; b < 8; b++) {
+            out[i * 8 + b] = (unsigned char)(lanes[i] >> (56 - 8 * b));
         }
-        ulid_encode(str, g->last);
+    }
+}
 
-        return ts;
+// Parse one "pattern=policy[:args]" persistence policy entry
+// Returns 0 on success
+static int parse_persist_policy(char *token, struct persist_policy *policy) {
+    char *eq = strrchr(token, '=');
+    if (eq == NULL || eq == token) {
+        return 1;
+    }
+    *eq = '\0';
+    char *spec = eq + 1;
+    char *args = strchr(spec, ':');
+    if (args != NULL) {
+        *args++ = '\0';
+    }
+    
+    memset(policy, 0, sizeof(*policy));
+    if (strcmp(spec, "all") == 0) {
+        policy->type = POLICY_ALL;
+    } else if (strcmp(spec, "skip") == 0) {
+        policy->type = POLICY_SKIP;
+    } else if (strcmp(spec, "every") == 0) {
+        int n = args ? atoi(args) : 0;
+        if (n <= 0) {
+            return 1;
+        }
+        policy->type = POLICY_EVERY;
+        policy->every_n = (unsigned int)n;
+    } else if (strcmp(spec, "interval") == 0) {
+        policy->interval_ms = args ? parse_duration_ms(args) : 0;
+        if (policy->interval_ms == 0) {
+            return 1;
+        }
+        policy->type = POLICY_INTERVAL;
+    } else if (strcmp(spec, "changed") == 0) {
+        policy->type = POLICY_CHANGED;
+    } else if (strcmp(spec, "deadband") == 0) {
+        // deadband:<delta> for plain numeric payloads, deadband:<field>:<delta> for JSON objects
+        if (args == NULL) {
+            return 1;
+        }
+        char *delta = strrchr(args, ':');
+        if (delta != NULL) {
+            *delta++ = '\0';
+            policy->field = strdup(args);
+            if (policy->field == NULL) {
+                return 1;
+            }
+        } else {
+            delta = args;
+        }
+        char *end = NULL;
+        policy->deadband = strtod(delta, &end);
+        if (end == delta || *end != '\0' || policy->deadband < 0) {
+            free(policy->field);
+            policy->field = NULL;
+            return 1;
+        }
+        policy->type = POLICY_DEADBAND;
+    } else {
+        return 1;
+    }
+    
+    policy->pattern = strdup(token);
+    if (policy->pattern == NULL) {
+        free(policy->field);
+        policy->field = NULL;
+        return 1;
     }
+    return 0;
+}
 
-    // Fill out timestamp.
-    g->last_ts = ts;
-    g->last[0] = ts >> 40;
-    g->last[1] = ts >> 32;
-    g->last[2] = ts >> 24;
-    g->last[3] = ts >> 16;
-    g->last[4] = ts >>  8;
-    g->last[5] = ts >>  0;
+// Parse comma-separated persistence policies (first matching pattern wins)
+static void parse_persist_policies(const char *policies_str) {
+    if (policies_str == NULL || *policies_str == '\0') {
+        return;
+    }
+    
+    char *policies_copy = strdup(policies_str);
+    if (policies_copy == NULL) {
+        return;
+    }
+    
+    char *saveptr = NULL;
+    char *token = strtok_r(policies_copy, ",", &saveptr);
+    while (token != NULL && persist_policy_count < MAX_PERSIST_POLICIES) {
+        // Trim leading whitespace
+        while (*token == ' ') token++;
+        // Trim trailing whitespace
+        char *end = token + strlen(token) - 1;
+        while (end > token && *end == ' ') {
+            *end = '\0';
+            end--;
+        }
+        
+        if (*token != '\0') {
+            char *entry = strdup(token);
+            if (entry != NULL) {
+                if (parse_persist_policy(token, &persist_policies[persist_policy_count]) == 0) {
+                    mosquitto_log_printf(MOSQ_LOG_INFO, "Persistence policy: %s", entry);
+                    persist_policy_count++;
+                } else {
+                    mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring invalid persistence policy: %s", entry);
+                }
+                free(entry);
+            }
+        }
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    
+    free(policies_copy);
+}
 
-    // Fill out random section.
-    for (int k = 0; k < 10; k++) {
-        g->i = (g->i + 1) & 0xff;
-        g->j = (g->j + g->s[g->i]) & 0xff;
-        int tmp = g->s[g->i];
-        g->s[g->i] = g->s[g->j];
-        g->s[g->j] = tmp;
-        g->last[6 + k] = g->s[(g->s[g->i] + g->s[g->j]) & 0xff];
+// Free persistence policies and their per-topic state
+static void free_persist_policies(void) {
+    for (int i = 0; i < persist_policy_count; i++) {
+        free(persist_policies[i].pattern);
+        free(persist_policies[i].field);
+        memset(&persist_policies[i], 0, sizeof(persist_policies[i]));
+    }
+    persist_policy_count = 0;
+    
+    for (size_t i = 0; i < policy_state_capacity; i++) {
+        free(policy_states[i].topic);
     }
+    free(policy_states);
+    policy_states = NULL;
+    policy_state_capacity = 0;
+    policy_state_count = 0;
+}
 
-    if (g->flags & ULID_PARANOID) {
-        g->last[6] &= 0x7f;
+// Find the first policy whose pattern matches the topic, or NULL
+static const struct persist_policy *find_persist_policy(const char *topic) {
+    for (int i = 0; i < persist_policy_count; i++) {
+        if (topic_matches_pattern(persist_policies[i].pattern, topic)) {
+            return &persist_policies[i];
+        }
     }
+    return NULL;
+}
 
-    ulid_encode(str, g->last);
+// Messages older than this leave a topic's policy state idle (0 = nothing is idle yet)
+static unsigned long long policy_state_idle_cutoff(unsigned long long now_ms) {
+    unsigned long long idle_ms = POLICY_STATE_IDLE_MS;
+    for (int i = 0; i < persist_policy_count; i++) {
+        if (persist_policies[i].type == POLICY_INTERVAL && persist_policies[i].interval_ms > idle_ms) {
+            idle_ms = persist_policies[i].interval_ms;
+        }
+    }
+    return now_ms > idle_ms ? now_ms - idle_ms : 0;
+}
 
-    return ts;
+// Move the states into a table of new_capacity slots, dropping those last seen before cutoff_ms
+// Returns 0 on success
+static int policy_states_rehash(size_t new_capacity, unsigned long long cutoff_ms) {
+    struct policy_state *new_states = calloc(new_capacity, sizeof(struct policy_state));
+    if (new_states == NULL) {
+        return -1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < policy_state_capacity; i++) {
+        struct policy_state *state = &policy_states[i];
+        if (state->topic_hash == 0) {
+            continue;
+        }
+        if (state->last_seen_ms < cutoff_ms) {
+            free(state->topic);
+            atomic_fetch_add(&policy_states_evicted, 1);
+            continue;
+        }
+        size_t slot = state->topic_hash & (new_capacity - 1);
+        while (new_states[slot].topic_hash != 0) {
+            slot = (slot + 1) & (new_capacity - 1);
+        }
+        new_states[slot] = *state;
+        count++;
+    }
+    free(policy_states);
+    policy_states = new_states;
+    policy_state_capacity = new_capacity;
+    policy_state_count = count;
+    return 0;
 }
 
-// Enqueue a message for batch insert
-static void enqueue_message(const char *ulid, const char *topic, const char *payload, 
-                           size_t payloadlen, const char *headers, int retain, int qos) {
-    struct msg_entry *entry = malloc(sizeof(struct msg_entry));
-    if (entry == NULL) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate message entry");
+// Drop idle policy states, every POLICY_STATE_SWEEP_INTERVAL_SEC (broker thread, from the tick)
+static void sweep_policy_states(time_t now_s) {
+    if (now_s - last_policy_sweep < POLICY_STATE_SWEEP_INTERVAL_SEC || policy_state_count == 0) {
         return;
     }
+    last_policy_sweep = now_s;
+    size_t before = policy_state_count;
+    policy_states_rehash(policy_state_capacity, policy_state_idle_cutoff((unsigned long long)now_s * 1000ULL));
+    if (policy_state_count < before) {
+        LOG_DEBUG("Evicted %zu idle policy states, %zu left", before - policy_state_count, policy_state_count);
+    }
+}
+
+// Look up (or create) the state of a topic in the open-addressing table. Idle states are
+// dropped whenever the table has to grow. Returns NULL if the table is full and cannot grow
+static struct policy_state *policy_state_lookup(const char *topic, unsigned long long now_ms) {
+    uint64_t topic_hash = hash64(topic, strlen(topic));
+    // Hash 0 marks empty slots
+    if (topic_hash == 0) {
+        topic_hash = 1;
+    }
     
-    entry->operation = OP_INSERT;
-    memcpy(entry->ulid, ulid, 27);
-    entry->topic = strdup(topic);
-    entry->payload = strndup(payload, payloadlen);
-    entry->headers = NULL;  // Initialize to NULL first
-    entry->retain = retain;
-    entry->qos = qos;
-    entry->next = NULL;
-    
-    // Check mandatory allocations first
-    if (entry->topic == NULL || entry->payload == NULL) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate message strings");
-        free(entry->topic);
-        free(entry->payload);
-        free(entry);
-        return;
+    if (policy_state_count + 1 > policy_state_capacity / 4 * 3) {
+        size_t new_capacity = policy_state_capacity ? policy_state_capacity * 2 : POLICY_STATE_INITIAL_CAPACITY;
+        if (new_capacity > MAX_POLICY_STATES) {
+            new_capacity = policy_state_capacity;
+        }
+        // At the maximum size the table is only swept here once per sweep interval
+        time_t now_s = (time_t)(now_ms / 1000);
+        if (new_capacity > policy_state_capacity || now_s - last_policy_sweep >= POLICY_STATE_SWEEP_INTERVAL_SEC) {
+            last_policy_sweep = now_s;
+            policy_states_rehash(new_capacity, policy_state_idle_cutoff(now_ms));
+        }
+        if (policy_state_count + 1 > policy_state_capacity / 4 * 3) {
+            return NULL;
+        }
     }
     
-    // Now handle optional headers - if strdup fails, log warning but continue
-    if (headers != NULL) {
-        entry->headers = strdup(headers);
-        if (entry->headers == NULL) {
-            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to allocate headers string, message stored without headers");
+    size_t slot = topic_hash & (policy_state_capacity - 1);
+    while (policy_states[slot].topic_hash != 0) {
+        if (policy_states[slot].topic_hash == topic_hash && strcmp(policy_states[slot].topic, topic) == 0) {
+            policy_states[slot].last_seen_ms = now_ms;
+            return &policy_states[slot];
         }
+        slot = (slot + 1) & (policy_state_capacity - 1);
     }
     
-    pthread_mutex_lock(&queue_mutex);
+    char *topic_copy = strdup(topic);
+    if (topic_copy == NULL) {
+        return NULL;
+    }
+    memset(&policy_states[slot], 0, sizeof(policy_states[slot]));
+    policy_states[slot].topic_hash = topic_hash;
+    policy_states[slot].topic = topic_copy;
+    policy_states[slot].last_seen_ms = now_ms;
+    policy_state_count++;
+    return &policy_states[slot];
+}
+
+// Extract a numeric value from the payload: either the whole payload is a number,
+// or field names a top-level member of a JSON object. Returns 0 on success
+static int extract_numeric_value(const char *payload, size_t payloadlen, const char *field, double *value) {
+    char buf[64];
+    const char *p = payload;
+    const char *end = payload + payloadlen;
     
-    // Enforce maximum queue size to prevent unbounded memory growth
-    if (msg_queue_size >= MAX_QUEUE_SIZE) {
-        mosquitto_log_printf(MOSQ_LOG_WARNING, "Message queue full (%d), dropping oldest entry", MAX_QUEUE_SIZE);
-        // Drop oldest entry from head
-        struct msg_entry *old = msg_queue_head;
-        if (old != NULL) {
-            msg_queue_head = old->next;
-            if (msg_queue_head == NULL) {
-                msg_queue_tail = NULL;
+    if (field != NULL) {
+        // Scan for "field" followed by ':'; nested objects are not descended into
+        size_t field_len = strlen(field);
+        int depth = 0;
+        const char *num = NULL;
+        while (p < end) {
+            if (*p == '{' || *p == '[') {
+                depth++;
+                p++;
+            } else if (*p == '}' || *p == ']') {
+                depth--;
+                p++;
+            } else if (*p == '"') {
+                const char *key = ++p;
+                while (p < end && *p != '"') {
+                    if (*p == '\\' && p + 1 < end) {
+                        p++;
+                    }
+                    p++;
+                }
+                if (p >= end) {
+                    return 1;
+                }
+                size_t key_len = (size_t)(p - key);
+                p++;
+                if (depth == 1 && key_len == field_len && memcmp(key, field, field_len) == 0) {
+                    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+                    if (p < end && *p == ':') {
+                        num = p + 1;
+                        break;
+                    }
+                }
+            } else {
+                p++;
             }
-            msg_queue_size--;
-            free(old->topic);
-            free(old->payload);
-            free(old->headers);
-            free(old);
         }
+        if (num == NULL) {
+            return 1;
+        }
+        p = num;
     }
     
-    // Add to queue
-    if (msg_queue_tail == NULL) {
-        msg_queue_head = msg_queue_tail = entry;
-    } else {
-        msg_queue_tail->next = entry;
-        msg_queue_tail = entry;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    size_t len = (size_t)(end - p);
+    if (len == 0) {
+        return 1;
     }
-    msg_queue_size++;
+    if (len >= sizeof(buf)) {
+        // Too long to be a plain number; a JSON member value only needs its leading digits
+        if (field == NULL) {
+            return 1;
+        }
+        len = sizeof(buf) - 1;
+    }
+    memcpy(buf, p, len);
+    buf[len] = '\0';
     
-    // Signal the batch worker if queue is getting full
-    if (msg_queue_size >= batch_size) {
-        pthread_cond_signal(&queue_cond);
+    char *num_end = NULL;
+    *value = strtod(buf, &num_end);
+    if (num_end == buf) {
+        return 1;
+    }
+    // A plain numeric payload must not have trailing content
+    if (field == NULL) {
+        while (*num_end == ' ' || *num_end == '\t' || *num_end == '\r' || *num_end == '\n') num_end++;
+        if (*num_end != '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Evaluate the persistence policy for a message
+// Called from on_message_callback on the broker thread only, so the state table needs no locking
+// Returns 1 if the message should be written to the msg table
+static int policy_allows_persist(const char *topic, const char *payload, size_t payloadlen, 
+                                 unsigned long long now_ms) {
+    const struct persist_policy *policy = find_persist_policy(topic);
+    if (policy == NULL || policy->type == POLICY_ALL) {
+        return 1;
+    }
+    if (policy->type == POLICY_SKIP) {
+        return 0;
     }
     
-    pthread_mutex_unlock(&queue_mutex);
+    struct policy_state *state = policy_state_lookup(topic, now_ms);
+    if (state == NULL) {
+        // State table exhausted - fail open rather than lose data
+        return 1;
+    }
+    
+    int first = !(state->flags & POLICY_STATE_SEEN);
+    int persist = 0;
+    
+    switch (policy->type) {
+        case POLICY_EVERY:
+            persist = (state->count % policy->every_n) == 0;
+            state->count++;
+            break;
+        case POLICY_INTERVAL:
+            persist = first || now_ms - state->last_persist_ms >= policy->interval_ms;
+            break;
+        case POLICY_CHANGED: {
+            uint64_t payload_hash = hash64(payload, payloadlen);
+            persist = first || payload_hash != state->payload_hash;
+            state->payload_hash = payload_hash;
+            break;
+        }
+        case POLICY_DEADBAND: {
+            double value;
+            if (extract_numeric_value(payload, payloadlen, policy->field, &value) != 0) {
+                // Non-numeric payloads are always stored
+                return 1;
+            }
+            double delta = value - state->last_value;
+            if (delta < 0) {
+                delta = -delta;
+            }
+            persist = first || delta > policy->deadband;
+            if (persist) {
+                state->last_value = value;
+            }
+            break;
+        }
+    }
+    
+    state->flags |= POLICY_STATE_SEEN;
+    if (persist) {
+        state->last_persist_ms = now_ms;
+    }
+    return persist;
 }
 
-// Enqueue a delete operation for batch processing
-// If ulid is NULL, will delete the most recent message for the topic
-static void enqueue_delete(const char *topic, const char *ulid) {
-    struct msg_entry *entry = malloc(sizeof(struct msg_entry));
-    if (entry == NULL) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate delete entry");
+// Parse "rate[/burst]" (messages per second, burst defaults to the rate); returns 0 on success
+static int parse_quota_rate(const char *value, struct quota_rate *rate) {
+    char *end = NULL;
+    double per_sec = strtod(value, &end);
+    double burst = per_sec;
+    if (end == value || per_sec <= 0) {
+        return 1;
+    }
+    if (*end == '/') {
+        const char *burst_str = end + 1;
+        burst = strtod(burst_str, &end);
+        if (end == burst_str || burst < 1) {
+            return 1;
+        }
+    }
+    if (*end != '\0') {
+        return 1;
+    }
+    rate->interval_us = (unsigned long long)(1000000.0 / per_sec);
+    if (rate->interval_us == 0) {
+        rate->interval_us = 1;
+    }
+    rate->tolerance_us = rate->interval_us * (unsigned long long)(burst < 1 ? 0 : burst - 1);
+    return 0;
+}
+
+// Parse comma-separated "pattern=rate[/burst]" topic quotas (first matching pattern wins)
+static void parse_topic_quotas(const char *quotas_str) {
+    char *quotas_copy = strdup(quotas_str);
+    if (quotas_copy == NULL) {
+        return;
+    }
+    
+    char *saveptr = NULL;
+    char *token = strtok_r(quotas_copy, ",", &saveptr);
+    while (token != NULL && topic_quota_count < MAX_TOPIC_QUOTAS) {
+        while (*token == ' ') token++;
+        char *end = token + strlen(token) - 1;
+        while (end > token && *end == ' ') {
+            *end = '\0';
+            end--;
+        }
+        
+        char *eq = strrchr(token, '=');
+        struct topic_quota *quota = &topic_quotas[topic_quota_count];
+        if (eq != NULL && eq != token && parse_quota_rate(eq + 1, &quota->rate) == 0) {
+            *eq = '\0';
+            quota->pattern = strdup(token);
+            if (quota->pattern != NULL) {
+                atomic_store(&quota->tat_us, 0);
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Topic quota: %s=%s", token, eq + 1);
+                topic_quota_count++;
+            }
+        } else if (*token != '\0') {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring invalid topic quota: %s", token);
+        }
+        token = strtok_r(NULL, ",", &saveptr);
+    }
+    
+    free(quotas_copy);
+}
+
+static void free_quotas(void) {
+    for (int i = 0; i < topic_quota_count; i++) {
+        free(topic_quotas[i].pattern);
+        topic_quotas[i].pattern = NULL;
+    }
+    topic_quota_count = 0;
+    free(quota_clients);
+    quota_clients = NULL;
+    atomic_store(&quota_clients_tracked, 0);
+}
+
+// Take a token from a bucket; returns 1 if the message is within the quota
+static int quota_take(atomic_ullong *tat_us, const struct quota_rate *rate, unsigned long long now_us) {
+    unsigned long long current = atomic_load(tat_us);
+    for (;;) {
+        unsigned long long tat = current;
+        // A bucket ahead by more than it can ever be was left behind by a clock step back
+        if (tat < now_us || tat > now_us + rate->tolerance_us + rate->interval_us) {
+            tat = now_us;
+        } else if (tat - now_us > rate->tolerance_us) {
+            return 0;
+        }
+        if (atomic_compare_exchange_weak(tat_us, &current, tat + rate->interval_us)) {
+            return 1;
+        }
+    }
+}
+
+// Bucket of a client id in the fixed open-addressing table, or NULL if its probe window is
+// taken by active clients. Slots of idle clients (full bucket) are taken over
+static atomic_ullong *quota_client_bucket(const char *client_id, unsigned long long now_us) {
+    uint64_t client_hash = hash64(client_id, strlen(client_id));
+    if (client_hash == 0) {
+        client_hash = 1;
+    }
+    
+    size_t start = client_hash & (QUOTA_CLIENT_SLOTS - 1);
+    for (int i = 0; i < QUOTA_PROBE_LIMIT; i++) {
+        struct quota_slot *slot = &quota_clients[(start + i) & (QUOTA_CLIENT_SLOTS - 1)];
+        unsigned long long current = atomic_load(&slot->client_hash);
+        if (current == client_hash) {
+            return &slot->tat_us;
+        }
+        if (current == 0) {
+            if (atomic_compare_exchange_strong(&slot->client_hash, &current, client_hash)) {
+                atomic_fetch_add(&quota_clients_tracked, 1);
+                return &slot->tat_us;
+            }
+            if (current == client_hash) {
+                return &slot->tat_us;
+            }
+        }
+    }
+    for (int i = 0; i < QUOTA_PROBE_LIMIT; i++) {
+        struct quota_slot *slot = &quota_clients[(start + i) & (QUOTA_CLIENT_SLOTS - 1)];
+        unsigned long long current = atomic_load(&slot->client_hash);
+        if (atomic_load(&slot->tat_us) <= now_us && 
+            atomic_compare_exchange_strong(&slot->client_hash, &current, client_hash)) {
+            return &slot->tat_us;
+        }
+    }
+    return NULL;
+}
+
+// Check the client and topic quotas of a message; returns 1 if it is over a quota
+static int quota_exceeded(const char *client_id, const char *topic, unsigned long long now_ms) {
+    unsigned long long now_us = now_ms * 1000ULL;
+    int over = 0;
+    if (quota_clients != NULL && client_id != NULL) {
+        // Table exhausted - fail open rather than lose data
+        atomic_ullong *bucket = quota_client_bucket(client_id, now_us);
+        over = bucket != NULL && !quota_take(bucket, &client_quota, now_us);
+    }
+    if (!over) {
+        for (int i = 0; i < topic_quota_count; i++) {
+            if (topic_matches_pattern(topic_quotas[i].pattern, topic)) {
+                over = !quota_take(&topic_quotas[i].tat_us, &topic_quotas[i].rate, now_us);
+                break;
+            }
+        }
+    }
+    if (over) {
+        atomic_fetch_add(&quota_over_limit, 1);
+    }
+    return over;
+}
+
+// Parse comma-separated "lane=capacity[:oldest|newest[:weight]]" queue lane settings
+static void parse_queue_lanes(const char *lanes_str) {
+    char *lanes_copy = strdup(lanes_str);
+    if (lanes_copy == NULL) {
+        return;
+    }
+    
+    char *saveptr = NULL;
+    for (char *token = strtok_r(lanes_copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr)) {
+        while (*token == ' ') token++;
+        char *eq = strchr(token, '=');
+        struct msg_lane *lane = NULL;
+        for (int l = 0; eq != NULL && l < LANE_COUNT; l++) {
+            if ((size_t)(eq - token) == strlen(msg_lanes[l].name) && strncmp(token, msg_lanes[l].name, eq - token) == 0) {
+                lane = &msg_lanes[l];
+            }
+        }
+        
+        char *end = NULL;
+        long capacity = lane != NULL ? strtol(eq + 1, &end, 10) : 0;
+        int drop_policy = lane != NULL ? lane->drop_policy : LANE_DROP_OLDEST;
+        long weight = lane != NULL ? lane->weight : 0;
+        int valid = lane != NULL && end != eq + 1 && capacity > 0 && capacity <= INT_MAX;
+        if (valid && *end == ':') {
+            char *policy = end + 1;
+            char *colon = strchr(policy, ':');
+            size_t len = colon != NULL ? (size_t)(colon - policy) : strcspn(policy, " ");
+            if (len == 6 && strncmp(policy, "oldest", 6) == 0) {
+                drop_policy = LANE_DROP_OLDEST;
+            } else if (len == 6 && strncmp(policy, "newest", 6) == 0) {
+                drop_policy = LANE_DROP_NEWEST;
+            } else {
+                valid = 0;
+            }
+            end = policy + len;
+            if (valid && colon != NULL) {
+                weight = strtol(colon + 1, &end, 10);
+                valid = end != colon + 1 && weight >= 1 && weight <= 64;
+            }
+        }
+        if (valid && strspn(end, " ") != strlen(end)) {
+            valid = 0;
+        }
+        
+        if (valid) {
+            lane->capacity = (int)capacity;
+            lane->drop_policy = drop_policy;
+            lane->weight = (int)weight;
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Queue lane %s: capacity %d, drop %s, weight %d", lane->name, 
+                                lane->capacity, drop_policy == LANE_DROP_NEWEST ? "newest" : "oldest", lane->weight);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring invalid queue lane: %s", token);
+        }
+    }
+    
+    free(lanes_copy);
+}
+
+// Returns unix epoch microseconds.
+static unsigned long long platform_utime(int coarse) {
+	// CLOCK_REALTIME_COARSE has a resolution of 1ms, which is sufficient for this purpose. It's also much faster.
+	struct timespec tv[1];
+	clock_gettime(coarse ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, tv);
+	return tv->tv_sec * 1000000ULL + tv->tv_nsec / 1000ULL;
+}
+
+// Gather entropy from the operating system. Returns 0 on success.
+static int platform_entropy(void *buf, int len) {
+    return syscall(SYS_getrandom, buf, len, 0) != len;
+}
+
+int ulid_generator_init(struct ulid_generator *g, int flags) {
+    g->last_ts = 0;
+    g->flags = flags;
+    g->node_id = ULID_NODE_NONE;
+    g->i = g->j = 0;
+    for (int i = 0; i < 256; i++) {
+        g->s[i] = i;
+    }
+
+    /* RC4 is used to fill the random segment of ULIDs. It's tiny,
+     * simple, perfectly sufficient for the task (assuming it's seeded
+     * properly), and doesn't require fixed-width integers. It's not the
+     * fastest option, but it's plenty fast for the task.
+     *
+     * Besides, when we're in a serious hurry in normal operation (not
+     * in "relaxed" mode), we're incrementing the random field much more
+     * often than generating fresh random bytes.
+     */
+
+    int initstyle = 1;
+    unsigned char key[256] = {0};
+    if (!platform_entropy(key, 256)) {
+        // Mix entropy into the RC4 state.
+        for (int i = 0, j = 0; i < 256; i++) {
+            j = (j + g->s[i] + key[i]) & 0xff;
+            int tmp = g->s[i];
+            g->s[i] = g->s[j];
+            g->s[j] = tmp;
+        }
+        initstyle = 0;
+    } else if (!(flags & ULID_SECURE)) {
+        // Failed to read entropy from OS, so generate some.
+        unsigned long n = 0;
+        unsigned long long now;
+        unsigned long long start = platform_utime(0);
+        do {
+            struct {
+                clock_t clk;
+                unsigned long long ts;
+                long n;
+                void *stackgap;
+            } noise;
+            noise.ts = now = platform_utime(0);
+            noise.clk = clock();
+            noise.stackgap = &noise;
+            noise.n = n;
+            unsigned char *k = (unsigned char *)&noise;
+            for (int i = 0, j = 0; i < 256; i++) {
+                j = (j + g->s[i] + k[i % sizeof(noise)]) & 0xff;
+                int tmp = g->s[i];
+                g->s[i] = g->s[j];
+                g->s[j] = tmp;
+            }
+        } while (n++ < 1UL << 16 || now - start < 500000ULL);
+    }
+    return initstyle;
+}
+
+void ulid_encode(char str[27], const unsigned char ulid[16]) {
+    static const char set[256] = {
+        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
+        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
+        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
+        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
+        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
+        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
+        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
+        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
+        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
+        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
+        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
+        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
+        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
+        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a,
+        0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+        0x38, 0x39, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46,
+        0x47, 0x48, 0x4a, 0x4b, 0x4d, 0x4e, 0x50, 0x51,
+        0x52, 0x53, 0x54, 0x56, 0x57, 0x58, 0x59, 0x5a
+    };
+    str[ 0] = set[ ulid[ 0] >> 5];
+    str[ 1] = set[ ulid[ 0] >> 0];
+    str[ 2] = set[ ulid[ 1] >> 3];
+    str[ 3] = set[(ulid[ 1] << 2 | ulid[ 2] >> 6) & 0x1f];
+    str[ 4] = set[ ulid[ 2] >> 1];
+    str[ 5] = set[(ulid[ 2] << 4 | ulid[ 3] >> 4) & 0x1f];
+    str[ 6] = set[(ulid[ 3] << 1 | ulid[ 4] >> 7) & 0x1f];
+    str[ 7] = set[ ulid[ 4] >> 2];
+    str[ 8] = set[(ulid[ 4] << 3 | ulid[ 5] >> 5) & 0x1f];
+    str[ 9] = set[ ulid[ 5] >> 0];
+    str[10] = set[ ulid[ 6] >> 3];
+    str[11] = set[(ulid[ 6] << 2 | ulid[ 7] >> 6) & 0x1f];
+    str[12] = set[ ulid[ 7] >> 1];
+    str[13] = set[(ulid[ 7] << 4 | ulid[ 8] >> 4) & 0x1f];
+    str[14] = set[(ulid[ 8] << 1 | ulid[ 9] >> 7) & 0x1f];
+    str[15] = set[ ulid[ 9] >> 2];
+    str[16] = set[(ulid[ 9] << 3 | ulid[10] >> 5) & 0x1f];
+    str[17] = set[ ulid[10] >> 0];
+    str[18] = set[ ulid[11] >> 3];
+    str[19] = set[(ulid[11] << 2 | ulid[12] >> 6) & 0x1f];
+    str[20] = set[ ulid[12] >> 1];
+    str[21] = set[(ulid[12] << 4 | ulid[13] >> 4) & 0x1f];
+    str[22] = set[(ulid[13] << 1 | ulid[14] >> 7) & 0x1f];
+    str[23] = set[ ulid[14] >> 2];
+    str[24] = set[(ulid[14] << 3 | ulid[15] >> 5) & 0x1f];
+    str[25] = set[ ulid[15] >> 0];
+    str[26] = 0;
+}
+
+int ulid_decode(unsigned char ulid[16], const char *s) {
+    static const signed char v[] = {
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+        0x08, 0x09,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+        0x11, 0x01, 0x12, 0x13, 0x01, 0x14, 0x15, 0x00,
+        0x16, 0x17, 0x18, 0x19, 0x1a,   -1, 0x1b, 0x1c,
+        0x1d, 0x1e, 0x1f,   -1,   -1,   -1,   -1,   -1,
+          -1, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+        0x11, 0x01, 0x12, 0x13, 0x01, 0x14, 0x15, 0x00,
+        0x16, 0x17, 0x18, 0x19, 0x1a,   -1, 0x1b, 0x1c,
+        0x1d, 0x1e, 0x1f,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,
+          -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1
+    };
+    if (v[(int)s[0]] > 7)
+        return 1;
+    for (int i = 0; i < 26; i++)
+        if (v[(int)s[i]] == -1)
+            return 2;
+    ulid[ 0] = v[(int)s[ 0]] << 5 | v[(int)s[ 1]] >> 0;
+    ulid[ 1] = v[(int)s[ 2]] << 3 | v[(int)s[ 3]] >> 2;
+    ulid[ 2] = v[(int)s[ 3]] << 6 | v[(int)s[ 4]] << 1 | v[(int)s[ 5]] >> 4;
+    ulid[ 3] = v[(int)s[ 5]] << 4 | v[(int)s[ 6]] >> 1;
+    ulid[ 4] = v[(int)s[ 6]] << 7 | v[(int)s[ 7]] << 2 | v[(int)s[ 8]] >> 3;
+    ulid[ 5] = v[(int)s[ 8]] << 5 | v[(int)s[ 9]] >> 0;
+    ulid[ 6] = v[(int)s[10]] << 3 | v[(int)s[11]] >> 2;
+    ulid[ 7] = v[(int)s[11]] << 6 | v[(int)s[12]] << 1 | v[(int)s[13]] >> 4;
+    ulid[ 8] = v[(int)s[13]] << 4 | v[(int)s[14]] >> 1;
+    ulid[ 9] = v[(int)s[14]] << 7 | v[(int)s[15]] << 2 | v[(int)s[16]] >> 3;
+    ulid[10] = v[(int)s[16]] << 5 | v[(int)s[17]] >> 0;
+    ulid[11] = v[(int)s[18]] << 3 | v[(int)s[19]] >> 2;
+    ulid[12] = v[(int)s[19]] << 6 | v[(int)s[20]] << 1 | v[(int)s[21]] >> 4;
+    ulid[13] = v[(int)s[21]] << 4 | v[(int)s[22]] >> 1;
+    ulid[14] = v[(int)s[22]] << 7 | v[(int)s[23]] << 2 | v[(int)s[24]] >> 3;
+    ulid[15] = v[(int)s[24]] << 5 | v[(int)s[25]] >> 0;
+    return 0;
+}
+
+unsigned long long ulid_generate(struct ulid_generator *g, char str[27]) {
+    unsigned long long ts = platform_utime(1) / 1000;
+
+    if ((g->flags & ULID_MONOTONIC) && ts < g->last_ts) {
+        // Wall clock went backwards: stay on the last timestamp, the random field below
+        // acts as the logical counter until the clock has caught up
+        unsigned long long step = g->last_ts - ts;
+        atomic_fetch_add(&ulid_clock_corrections, 1);
+        if (step > atomic_load(&ulid_clock_max_step_back_ms)) {
+            atomic_store(&ulid_clock_max_step_back_ms, step);
+        }
+        ts = g->last_ts;
+    }
+
+    // With a node id only the 64 bits after it are random/counter
+    int random_start = g->node_id != ULID_NODE_NONE ? 8 : 6;
+
+    if (!(g->flags & ULID_RELAXED) && g->last_ts == ts) {
+        // Chance of 80-bit overflow is so small that it's not considered.
+        for (int i = 15; i >= random_start; i--) {
+            if (++g->last[i]) {
+                break;
+            }
+        }
+        ulid_encode(str, g->last);
+
+        return ts;
+    }
+
+    // Fill out timestamp.
+    g->last_ts = ts;
+    g->last[0] = ts >> 40;
+    g->last[1] = ts >> 32;
+    g->last[2] = ts >> 24;
+    g->last[3] = ts >> 16;
+    g->last[4] = ts >>  8;
+    g->last[5] = ts >>  0;
+
+    // Fill out random section.
+    for (int k = 0; k < 10; k++) {
+        g->i = (g->i + 1) & 0xff;
+        g->j = (g->j + g->s[g->i]) & 0xff;
+        int tmp = g->s[g->i];
+        g->s[g->i] = g->s[g->j];
+        g->s[g->j] = tmp;
+        g->last[6 + k] = g->s[(g->s[g->i] + g->s[g->j]) & 0xff];
+    }
+
+    if (g->node_id != ULID_NODE_NONE) {
+        g->last[6] = g->node_id >> 8;
+        g->last[7] = g->node_id & 0xff;
+    }
+
+    if (g->flags & ULID_PARANOID) {
+        g->last[random_start] &= 0x7f;
+    }
+
+    ulid_encode(str, g->last);
+
+    return ts;
+}
+
+// Continue after an existing ULID (the newest stored one), so a clock that is behind
+// after a restart does not produce ULIDs sorting before existing rows
+// Returns 0 if the generator was advanced
+int ulid_generator_seed(struct ulid_generator *g, const char *ulid) {
+    unsigned char bytes[16];
+    if (ulid == NULL || strlen(ulid) != 26 || ulid_decode(bytes, ulid) != 0) {
+        return 1;
+    }
+    
+    unsigned long long ts = 0;
+    for (int i = 0; i < 6; i++) {
+        ts = ts << 8 | bytes[i];
+    }
+    if (ts <= g->last_ts) {
+        return 1;
+    }
+    
+    memcpy(g->last, bytes, 16);
+    g->last_ts = ts;
+    if (g->node_id != ULID_NODE_NONE) {
+        // The newest row may come from another node (merged database)
+        g->last[6] = g->node_id >> 8;
+        g->last[7] = g->node_id & 0xff;
+    }
+    return 0;
+}
+
+// Parse a node id: a number 0-65535 is used as is, any other name (e.g. a host name)
+// is hashed to 16 bits. Returns ULID_NODE_NONE for an empty value
+static int parse_node_id(const char *value) {
+    if (value == NULL || *value == '\0') {
+        return ULID_NODE_NONE;
+    }
+    
+    char *end = NULL;
+    long num = strtol(value, &end, 10);
+    if (*end == '\0' && num >= 0 && num <= 0xffff) {
+        return (int)num;
+    }
+    
+    // Two names can hash to the same id (likely from a few hundred nodes on), which
+    // msg_merge reports as conflicting ULIDs; numeric ids are collision-free
+    int node_id = (int)(hash64(value, strlen(value)) & 0xffff);
+    mosquitto_log_printf(MOSQ_LOG_WARNING, "Node name '%s' hashed to node id %d; hashed ids of different nodes "
+                        "can collide, set a distinct numeric plugin_opt_node_id to rule that out", value, node_id);
+    return node_id;
+}
+
+// Allocate a queue entry for a message, NULL if out of memory
+// If file_hash is set the payload already lives in the file store and is not copied
+static struct msg_entry *new_message_entry(int operation, const char *ulid, const char *topic, const char *payload, 
+                                           size_t payloadlen, const unsigned char *file_hash, const char *headers, 
+                                           int retain, int qos, unsigned long long expires_at) {
+    struct msg_entry *entry = malloc(sizeof(struct msg_entry));
+    if (entry == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate message entry");
+        return NULL;
+    }
+    
+    entry->operation = operation;
+    memcpy(entry->ulid, ulid, 27);
+    entry->topic = strdup(topic);
+    entry->offloaded = file_hash != NULL;
+    if (entry->offloaded) {
+        memcpy(entry->payload_hash, file_hash, PAYLOAD_HASH_LEN);
+        entry->payload = NULL;
+    } else {
+        // Keep the exact payload bytes for the retained store; the msg table still
+        // binds it as NUL-terminated text
+        entry->payload = malloc(payloadlen + 1);
+        if (entry->payload != NULL) {
+            if (payloadlen > 0) {
+                memcpy(entry->payload, payload, payloadlen);
+            }
+            entry->payload[payloadlen] = '\0';
+        }
+    }
+    entry->payloadlen = payloadlen;
+    entry->headers = NULL;  // Initialize to NULL first
+    entry->expires_at = expires_at;
+    entry->retain = retain;
+    entry->qos = qos;
+    entry->client_id = NULL;
+    entry->username = NULL;
+    entry->attempts = 0;
+    entry->retained_stored = 0;
+    entry->spool = SPOOL_NONE;
+    entry->spool_next = NULL;
+    entry->retry_at_ms = 0;
+    entry->error = NULL;
+    entry->seq = 0;
+    entry->next = NULL;
+    
+    // Check mandatory allocations first
+    if (entry->topic == NULL || (entry->payload == NULL && !entry->offloaded)) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate message strings");
+        free(entry->topic);
+        free(entry->payload);
+        free(entry);
+        return NULL;
+    }
+    
+    // Now handle optional headers - if strdup fails, log warning but continue
+    if (headers != NULL) {
+        entry->headers = strdup(headers);
+        if (entry->headers == NULL) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to allocate headers string, message stored without headers");
+        }
+    }
+    return entry;
+}
+
+// Attach the publisher to an entry (store_client); a failed copy only loses the identity
+static void entry_set_client(struct msg_entry *entry, const char *client_id, const char *username) {
+    if (client_id == NULL) {
+        return;
+    }
+    entry->client_id = strdup(client_id);
+    entry->username = username != NULL ? strdup(username) : NULL;
+}
+
+static int entry_lane(const struct msg_entry *entry) {
+    if (entry->operation == OP_DELETE || entry->operation == OP_DELETE_FALLBACK) {
+        return LANE_DELETE;
+    }
+    return entry->qos >= 2 ? LANE_QOS2 : entry->qos == 1 ? LANE_QOS1 : LANE_QOS0;
+}
+
+// Lane capacity; until the database is ready the lanes hold startup_queue_size / LANE_QOS0_DEFAULT_CAPACITY
+// times as much, so messages arriving during schema setup are kept
+static int lane_capacity(const struct msg_lane *lane) {
+    if (atomic_load(&db_ready)) {
+        return lane->capacity;
+    }
+    long long capacity = (long long)lane->capacity * startup_queue_size / LANE_QOS0_DEFAULT_CAPACITY;
+    return capacity > lane->capacity ? (int)capacity : lane->capacity;
+}
+
+// Append an entry to its lane (queue_mutex held)
+static void lane_push(struct msg_lane *lane, struct msg_entry *entry) {
+    entry->next = NULL;
+    if (lane->tail == NULL) {
+        lane->head = lane->tail = entry;
+    } else {
+        lane->tail->next = entry;
+        lane->tail = entry;
+    }
+    lane->size++;
+    msg_queue_size++;
+}
+
+// Hand a queued entry with a large payload to the spool thread (queue_mutex held). Sparkplug
+// payloads are decoded by the worker, so their bytes stay queued
+static void spool_entry(struct msg_entry *entry) {
+    if (!atomic_load(&spool_thread_running) || entry->operation != OP_INSERT || entry->offloaded || 
+        (long long)entry->payloadlen < offload_min_size || (entry->retain && restore_retained) || 
+        (sparkplug_enabled && strncmp(entry->topic, SPARKPLUG_NAMESPACE, sizeof(SPARKPLUG_NAMESPACE) - 1) == 0)) {
+        return;
+    }
+    entry->spool = SPOOL_WAITING;
+    entry->spool_next = NULL;
+    if (spool_tail == NULL) {
+        spool_head = spool_tail = entry;
+    } else {
+        spool_tail->spool_next = entry;
+        spool_tail = entry;
+    }
+    pthread_cond_signal(&spool_cond);
+}
+
+// Take an entry that leaves its lane off the spool (queue_mutex held). An entry being written
+// is waited for with wait set; without, the spool thread frees it once done and 1 is returned
+static int spool_release(struct msg_entry *entry, int wait) {
+    if (entry->spool == SPOOL_WAITING) {
+        struct msg_entry **link = &spool_head;
+        struct msg_entry *prev = NULL;
+        while (*link != entry) {
+            prev = *link;
+            link = &prev->spool_next;
+        }
+        *link = entry->spool_next;
+        if (spool_tail == entry) {
+            spool_tail = prev;
+        }
+        entry->spool_next = NULL;
+        entry->spool = SPOOL_NONE;
+        return 0;
+    }
+    if (entry->spool != SPOOL_WRITING) {
+        return 0;
+    }
+    if (!wait) {
+        spool_orphaned = 1;
+        return 1;
+    }
+    while (entry->spool == SPOOL_WRITING) {
+        pthread_cond_wait(&spool_done_cond, &queue_mutex);
+    }
+    return 0;
+}
+
+// Add an entry to its lane, applying the lane's capacity and drop policy. Over-quota
+// messages are shed instead once the lane holds QUOTA_QUEUE_SHARE_PCT of its capacity
+static void queue_entry(struct msg_entry *entry, int over_quota) {
+    pthread_mutex_lock(&queue_mutex);
+    
+    struct msg_lane *lane = &msg_lanes[entry_lane(entry)];
+    int capacity = lane_capacity(lane);
+    if (over_quota && lane->size >= (long long)capacity * QUOTA_QUEUE_SHARE_PCT / 100) {
+        pthread_mutex_unlock(&queue_mutex);
+        atomic_fetch_add(&quota_shed, 1);
+        entry->next = NULL;
+        free_entries(entry);
+        return;
+    }
+    if (lane->size >= capacity) {
+        unsigned long long dropped = atomic_fetch_add(&lane->dropped, 1);
+        if (!lane->full) {
+            lane->full = 1;
+            lane->full_dropped = dropped;
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Queue lane %s full (%d), dropping %s entries", lane->name, capacity, 
+                                lane->drop_policy == LANE_DROP_NEWEST ? "new" : "oldest");
+        }
+        if (lane->drop_policy == LANE_DROP_NEWEST) {
+            pthread_mutex_unlock(&queue_mutex);
+            entry->next = NULL;
+            free_entries(entry);
+            return;
+        }
+        struct msg_entry *old = lane->head;
+        if (old != NULL) {
+            lane->head = old->next;
+            if (lane->head == NULL) {
+                lane->tail = NULL;
+            }
+            lane->size--;
+            msg_queue_size--;
+            old->next = NULL;
+            if (!spool_release(old, 0)) {
+                free_entries(old);
+            }
+        }
+    } else if (lane->full) {
+        lane->full = 0;
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Queue lane %s has room again, %llu entries dropped", lane->name, 
+                            atomic_load(&lane->dropped) - lane->full_dropped);
+    }
+    
+    entry->seq = ++msg_queue_seq;
+    lane_push(lane, entry);
+    spool_entry(entry);
+    
+    // Signal the batch worker once a batch is ready; deletes wait for the batch as well,
+    // so a storm of retained clears is written in full batches
+    if (msg_queue_size >= runtime_config_get()->batch_size) {
+        pthread_cond_signal(&queue_cond);
+    }
+    
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+// Enqueue a message for batch insert (OP_INSERT) or retained store update only (OP_RETAINED)
+static void enqueue_message(int operation, const char *ulid, const char *topic, const char *payload, 
+                           size_t payloadlen, const char *headers, 
+                           int retain, int qos, unsigned long long expires_at, 
+                           const char *client_id, const char *username, int over_quota) {
+    struct msg_entry *entry = new_message_entry(operation, ulid, topic, payload, payloadlen, NULL, 
+                                                headers, retain, qos, expires_at);
+    if (entry == NULL) {
+        return;
+    }
+    if (operation == OP_INSERT) {
+        entry_set_client(entry, client_id, username);
+    }
+    queue_entry(entry, over_quota);
+}
+
+// Enqueue a delete operation for batch processing
+// If ulid is NULL, will delete the most recent message for the topic
+static void enqueue_delete(const char *topic, const char *ulid) {
+    struct msg_entry *entry = malloc(sizeof(struct msg_entry));
+    if (entry == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate delete entry");
+        return;
+    }
+    
+    if (ulid != NULL) {
+        entry->operation = OP_DELETE;
+        memcpy(entry->ulid, ulid, 27);
+    } else {
+        entry->operation = OP_DELETE_FALLBACK;
+        entry->ulid[0] = '\0';
+    }
+    entry->topic = strdup(topic);
+    entry->payload = NULL;
+    entry->payloadlen = 0;
+    entry->offloaded = 0;
+    entry->expires_at = 0;
+    entry->headers = NULL;
+    entry->retain = 0;
+    entry->qos = 0;
+    entry->client_id = NULL;
+    entry->username = NULL;
+    entry->attempts = 0;
+    entry->retained_stored = 0;
+    entry->spool = SPOOL_NONE;
+    entry->spool_next = NULL;
+    entry->retry_at_ms = 0;
+    entry->error = NULL;
+    entry->seq = 0;
+    entry->next = NULL;
+    
+    if (entry->topic == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate delete topic string");
+        free(entry);
+        return;
+    }
+    
+    queue_entry(entry, 0);
+}
+
+// Put a batch that could not be written back at the head of the lanes, ahead of newer messages
+static void requeue_batch(struct msg_entry *batch_head, int batch_count) {
+    struct msg_entry *heads[LANE_COUNT] = { NULL };
+    struct msg_entry *tails[LANE_COUNT] = { NULL };
+    int sizes[LANE_COUNT] = { 0 };
+    for (struct msg_entry *entry = batch_head, *next; entry != NULL; entry = next) {
+        next = entry->next;
+        int l = entry_lane(entry);
+        entry->next = NULL;
+        if (tails[l] == NULL) {
+            heads[l] = entry;
+        } else {
+            tails[l]->next = entry;
+        }
+        tails[l] = entry;
+        sizes[l]++;
+    }
+    
+    pthread_mutex_lock(&queue_mutex);
+    for (int l = 0; l < LANE_COUNT; l++) {
+        struct msg_lane *lane = &msg_lanes[l];
+        if (heads[l] == NULL) {
+            continue;
+        }
+        tails[l]->next = lane->head;
+        lane->head = heads[l];
+        if (lane->tail == NULL) {
+            lane->tail = tails[l];
+        }
+        lane->size += sizes[l];
+    }
+    msg_queue_size += batch_count;
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+// Deletes and retained messages depend on what is already stored for their topic
+static int entry_is_ordered(const struct msg_entry *entry) {
+    return entry->operation != OP_INSERT || entry->retain;
+}
+
+// Delete-latest left behind in the delete lane: topic hash and arrival order of the oldest
+struct pending_delete {
+    uint64_t hash;
+    unsigned long long seq;
+};
+
+static int compare_pending_deletes(const void *a, const void *b) {
+    const struct pending_delete *x = a;
+    const struct pending_delete *y = b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int compare_pending_delete_hash(const void *a, const void *b) {
+    const struct pending_delete *x = a;
+    const struct pending_delete *y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+// Collect the delete-latest operations the batch leaves behind (ordered, so all of them from
+// the horizon on), one per topic hash. Returns their number, or -1 if out of memory
+static int collect_pending_deletes(unsigned long long horizon, struct pending_delete **pending) {
+    *pending = NULL;
+    const struct msg_lane *lane = &msg_lanes[LANE_DELETE];
+    if (lane->size == 0) {
+        return 0;
+    }
+    *pending = malloc((size_t)lane->size * sizeof(**pending));
+    if (*pending == NULL) {
+        return -1;
+    }
+    int count = 0;
+    for (struct msg_entry *entry = lane->head; entry != NULL; entry = entry->next) {
+        if (entry->seq >= horizon && entry->operation == OP_DELETE_FALLBACK) {
+            (*pending)[count].hash = hash64(entry->topic, strlen(entry->topic));
+            (*pending)[count].seq = entry->seq;
+            count++;
+        }
+    }
+    qsort(*pending, (size_t)count, sizeof(**pending), compare_pending_deletes);
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || (*pending)[unique - 1].hash != (*pending)[i].hash) {
+            (*pending)[unique++] = (*pending)[i];
+        }
+    }
+    return unique;
+}
+
+// An insert taken ahead of an older delete-latest on its topic would become the row the
+// delete removes, so it has to wait like an ordered entry
+static int entry_waits_for_delete(const struct msg_entry *entry, const struct pending_delete *pending, int count) {
+    if (count <= 0 || entry->operation != OP_INSERT) {
+        return 0;
+    }
+    struct pending_delete key = { hash64(entry->topic, strlen(entry->topic)), 0 };
+    const struct pending_delete *found = bsearch(&key, pending, (size_t)count, sizeof(*pending), compare_pending_delete_hash);
+    return found != NULL && found->seq < entry->seq;
+}
+
+// Take the next batch from the lanes (queue_mutex held). Everything is taken while the lanes
+// hold at most LANE_DRAIN_MAX entries; beyond that each lane gets weight * LANE_QUANTUM
+// entries per round. Ordered entries, and inserts on a topic with an older delete-latest left
+// behind, are not taken ahead of an older entry left in another lane. The batch is linked in
+// arrival order; returns the number of entries
+static int take_batch(struct msg_entry **batch) {
+    int take[LANE_COUNT];
+    int left = msg_queue_size > LANE_DRAIN_MAX ? LANE_DRAIN_MAX : msg_queue_size;
+    for (int l = 0; l < LANE_COUNT; l++) {
+        take[l] = msg_queue_size > LANE_DRAIN_MAX ? 0 : msg_lanes[l].size;
+    }
+    while (msg_queue_size > LANE_DRAIN_MAX && left > 0) {
+        for (int l = 0; l < LANE_COUNT && left > 0; l++) {
+            int n = msg_lanes[l].weight * LANE_QUANTUM;
+            if (n > msg_lanes[l].size - take[l]) {
+                n = msg_lanes[l].size - take[l];
+            }
+            if (n > left) {
+                n = left;
+            }
+            take[l] += n;
+            left -= n;
+        }
+    }
+    
+    if (msg_queue_size > LANE_DRAIN_MAX) {
+        // Oldest entry left behind in any lane
+        unsigned long long horizon = ULLONG_MAX;
+        for (int l = 0; l < LANE_COUNT; l++) {
+            struct msg_entry *entry = msg_lanes[l].head;
+            for (int i = 0; i < take[l]; i++) {
+                entry = entry->next;
+            }
+            if (entry != NULL && entry->seq < horizon) {
+                horizon = entry->seq;
+            }
+        }
+        // Without memory for the pending deletes every entry counts as ordered
+        struct pending_delete *pending = NULL;
+        int pending_count = collect_pending_deletes(horizon, &pending);
+        int cut[LANE_COUNT];
+        int total = 0;
+        for (int l = 0; l < LANE_COUNT; l++) {
+            struct msg_entry *entry = msg_lanes[l].head;
+            for (cut[l] = 0; cut[l] < take[l]; cut[l]++) {
+                int ordered = pending_count < 0 || entry_is_ordered(entry) || 
+                              entry_waits_for_delete(entry, pending, pending_count);
+                if (ordered && entry->seq > horizon) {
+                    break;
+                }
+                entry = entry->next;
+            }
+            total += cut[l];
+        }
+        free(pending);
+        // Requeued retries are not in arrival order; then the lanes are drained as they are
+        if (total > 0) {
+            memcpy(take, cut, sizeof(take));
+        }
+    }
+    
+    // Detach the lane prefixes and merge them by arrival order
+    struct msg_entry *parts[LANE_COUNT];
+    int count = 0;
+    for (int l = 0; l < LANE_COUNT; l++) {
+        struct msg_lane *lane = &msg_lanes[l];
+        parts[l] = take[l] > 0 ? lane->head : NULL;
+        if (take[l] == 0) {
+            continue;
+        }
+        struct msg_entry *last = lane->head;
+        for (int i = 1; i < take[l]; i++) {
+            last = last->next;
+        }
+        lane->head = last->next;
+        if (lane->head == NULL) {
+            lane->tail = NULL;
+        }
+        last->next = NULL;
+        lane->size -= take[l];
+        count += take[l];
+    }
+    msg_queue_size -= count;
+    
+    struct msg_entry **link = batch;
+    for (;;) {
+        int next = -1;
+        for (int l = 0; l < LANE_COUNT; l++) {
+            if (parts[l] != NULL && (next < 0 || parts[l]->seq < parts[next]->seq)) {
+                next = l;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+        *link = parts[next];
+        link = &parts[next]->next;
+        parts[next] = parts[next]->next;
+    }
+    *link = NULL;
+    return count;
+}
+
+// Free everything left in the lanes (queue_mutex held)
+static void clear_lanes(void) {
+    for (int l = 0; l < LANE_COUNT; l++) {
+        for (struct msg_entry *entry = msg_lanes[l].head; entry != NULL; entry = entry->next) {
+            spool_release(entry, 1);
+        }
+        free_entries(msg_lanes[l].head);
+        msg_lanes[l].head = msg_lanes[l].tail = NULL;
+        msg_lanes[l].size = 0;
+        msg_lanes[l].full = 0;
+    }
+    msg_queue_size = 0;
+}
+
+static void free_entries(struct msg_entry *entry) {
+    while (entry != NULL) {
+        struct msg_entry *next = entry->next;
+        free(entry->topic);
+        free(entry->payload);
+        free(entry->headers);
+        free(entry->client_id);
+        free(entry->username);
+        free(entry->error);
+        free(entry);
+        entry = next;
+    }
+}
+
+// Lock contention with sqld that is worth retrying
+static int is_transient_error(int rc) {
+    return (rc & 0xff) == SQLITE_BUSY || (rc & 0xff) == SQLITE_LOCKED;
+}
+
+static int busy_sleep_ms(int count) {
+    return count < 6 ? 1 << count : BUSY_SLEEP_MAX_MS;
+}
+
+// SQLite busy handler: sleep 1, 2, 4 .. BUSY_SLEEP_MAX_MS ms until busy_timeout_ms is used up
+static int on_busy(void *arg, int count) {
+    UNUSED(arg);
+    int waited = 0;
+    for (int i = 0; i < count; i++) {
+        waited += busy_sleep_ms(i);
+    }
+    if (waited >= busy_timeout_ms) {
+        return 0;
+    }
+    
+    int sleep_ms = busy_sleep_ms(count);
+    usleep(sleep_ms * 1000);
+    atomic_fetch_add(&busy_waits, 1);
+    atomic_fetch_add(&busy_wait_ms, sleep_ms);
+    return 1;
+}
+
+// Append s as the contents of a JSON string. Bytes that are not valid UTF-8 become U+FFFD
+static void json_append_escaped(sqlite3_str *out, const char *s) {
+    const unsigned char *p = (const unsigned char *)s;
+    while (*p != '\0') {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\') {
+            sqlite3_str_appendf(out, "\\%c", c);
+            p++;
+        } else if (c < 0x20) {
+            sqlite3_str_appendf(out, "\\u%04x", c);
+            p++;
+        } else if (c < 0x80) {
+            sqlite3_str_appendchar(out, 1, (char)c);
+            p++;
+        } else {
+            int len = c >= 0xf0 && c < 0xf5 ? 4 : c >= 0xe0 ? 3 : c >= 0xc2 && c < 0xe0 ? 2 : 0;
+            // No overlong forms, surrogates or code points above U+10FFFF
+            unsigned char lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+            unsigned char hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+            int valid = len > 0 && p[1] >= lo && p[1] <= hi;
+            for (int i = 2; valid && i < len; i++) {
+                valid = (p[i] & 0xc0) == 0x80;
+            }
+            if (valid) {
+                sqlite3_str_append(out, (const char *)p, len);
+                p += len;
+            } else {
+                sqlite3_str_appendall(out, "\xef\xbf\xbd");
+                p++;
+            }
+        }
+    }
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Run a write script (BEGIN IMMEDIATE ... COMMIT) in sqld as one Hrana pipeline, sent as
+// HTTP/1.0 over handoff_socket so the response is neither chunked nor kept alive. The
+// ROLLBACK only has an effect if the sequence stopped before its COMMIT. Without a complete
+// response it is not known whether sqld committed; the batch is sent again, which the scripts
+// allow: inserts skip rows that exist, deletes and upserts give the same result twice
+// Returns SQLITE_OK, SQLITE_BUSY if the batch should be retried, or SQLITE_ERROR
+static int handoff_execute(const char *script) {
+    sqlite3_str *body = sqlite3_str_new(NULL);
+    sqlite3_str_appendall(body, "{\"baton\":null,\"requests\":[{\"type\":\"sequence\",\"sql\":\"");
+    json_append_escaped(body, script);
+    sqlite3_str_appendall(body, "\"},{\"type\":\"execute\",\"stmt\":{\"sql\":\"ROLLBACK\"}},{\"type\":\"close\"}]}");
+    int body_len = sqlite3_str_length(body);
+    char *body_json = sqlite3_str_finish(body);
+    char *request = body_json != NULL ? sqlite3_mprintf(
+        "POST /v2/pipeline HTTP/1.0\r\nHost: localhost\r\nContent-Type: application/json\r\n"
+        "Content-Length: %d\r\n\r\n%s", body_len, body_json) : NULL;
+    sqlite3_free(body_json);
+    if (request == NULL) {
+        return SQLITE_NOMEM;
+    }
+    
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", handoff_socket);
+    struct timeval timeout = { .tv_sec = HANDOFF_TIMEOUT_SEC, .tv_usec = 0 };
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || 
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 || 
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0 || 
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || 
+        send_all(fd, request, strlen(request)) != 0) {
+        LOG_DEBUG("sqld handoff to %s failed: %s", handoff_socket, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        sqlite3_free(request);
+        return SQLITE_BUSY;
+    }
+    sqlite3_free(request);
+    
+    static char response[HANDOFF_RESPONSE_MAX];
+    size_t len = 0;
+    ssize_t n;
+    while (len < sizeof(response) - 1 && (n = recv(fd, response + len, sizeof(response) - 1 - len, 0)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        len += (size_t)n;
+    }
+    response[len] = '\0';
+    close(fd);
+    
+    int status = strncmp(response, "HTTP/1.", 7) == 0 && len > 12 ? atoi(response + 9) : 0;
+    const char *payload = strstr(response, "\r\n\r\n");
+    if (status == 200 && payload != NULL && strstr(payload, "\"results\":[{\"type\":\"ok\"") != NULL) {
+        return SQLITE_OK;
+    }
+    if (status == 0 || status == 429 || status >= 500 || 
+        (payload != NULL && (strstr(payload, "SQLITE_BUSY") != NULL || strstr(payload, "database is locked") != NULL))) {
+        return SQLITE_BUSY;
+    }
+    
+    const char *message = payload != NULL ? strstr(payload, "\"message\":\"") : NULL;
+    mosquitto_log_printf(MOSQ_LOG_ERR, "sqld rejected write batch (HTTP %d): %.200s", 
+                        status, message != NULL ? message + 11 : (payload != NULL ? payload + 4 : response));
+    return SQLITE_ERROR;
+}
+
+// Start a write transaction. IMMEDIATE takes the write lock up front, so contention with
+// sqld surfaces here (after the busy handler gave up) rather than halfway through a batch
+static int write_begin(void) {
+    if (handoff_socket != NULL) {
+        handoff_script = sqlite3_str_new(NULL);
+        sqlite3_str_appendall(handoff_script, "BEGIN IMMEDIATE;\n");
+        return SQLITE_OK;
+    }
+    return sqlite3_exec(msg_db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+}
+
+// Execute a write statement, or add it with its bound values to the handoff script
+static int write_step(sqlite3_stmt *stmt) {
+    if (handoff_script == NULL) {
+        return sqlite3_step(stmt);
+    }
+    char *sql = sqlite3_expanded_sql(stmt);
+    if (sql == NULL) {
+        return SQLITE_NOMEM;
+    }
+    sqlite3_str_appendf(handoff_script, "%s;\n", sql);
+    sqlite3_free(sql);
+    return SQLITE_DONE;
+}
+
+// Rows changed by the last write_step; -1 in a handoff script, where it is not known yet
+static int write_changes(void) {
+    return handoff_script != NULL ? -1 : sqlite3_changes(msg_db);
+}
+
+static void write_rollback(void) {
+    if (handoff_script != NULL) {
+        sqlite3_free(sqlite3_str_finish(handoff_script));
+        handoff_script = NULL;
+        return;
+    }
+    sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+}
+
+// Commit the write transaction; on failure it is rolled back
+// Returns SQLITE_OK, a transient error (retry later) or another error code
+static int write_commit(void) {
+    if (handoff_script != NULL) {
+        sqlite3_str_appendall(handoff_script, "COMMIT;");
+        char *script = sqlite3_str_finish(handoff_script);
+        handoff_script = NULL;
+        int rc = script != NULL ? handoff_execute(script) : SQLITE_NOMEM;
+        sqlite3_free(script);
+        if (rc == SQLITE_ERROR) {
+            atomic_fetch_add(&batch_failures, 1);
+        }
+        return rc;
+    }
+    
+    int rc = sqlite3_exec(msg_db, "COMMIT", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        rc = sqlite3_extended_errcode(msg_db);
+        if (!is_transient_error(rc)) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to commit transaction: %s", sqlite3_errmsg(msg_db));
+        }
+        sqlite3_exec(msg_db, "ROLLBACK", NULL, NULL, NULL);
+    }
+    return rc;
+}
+
+// Run one statement of the write transaction that has no parameters
+// Returns SQLITE_OK or the error code
+static int write_sql(const char *sql) {
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(msg_db, sql, -1, &stmt, NULL);
+    if (rc == SQLITE_OK) {
+        rc = write_step(stmt);
+        if (rc == SQLITE_DONE || rc == SQLITE_ROW) {
+            rc = SQLITE_OK;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+static void topic_tree_record(const char *topic, uint64_t count, const char *ulid, int retained, int from_database);
+static void topic_tree_forget(const char *topic, uint64_t count);
+
+// Note a change of the open write transaction for the topic tree (worker thread): count
+// messages added with the newest ulid, or taken off if negative, and the retained flag to
+// set (-1 leaves it)
+static void topic_tree_later(const char *topic, int64_t count, const char *ulid, int retained) {
+    if (!topic_tree_enabled || (count == 0 && retained < 0)) {
+        return;
+    }
+    if (topic_change_count == topic_change_capacity) {
+        int capacity = topic_change_capacity > 0 ? topic_change_capacity * 2 : 64;
+        struct topic_change *changes = realloc(topic_changes, (size_t)capacity * sizeof(*changes));
+        if (changes == NULL) {
+            return;
+        }
+        topic_changes = changes;
+        topic_change_capacity = capacity;
+    }
+    char *copy = strdup(topic);
+    if (copy != NULL) {
+        struct topic_change *change = &topic_changes[topic_change_count++];
+        change->topic = copy;
+        change->count = count;
+        snprintf(change->ulid, sizeof(change->ulid), "%s", ulid != NULL ? ulid : "");
+        change->retained = retained;
+    }
+}
+
+// Apply the noted changes to the topic tree if the transaction committed, else drop them
+static void topic_tree_end(int committed) {
+    if (topic_change_count == 0) {
+        return;
+    }
+    if (committed) {
+        pthread_mutex_lock(&topic_tree_mutex);
+        for (int i = 0; i < topic_change_count; i++) {
+            struct topic_change *change = &topic_changes[i];
+            if (change->count < 0) {
+                topic_tree_forget(change->topic, (uint64_t)-change->count);
+                if (change->retained >= 0) {
+                    topic_tree_record(change->topic, 0, change->ulid, change->retained, 0);
+                }
+            } else {
+                topic_tree_record(change->topic, (uint64_t)change->count, change->ulid, change->retained, 0);
+            }
+        }
+        pthread_mutex_unlock(&topic_tree_mutex);
+    }
+    for (int i = 0; i < topic_change_count; i++) {
+        free(topic_changes[i].topic);
+    }
+    topic_change_count = 0;
+}
+
+// Replace the retained message for a topic in msg_retained (inside the batch transaction)
+// A retried message does not replace a newer one stored since its first attempt
+static void store_retained(const struct msg_entry *entry) {
+    if (retained_upsert_stmt == NULL || entry->offloaded) {
+        return;
+    }
+    
+    sqlite3_bind_text(retained_upsert_stmt, 1, entry->topic, -1, SQLITE_STATIC);
+    sqlite3_bind_text(retained_upsert_stmt, 2, entry->ulid, -1, SQLITE_STATIC);
+    sqlite3_bind_blob(retained_upsert_stmt, 3, entry->payload, (int)entry->payloadlen, SQLITE_STATIC);
+    sqlite3_bind_int(retained_upsert_stmt, 4, entry->qos);
+    if (entry->headers) {
+        sqlite3_bind_text(retained_upsert_stmt, 5, entry->headers, -1, SQLITE_STATIC);
+    } else {
+        sqlite3_bind_null(retained_upsert_stmt, 5);
+    }
+    if (entry->expires_at > 0) {
+        sqlite3_bind_int64(retained_upsert_stmt, 6, (sqlite3_int64)entry->expires_at);
+    } else {
+        sqlite3_bind_null(retained_upsert_stmt, 6);
+    }
+    sqlite3_bind_int(retained_upsert_stmt, 7, entry->attempts > 0);
+    
+    if (write_step(retained_upsert_stmt) != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Retained store update failed for topic %s: %s", 
+                           entry->topic, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(retained_upsert_stmt);
+}
+
+// Remove the retained message for a topic from msg_retained
+// An empty retained publish always clears the broker's retained message, whichever ULID it carried
+static void clear_retained(const char *topic) {
+    if (retained_delete_stmt == NULL) {
+        return;
+    }
+    
+    sqlite3_bind_text(retained_delete_stmt, 1, topic, -1, SQLITE_STATIC);
+    if (write_step(retained_delete_stmt) != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Retained store clear failed for topic %s: %s", 
+                           topic, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(retained_delete_stmt);
+}
+
+// Split layout: delete the payload half of a message
+static void delete_payload_row(const char *ulid) {
+    if (payload_delete_stmt == NULL) {
+        return;
+    }
+    sqlite3_bind_text(payload_delete_stmt, 1, ulid, -1, SQLITE_TRANSIENT);
+    if (write_step(payload_delete_stmt) != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Payload delete failed for ulid %s: %s", ulid, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(payload_delete_stmt);
+}
+
+// Store a large payload in payload_blob (or add a reference to an identical one)
+// Returns 0 on success with the content hash in hash
+static int store_payload_blob(const struct msg_entry *entry, unsigned char hash[PAYLOAD_HASH_LEN]) {
+    if (blob_upsert_stmt == NULL) {
+        return 1;
+    }
+    
+    // Hash exactly what the msg table would store as text
+    size_t len = strlen(entry->payload);
+    payload_hash128(entry->payload, len, hash);
+    
+    sqlite3_bind_blob(blob_upsert_stmt, 1, hash, PAYLOAD_HASH_LEN, SQLITE_STATIC);
+    sqlite3_bind_text(blob_upsert_stmt, 2, entry->payload, (int)len, SQLITE_STATIC);
+    int rc = sqlite3_step(blob_upsert_stmt);
+    sqlite3_reset(blob_upsert_stmt);
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Payload blob store failed for topic %s: %s", 
+                           entry->topic, sqlite3_errmsg(msg_db));
+        return 1;
+    }
+    return 0;
+}
+
+// Format the location of an offloaded payload relative to the file store root ("hh/<32 hex>")
+static void payload_file_relpath(const unsigned char hash[PAYLOAD_HASH_LEN], char out[3 + 2 * PAYLOAD_HASH_LEN + 1]) {
+    static const char hex[] = "0123456789abcdef";
+    out[0] = hex[hash[0] >> 4];
+    out[1] = hex[hash[0] & 0x0f];
+    out[2] = '/';
+    for (int i = 0; i < PAYLOAD_HASH_LEN; i++) {
+        out[3 + 2 * i] = hex[hash[i] >> 4];
+        out[4 + 2 * i] = hex[hash[i] & 0x0f];
+    }
+    out[3 + 2 * PAYLOAD_HASH_LEN] = '\0';
+}
+
+// Write a payload to the content-addressed file store (spool or worker thread; the GC removes
+// files under the same payload_file_mutex). Identical content maps to the same file, which is
+// only touched (mtime) when reused. Returns 0 on success with the content hash in hash
+static int write_payload_file(const void *payload, size_t len, const unsigned char hash[PAYLOAD_HASH_LEN]) {
+    char relpath[3 + 2 * PAYLOAD_HASH_LEN + 1];
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 4];
+    
+    payload_file_relpath(hash, relpath);
+    if (snprintf(path, sizeof(path), "%s/%s", offload_dir, relpath) >= (int)sizeof(path)) {
+        return 1;
+    }
+    
+    // Reuse an existing file; refreshing its mtime keeps the GC grace period from expiring
+    // while a retried message still references it
+    if (utimensat(AT_FDCWD, path, NULL, 0) == 0) {
+        return 0;
+    }
+    
+    // Fan-out directory (hh) is created on demand
+    path[strlen(offload_dir) + 3] = '\0';
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create payload directory %s: %s", path, strerror(errno));
+        return 1;
+    }
+    path[strlen(offload_dir) + 3] = '/';
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create payload file %s: %s", tmp_path, strerror(errno));
+        return 1;
+    }
+    
+    const unsigned char *p = payload;
+    size_t remaining = len;
+    while (remaining > 0) {
+        ssize_t written = write(fd, p, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        p += written;
+        remaining -= (size_t)written;
+    }
+    
+    // Publish the file under its final name only once it is complete
+    int rc = (remaining == 0 && close(fd) == 0) ? rename(tmp_path, path) : (close(fd), -1);
+    if (rc != 0) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to write payload file %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+    }
+    return rc != 0;
+}
+
+static int offload_payload(const void *payload, size_t len, unsigned char hash[PAYLOAD_HASH_LEN]) {
+    payload_hash128(payload, len, hash);
+    pthread_mutex_lock(&payload_file_mutex);
+    int rc = write_payload_file(payload, len, hash);
+    pthread_mutex_unlock(&payload_file_mutex);
+    return rc;
+}
+
+// Spool thread: write the payloads handed over by queue_entry() to the file store and free
+// them, outside queue_mutex. A failed write leaves the payload to the worker
+static void *spool_worker(void *arg) {
+    UNUSED(arg);
+    pthread_mutex_lock(&queue_mutex);
+    while (atomic_load(&spool_thread_running)) {
+        struct msg_entry *entry = spool_head;
+        if (entry == NULL) {
+            pthread_cond_wait(&spool_cond, &queue_mutex);
+            continue;
+        }
+        spool_head = entry->spool_next;
+        if (spool_head == NULL) {
+            spool_tail = NULL;
+        }
+        entry->spool_next = NULL;
+        entry->spool = SPOOL_WRITING;
+        pthread_mutex_unlock(&queue_mutex);
+        
+        unsigned char hash[PAYLOAD_HASH_LEN];
+        int rc = offload_payload(entry->payload, entry->payloadlen, hash);
+        
+        pthread_mutex_lock(&queue_mutex);
+        entry->spool = SPOOL_NONE;
+        if (spool_orphaned) {
+            spool_orphaned = 0;
+            entry->next = NULL;
+            free_entries(entry);
+        } else if (rc == 0) {
+            memcpy(entry->payload_hash, hash, PAYLOAD_HASH_LEN);
+            entry->offloaded = 1;
+            free(entry->payload);
+            entry->payload = NULL;
+        }
+        pthread_cond_broadcast(&spool_done_cond);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return NULL;
+}
+
+// Write the large payloads of a batch the spool thread has not written to the file store
+// (worker thread, before the batch transaction). The retained store needs the bytes, so
+// restored retained messages stay in the database. The payload stays in memory until the
+// batch is freed; a failed write leaves the message inline
+static void offload_batch(struct msg_entry *batch) {
+    for (struct msg_entry *entry = batch; entry != NULL; entry = entry->next) {
+        if (entry->operation == OP_INSERT && !entry->offloaded && entry->payload != NULL && 
+            (long long)entry->payloadlen >= offload_min_size && !(entry->retain && restore_retained) && 
+            offload_payload(entry->payload, entry->payloadlen, entry->payload_hash) == 0) {
+            entry->offloaded = 1;
+        }
+    }
+}
+
+// Register an offloaded payload in payload_blob (or add a reference to it)
+// Returns 0 on success
+static int store_payload_file_ref(const struct msg_entry *entry) {
+    if (file_upsert_stmt == NULL) {
+        return 1;
+    }
+    
+    char relpath[3 + 2 * PAYLOAD_HASH_LEN + 1];
+    payload_file_relpath(entry->payload_hash, relpath);
+    
+    // data holds a readable reference so the msg view shows where the payload is
+    char *reference = sqlite3_mprintf("payloads/%s", relpath);
+    if (reference == NULL) {
+        return 1;
+    }
+    
+    sqlite3_bind_blob(file_upsert_stmt, 1, entry->payload_hash, PAYLOAD_HASH_LEN, SQLITE_STATIC);
+    sqlite3_bind_text(file_upsert_stmt, 2, reference, -1, sqlite3_free);
+    sqlite3_bind_text(file_upsert_stmt, 3, relpath, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(file_upsert_stmt, 4, (sqlite3_int64)entry->payloadlen);
+    int rc = sqlite3_step(file_upsert_stmt);
+    sqlite3_reset(file_upsert_stmt);
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Payload file reference failed for topic %s: %s", 
+                           entry->topic, sqlite3_errmsg(msg_db));
+        return 1;
+    }
+    return 0;
+}
+
+// Give back a payload_blob reference taken for a row that was not written
+static void release_payload_blob(const unsigned char hash[PAYLOAD_HASH_LEN]) {
+    if (blob_release_stmt == NULL) {
+        return;
+    }
+    sqlite3_bind_blob(blob_release_stmt, 1, hash, PAYLOAD_HASH_LEN, SQLITE_STATIC);
+    sqlite3_step(blob_release_stmt);
+    sqlite3_reset(blob_release_stmt);
+}
+
+static void client_cache_clear(void) {
+    for (int i = 0; i < CLIENT_CACHE_SIZE; i++) {
+        free(client_cache[i].client_id);
+        free(client_cache[i].username);
+    }
+    memset(client_cache, 0, sizeof(client_cache));
+}
+
+// msg_client key of the entry's publisher, 0 if it has none (worker thread, inside the batch
+// transaction). Pairs missing from the cache are looked up and added to msg_client
+static sqlite3_int64 client_key(const struct msg_entry *entry) {
+    if (entry->client_id == NULL || client_select_stmt == NULL) {
+        return 0;
+    }
+    const char *username = entry->username != NULL ? entry->username : "";
+    uint64_t hash = hash64_seeded(username, strlen(username), hash64(entry->client_id, strlen(entry->client_id)));
+    struct client_cache_slot *slot = &client_cache[hash % CLIENT_CACHE_SIZE];
+    if (slot->client_id != NULL && slot->hash == hash && strcmp(slot->client_id, entry->client_id) == 0 && 
+        strcmp(slot->username, username) == 0) {
+        return slot->key;
+    }
+    atomic_fetch_add(&client_cache_misses, 1);
+    
+    sqlite3_int64 key = 0;
+    sqlite3_bind_text(client_select_stmt, 1, entry->client_id, -1, SQLITE_STATIC);
+    sqlite3_bind_text(client_select_stmt, 2, username, -1, SQLITE_STATIC);
+    if (sqlite3_step(client_select_stmt) == SQLITE_ROW) {
+        key = sqlite3_column_int64(client_select_stmt, 0);
+    }
+    sqlite3_reset(client_select_stmt);
+    
+    if (key == 0) {
+        sqlite3_bind_text(client_insert_stmt, 1, entry->client_id, -1, SQLITE_STATIC);
+        sqlite3_bind_text(client_insert_stmt, 2, username, -1, SQLITE_STATIC);
+        if (sqlite3_step(client_insert_stmt) == SQLITE_DONE) {
+            key = sqlite3_last_insert_rowid(msg_db);
+            atomic_fetch_add(&clients_added, 1);
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to add client %s to msg_client: %s", 
+                                entry->client_id, sqlite3_errmsg(msg_db));
+        }
+        sqlite3_reset(client_insert_stmt);
+        if (key == 0) {
+            return 0;
+        }
+    }
+    
+    char *client_id = strdup(entry->client_id);
+    char *user = strdup(username);
+    if (client_id != NULL && user != NULL) {
+        free(slot->client_id);
+        free(slot->username);
+        slot->hash = hash;
+        slot->key = key;
+        slot->client_id = client_id;
+        slot->username = user;
+    } else {
+        free(client_id);
+        free(user);
+    }
+    return key;
+}
+
+// Key of a dictionary row (metric_node, metric_device, metric_name), added if missing
+// (worker thread, inside the batch transaction). select_stmt and insert_stmt take the text
+// columns as ?1 and, for metric_node, ?2. Returns 0 on error
+static sqlite3_int64 dictionary_key(sqlite3_stmt *select_stmt, sqlite3_stmt *insert_stmt, 
+                                    const char *name, size_t len, const char *second) {
+    sqlite3_int64 key = 0;
+    sqlite3_bind_text(select_stmt, 1, name, (int)len, SQLITE_STATIC);
+    if (second != NULL) {
+        sqlite3_bind_text(select_stmt, 2, second, -1, SQLITE_STATIC);
+    }
+    if (sqlite3_step(select_stmt) == SQLITE_ROW) {
+        key = sqlite3_column_int64(select_stmt, 0);
+    }
+    sqlite3_reset(select_stmt);
+    if (key != 0) {
+        return key;
+    }
+    
+    sqlite3_bind_text(insert_stmt, 1, name, (int)len, SQLITE_STATIC);
+    if (second != NULL) {
+        sqlite3_bind_text(insert_stmt, 2, second, -1, SQLITE_STATIC);
+    }
+    if (sqlite3_step(insert_stmt) == SQLITE_DONE) {
+        key = sqlite3_last_insert_rowid(msg_db);
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to add Sparkplug name %.*s: %s", 
+                            (int)len, name, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(insert_stmt);
+    return key;
+}
+
+// Id of a metric or device name, from the direct-mapped cache or the dictionary table
+static sqlite3_int64 sparkplug_name_id(struct sparkplug_name_slot *cache, sqlite3_stmt *select_stmt, 
+                                       sqlite3_stmt *insert_stmt, const char *name, size_t len) {
+    uint64_t hash = hash64(name, len);
+    struct sparkplug_name_slot *slot = &cache[hash % SPARKPLUG_NAME_CACHE_SIZE];
+    if (slot->name != NULL && slot->hash == hash && strncmp(slot->name, name, len) == 0 && slot->name[len] == '\0') {
+        return slot->id;
+    }
+    
+    sqlite3_int64 id = dictionary_key(select_stmt, insert_stmt, name, len, NULL);
+    char *copy = id != 0 ? strndup(name, len) : NULL;
+    if (copy != NULL) {
+        free(slot->name);
+        slot->hash = hash;
+        slot->id = id;
+        slot->name = copy;
+    }
+    return id;
+}
+
+static void sparkplug_name_cache_clear(struct sparkplug_name_slot *cache) {
+    for (int i = 0; i < SPARKPLUG_NAME_CACHE_SIZE; i++) {
+        free(cache[i].name);
+    }
+    memset(cache, 0, SPARKPLUG_NAME_CACHE_SIZE * sizeof(*cache));
+}
+
+// Forget dictionary ids, which a rolled back batch may have added. The alias maps stay:
+// they describe the edge nodes' sessions, not the database
+static void sparkplug_cache_clear(void) {
+    sparkplug_name_cache_clear(metric_name_cache);
+    sparkplug_name_cache_clear(metric_device_cache);
+    for (int i = 0; i < SPARKPLUG_NODE_TABLE_SIZE; i++) {
+        for (struct sparkplug_node *node = sparkplug_nodes[i]; node != NULL; node = node->next) {
+            node->node_id = 0;
+        }
+    }
+}
+
+static void sparkplug_aliases_reset(struct sparkplug_node *node) {
+    for (size_t i = 0; i < node->alias_capacity; i++) {
+        free(node->aliases[i].name);
+    }
+    free(node->aliases);
+    node->aliases = NULL;
+    node->alias_capacity = 0;
+    node->alias_count = 0;
+}
+
+static void sparkplug_free(void) {
+    sparkplug_cache_clear();
+    for (int i = 0; i < SPARKPLUG_NODE_TABLE_SIZE; i++) {
+        struct sparkplug_node *node = sparkplug_nodes[i];
+        while (node != NULL) {
+            struct sparkplug_node *next = node->next;
+            sparkplug_aliases_reset(node);
+            free(node->group_id);
+            free(node->edge_node);
+            free(node);
+            node = next;
+        }
+        sparkplug_nodes[i] = NULL;
+    }
+}
+
+static void finalize_sparkplug_store(void) {
+    sqlite3_stmt **stmts[] = { &metric_insert_stmt, &metric_retention_stmt, &metric_node_select_stmt, 
+                               &metric_node_insert_stmt, &metric_device_select_stmt, &metric_device_insert_stmt, 
+                               &metric_name_select_stmt, &metric_name_insert_stmt };
+    for (size_t i = 0; i < sizeof(stmts) / sizeof(stmts[0]); i++) {
+        sqlite3_finalize(*stmts[i]);
+        *stmts[i] = NULL;
+    }
+    sparkplug_free();
+}
+
+// Slot of an alias in an open addressing map: the alias itself or the empty slot for it
+static struct sparkplug_alias *sparkplug_alias_slot(struct sparkplug_alias *aliases, size_t capacity, uint64_t alias) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)hash64(&alias, sizeof(alias)) & mask;
+    while (aliases[i].name != NULL && aliases[i].alias != alias) {
+        i = (i + 1) & mask;
+    }
+    return &aliases[i];
+}
+
+// Remember the name and datatype a BIRTH message announced for an alias
+static void sparkplug_alias_put(struct sparkplug_node *node, uint64_t alias, const char *name, size_t len, 
+                                uint32_t datatype) {
+    // Grow at 3/4 load, so probing always finds an empty slot
+    if ((node->alias_count + 1) * 4 > node->alias_capacity * 3) {
+        size_t capacity = node->alias_capacity > 0 ? node->alias_capacity * 2 : SPARKPLUG_ALIAS_MIN;
+        struct sparkplug_alias *aliases = calloc(capacity, sizeof(*aliases));
+        if (aliases == NULL) {
+            return;
+        }
+        for (size_t i = 0; i < node->alias_capacity; i++) {
+            if (node->aliases[i].name != NULL) {
+                *sparkplug_alias_slot(aliases, capacity, node->aliases[i].alias) = node->aliases[i];
+            }
+        }
+        free(node->aliases);
+        node->aliases = aliases;
+        node->alias_capacity = capacity;
+    }
+    
+    char *copy = strndup(name, len);
+    if (copy == NULL) {
+        return;
+    }
+    struct sparkplug_alias *slot = sparkplug_alias_slot(node->aliases, node->alias_capacity, alias);
+    if (slot->name == NULL) {
+        node->alias_count++;
+    }
+    free(slot->name);
+    slot->alias = alias;
+    slot->name = copy;
+    slot->datatype = datatype;
+}
+
+static const struct sparkplug_alias *sparkplug_alias_get(const struct sparkplug_node *node, uint64_t alias) {
+    if (node->alias_capacity == 0) {
+        return NULL;
+    }
+    const struct sparkplug_alias *slot = sparkplug_alias_slot(node->aliases, node->alias_capacity, alias);
+    return slot->name != NULL ? slot : NULL;
+}
+
+// Edge node of a topic, created on first sight, with its metric_node key
+static struct sparkplug_node *sparkplug_node(const char *group_id, size_t group_len, const char *edge_node, 
+                                             size_t edge_len) {
+    uint64_t hash = hash64_seeded(edge_node, edge_len, hash64(group_id, group_len));
+    struct sparkplug_node **slot = &sparkplug_nodes[hash % SPARKPLUG_NODE_TABLE_SIZE];
+    struct sparkplug_node *node = *slot;
+    while (node != NULL && (node->hash != hash || strncmp(node->group_id, group_id, group_len) != 0 || 
+                            node->group_id[group_len] != '\0' || strncmp(node->edge_node, edge_node, edge_len) != 0 || 
+                            node->edge_node[edge_len] != '\0')) {
+        node = node->next;
+    }
+    if (node == NULL) {
+        node = calloc(1, sizeof(*node));
+        if (node == NULL) {
+            return NULL;
+        }
+        node->group_id = strndup(group_id, group_len);
+        node->edge_node = strndup(edge_node, edge_len);
+        if (node->group_id == NULL || node->edge_node == NULL) {
+            free(node->group_id);
+            free(node->edge_node);
+            free(node);
+            return NULL;
+        }
+        node->hash = hash;
+        node->next = *slot;
+        *slot = node;
+    }
+    if (node->node_id == 0) {
+        node->node_id = dictionary_key(metric_node_select_stmt, metric_node_insert_stmt, 
+                                       node->group_id, group_len, node->edge_node);
+    }
+    return node->node_id != 0 ? node : NULL;
+}
+
+// Bind ?5 value_num and ?6 value_str of metric_insert_stmt. Integers keep their sign as the
+// datatype says; UInt64 values beyond the int64 range are stored as real
+// Returns 1 for values without a scalar form (Bytes, File, DataSet, Template)
+static int bind_metric_value(const struct sparkplug_metric *metric, uint32_t datatype) {
+    sqlite3_bind_null(metric_insert_stmt, 5);
+    sqlite3_bind_null(metric_insert_stmt, 6);
+    if (metric->is_null) {
+        return 0;
+    }
+    
+    uint64_t v = metric->int_value;
+    switch (metric->value_field) {
+        case SPARKPLUG_VALUE_NONE:
+            return 0;
+        case SPARKPLUG_VALUE_INT:
+        case SPARKPLUG_VALUE_LONG:
+            switch (datatype) {
+                case SPARKPLUG_TYPE_INT8:   sqlite3_bind_int64(metric_insert_stmt, 5, (int8_t)v); break;
+                case SPARKPLUG_TYPE_INT16:  sqlite3_bind_int64(metric_insert_stmt, 5, (int16_t)v); break;
+                case SPARKPLUG_TYPE_INT32:  sqlite3_bind_int64(metric_insert_stmt, 5, (int32_t)v); break;
+                case SPARKPLUG_TYPE_UINT8:
+                case SPARKPLUG_TYPE_UINT16:
+                case SPARKPLUG_TYPE_UINT32:
+                case SPARKPLUG_TYPE_UINT64:
+                    if (v > INT64_MAX) {
+                        sqlite3_bind_double(metric_insert_stmt, 5, (double)v);
+                    } else {
+                        sqlite3_bind_int64(metric_insert_stmt, 5, (sqlite3_int64)v);
+                    }
+                    break;
+                default:
+                    // Int64, DateTime, or no datatype: int_value is unsigned, long_value two's complement
+                    sqlite3_bind_int64(metric_insert_stmt, 5, metric->value_field == SPARKPLUG_VALUE_INT 
+                                                              ? (sqlite3_int64)(uint32_t)v : (sqlite3_int64)v);
+                    break;
+            }
+            return 0;
+        case SPARKPLUG_VALUE_FLOAT:
+        case SPARKPLUG_VALUE_DOUBLE:
+            sqlite3_bind_double(metric_insert_stmt, 5, metric->double_value);
+            return 0;
+        case SPARKPLUG_VALUE_BOOLEAN:
+            sqlite3_bind_int(metric_insert_stmt, 5, v != 0);
+            return 0;
+        case SPARKPLUG_VALUE_STRING:
+            sqlite3_bind_text(metric_insert_stmt, 6, (const char *)metric->bytes, (int)metric->bytes_len, SQLITE_STATIC);
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+struct sparkplug_context {
+    struct sparkplug_node *node;
+    sqlite3_int64 device_id;        // 0 for the edge node's own metrics
+    uint64_t timestamp;             // Payload timestamp, 0 if the payload has none
+    unsigned long long message_ms;  // Arrival time from the ULID
+    int birth;
+};
+
+static int store_sparkplug_metric(const struct sparkplug_metric *metric, void *arg) {
+    struct sparkplug_context *ctx = arg;
+    const char *name = metric->name;
+    size_t name_len = metric->name_len;
+    uint32_t datatype = metric->datatype;
+    
+    if (name != NULL) {
+        if (ctx->birth && metric->has_alias) {
+            sparkplug_alias_put(ctx->node, metric->alias, name, name_len, datatype);
+        }
+    } else {
+        const struct sparkplug_alias *known = metric->has_alias ? sparkplug_alias_get(ctx->node, metric->alias) : NULL;
+        if (known == NULL) {
+            atomic_fetch_add(&sparkplug_unresolved, 1);
+            return 0;
+        }
+        name = known->name;
+        name_len = strlen(name);
+        if (datatype == 0) {
+            datatype = known->datatype;
+        }
+    }
+    
+    if (bind_metric_value(metric, datatype) != 0) {
+        atomic_fetch_add(&sparkplug_skipped, 1);
+        return 0;
+    }
+    sqlite3_int64 metric_id = sparkplug_name_id(metric_name_cache, metric_name_select_stmt, metric_name_insert_stmt, 
+                                                name, name_len);
+    if (metric_id == 0) {
+        return 0;
+    }
+    
+    uint64_t ts = metric->timestamp != 0 ? metric->timestamp : ctx->timestamp != 0 ? ctx->timestamp : ctx->message_ms;
+    sqlite3_bind_int64(metric_insert_stmt, 1, (sqlite3_int64)ts);
+    sqlite3_bind_int64(metric_insert_stmt, 2, ctx->node->node_id);
+    sqlite3_bind_int64(metric_insert_stmt, 3, ctx->device_id);
+    sqlite3_bind_int64(metric_insert_stmt, 4, metric_id);
+    if (write_step(metric_insert_stmt) == SQLITE_DONE) {
+        atomic_fetch_add(&sparkplug_metrics, 1);
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to store Sparkplug metric %.*s: %s", 
+                            (int)name_len, name, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(metric_insert_stmt);
+    return 0;
+}
+
+// Decode a Sparkplug B message written by this batch into metric rows (worker thread, inside
+// the batch transaction). Topics: spBv1.0/<group_id>/<message_type>/<edge_node_id>[/<device_id>]
+// Offloaded payloads are still in memory; only replayed dead letters of them have none
+static void store_sparkplug(const struct msg_entry *entry) {
+    const size_t prefix_len = sizeof(SPARKPLUG_NAMESPACE) - 1;
+    if (metric_insert_stmt == NULL || entry->payload == NULL || 
+        strncmp(entry->topic, SPARKPLUG_NAMESPACE, prefix_len) != 0) {
+        return;
+    }
+    
+    const char *group_id = entry->topic + prefix_len;
+    const char *type = strchr(group_id, '/');
+    const char *edge_node = type != NULL ? strchr(type + 1, '/') : NULL;
+    if (edge_node == NULL) {
+        return;
+    }
+    type++;
+    edge_node++;
+    const char *device = strchr(edge_node, '/');
+    size_t group_len = (size_t)(type - 1 - group_id);
+    size_t type_len = (size_t)(edge_node - 1 - type);
+    size_t edge_len = device != NULL ? (size_t)(device - edge_node) : strlen(edge_node);
+    
+    int birth;
+    if (type_len == 5 && (strncmp(type, "NDATA", 5) == 0 || strncmp(type, "DDATA", 5) == 0)) {
+        birth = 0;
+    } else if (type_len == 6 && (strncmp(type, "NBIRTH", 6) == 0 || strncmp(type, "DBIRTH", 6) == 0)) {
+        birth = 1;
+    } else {
+        return;     // NDEATH, DDEATH, NCMD, DCMD and STATE carry no measurements
+    }
+    // Device messages name the device in a fifth level, edge node messages have none
+    int device_message = type[0] == 'D';
+    if (group_len == 0 || edge_len == 0 || device_message != (device != NULL) || 
+        (device != NULL && (device[1] == '\0' || strchr(device + 1, '/') != NULL))) {
+        return;
+    }
+    
+    struct sparkplug_context ctx = { .birth = birth };
+    ctx.node = sparkplug_node(group_id, group_len, edge_node, edge_len);
+    if (ctx.node == NULL) {
+        return;
+    }
+    if (device != NULL) {
+        device++;
+        ctx.device_id = sparkplug_name_id(metric_device_cache, metric_device_select_stmt, metric_device_insert_stmt, 
+                                          device, strlen(device));
+        if (ctx.device_id == 0) {
+            return;
+        }
+    }
+    // NBIRTH starts a new session of the edge node, with a new set of aliases
+    if (birth && !device_message) {
+        sparkplug_aliases_reset(ctx.node);
+    }
+    
+    unsigned char ulid_bytes[16];
+    if (ulid_decode(ulid_bytes, entry->ulid) == 0) {
+        for (int i = 0; i < 6; i++) {
+            ctx.message_ms = ctx.message_ms << 8 | ulid_bytes[i];
+        }
+    }
+    
+    if (sparkplug_decode((const unsigned char *)entry->payload, entry->payloadlen, &ctx.timestamp, 
+                         store_sparkplug_metric, &ctx) != 0) {
+        atomic_fetch_add(&sparkplug_malformed, 1);
+        mosquitto_log_printf(MOSQ_LOG_DEBUG, "Malformed Sparkplug B payload on %s", entry->topic);
+    }
+    atomic_fetch_add(&sparkplug_payloads, 1);
+}
+
+// Bind message columns by fixed parameter number and execute the statement:
+// ?1 ulid, ?2 topic, ?3 payload, ?4 retain, ?5 qos, ?6 headers, ?7 payload_hash,
+// ?8 expires_at, ?9 client_key
+// Each layout's statements reference only the columns they store
+static int step_message_statement(sqlite3_stmt *stmt, const struct msg_entry *entry, 
+                                  const unsigned char *hash, sqlite3_int64 client_key) {
+    int params = sqlite3_bind_parameter_count(stmt);
+    
+    sqlite3_bind_text(stmt, 1, entry->ulid, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, entry->topic, -1, SQLITE_STATIC);
+    if (hash != NULL) {
+        // Row only references the shared payload
+        sqlite3_bind_text(stmt, 3, "", 0, SQLITE_STATIC);
+    } else {
+        sqlite3_bind_text(stmt, 3, entry->payload, -1, SQLITE_STATIC);
+    }
+    sqlite3_bind_int(stmt, 4, entry->retain);
+    sqlite3_bind_int(stmt, 5, entry->qos);
+    if (params >= 6) {
+        if (entry->headers) {
+            sqlite3_bind_text(stmt, 6, entry->headers, -1, SQLITE_STATIC);
+        } else {
+            sqlite3_bind_null(stmt, 6);
+        }
+    }
+    if (params >= 7) {
+        if (hash != NULL) {
+            sqlite3_bind_blob(stmt, 7, hash, PAYLOAD_HASH_LEN, SQLITE_STATIC);
+        } else {
+            sqlite3_bind_null(stmt, 7);
+        }
+    }
+    if (params >= 8) {
+        if (entry->expires_at > 0) {
+            sqlite3_bind_int64(stmt, 8, (sqlite3_int64)entry->expires_at);
+        } else {
+            sqlite3_bind_null(stmt, 8);
+        }
+    }
+    if (params >= 9) {
+        if (client_key > 0) {
+            sqlite3_bind_int64(stmt, 9, client_key);
+        } else {
+            sqlite3_bind_null(stmt, 9);
+        }
+    }
+    
+    int rc = write_step(stmt);
+    sqlite3_reset(stmt);
+    return rc;
+}
+
+// Write one message (both halves in the split layout, payload half first)
+// Returns SQLITE_DONE on success
+static int insert_message(const struct msg_entry *entry) {
+    unsigned char hash[PAYLOAD_HASH_LEN];
+    int deduplicated;
+    if (entry->offloaded) {
+        memcpy(hash, entry->payload_hash, PAYLOAD_HASH_LEN);
+        deduplicated = store_payload_file_ref(entry) == 0;
+        if (!deduplicated) {
+            // Without the reference the payload is unreachable; drop the row
+            return SQLITE_ERROR;
+        }
+    } else {
+        deduplicated = storage_layout != LAYOUT_INLINE && dedup_min_size > 0 && 
+                       entry->payloadlen >= (size_t)dedup_min_size && store_payload_blob(entry, hash) == 0;
+    }
+    int rc = SQLITE_DONE;
+    
+    if (payload_insert_stmt != NULL) {
+        rc = step_message_statement(payload_insert_stmt, entry, deduplicated ? hash : NULL, 0);
+    }
+    if (rc == SQLITE_DONE) {
+        rc = step_message_statement(insert_stmt, entry, deduplicated ? hash : NULL, client_key(entry));
+        if (rc != SQLITE_DONE && payload_insert_stmt != NULL) {
+            // Keep the two halves consistent; the caller reports the original error
+            char *errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(msg_db));
+            delete_payload_row(entry->ulid);
+            if (errmsg != NULL) {
+                mosquitto_log_printf(MOSQ_LOG_ERR, "Message row insert failed for topic %s: %s", entry->topic, errmsg);
+                sqlite3_free(errmsg);
+            }
+        }
+    }
+    if (rc != SQLITE_DONE && deduplicated) {
+        release_payload_blob(hash);
+    }
+    return rc;
+}
+
+// Insert or replace the msg_bucket row keyed by topic and first ULID
+static int write_bucket_row(const struct ts_bucket *bucket, const char *start_ulid, int count,
+                            const unsigned char *data, size_t len) {
+    sqlite3_bind_text(bucket_upsert_stmt, 1, bucket->topic, -1, SQLITE_STATIC);
+    sqlite3_bind_text(bucket_upsert_stmt, 2, start_ulid, -1, SQLITE_STATIC);
+    sqlite3_bind_text(bucket_upsert_stmt, 3, bucket->end_ulid, -1, SQLITE_STATIC);
+    sqlite3_bind_int(bucket_upsert_stmt, 4, count);
+    sqlite3_bind_blob(bucket_upsert_stmt, 5, data, (int)len, SQLITE_STATIC);
+    int rc = write_step(bucket_upsert_stmt);
+    sqlite3_reset(bucket_upsert_stmt);
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Bucket write failed for topic %s: %s", 
+                           bucket->topic, sqlite3_errmsg(msg_db));
+        return 1;
+    }
+    return 0;
+}
+
+// Write the messages added since the last segment as a row of their own, so every message
+// is written once while the bucket is open. The first timestamp delta is rebased to 0
+static int write_bucket_segment(struct ts_bucket *bucket) {
+    if (bucket->seg_count == 0) {
+        return 0;
+    }
+    
+    const unsigned char *p = bucket->data + bucket->seg_offset;
+    const unsigned char *end = bucket->data + bucket->len;
+    uint64_t delta;
+    if (msg_bucket_get_varint(&p, end, &delta) != 0) {
+        return 1;
+    }
+    unsigned char *segment = malloc(1 + MSG_BUCKET_MAX_VARINT + (size_t)(end - p));
+    if (segment == NULL) {
+        return 1;
+    }
+    size_t len = 0;
+    segment[len++] = MSG_BUCKET_FORMAT;
+    len += msg_bucket_put_varint(segment + len, msg_bucket_zigzag((int64_t)bucket->seg_first_ms));
+    memcpy(segment + len, p, (size_t)(end - p));
+    len += (size_t)(end - p);
+    
+    int rc = write_bucket_row(bucket, bucket->seg_ulid, bucket->seg_count, segment, len);
+    free(segment);
+    // The segment counts as written once the transaction commits (buckets_committed)
+    bucket->seg_written = rc == 0;
+    return rc;
+}
+
+// Replace the segments of a closing bucket with one row holding all its messages, deflated
+// (MSG_BUCKET_FORMAT_DEFLATE) unless that does not make it smaller
+static int close_bucket(struct ts_bucket *bucket) {
+    if (bucket->count == 0) {
+        return 0;
+    }
+    
+    size_t plain = bucket->len - 1;
+    uLongf packed = compressBound((uLong)plain);
+    unsigned char *data = malloc(1 + MSG_BUCKET_MAX_VARINT + packed);
+    if (data == NULL) {
+        return 1;
+    }
+    size_t header = 1 + msg_bucket_put_varint(data + 1, plain);
+    const unsigned char *row = bucket->data;
+    size_t len = bucket->len;
+    if (compress2(data + header, &packed, bucket->data + 1, (uLong)plain, Z_DEFAULT_COMPRESSION) == Z_OK && 
+        header + packed < bucket->len) {
+        data[0] = MSG_BUCKET_FORMAT_DEFLATE;
+        row = data;
+        len = header + packed;
+    }
+    
+    sqlite3_bind_text(bucket_segment_delete_stmt, 1, bucket->topic, -1, SQLITE_STATIC);
+    sqlite3_bind_text(bucket_segment_delete_stmt, 2, bucket->start_ulid, -1, SQLITE_STATIC);
+    sqlite3_bind_text(bucket_segment_delete_stmt, 3, bucket->end_ulid, -1, SQLITE_STATIC);
+    int rc = write_step(bucket_segment_delete_stmt);
+    sqlite3_reset(bucket_segment_delete_stmt);
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Bucket segment cleanup failed for topic %s: %s", 
+                           bucket->topic, sqlite3_errmsg(msg_db));
+        free(data);
+        return 1;
+    }
+    rc = write_bucket_row(bucket, bucket->start_ulid, bucket->count, row, len);
+    free(data);
+    return rc;
+}
+
+static void free_bucket(struct ts_bucket *bucket) {
+    free(bucket->topic);
+    free(bucket->data);
+    free(bucket);
+}
+
+// Append a message to a bucket, returns 0 on success
+static int bucket_append(struct ts_bucket *bucket, const struct msg_entry *entry, unsigned long long ts_ms,
+                         const unsigned char ulid_bytes[16]) {
+    size_t headerslen = entry->headers != NULL ? strlen(entry->headers) : 0;
+    size_t needed = bucket->len + 3 * MSG_BUCKET_MAX_VARINT + MSG_BUCKET_RANDOM_LEN + 1 + 
+                    entry->payloadlen + headerslen;
+    
+    if (needed > bucket->cap) {
+        size_t cap = bucket->cap > 0 ? bucket->cap : 256;
+        while (cap < needed) {
+            cap *= 2;
+        }
+        unsigned char *data = realloc(bucket->data, cap);
+        if (data == NULL) {
+            return 1;
+        }
+        bucket->data = data;
+        bucket->cap = cap;
+    }
+    
+    unsigned char *p = bucket->data + bucket->len;
+    if (bucket->len == 0) {
+        *p++ = MSG_BUCKET_FORMAT;
+    }
+    // Timestamps are delta-encoded; a clock step backwards yields a negative delta
+    p += msg_bucket_put_varint(p, msg_bucket_zigzag((int64_t)(ts_ms - bucket->last_ms)));
+    memcpy(p, ulid_bytes + 6, MSG_BUCKET_RANDOM_LEN);
+    p += MSG_BUCKET_RANDOM_LEN;
+    *p++ = (unsigned char)((entry->qos & MSG_BUCKET_QOS_MASK) | 
+                           (entry->retain ? MSG_BUCKET_FLAG_RETAIN : 0) | 
+                           (entry->headers != NULL ? MSG_BUCKET_FLAG_HEADERS : 0));
+    p += msg_bucket_put_varint(p, entry->payloadlen);
+    if (entry->payloadlen > 0) {
+        memcpy(p, entry->payload, entry->payloadlen);
+        p += entry->payloadlen;
+    }
+    if (entry->headers != NULL) {
+        p += msg_bucket_put_varint(p, headerslen);
+        memcpy(p, entry->headers, headerslen);
+        p += headerslen;
+    }
+    
+    if (bucket->seg_count++ == 0) {
+        bucket->seg_offset = bucket->len;
+        bucket->seg_first_ms = ts_ms;
+        memcpy(bucket->seg_ulid, entry->ulid, 27);
+    }
+    bucket->len = (size_t)(p - bucket->data);
+    bucket->last_ms = ts_ms;
+    bucket->count++;
+    memcpy(bucket->end_ulid, entry->ulid, 27);
+    return 0;
+}
+
+// Store a message in the open bucket of its topic (worker thread, inside the batch transaction)
+// Returns 0 if the message was bucketed, 1 if it must be stored as a plain row
+static int bucket_store_message(const struct msg_entry *entry) {
+    if (bucket_upsert_stmt == NULL || entry->retain || entry->offloaded || 
+        (entry->expires_at > 0 && expiry_select_stmt != NULL)) {
+        return 1;
+    }
+    
+    unsigned char ulid_bytes[16];
+    if (ulid_decode(ulid_bytes, entry->ulid) != 0) {
+        return 1;
+    }
+    unsigned long long ts_ms = 0;
+    for (int i = 0; i < 6; i++) {
+        ts_ms = ts_ms << 8 | ulid_bytes[i];
+    }
+    
+    uint64_t topic_hash = hash64(entry->topic, strlen(entry->topic));
+    struct ts_bucket **slot = &open_buckets[topic_hash % BUCKET_TABLE_SIZE];
+    struct ts_bucket *bucket = *slot;
+    while (bucket != NULL && (bucket->topic_hash != topic_hash || strcmp(bucket->topic, entry->topic) != 0)) {
+        bucket = bucket->next;
+    }
+    
+    if (bucket != NULL && (bucket->count >= bucket_max_points || ts_ms - bucket->start_ms >= bucket_window_ms)) {
+        // Full: write the closed bucket and start a new one in place
+        if (close_bucket(bucket) != 0) {
+            return 1;
+        }
+        bucket->len = 0;
+        bucket->count = 0;
+        bucket->seg_count = 0;
+        bucket->last_ms = 0;
+        bucket->start_ms = ts_ms;
+        memcpy(bucket->start_ulid, entry->ulid, 27);
+    } else if (bucket == NULL) {
+        if (open_bucket_count >= MAX_OPEN_BUCKETS || !is_topic_bucketed(entry->topic)) {
+            return 1;
+        }
+        bucket = calloc(1, sizeof(*bucket));
+        if (bucket == NULL || (bucket->topic = strdup(entry->topic)) == NULL) {
+            free(bucket);
+            return 1;
+        }
+        bucket->topic_hash = topic_hash;
+        bucket->start_ms = ts_ms;
+        memcpy(bucket->start_ulid, entry->ulid, 27);
+        bucket->next = *slot;
+        *slot = bucket;
+        open_bucket_count++;
+    }
+    
+    return bucket_append(bucket, entry, ts_ms, ulid_bytes);
+}
+
+// Drop all open buckets without writing them (after a rolled back batch); the next
+// message of each topic starts a new bucket, segments committed earlier remain as rows
+static void discard_buckets(void) {
+    for (int i = 0; i < BUCKET_TABLE_SIZE; i++) {
+        while (open_buckets[i] != NULL) {
+            struct ts_bucket *bucket = open_buckets[i];
+            open_buckets[i] = bucket->next;
+            free_bucket(bucket);
+        }
+    }
+    open_bucket_count = 0;
+}
+
+// Settle the segments and closes written by the transaction that just ended: once committed
+// segments are done with and closed buckets released, otherwise they are written again later
+static void buckets_committed(int committed) {
+    for (int i = 0; i < BUCKET_TABLE_SIZE; i++) {
+        struct ts_bucket **link = &open_buckets[i];
+        while (*link != NULL) {
+            struct ts_bucket *bucket = *link;
+            if (committed && bucket->closed) {
+                *link = bucket->next;
+                free_bucket(bucket);
+                open_bucket_count--;
+                continue;
+            }
+            if (committed && bucket->seg_written) {
+                bucket->seg_offset = bucket->len;
+                bucket->seg_count = 0;
+            }
+            bucket->seg_written = 0;
+            bucket->closed = 0;
+            link = &bucket->next;
+        }
+    }
+}
+
+// Write pending segments and close the buckets whose window has passed (worker thread)
+// With close_all every bucket is closed and released (shutdown). Outside of a batch
+// transaction the writes get one of their own (started on the first write), a close being
+// a delete and an insert; in a batch transaction write_batch settles them after its commit
+static void flush_buckets(int close_all) {
+    if (open_bucket_count == 0) {
+        return;
+    }
+    
+    int in_transaction = handoff_socket != NULL ? handoff_script != NULL : !sqlite3_get_autocommit(msg_db);
+    int own_transaction = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    unsigned long long now_ms = (unsigned long long)ts.tv_sec * 1000ULL + (unsigned long long)ts.tv_nsec / 1000000ULL;
+    
+    for (int i = 0; i < BUCKET_TABLE_SIZE; i++) {
+        for (struct ts_bucket *bucket = open_buckets[i]; bucket != NULL; bucket = bucket->next) {
+            int closing = close_all || now_ms - bucket->start_ms >= bucket_window_ms;
+            if (!in_transaction && (closing || bucket->seg_count > 0)) {
+                if (write_begin() != SQLITE_OK) {
+                    // Database busy: retried on the next call; at shutdown the committed
+                    // segments stay as separate rows
+                    if (close_all) {
+                        discard_buckets();
+                    }
+                    return;
+                }
+                in_transaction = own_transaction = 1;
+            }
+            if (closing) {
+                // On failure the bucket stays open and is closed again with the next call
+                bucket->closed = close_bucket(bucket) == 0;
+            } else {
+                write_bucket_segment(bucket);
+            }
+        }
+    }
+    
+    if (own_transaction) {
+        buckets_committed(write_commit() == SQLITE_OK);
+    }
+    // At shutdown the committed segments of buckets that could not be closed stay as separate rows
+    if (close_all) {
+        discard_buckets();
+    }
+}
+
+// Move a failed operation to the retry queue; the delay doubles with every attempt
+// A NULL error keeps the one already set on the entry
+static void retry_later(struct msg_entry *entry, const char *error) {
+    entry->attempts++;
+    if (error != NULL) {
+        free(entry->error);
+        entry->error = strdup(error);
+    }
+    
+    if (retry_queue_size >= MAX_RETRY_QUEUE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Retry queue full (%d), dropping failed operation for topic %s", 
+                            MAX_RETRY_QUEUE, entry->topic);
+        atomic_fetch_add(&operations_dropped, 1);
+        entry->next = NULL;
+        free_entries(entry);
+        return;
+    }
+    
+    unsigned long long delay_ms = RETRY_MIN_MS;
+    for (int i = 1; i < entry->attempts && delay_ms < RETRY_MAX_MS; i++) {
+        delay_ms *= 2;
+    }
+    if (delay_ms > RETRY_MAX_MS) {
+        delay_ms = RETRY_MAX_MS;
+    }
+    entry->retry_at_ms = platform_utime(1) / 1000 + delay_ms;
+    entry->next = retry_queue;
+    retry_queue = entry;
+    retry_queue_size++;
+    atomic_store(&retry_queued, retry_queue_size);
+}
+
+// Keep the error of a failed write in buf; returns its (extended) result code
+static int write_failure(int rc, char *buf, size_t len) {
+    int code = sqlite3_extended_errcode(msg_db);
+    if (code == SQLITE_OK) {
+        // Cleanup after the failure (split layout) already reset the connection's error
+        snprintf(buf, len, "%s", sqlite3_errstr(rc));
+        return rc;
+    }
+    snprintf(buf, len, "%s", sqlite3_errmsg(msg_db));
+    return code;
+}
+
+#define WRITE_BUSY    1                  // write_batch: database busy, back off before the retry
+#define WRITE_REQUEUE 2                  // write_batch: transaction rolled back, retry right away
+
+static int write_batch(struct msg_entry **batch, int *count);
+
+// sqld reports only whether a whole script failed, not which row: a rejected batch is written
+// again one operation per script, so that only the failing operations are retried
+static int write_one_by_one(struct msg_entry **batch, int *count) {
+    mosquitto_log_printf(MOSQ_LOG_WARNING, "sqld rejected a batch of %d operations, writing them one at a time", *count);
+    while (*batch != NULL) {
+        struct msg_entry *single = *batch;
+        int one = 1;
+        *batch = single->next;
+        single->next = NULL;
+        (*count)--;
+        int rc = write_batch(&single, &one);
+        if (rc != 0) {
+            // Back in front of the rest, which stays in arrival order
+            if (single != NULL) {
+                single->next = *batch;
+                *batch = single;
+                (*count)++;
+            }
+            return rc;
+        }
+    }
+    return 0;
+}
+
+// Write a batch in one transaction. Operations that fail on their own, and the whole batch if
+// it cannot be committed, go to the retry queue. Returns 0 when the batch is done with, or
+// WRITE_BUSY or WRITE_REQUEUE with the entries left to requeue in batch and count
+static int write_batch(struct msg_entry **batch, int *count) {
+    struct msg_entry *batch_head = *batch;
+    int batch_count = *count;
+    
+    // Begin transaction for batch operations
+    int rc = write_begin();
+    int began = rc == SQLITE_OK;
+    if (rc != SQLITE_OK) {
+        if (is_transient_error(sqlite3_extended_errcode(msg_db))) {
+            return WRITE_BUSY;
+        }
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to begin transaction: %s", sqlite3_errmsg(msg_db));
+        // Fall through and try individual operations anyway
+    }
+    
+    // Process all entries in batch; operations that fail on their own wait in failed_list
+    // until the transaction ends, which decides whether their retained store update counts
+    struct msg_entry **link = &batch_head;
+    struct msg_entry *entry;
+    struct msg_entry *failed_list = NULL;
+    int insert_count = 0;
+    int delete_count = 0;
+    int busy = 0;
+    int rolled_back = 0;
+    int aborted = 0;
+    char error[256];
+    while ((entry = *link) != NULL) {
+        int failed = SQLITE_OK;
+        if (entry->operation == OP_INSERT) {
+            // Insert operation
+            if (bucket_pattern_count > 0 && bucket_store_message(entry) == 0) {
+                insert_count++;
+                topic_tree_later(entry->topic, 1, entry->ulid, entry->retain ? 1 : -1);
+            } else if (insert_stmt != NULL) {
+                rc = insert_message(entry);
+                if (rc == SQLITE_DONE) {
+                    insert_count++;
+                    topic_tree_later(entry->topic, 1, entry->ulid, entry->retain ? 1 : -1);
+                } else if (is_transient_error(sqlite3_extended_errcode(msg_db))) {
+                    busy = 1;
+                    break;
+                } else {
+                    failed = write_failure(rc, error, sizeof(error));
+                    mosquitto_log_printf(MOSQ_LOG_ERR, "Batch insert failed for topic %s: %s", entry->topic, error);
+                }
+            }
+            // Once a transaction with its retained store update is committed, retries skip it
+            if (entry->retain && !entry->retained_stored) {
+                store_retained(entry);
+            }
+            if (sparkplug_enabled && failed == SQLITE_OK) {
+                store_sparkplug(entry);
+            }
+        } else if (entry->operation == OP_RETAINED) {
+            if (entry->payloadlen > 0) {
+                store_retained(entry);
+            } else {
+                clear_retained(entry->topic);
+            }
+            // The topic tree follows what is stored, here only the retained store
+            topic_tree_later(entry->topic, 0, entry->ulid, entry->payloadlen > 0);
+        } else if (entry->operation == OP_DELETE) {
+            // Delete with specific ULID
+            if (delete_stmt != NULL) {
+                sqlite3_bind_text(delete_stmt, 1, entry->topic, -1, SQLITE_STATIC);
+                sqlite3_bind_text(delete_stmt, 2, entry->ulid, -1, SQLITE_STATIC);
+                
+                rc = write_step(delete_stmt);
+                if (rc == SQLITE_DONE) {
+                    // An unknown change count (handoff) counts as deleted, like the fallback below
+                    int changes = write_changes();
+                    if (changes != 0) {
+                        delete_payload_row(entry->ulid);
+                        topic_tree_later(entry->topic, -1, NULL, 0);
+                        delete_count++;
+                        mosquitto_log_printf(MOSQ_LOG_INFO, "Deleted message for topic: %s (ulid: %s)", 
+                                            entry->topic, entry->ulid);
+                    }
+                } else if (is_transient_error(sqlite3_extended_errcode(msg_db))) {
+                    busy = 1;
+                } else {
+                    failed = write_failure(rc, error, sizeof(error));
+                    mosquitto_log_printf(MOSQ_LOG_ERR, "Delete failed for topic %s: %s", entry->topic, error);
+                }
+                sqlite3_reset(delete_stmt);
+                if (busy) {
+                    break;
+                }
+            }
+            clear_retained(entry->topic);
+        } else if (entry->operation == OP_DELETE_FALLBACK) {
+            // Delete most recent message for topic (fallback when no ULID provided)
+            if (handoff_script != NULL && delete_latest_stmt != NULL) {
+                sqlite3_bind_text(delete_latest_stmt, 1, entry->topic, -1, SQLITE_STATIC);
+                rc = write_step(delete_latest_stmt);
+                sqlite3_reset(delete_latest_stmt);
+                if (rc == SQLITE_DONE) {
+                    // Whether a row was there is not known, it counts as deleted like the other handoff deletes
+                    topic_tree_later(entry->topic, -1, NULL, 0);
+                } else {
+                    failed = write_failure(rc, error, sizeof(error));
+                    mosquitto_log_printf(MOSQ_LOG_ERR, "Delete failed for topic %s: %s", entry->topic, error);
+                }
+            } else if (find_latest_stmt != NULL) {
+                sqlite3_bind_text(find_latest_stmt, 1, entry->topic, -1, SQLITE_STATIC);
+                rc = sqlite3_step(find_latest_stmt);
+                if (rc == SQLITE_ROW) {
+                    const char *found_ulid = (const char *)sqlite3_column_text(find_latest_stmt, 0);
+                    if (delete_stmt != NULL && found_ulid != NULL) {
+                        sqlite3_bind_text(delete_stmt, 1, entry->topic, -1, SQLITE_STATIC);
+                        sqlite3_bind_text(delete_stmt, 2, found_ulid, -1, SQLITE_TRANSIENT);
+                        
+                        rc = write_step(delete_stmt);
+                        if (rc == SQLITE_DONE) {
+                            if (write_changes() > 0) {
+                                delete_payload_row(found_ulid);
+                                topic_tree_later(entry->topic, -1, NULL, 0);
+                                delete_count++;
+                                mosquitto_log_printf(MOSQ_LOG_INFO, "Deleted most recent message for topic: %s (ulid: %s)", 
+                                                    entry->topic, found_ulid);
+                            }
+                        } else if (is_transient_error(sqlite3_extended_errcode(msg_db))) {
+                            busy = 1;
+                        } else {
+                            failed = write_failure(rc, error, sizeof(error));
+                            mosquitto_log_printf(MOSQ_LOG_ERR, "Delete failed for topic %s: %s", entry->topic, error);
+                            // Retry the message that was found, not whatever is latest by then
+                            entry->operation = OP_DELETE;
+                            snprintf(entry->ulid, sizeof(entry->ulid), "%s", found_ulid);
+                        }
+                        sqlite3_reset(delete_stmt);
+                    }
+                } else if (rc == SQLITE_DONE) {
+                    mosquitto_log_printf(MOSQ_LOG_WARNING, "No message found to delete for topic: %s", entry->topic);
+                } else if (is_transient_error(sqlite3_extended_errcode(msg_db))) {
+                    busy = 1;
+                } else {
+                    failed = write_failure(rc, error, sizeof(error));
+                    mosquitto_log_printf(MOSQ_LOG_ERR, "Delete lookup failed for topic %s: %s", entry->topic, error);
+                }
+                sqlite3_reset(find_latest_stmt);
+                if (busy) {
+                    break;
+                }
+            }
+            clear_retained(entry->topic);
+        }
+        
+        if (failed != SQLITE_OK) {
+            *link = entry->next;
+            batch_count--;
+            free(entry->error);
+            entry->error = strdup(error);
+            entry->next = failed_list;
+            failed_list = entry;
+            // Errors like SQLITE_FULL can roll back the whole transaction; the other
+            // operations of the batch are then written again with the next batch
+            if (began && handoff_script == NULL && sqlite3_get_autocommit(msg_db)) {
+                rolled_back = 1;
+                break;
+            }
+            continue;
+        }
+        link = &entry->next;
+    }
+    
+    if (delete_count > 0) {
+        payload_gc_pending = 1;
+    }
+    
+    if (busy || rolled_back) {
+        write_rollback();
+    } else {
+        // Messages added to open buckets are written as segments in the same transaction
+        flush_buckets(0);
+        rc = write_commit();
+        busy = is_transient_error(rc);
+        if (rc != SQLITE_OK && !busy) {
+            aborted = rc;
+        }
+    }
+    
+    int committed = !busy && !rolled_back && !aborted;
+    topic_tree_end(committed);
+    if (committed) {
+        buckets_committed(1);
+    } else {
+        // Open buckets already hold messages of this batch; the rows keep their last committed state
+        discard_buckets();
+        // So may the client cache and the Sparkplug dictionary ids (rows added by this batch are gone)
+        client_cache_clear();
+        sparkplug_cache_clear();
+    }
+    while (failed_list != NULL) {
+        entry = failed_list;
+        failed_list = entry->next;
+        if (committed && entry->operation == OP_INSERT && entry->retain) {
+            if (!entry->retained_stored) {
+                topic_tree_later(entry->topic, 0, entry->ulid, 1);
+            }
+            entry->retained_stored = 1;
+        }
+        retry_later(entry, NULL);
+    }
+    if (busy || rolled_back) {
+        *batch = batch_head;
+        *count = batch_count;
+        return batch_head == NULL ? 0 : busy ? WRITE_BUSY : WRITE_REQUEUE;
+    }
+    if (aborted && handoff_socket != NULL && batch_count > 1) {
+        *batch = batch_head;
+        *count = batch_count;
+        return write_one_by_one(batch, count);
+    }
+    if (aborted) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Batch of %d operations rolled back (%s), retrying them later", 
+                            batch_count, sqlite3_errstr(aborted));
+        while (batch_head != NULL) {
+            entry = batch_head;
+            batch_head = entry->next;
+            retry_later(entry, sqlite3_errstr(aborted));
+        }
+        *batch = NULL;
+        return 0;
+    }
+    
+    if (insert_count > 0 || delete_count > 0) {
+        LOG_DEBUG("Batch: %d inserts, %d deletes committed", 
+                  insert_count, delete_count);
+    }
+    
+    free_entries(batch_head);
+    *batch = NULL;
+    return 0;
+}
+
+// Flush queued messages to database as a batch
+// Returns 1 if the database was busy and the batch was put back into the queue
+static int flush_batch(void) {
+    struct msg_entry *batch_head = NULL;
+    int batch_count = 0;
+    
+    pthread_mutex_lock(&queue_mutex);
+    if (msg_queue_size == 0) {
+        pthread_mutex_unlock(&queue_mutex);
+        return 0;
+    }
+    
+    batch_count = take_batch(&batch_head);
+    // Payloads the spool has not reached yet are written below
+    for (struct msg_entry *entry = batch_head; entry != NULL; entry = entry->next) {
+        spool_release(entry, 1);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    
+    if (batch_count == 0 || msg_db == NULL) {
+        return 0;
+    }
+    
+    // File writes stay outside the write transaction
+    if (offload_min_size > 0) {
+        offload_batch(batch_head);
+    }
+    
+    int rc = write_batch(&batch_head, &batch_count);
+    if (rc != 0) {
+        requeue_batch(batch_head, batch_count);
+    }
+    return rc == WRITE_BUSY;
+}
+
+// Create msg_deadletter (if needed) and prepare its insert statement; returns 0 on success
+static int open_deadletter_store(void) {
+    if (deadletter_insert_stmt != NULL) {
+        return 0;
+    }
+    char *err_msg = NULL;
+    if (sqlite3_exec(msg_db, 
+            "CREATE TABLE IF NOT EXISTS msg_deadletter(id integer primary key, operation text not null, "
+            "ulid text not null, topic text not null, payload blob, payload_hash blob, retain integer not null default 0, "
+            "qos integer not null default 0, headers text, expires_at integer, error text, attempts integer not null, "
+            "failed_at integer not null, client_id text, username text);", NULL, NULL, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create dead-letter table: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    // Dead-letter tables created before publisher identity support
+    if (!table_has_column("msg_deadletter", "client_id") && 
+        sqlite3_exec(msg_db, "ALTER TABLE msg_deadletter ADD COLUMN client_id text;"
+                             "ALTER TABLE msg_deadletter ADD COLUMN username text;", NULL, NULL, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to add msg_deadletter.client_id: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    // Handoff scripts may run twice, so there a dead letter already stored is not added again
+    if (sqlite3_prepare_v2(msg_db, handoff_socket != NULL ? 
+            "INSERT INTO msg_deadletter (operation, ulid, topic, payload, payload_hash, retain, qos, headers, "
+            "expires_at, error, attempts, failed_at, client_id, username) "
+            "SELECT ?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14 WHERE NOT EXISTS "
+            "(SELECT 1 FROM msg_deadletter WHERE ulid = ?2 AND operation = ?1 AND failed_at = ?12)" : 
+            "INSERT INTO msg_deadletter (operation, ulid, topic, payload, payload_hash, retain, qos, headers, "
+            "expires_at, error, attempts, failed_at, client_id, username) "
+            "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14)", 
+            -1, &deadletter_insert_stmt, NULL) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare dead-letter insert: %s", sqlite3_errmsg(msg_db));
+        return 1;
+    }
+    if (atomic_load(&deadletter_rows) < 0) {
+        atomic_store(&deadletter_rows, 0);
+    }
+    return 0;
+}
+
+static const char *operation_name(int operation) {
+    switch (operation) {
+        case OP_INSERT: return "insert";
+        case OP_DELETE: return "delete";
+        case OP_DELETE_FALLBACK: return "delete_latest";
+        default: return "retained";
+    }
+}
+
+// Store failed operations in msg_deadletter in one transaction (through the write path, so
+// sqld writes them with the handoff) and free them
+// Returns 0 on success; on failure the list is left untouched
+static int store_dead_letters(struct msg_entry *list) {
+    if (open_deadletter_store() != 0 || write_begin() != SQLITE_OK) {
+        return 1;
+    }
+    
+    int stored = 0;
+    int rc = SQLITE_DONE;
+    sqlite3_int64 now = (sqlite3_int64)time(NULL);
+    for (struct msg_entry *entry = list; entry != NULL && rc == SQLITE_DONE; entry = entry->next) {
+        sqlite3_stmt *stmt = deadletter_insert_stmt;
+        sqlite3_bind_text(stmt, 1, operation_name(entry->operation), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, entry->ulid, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, entry->topic, -1, SQLITE_STATIC);
+        if (entry->payload != NULL && entry->operation == OP_INSERT && !entry->offloaded) {
+            sqlite3_bind_blob(stmt, 4, entry->payload, (int)entry->payloadlen, SQLITE_STATIC);
+        } else {
+            sqlite3_bind_null(stmt, 4);
+        }
+        if (entry->offloaded) {
+            sqlite3_bind_blob(stmt, 5, entry->payload_hash, PAYLOAD_HASH_LEN, SQLITE_STATIC);
+        } else {
+            sqlite3_bind_null(stmt, 5);
+        }
+        sqlite3_bind_int(stmt, 6, entry->retain);
+        sqlite3_bind_int(stmt, 7, entry->qos);
+        if (entry->headers != NULL) {
+            sqlite3_bind_text(stmt, 8, entry->headers, -1, SQLITE_STATIC);
+        } else {
+            sqlite3_bind_null(stmt, 8);
+        }
+        if (entry->expires_at > 0) {
+            sqlite3_bind_int64(stmt, 9, (sqlite3_int64)entry->expires_at);
+        } else {
+            sqlite3_bind_null(stmt, 9);
+        }
+        sqlite3_bind_text(stmt, 10, entry->error, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 11, entry->attempts);
+        sqlite3_bind_int64(stmt, 12, now);
+        if (entry->client_id != NULL) {
+            sqlite3_bind_text(stmt, 13, entry->client_id, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 14, entry->username, -1, SQLITE_STATIC);
+        } else {
+            sqlite3_bind_null(stmt, 13);
+            sqlite3_bind_null(stmt, 14);
+        }
+        rc = write_step(stmt);
+        sqlite3_reset(stmt);
+        stored++;
+    }
+    
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to store dead letters: %s", sqlite3_errmsg(msg_db));
+        write_rollback();
+        return 1;
+    }
+    rc = write_commit();
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to store dead letters: %s", sqlite3_errstr(rc));
+        return 1;
+    }
+    mosquitto_log_printf(MOSQ_LOG_WARNING, "Moved %d failed operations to msg_deadletter", stored);
+    atomic_fetch_add(&deadletters_stored, (unsigned long long)stored);
+    atomic_fetch_add(&deadletter_rows, stored);
+    free_entries(list);
+    return 0;
+}
+
+// Put due operations of the retry queue back into the message queue and move the ones that
+// used up retry_attempts to msg_deadletter (worker thread)
+static void process_retry_queue(void) {
+    if (retry_queue == NULL || msg_db == NULL) {
+        return;
+    }
+    
+    unsigned long long now_ms = platform_utime(1) / 1000;
+    struct msg_entry *due = NULL;
+    struct msg_entry *dead = NULL;
+    int due_count = 0;
+    int dead_count = 0;
+    struct msg_entry **link = &retry_queue;
+    while (*link != NULL) {
+        struct msg_entry *entry = *link;
+        if (entry->retry_at_ms > now_ms) {
+            link = &entry->next;
+            continue;
+        }
+        *link = entry->next;
+        if (entry->attempts >= retry_attempts) {
+            entry->next = dead;
+            dead = entry;
+            dead_count++;
+        } else {
+            entry->next = due;
+            due = entry;
+            due_count++;
+        }
+    }
+    
+    if (dead != NULL && store_dead_letters(dead) != 0) {
+        // Keep them and try again later
+        struct msg_entry *tail = dead;
+        while (tail->next != NULL) {
+            tail = tail->next;
+        }
+        for (struct msg_entry *entry = dead; entry != NULL; entry = entry->next) {
+            entry->retry_at_ms = now_ms + RETRY_MAX_MS;
+        }
+        tail->next = retry_queue;
+        retry_queue = dead;
+        dead_count = 0;
+    }
+    if (due != NULL) {
+        requeue_batch(due, due_count);
+        atomic_fetch_add(&operations_retried, (unsigned long long)due_count);
+    }
+    retry_queue_size -= due_count + dead_count;
+    atomic_store(&retry_queued, retry_queue_size);
+}
+
+// Move one slice of dead letters (up to the newest row at the time of the request) back
+// into the message queue as new attempts (worker thread). The slice is read locally and
+// deleted through the write path; with the handoff only this thread adds or removes rows
+// below replay_max_id, so the read does not need to be in the same transaction
+static void replay_dead_letters(void) {
+    if (msg_db == NULL) {
+        return;
+    }
+    if (atomic_exchange(&replay_requested, 0) && replay_max_id == 0) {
+        replay_max_id = atomic_load(&deadletter_rows) > 0 ? 
+                        pragma_int("SELECT coalesce(max(id), 0) FROM msg_deadletter") : 0;
+        if (replay_max_id <= 0) {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "No dead letters to replay");
+            replay_max_id = 0;
+            return;
+        }
+    }
+    if (replay_max_id <= 0) {
+        return;
+    }
+    // Replayed rows keep their ULID, which the topic tree load may still count as well
+    if (topic_tree_enabled && atomic_load(&copy_thread_running) && !atomic_load(&topic_tree_loaded)) {
+        return;
+    }
+    
+    sqlite3_stmt *stmt = NULL;
+    if (write_begin() != SQLITE_OK) {
+        return;
+    }
+    int rc = sqlite3_prepare_v2(msg_db, 
+        "SELECT id, operation, ulid, topic, payload, payload_hash, retain, qos, headers, expires_at, "
+        "client_id, username FROM msg_deadletter WHERE id <= ?1 ORDER BY id LIMIT ?2", -1, &stmt, NULL);
+    
+    struct msg_entry *head = NULL;
+    struct msg_entry **tail = &head;
+    int count = 0;
+    sqlite3_int64 last_id = 0;
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(stmt, 1, replay_max_id);
+        sqlite3_bind_int(stmt, 2, REPLAY_SLICE);
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            last_id = sqlite3_column_int64(stmt, 0);
+            const char *operation = (const char *)sqlite3_column_text(stmt, 1);
+            char ulid[27];
+            snprintf(ulid, sizeof(ulid), "%s", (const char *)sqlite3_column_text(stmt, 2));
+            const char *topic = (const char *)sqlite3_column_text(stmt, 3);
+            const char *payload = sqlite3_column_blob(stmt, 4);
+            size_t payloadlen = (size_t)sqlite3_column_bytes(stmt, 4);
+            const unsigned char *hash = sqlite3_column_bytes(stmt, 5) == PAYLOAD_HASH_LEN ? sqlite3_column_blob(stmt, 5) : NULL;
+            
+            int op = strcmp(operation, "delete") == 0 ? OP_DELETE : 
+                     strcmp(operation, "delete_latest") == 0 ? OP_DELETE_FALLBACK : OP_INSERT;
+            struct msg_entry *entry = new_message_entry(op, ulid, topic, payload != NULL ? payload : "", 
+                                                        payload != NULL ? payloadlen : 0, hash, 
+                                                        (const char *)sqlite3_column_text(stmt, 8), 
+                                                        sqlite3_column_int(stmt, 6), sqlite3_column_int(stmt, 7), 
+                                                        (unsigned long long)sqlite3_column_int64(stmt, 9));
+            if (entry != NULL) {
+                entry_set_client(entry, (const char *)sqlite3_column_text(stmt, 10), 
+                                 (const char *)sqlite3_column_text(stmt, 11));
+                *tail = entry;
+                tail = &entry->next;
+                count++;
+            }
+        }
+    }
+    sqlite3_finalize(stmt);
+    
+    if (rc == SQLITE_DONE && last_id > 0) {
+        stmt = NULL;
+        rc = sqlite3_prepare_v2(msg_db, "DELETE FROM msg_deadletter WHERE id <= ?1", -1, &stmt, NULL);
+        if (rc == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, last_id);
+            rc = write_step(stmt);
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Dead-letter replay failed, retrying: %s", sqlite3_errmsg(msg_db));
+        write_rollback();
+        free_entries(head);
+        return;
+    }
+    rc = write_commit();
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Dead-letter replay failed, retrying: %s", sqlite3_errstr(rc));
+        free_entries(head);
+        return;
+    }
+    
+    if (head != NULL) {
+        requeue_batch(head, count);
+    }
+    atomic_fetch_add(&deadletters_replayed, (unsigned long long)count);
+    long long rows = atomic_fetch_sub(&deadletter_rows, count) - count;
+    if (last_id == 0 || last_id >= replay_max_id) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Dead-letter replay complete, %lld left", rows > 0 ? rows : 0);
+        replay_max_id = 0;
+    }
+}
+
+// Generate ULID prefix (first 10 chars) from timestamp in milliseconds
+// Used for time-based queries since ULIDs are lexicographically sortable by time
+static void timestamp_to_ulid_prefix(unsigned long long ts_ms, char prefix[11]) {
+    static const char set[] = "0123456789ABCDEFGHJKMNPQRSTVWXYZ";
+    
+    // ULID timestamp is stored in first 6 bytes (48 bits), encoded as 10 base32 chars
+    unsigned char bytes[6];
+    bytes[0] = ts_ms >> 40;
+    bytes[1] = ts_ms >> 32;
+    bytes[2] = ts_ms >> 24;
+    bytes[3] = ts_ms >> 16;
+    bytes[4] = ts_ms >> 8;
+    bytes[5] = ts_ms >> 0;
+    
+    // Encode to base32 (same as ulid_encode but only first 10 chars)
+    prefix[0] = set[bytes[0] >> 5];
+    prefix[1] = set[bytes[0] & 0x1f];
+    prefix[2] = set[bytes[1] >> 3];
+    prefix[3] = set[(bytes[1] << 2 | bytes[2] >> 6) & 0x1f];
+    prefix[4] = set[(bytes[2] >> 1) & 0x1f];
+    prefix[5] = set[(bytes[2] << 4 | bytes[3] >> 4) & 0x1f];
+    prefix[6] = set[(bytes[3] << 1 | bytes[4] >> 7) & 0x1f];
+    prefix[7] = set[(bytes[4] >> 2) & 0x1f];
+    prefix[8] = set[(bytes[4] << 3 | bytes[5] >> 5) & 0x1f];
+    prefix[9] = set[bytes[5] & 0x1f];
+    prefix[10] = '\0';
+}
+
+// Run one retention slice; returns the number of rows deleted (-1 if unknown or on error)
+// Statements take the cutoff as ULID prefix (?1) or in ms (?3), and the slice size as ?2
+static int retention_slice(sqlite3_stmt *stmt, int limit, const char *what) {
+    if (stmt == NULL) {
+        return 0;
+    }
+    if (sqlite3_bind_parameter_count(stmt) >= 3) {
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)retention_cutoff_ms);
+    } else {
+        sqlite3_bind_text(stmt, 1, retention_cutoff, -1, SQLITE_STATIC);
+    }
+    sqlite3_bind_int(stmt, 2, limit);
+    int changes = -1;
+    if (write_step(stmt) == SQLITE_DONE) {
+        changes = write_changes();
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Retention cleanup of %s failed: %s", what, sqlite3_errmsg(msg_db));
+    }
+    sqlite3_reset(stmt);
+    return changes;
+}
+
+// Note the topics of the rows the next retention slice deletes, for the topic tree. The
+// statements select the same rows as the deletes, by the cutoff (?1) and slice size (?2)
+static void retention_forget(sqlite3_stmt *stmt, int limit) {
+    if (stmt == NULL) {
+        return;
+    }
+    sqlite3_bind_text(stmt, 1, retention_cutoff, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, limit);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *topic = (const char *)sqlite3_column_text(stmt, 0);
+        if (topic != NULL) {
+            topic_tree_later(topic, -sqlite3_column_int64(stmt, 1), NULL, -1);
+        }
+    }
+    sqlite3_reset(stmt);
+}
+
+// Whether rows before the cutoff are left after a slice sqld has committed (handoff, which
+// reports no row counts); the local connection reads the same database file
+static int retention_rows_left(void) {
+    char *sql = sqlite3_mprintf("SELECT EXISTS (SELECT 1 FROM \"%w\" WHERE ulid < ?1)%s%s%s", msg_table, 
+                                bucket_retention_stmt != NULL ? " OR EXISTS (SELECT 1 FROM msg_bucket WHERE bucket_end < ?1)" : "", 
+                                payload_retention_stmt != NULL ? " OR EXISTS (SELECT 1 FROM msg_payload WHERE ulid < ?1)" : "", 
+                                metric_retention_stmt != NULL ? " OR EXISTS (SELECT 1 FROM metric WHERE ts < ?2)" : "");
+    sqlite3_stmt *stmt = NULL;
+    // Unknown counts as left, the next worker iteration checks again
+    int left = 1;
+    if (sql != NULL && sqlite3_prepare_v2(msg_db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, retention_cutoff, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)retention_cutoff_ms);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            left = sqlite3_column_int(stmt, 0);
+        }
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+    return left;
+}
+
+// Delete messages older than the retention period (worker thread)
+// The cutoff is taken every RETENTION_CHECK_INTERVAL_SEC (and right after startup); older rows
+// are then deleted in slices of RETENTION_SLICE rows, one transaction per slice, for at most
+// RETENTION_BUDGET_MS per call, so a large backlog never holds up batch writes
+static void cleanup_old_messages(int retention_days) {
+    if (retention_days <= 0 || msg_db == NULL) {
+        retention_pending = 0;
+        return;
+    }
+    // Rows deleted before the topic tree has read them would be taken off it too early
+    if (topic_tree_enabled && atomic_load(&copy_thread_running) && !atomic_load(&topic_tree_loaded)) {
+        return;
+    }
+    
+    time_t now = time(NULL);
+    
+    if (!retention_pending) {
+        // Only take a new cutoff periodically (every RETENTION_CHECK_INTERVAL_SEC)
+        if (now - last_retention_check < RETENTION_CHECK_INTERVAL_SEC) {
+            return;
+        }
+        last_retention_check = now;
+        
+        // Cutoff as ULID prefix
+        unsigned long long cutoff_ms = ((unsigned long long)now - (retention_days * 24 * 60 * 60)) * 1000ULL;
+        timestamp_to_ulid_prefix(cutoff_ms, retention_cutoff);
+        retention_cutoff_ms = cutoff_ms;
+        retention_pending = 1;
+        retention_deleted = 0;
+    }
+    
+    int limit = RETENTION_SLICE;
+    unsigned long long start_ms = platform_utime(1) / 1000;
+    do {
+        if (write_begin() != SQLITE_OK) {
+            // Database busy, continue with the next worker iteration
+            return;
+        }
+        retention_forget(retention_topics_stmt, limit);
+        int deleted = retention_slice(retention_delete_stmt, limit, "messages");
+        // Buckets are removed once their last message is past the cutoff
+        retention_forget(bucket_retention_topics_stmt, limit);
+        int buckets = retention_slice(bucket_retention_stmt, limit, "buckets");
+        // Split layout: payloads are removed by the same ULID range
+        int payloads = retention_slice(payload_retention_stmt, limit, "payloads");
+        // Sparkplug metrics by their own timestamp
+        int metrics = retention_slice(metric_retention_stmt, limit, "metrics");
+        int rc = write_commit();
+        topic_tree_end(rc == SQLITE_OK);
+        if (rc != SQLITE_OK) {
+            return;
+        }
+        
+        // Handoff slices report -1, sqld does not return row counts
+        if (deleted > 0) {
+            retention_deleted += (unsigned long long)deleted;
+        }
+        if (deleted != 0) {
+            payload_gc_pending = 1;
+            vacuum_pending = 1;
+        }
+        int left = handoff_socket != NULL ? retention_rows_left() : 
+                   deleted >= limit || buckets >= limit || payloads >= limit || metrics >= limit;
+        if (!left) {
+            retention_pending = 0;
+            if (retention_deleted > 0) {
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Retention cleanup: deleted %llu messages older than %d days", 
+                                    retention_deleted, retention_days);
+            }
+            break;
+        }
+    } while (platform_utime(1) / 1000 - start_ms < RETENTION_BUDGET_MS);
+}
+
+// Delete messages whose MQTT v5 expiry has passed (worker thread)
+// Runs every EXPIRY_SWEEP_INTERVAL_MS and deletes slices of EXPIRY_SWEEP_SLICE rows, each
+// in its own transaction, until nothing is left or EXPIRY_SWEEP_BUDGET_MS is used up
+static void sweep_expired_messages(void) {
+    if (expiry_select_stmt == NULL) {
+        return;
+    }
+    
+    unsigned long long now_ms = platform_utime(1) / 1000;
+    if (now_ms - last_expiry_sweep_ms < EXPIRY_SWEEP_INTERVAL_MS) {
+        return;
+    }
+    // Like retention, wait until the topic tree has read the stored rows
+    if (topic_tree_enabled && atomic_load(&copy_thread_running) && !atomic_load(&topic_tree_loaded)) {
+        return;
+    }
+    last_expiry_sweep_ms = now_ms;
+    
+    static char ulids[EXPIRY_SWEEP_SLICE][27];
+    static char *topics[EXPIRY_SWEEP_SLICE];  // For the topic tree
+    int total = 0;
+    int count;
+    do {
+        count = 0;
+        sqlite3_bind_int64(expiry_select_stmt, 1, (sqlite3_int64)now_ms);
+        sqlite3_bind_int(expiry_select_stmt, 2, EXPIRY_SWEEP_SLICE);
+        while (count < EXPIRY_SWEEP_SLICE && sqlite3_step(expiry_select_stmt) == SQLITE_ROW) {
+            const char *ulid = (const char *)sqlite3_column_text(expiry_select_stmt, 0);
+            const char *topic = (const char *)sqlite3_column_text(expiry_select_stmt, 1);
+            if (ulid != NULL) {
+                topics[count] = topic_tree_enabled && topic != NULL ? strdup(topic) : NULL;
+                snprintf(ulids[count++], sizeof(ulids[0]), "%s", ulid);
+            }
+        }
+        sqlite3_reset(expiry_select_stmt);
+        if (count == 0) {
+            break;
+        }
+        
+        int began = write_begin() == SQLITE_OK;
+        int deleted = 0;
+        for (int i = 0; i < count; i++) {
+            sqlite3_bind_text(expiry_delete_stmt, 1, ulids[i], -1, SQLITE_STATIC);
+            // The ULID was just read as expired, so an unknown change count (handoff) counts as deleted
+            if (began && write_step(expiry_delete_stmt) == SQLITE_DONE && write_changes() != 0) {
+                delete_payload_row(ulids[i]);
+                if (topics[i] != NULL) {
+                    topic_tree_later(topics[i], -1, NULL, -1);
+                }
+                deleted++;
+            }
+            sqlite3_reset(expiry_delete_stmt);
+            free(topics[i]);
+            topics[i] = NULL;
+        }
+        if (!began) {
+            break;
+        }
+        int rc = write_commit();
+        topic_tree_end(rc == SQLITE_OK);
+        if (rc != SQLITE_OK) {
+            LOG_DEBUG("Expiry sweep: commit failed, retrying with the next sweep");
+            break;
+        }
+        total += deleted;
+    } while (count == EXPIRY_SWEEP_SLICE && platform_utime(1) / 1000 - now_ms < EXPIRY_SWEEP_BUDGET_MS);
+    
+    if (total > 0) {
+        atomic_fetch_add(&expired_deleted, total);
+        payload_gc_pending = 1;
+        LOG_DEBUG("Expiry sweep: deleted %d expired messages", total);
+    }
+}
+
+// Remove one slice of payload blobs that are no longer referenced by any message
+// Runs on the worker thread after deletes until a slice comes back short. Offloaded
+// payload files are unlinked unless they were reused within the grace period, since a
+// reused file may belong to a message that is still queued
+static void collect_payload_garbage(void) {
+    if (payload_gc_stmt == NULL) {
+        return;
+    }
+    if (!payload_gc_pending) {
+        if (payload_gc_retry_at == 0 || time(NULL) < payload_gc_retry_at) {
+            return;
+        }
+        payload_gc_retry_at = 0;
+    }
+    
+    char *err_msg = NULL;
+    if (sqlite3_exec(msg_db, "BEGIN TRANSACTION", NULL, NULL, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Payload blob cleanup failed to begin transaction: %s", err_msg);
+        sqlite3_free(err_msg);
+        return;
+    }
+    
+    int candidates = 0;
+    int removed = 0;
+    int deferred = 0;
+    time_t now = time(NULL);
+    
+    sqlite3_bind_int(payload_gc_stmt, 1, PAYLOAD_GC_BATCH);
+    while (sqlite3_step(payload_gc_stmt) == SQLITE_ROW) {
+        candidates++;
+        const void *hash = sqlite3_column_blob(payload_gc_stmt, 0);
+        int hash_len = sqlite3_column_bytes(payload_gc_stmt, 0);
+        const char *location = (const char *)sqlite3_column_text(payload_gc_stmt, 1);
+        
+        if (location != NULL && offload_dir != NULL) {
+            char path[PATH_MAX];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", offload_dir, location);
+            
+            // The spool thread may reuse the file meanwhile, which refreshes its mtime
+            pthread_mutex_lock(&payload_file_mutex);
+            if (stat(path, &st) == 0 && now - st.st_mtime < OFFLOAD_GC_GRACE_SEC) {
+                pthread_mutex_unlock(&payload_file_mutex);
+                deferred++;
+                continue;
+            }
+            int unlink_errno = unlink(path) != 0 && errno != ENOENT ? errno : 0;
+            pthread_mutex_unlock(&payload_file_mutex);
+            if (unlink_errno != 0) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to remove payload file %s: %s", path, strerror(unlink_errno));
+            }
+        }
+        
+        sqlite3_bind_blob(payload_gc_delete_stmt, 1, hash, hash_len, SQLITE_TRANSIENT);
+        if (sqlite3_step(payload_gc_delete_stmt) == SQLITE_DONE) {
+            removed += sqlite3_changes(msg_db);
+        }
+        sqlite3_reset(payload_gc_delete_stmt);
+    }
+    sqlite3_reset(payload_gc_stmt);
+    
+    if (sqlite3_exec(msg_db, "COMMIT", NULL, NULL, &err_msg) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Payload blob cleanup failed to commit: %s", err_msg);
+        sqlite3_free(err_msg);
+    }
+    
+    if (candidates < PAYLOAD_GC_BATCH || removed == 0) {
+        payload_gc_pending = 0;
+        if (deferred > 0) {
+            payload_gc_retry_at = now + OFFLOAD_GC_GRACE_SEC;
+        }
+    }
+    if (removed > 0) {
+        LOG_DEBUG("Payload blob cleanup: removed %d unreferenced blobs", removed);
+    }
+}
+
+// Page cache arena (SQLITE_CONFIG_PCACHE2)
+//
+// The arena is carved into equal slots when the first cache is created: a page header, the
+// page and SQLite's extra bytes. All caches share the slots; unpinned pages sit on one LRU
+// list and the least recently used one is recycled when no slot is free. Caches created on
+// the copy thread (snapshot and backup copies), of in-memory databases and with larger pages
+// than the slots are passed on to SQLite's default page cache.
+struct arena_cache;
+
+struct arena_page {
+    sqlite3_pcache_page base;       // pBuf and pExtra follow the header
+    struct arena_cache *cache;      // NULL while free
+    unsigned int key;
+    int pinned;
+    int overflow;                   // Allocated with sqlite3_malloc because the arena was full
+    struct arena_page *hash_next;   // Next page in the hash bucket, or on the free list
+    struct arena_page *lru_prev;    // Unpinned pages, most recently used first
+    struct arena_page *lru_next;
+};
+
+struct arena_cache {
+    sqlite3_pcache *delegate;       // Default page cache, NULL when served from the arena
+    struct arena_page **hash;
+    unsigned int hash_size;
+    unsigned int page_count;
+};
+
+static sqlite3_pcache_methods2 default_pcache;
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *arena_base = NULL;
+static size_t arena_bytes = 0;
+static int arena_huge = 0;                  // Mapped with MAP_HUGETLB
+static size_t arena_slot_size = 0;          // Header, page and extra bytes; 0 until the first cache
+static size_t arena_page_size = 0;
+static unsigned int arena_slots = 0;
+static unsigned int arena_free_count = 0;
+static struct arena_page *arena_free = NULL;
+static struct arena_page *arena_lru_head = NULL;
+static struct arena_page *arena_lru_tail = NULL;
+static _Thread_local int arena_bypass = 0;  // Set on threads whose caches stay out of the arena
+
+static void arena_lru_remove(struct arena_page *page) {
+    if (page->lru_prev != NULL) {
+        page->lru_prev->lru_next = page->lru_next;
+    } else {
+        arena_lru_head = page->lru_next;
+    }
+    if (page->lru_next != NULL) {
+        page->lru_next->lru_prev = page->lru_prev;
+    } else {
+        arena_lru_tail = page->lru_prev;
+    }
+    page->lru_prev = page->lru_next = NULL;
+}
+
+static void arena_lru_push(struct arena_page *page) {
+    page->lru_prev = NULL;
+    page->lru_next = arena_lru_head;
+    if (arena_lru_head != NULL) {
+        arena_lru_head->lru_prev = page;
+    } else {
+        arena_lru_tail = page;
+    }
+    arena_lru_head = page;
+}
+
+static struct arena_page *arena_lookup(struct arena_cache *cache, unsigned int key) {
+    struct arena_page *page = cache->hash[key % cache->hash_size];
+    while (page != NULL && page->key != key) {
+        page = page->hash_next;
+    }
+    return page;
+}
+
+static void arena_hash_remove(struct arena_page *page) {
+    struct arena_page **link = &page->cache->hash[page->key % page->cache->hash_size];
+    while (*link != page) {
+        link = &(*link)->hash_next;
+    }
+    *link = page->hash_next;
+    page->hash_next = NULL;
+}
+
+// Double the buckets once the cache holds as many pages; keeps the old table if out of memory
+static void arena_hash_grow(struct arena_cache *cache) {
+    unsigned int size = cache->hash_size * 2;
+    struct arena_page **hash = sqlite3_malloc64(sizeof(*hash) * size);
+    if (hash == NULL) {
+        return;
+    }
+    memset(hash, 0, sizeof(*hash) * size);
+    for (unsigned int b = 0; b < cache->hash_size; b++) {
+        struct arena_page *page = cache->hash[b];
+        while (page != NULL) {
+            struct arena_page *next = page->hash_next;
+            page->hash_next = hash[page->key % size];
+            hash[page->key % size] = page;
+            page = next;
+        }
+    }
+    sqlite3_free(cache->hash);
+    cache->hash = hash;
+    cache->hash_size = size;
+}
+
+// Drop a page from its cache and return its slot (arena_mutex held)
+static void arena_release(struct arena_page *page) {
+    arena_hash_remove(page);
+    if (!page->pinned) {
+        arena_lru_remove(page);
+    }
+    page->cache->page_count--;
+    page->cache = NULL;
+    if (page->overflow) {
+        sqlite3_free(page);
+        return;
+    }
+    page->hash_next = arena_free;
+    arena_free = page;
+    arena_free_count++;
+}
+
+// Carve the arena into slots for the first cache's page size (arena_mutex held)
+static void arena_carve(size_t page_size, size_t extra_size) {
+    arena_page_size = page_size;
+    arena_slot_size = (sizeof(struct arena_page) + page_size + extra_size + 7) & ~(size_t)7;
+    arena_slots = (unsigned int)(arena_bytes / arena_slot_size);
+    for (unsigned int s = arena_slots; s-- > 0;) {
+        struct arena_page *page = (struct arena_page *)(arena_base + (size_t)s * arena_slot_size);
+        page->base.pBuf = (unsigned char *)page + sizeof(struct arena_page);
+        page->base.pExtra = (unsigned char *)page->base.pBuf + page_size;
+        page->hash_next = arena_free;
+        arena_free = page;
+    }
+    arena_free_count = arena_slots;
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Page cache arena: %u pages of %zu bytes", arena_slots, page_size);
+}
+
+// A slot for a new page: a free one, else the least recently used unpinned page; with
+// force, a page outside the arena when every slot is pinned (arena_mutex held)
+static struct arena_page *arena_take(int force) {
+    struct arena_page *page = arena_free;
+    if (page != NULL) {
+        arena_free = page->hash_next;
+        arena_free_count--;
+        return page;
+    }
+    page = arena_lru_tail;
+    if (page != NULL) {
+        arena_release(page);
+        arena_free = page->hash_next;
+        arena_free_count--;
+        atomic_fetch_add_explicit(&pcache_evictions, 1, memory_order_relaxed);
+        return page;
+    }
+    if (!force) {
+        return NULL;
+    }
+    page = sqlite3_malloc64(arena_slot_size);
+    if (page != NULL) {
+        page->base.pBuf = (unsigned char *)page + sizeof(struct arena_page);
+        page->base.pExtra = (unsigned char *)page->base.pBuf + arena_page_size;
+        page->overflow = 1;
+        atomic_fetch_add_explicit(&pcache_overflow, 1, memory_order_relaxed);
+    }
+    return page;
+}
+
+static int arena_init(void *arg) {
+    UNUSED(arg);
+    return default_pcache.xInit != NULL ? default_pcache.xInit(default_pcache.pArg) : SQLITE_OK;
+}
+
+static void arena_shutdown(void *arg) {
+    UNUSED(arg);
+    if (default_pcache.xShutdown != NULL) {
+        default_pcache.xShutdown(default_pcache.pArg);
+    }
+}
+
+static sqlite3_pcache *arena_create(int page_size, int extra_size, int purgeable) {
+    struct arena_cache *cache = sqlite3_malloc64(sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(*cache));
+
+    pthread_mutex_lock(&arena_mutex);
+    if (arena_slot_size == 0 && purgeable && !arena_bypass) {
+        arena_carve((size_t)page_size, (size_t)extra_size);
+    }
+    int in_arena = purgeable && !arena_bypass && arena_slots > 0 &&
+                   sizeof(struct arena_page) + (size_t)page_size + (size_t)extra_size <= arena_slot_size;
+    if (in_arena) {
+        cache->hash = sqlite3_malloc64(sizeof(*cache->hash) * PAGE_CACHE_MIN_HASH);
+        if (cache->hash != NULL) {
+            memset(cache->hash, 0, sizeof(*cache->hash) * PAGE_CACHE_MIN_HASH);
+            cache->hash_size = PAGE_CACHE_MIN_HASH;
+        }
+    } else {
+        cache->delegate = default_pcache.xCreate(page_size, extra_size, purgeable);
+    }
+    if (cache->hash == NULL && cache->delegate == NULL) {
+        pthread_mutex_unlock(&arena_mutex);
+        sqlite3_free(cache);
+        return NULL;
+    }
+    pthread_mutex_unlock(&arena_mutex);
+    return (sqlite3_pcache *)cache;
+}
+
+static void arena_cachesize(sqlite3_pcache *p, int max_pages) {
+    struct arena_cache *cache = (struct arena_cache *)p;
+    // Arena caches are bounded by the arena instead of PRAGMA cache_size
+    if (cache->delegate != NULL) {
+        default_pcache.xCachesize(cache->delegate, max_pages);
+    }
+}
+
+static int arena_pagecount(sqlite3_pcache *p) {
+    struct arena_cache *cache = (struct arena_cache *)p;
+    if (cache->delegate != NULL) {
+        return default_pcache.xPagecount(cache->delegate);
+    }
+    pthread_mutex_lock(&arena_mutex);
+    int count = (int)cache->page_count;
+    pthread_mutex_unlock(&arena_mutex);
+    return count;
+}
+
+static sqlite3_pcache_page *arena_fetch(sqlite3_pcache *p, unsigned int key, int create) {
+    struct arena_cache *cache = (struct arena_cache *)p;
+    if (cache->delegate != NULL) {
+        return default_pcache.xFetch(cache->delegate, key, create);
+    }
+
+    pthread_mutex_lock(&arena_mutex);
+    struct arena_page *page = arena_lookup(cache, key);
+    if (page != NULL) {
+        if (!page->pinned) {
+            arena_lru_remove(page);
+            page->pinned = 1;
+        }
+        atomic_fetch_add_explicit(&pcache_hits, 1, memory_order_relaxed);
+    } else if (create != 0) {
+        page = arena_take(create == 2);
+        if (page != NULL) {
+            page->cache = cache;
+            page->key = key;
+            page->pinned = 1;
+            page->hash_next = cache->hash[key % cache->hash_size];
+            cache->hash[key % cache->hash_size] = page;
+            // SQLite expects the extra bytes of a new page to be zeroed
+            memset(page->base.pExtra, 0, arena_slot_size - sizeof(struct arena_page) - arena_page_size);
+            if (++cache->page_count > cache->hash_size) {
+                arena_hash_grow(cache);
+            }
+            atomic_fetch_add_explicit(&pcache_misses, 1, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&arena_mutex);
+    return page != NULL ? &page->base : NULL;
+}
+
+static void arena_unpin(sqlite3_pcache *p, sqlite3_pcache_page *pg, int discard) {
+    struct arena_cache *cache = (struct arena_cache *)p;
+    if (cache->delegate != NULL) {
+        default_pcache.xUnpin(cache->delegate, pg, discard);
+        return;
+    }
+
+    struct arena_page *page = (struct arena_page *)pg;
+    pthread_mutex_lock(&arena_mutex);
+    // Pages outside the arena are given back right away, SQLite may lose any unpinned page
+    if (discard || page->overflow) {
+        arena_release(page);
+    } else {
+        page->pinned = 0;
+        arena_lru_push(page);
+    }
+    pthread_mutex_unlock(&arena_mutex);
+}
+
+static void arena_rekey(sqlite3_pcache *p, sqlite3_pcache_page *pg, unsigned int old_key, unsigned int new_key) {
+    struct arena_cache *cache = (struct arena_cache *)p;
+    if (cache->delegate != NULL) {
+        default_pcache.xRekey(cache->delegate, pg, old_key, new_key);
+        return;
+    }
+
+    struct arena_page *page = (struct arena_page *)pg;
+    pthread_mutex_lock(&arena_mutex);
+    arena_hash_remove(page);
+    struct arena_page *existing = arena_lookup(cache, new_key);
+    if (existing != NULL) {
+        arena_release(existing);
+    }
+    page->key = new_key;
+    page->hash_next = cache->hash[new_key % cache->hash_size];
+    cache->hash[new_key % cache->hash_size] = page;
+    pthread_mutex_unlock(&arena_mutex);
+}
+
+// Drop every page with key >= limit, or only the unpinned pages (xShrink)
+static void arena_drop_pages(struct arena_cache *cache, unsigned int limit, int unpinned_only) {
+    pthread_mutex_lock(&arena_mutex);
+    for (unsigned int b = 0; b < cache->hash_size; b++) {
+        struct arena_page *page = cache->hash[b];
+        while (page != NULL) {
+            struct arena_page *next = page->hash_next;
+            if (page->key >= limit && (!unpinned_only || !page->pinned)) {
+                arena_release(page);
+            }
+            page = next;
+        }
+    }
+    pthread_mutex_unlock(&arena_mutex);
+}
+
+static void arena_truncate(sqlite3_pcache *p, unsigned int limit) {
+    struct arena_cache *cache = (struct arena_cache *)p;
+    if (cache->delegate != NULL) {
+        default_pcache.xTruncate(cache->delegate, limit);
+        return;
+    }
+    arena_drop_pages(cache, limit, 0);
+}
+
+static void arena_shrink(sqlite3_pcache *p) {
+    struct arena_cache *cache = (struct arena_cache *)p;
+    if (cache->delegate != NULL) {
+        default_pcache.xShrink(cache->delegate);
+        return;
+    }
+    arena_drop_pages(cache, 0, 1);
+}
+
+static void arena_destroy(sqlite3_pcache *p) {
+    struct arena_cache *cache = (struct arena_cache *)p;
+    if (cache->delegate != NULL) {
+        default_pcache.xDestroy(cache->delegate);
+    } else {
+        arena_drop_pages(cache, 0, 0);
+        sqlite3_free(cache->hash);
+    }
+    sqlite3_free(cache);
+}
+
+static const sqlite3_pcache_methods2 arena_pcache = {
+    .iVersion = 1,
+    .xInit = arena_init,
+    .xShutdown = arena_shutdown,
+    .xCreate = arena_create,
+    .xCachesize = arena_cachesize,
+    .xPagecount = arena_pagecount,
+    .xFetch = arena_fetch,
+    .xUnpin = arena_unpin,
+    .xRekey = arena_rekey,
+    .xTruncate = arena_truncate,
+    .xDestroy = arena_destroy,
+    .xShrink = arena_shrink,
+};
+
+// Map the arena and configure it as SQLite's page cache; has to run before the first
+// connection is opened, SQLite refuses configuration changes once initialized
+static void init_page_cache(void) {
+    if (page_cache_installed) {
+        return;
+    }
+    void *base = MAP_FAILED;
+    size_t bytes = (size_t)page_cache_size;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+#ifdef MAP_HUGETLB
+    if (page_cache_huge_pages) {
+        size_t huge_bytes = (bytes + PAGE_CACHE_HUGE_PAGE - 1) / PAGE_CACHE_HUGE_PAGE * PAGE_CACHE_HUGE_PAGE;
+        base = mmap(NULL, huge_bytes, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            bytes = huge_bytes;
+            arena_huge = 1;
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "No huge pages available for the page cache (%s), using normal pages",
+                                strerror(errno));
+        }
+    }
+#endif
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (base == MAP_FAILED) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to map %zu bytes for the page cache: %s", bytes, strerror(errno));
+            return;
+        }
+#ifdef MADV_HUGEPAGE
+        // Transparent huge pages, where the kernel has them enabled for madvise
+        if (page_cache_huge_pages) {
+            madvise(base, bytes, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    if (sqlite3_config(SQLITE_CONFIG_GETPCACHE2, &default_pcache) != SQLITE_OK ||
+        sqlite3_config(SQLITE_CONFIG_PCACHE2, &arena_pcache) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "SQLite is already in use in this process, page cache arena not used");
+        munmap(base, bytes);
+        arena_huge = 0;
+        return;
+    }
+    arena_base = base;
+    arena_bytes = bytes;
+    page_cache_installed = 1;
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Page cache arena of %zu bytes%s", bytes, arena_huge ? " on huge pages" : "");
+}
+
+// Dedicated SQLite heap (SQLITE_CONFIG_MALLOC)
+//
+// A binary buddy allocator like SQLite's memsys5, which SQLITE_CONFIG_HEAP needs but which
+// is rarely compiled into the system library. Blocks are SQLITE_HEAP_ATOM << n bytes; the
+// mapping holds the blocks followed by one control byte per atom (size and free flag of the
+// block starting there). Free blocks are kept in one list per size, linked through their
+// first bytes, and merged with their buddy when both are free.
+#define HEAP_CTRL_FREE 0x20
+#define HEAP_CTRL_LOGSIZE 0x1f
+
+struct heap_link {
+    int next;                       // Atom index of the next free block of this size, -1 = end
+    int prev;
+};
+
+static sqlite3_mem_methods default_mem;
+static pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *heap_base = NULL;
+static size_t heap_bytes = 0;
+static unsigned char *heap_ctrl = NULL;
+static int heap_atoms = 0;
+static int heap_free_lists[SQLITE_HEAP_LOGMAX + 1];
+static unsigned long long heap_used = 0;    // Bytes in allocated blocks
+static unsigned long long heap_live = 0;    // Allocated blocks
+static time_t last_heap_trim = 0;
+
+static struct heap_link *heap_link_at(int block) {
+    return (struct heap_link *)(heap_base + (size_t)block * SQLITE_HEAP_ATOM);
+}
+
+static void heap_link_block(int block, int logsize) {
+    struct heap_link *link = heap_link_at(block);
+    link->prev = -1;
+    link->next = heap_free_lists[logsize];
+    if (link->next >= 0) {
+        heap_link_at(link->next)->prev = block;
+    }
+    heap_free_lists[logsize] = block;
+}
+
+static void heap_unlink_block(int block, int logsize) {
+    struct heap_link *link = heap_link_at(block);
+    if (link->prev >= 0) {
+        heap_link_at(link->prev)->next = link->next;
+    } else {
+        heap_free_lists[logsize] = link->next;
+    }
+    if (link->next >= 0) {
+        heap_link_at(link->next)->prev = link->prev;
+    }
+}
+
+// Smallest n with SQLITE_HEAP_ATOM << n >= size, -1 if larger than the largest block
+static int heap_logsize(long long size) {
+    int logsize = 0;
+    while (((long long)SQLITE_HEAP_ATOM << logsize) < size) {
+        if (++logsize > SQLITE_HEAP_LOGMAX) {
+            return -1;
+        }
+    }
+    return logsize;
+}
+
+static int heap_contains(const void *p) {
+    return heap_base != NULL && (const unsigned char *)p >= heap_base &&
+           (const unsigned char *)p < heap_base + (size_t)heap_atoms * SQLITE_HEAP_ATOM;
+}
+
+static void *heap_malloc(int size) {
+    void *p = NULL;
+    int logsize = heap_logsize(size);
+    if (logsize >= 0) {
+        pthread_mutex_lock(&heap_mutex);
+        int bin = logsize;
+        while (bin <= SQLITE_HEAP_LOGMAX && heap_free_lists[bin] < 0) {
+            bin++;
+        }
+        if (bin <= SQLITE_HEAP_LOGMAX) {
+            int block = heap_free_lists[bin];
+            heap_unlink_block(block, bin);
+            // Split off the upper halves until the block has the requested size
+            while (bin > logsize) {
+                bin--;
+                int buddy = block + (1 << bin);
+                heap_ctrl[buddy] = (unsigned char)(HEAP_CTRL_FREE | bin);
+                heap_link_block(buddy, bin);
+            }
+            heap_ctrl[block] = (unsigned char)logsize;
+            heap_used += (unsigned long long)SQLITE_HEAP_ATOM << logsize;
+            heap_live++;
+            p = heap_link_at(block);
+        }
+        pthread_mutex_unlock(&heap_mutex);
+    }
+    if (p == NULL) {
+        p = default_mem.xMalloc(size);
+        if (p != NULL) {
+            atomic_fetch_add_explicit(&heap_fallbacks, 1, memory_order_relaxed);
+        }
+    }
+    return p;
+}
+
+static void heap_free(void *p) {
+    if (!heap_contains(p)) {
+        default_mem.xFree(p);
+        return;
+    }
+    pthread_mutex_lock(&heap_mutex);
+    int block = (int)(((unsigned char *)p - heap_base) / SQLITE_HEAP_ATOM);
+    int logsize = heap_ctrl[block] & HEAP_CTRL_LOGSIZE;
+    heap_used -= (unsigned long long)SQLITE_HEAP_ATOM << logsize;
+    heap_live--;
+    while (logsize < SQLITE_HEAP_LOGMAX) {
+        int size = 1 << logsize;
+        int buddy = ((block >> logsize) & 1) ? block - size : block + size;
+        if (buddy + size > heap_atoms || heap_ctrl[buddy] != (HEAP_CTRL_FREE | logsize)) {
+            break;
+        }
+        heap_unlink_block(buddy, logsize);
+        // The upper half stops being a block of its own
+        if (buddy < block) {
+            heap_ctrl[block] = 0;
+            block = buddy;
+        } else {
+            heap_ctrl[buddy] = 0;
+        }
+        logsize++;
+    }
+    heap_ctrl[block] = (unsigned char)(HEAP_CTRL_FREE | logsize);
+    heap_link_block(block, logsize);
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+static int heap_size(void *p) {
+    if (p == NULL) {
+        return 0;
+    }
+    if (!heap_contains(p)) {
+        return default_mem.xSize(p);
+    }
+    int block = (int)(((unsigned char *)p - heap_base) / SQLITE_HEAP_ATOM);
+    return SQLITE_HEAP_ATOM << (heap_ctrl[block] & HEAP_CTRL_LOGSIZE);
+}
+
+static void *heap_realloc(void *p, int size) {
+    if (!heap_contains(p)) {
+        return default_mem.xRealloc(p, size);
+    }
+    int old_size = heap_size(p);
+    if (size <= old_size) {
+        return p;
+    }
+    void *q = heap_malloc(size);
+    if (q != NULL) {
+        memcpy(q, p, (size_t)old_size);
+        heap_free(p);
+    }
+    return q;
+}
+
+static int heap_roundup(int size) {
+    int logsize = heap_logsize(size);
+    if (logsize < 0 || ((size_t)SQLITE_HEAP_ATOM << logsize) > heap_bytes) {
+        return default_mem.xRoundup(size);
+    }
+    return SQLITE_HEAP_ATOM << logsize;
+}
+
+static int heap_init(void *arg) {
+    UNUSED(arg);
+    return default_mem.xInit(default_mem.pAppData);
+}
+
+static void heap_shutdown(void *arg) {
+    UNUSED(arg);
+    default_mem.xShutdown(default_mem.pAppData);
+}
+
+static const sqlite3_mem_methods heap_mem = {
+    .xMalloc = heap_malloc,
+    .xFree = heap_free,
+    .xRealloc = heap_realloc,
+    .xSize = heap_size,
+    .xRoundup = heap_roundup,
+    .xInit = heap_init,
+    .xShutdown = heap_shutdown,
+    .pAppData = NULL,
+};
+
+// Map the heap and configure it as SQLite's allocator; like the page cache this has to run
+// before the first connection. Pages of the mapping are only backed once they are used
+static void init_sqlite_heap(void) {
+    if (sqlite_heap_installed) {
+        return;
+    }
+    size_t bytes = (size_t)sqlite_heap_size;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    void *base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (base == MAP_FAILED) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to map %zu bytes for the SQLite heap: %s", bytes, strerror(errno));
+        return;
+    }
+
+    // Carve the atoms into the largest aligned blocks, so every block's buddy is aligned too
+    heap_base = base;
+    heap_bytes = bytes;
+    heap_atoms = (int)(bytes / (SQLITE_HEAP_ATOM + 1) < INT_MAX ? bytes / (SQLITE_HEAP_ATOM + 1) : INT_MAX);
+    heap_ctrl = heap_base + (size_t)heap_atoms * SQLITE_HEAP_ATOM;
+    for (int logsize = 0; logsize <= SQLITE_HEAP_LOGMAX; logsize++) {
+        heap_free_lists[logsize] = -1;
+    }
+    int offset = 0;
+    for (int logsize = SQLITE_HEAP_LOGMAX; logsize >= 0; logsize--) {
+        while (heap_atoms - offset >= (1 << logsize)) {
+            heap_ctrl[offset] = (unsigned char)(HEAP_CTRL_FREE | logsize);
+            heap_link_block(offset, logsize);
+            offset += 1 << logsize;
+        }
+    }
+    heap_used = 0;
+    heap_live = 0;
+
+    if (sqlite3_config(SQLITE_CONFIG_GETMALLOC, &default_mem) != SQLITE_OK ||
+        sqlite3_config(SQLITE_CONFIG_MALLOC, &heap_mem) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "SQLite is already in use in this process, dedicated heap not used");
+        munmap(base, bytes);
+        heap_base = NULL;
+        return;
+    }
+    sqlite_heap_installed = 1;
+    mosquitto_log_printf(MOSQ_LOG_INFO, "SQLite heap of %zu bytes", bytes);
+}
+
+// Give the pages of large free blocks back to the OS; the first page of each block keeps its
+// free list link. Runs on the worker thread every SQLITE_HEAP_TRIM_INTERVAL_SEC
+static void trim_sqlite_heap(void) {
+    time_t now = time(NULL);
+    if (!sqlite_heap_installed || now - last_heap_trim < SQLITE_HEAP_TRIM_INTERVAL_SEC) {
+        return;
+    }
+    last_heap_trim = now;
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    pthread_mutex_lock(&heap_mutex);
+    for (int logsize = SQLITE_HEAP_LOGMAX; logsize >= 0 && ((size_t)SQLITE_HEAP_ATOM << logsize) >= SQLITE_HEAP_TRIM_MIN; logsize--) {
+        for (int block = heap_free_lists[logsize]; block >= 0; block = heap_link_at(block)->next) {
+            uintptr_t start = ((uintptr_t)heap_link_at(block) + sizeof(struct heap_link) + page - 1) & ~(page - 1);
+            uintptr_t end = ((uintptr_t)heap_link_at(block) + ((size_t)SQLITE_HEAP_ATOM << logsize)) & ~(page - 1);
+            if (end > start) {
+                madvise((void *)start, end - start, MADV_DONTNEED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+// Give SQLite its default page cache and allocator back and unmap the arena and heap. Only
+// possible once SQLite holds no memory, i.e. every connection is closed; otherwise both stay
+static void release_sqlite_memory(void) {
+    if (!page_cache_installed && !sqlite_heap_installed) {
+        return;
+    }
+    sqlite3_int64 used = 0;
+    sqlite3_int64 highwater = 0;
+    sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &used, &highwater, 0);
+    if (used > 0) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "SQLite page cache arena and heap kept, %lld bytes still allocated", 
+                            (long long)used);
+        return;
+    }
+    if (sqlite_heap_installed) {
+        sqlite3_soft_heap_limit64(0);
+    }
+    sqlite3_shutdown();
+
+    if (page_cache_installed) {
+        sqlite3_config(SQLITE_CONFIG_PCACHE2, &default_pcache);
+        munmap(arena_base, arena_bytes);
+        arena_base = NULL;
+        arena_bytes = 0;
+        arena_huge = 0;
+        arena_slot_size = 0;
+        arena_page_size = 0;
+        arena_slots = 0;
+        arena_free_count = 0;
+        arena_free = NULL;
+        arena_lru_head = arena_lru_tail = NULL;
+        page_cache_installed = 0;
+    }
+    if (sqlite_heap_installed) {
+        sqlite3_config(SQLITE_CONFIG_MALLOC, &default_mem);
+        munmap(heap_base, heap_bytes);
+        heap_base = NULL;
+        heap_bytes = 0;
+        heap_ctrl = NULL;
+        heap_atoms = 0;
+        sqlite_heap_installed = 0;
+    }
+}
+
+// Value of an integer PRAGMA on msg_db, -1 on error
+static long long pragma_int(const char *sql) {
+    sqlite3_stmt *stmt = NULL;
+    long long value = -1;
+    if (sqlite3_prepare_v2(msg_db, sql, -1, &stmt, NULL) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+static int queue_is_empty(void) {
+    pthread_mutex_lock(&queue_mutex);
+    int empty = msg_queue_size == 0;
+    pthread_mutex_unlock(&queue_mutex);
+    return empty;
+}
+
+// Release free pages in slices of VACUUM_SLICE_PAGES while no messages are waiting, for at
+// most VACUUM_BUDGET_MS per call (worker thread). Runs after deletes and every
+// VACUUM_CHECK_INTERVAL_SEC, which also refreshes the free-page metrics
+static void reclaim_free_pages(void) {
+    time_t now = time(NULL);
+    if (msg_db == NULL || (!vacuum_pending && now - last_vacuum_check < VACUUM_CHECK_INTERVAL_SEC)) {
+        return;
+    }
+    if (!queue_is_empty()) {
+        return;
+    }
+    last_vacuum_check = now;
+    vacuum_pending = 0;
+    
+    unsigned long long start_ms = platform_utime(1) / 1000;
+    for (;;) {
+        long long pages = pragma_int("PRAGMA page_count");
+        long long free_pages = pragma_int("PRAGMA freelist_count");
+        if (pages < 0 || free_pages < 0) {
+            return;
+        }
+        atomic_store(&db_page_count, (unsigned long long)pages);
+        atomic_store(&db_free_pages, (unsigned long long)free_pages);
+        
+        // sqld is the only writer in handoff mode
+        if (!auto_vacuum_incremental || handoff_socket != NULL || free_pages <= VACUUM_KEEP_FREE_PAGES) {
+            return;
+        }
+        if (platform_utime(1) / 1000 - start_ms >= VACUUM_BUDGET_MS || !queue_is_empty()) {
+            // Continue with the next idle iteration
+            vacuum_pending = 1;
+            return;
+        }
+        
+        long long slice = free_pages - VACUUM_KEEP_FREE_PAGES;
+        if (slice > VACUUM_SLICE_PAGES) {
+            slice = VACUUM_SLICE_PAGES;
+        }
+        char sql[64];
+        snprintf(sql, sizeof(sql), "PRAGMA incremental_vacuum(%lld)", slice);
+        int rc = sqlite3_exec(msg_db, sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {
+            if (!is_transient_error(rc)) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Incremental vacuum failed: %s", sqlite3_errmsg(msg_db));
+            }
+            vacuum_pending = 1;
+            return;
+        }
+        atomic_fetch_add(&vacuum_pages_released, (unsigned long long)slice);
+    }
+}
+
+// Queries the admin UI sends to sqld, written the same way (literal values)
+static const struct {
+    const char *name;
+    const char *sql;
+} canonical_queries[] = {
+    {"count",        "SELECT COUNT(*) FROM msg LIMIT 1"},
+    {"recent",       "SELECT topic, payload, ulid FROM msg ORDER BY ulid DESC LIMIT 100"},
+    {"since",        "SELECT topic, payload, ulid FROM msg WHERE ulid >= '01J0000000' ORDER BY ulid DESC LIMIT 100"},
+    {"topic",        "SELECT topic, payload, ulid FROM msg WHERE topic = 'a/b' ORDER BY ulid DESC LIMIT 100"},
+    {"topic_since",  "SELECT topic, payload, ulid FROM msg WHERE topic = 'a/b' AND ulid >= '01J0000000' "
+                     "ORDER BY ulid DESC LIMIT 100"},
+    {"topic_like",   "SELECT topic, payload, ulid FROM msg WHERE topic LIKE 'a/%' ORDER BY ulid DESC LIMIT 100"},
+};
+
+static int optimize_progress(void *deadline_ms) {
+    return platform_utime(1) / 1000 >= *(unsigned long long *)deadline_ms;
+}
+
+// EXPLAIN QUERY PLAN details of sql joined into one line, NULL on error (free with sqlite3_free)
+static char *query_plan_text(const char *sql) {
+    sqlite3_stmt *stmt = NULL;
+    char *explain = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+    if (explain == NULL) {
+        return NULL;
+    }
+    int rc = sqlite3_prepare_v2(msg_db, explain, -1, &stmt, NULL);
+    sqlite3_free(explain);
+    if (rc != SQLITE_OK) {
+        return NULL;
+    }
+
+    sqlite3_str *plan = sqlite3_str_new(msg_db);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_str_length(plan) > 0) {
+            sqlite3_str_appendall(plan, "; ");
+        }
+        sqlite3_str_appendall(plan, (const char *)sqlite3_column_text(stmt, 3));
+    }
+    sqlite3_finalize(stmt);
+    return sqlite3_str_finish(plan);
+}
+
+// Compare the plans of the canonical queries with the ones recorded in query_plan and record
+// the new ones. A change after fresh statistics (or a layout migration) is logged, since it
+// can move admin query latency by orders of magnitude
+// The table and the recorded plans are written through the write path (sqld with the handoff)
+static void check_query_plans(void) {
+    sqlite3_stmt *select = NULL;
+    sqlite3_stmt *upsert = NULL;
+
+    int rc = write_begin();
+    if (rc == SQLITE_OK) {
+        rc = write_sql("CREATE TABLE IF NOT EXISTS query_plan(name text primary key, plan text not null, "
+                       "checked_at integer not null, changed_at integer not null)");
+        if (rc == SQLITE_OK) {
+            rc = write_commit();
+        } else {
+            write_rollback();
+        }
+    }
+    if (rc != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "SELECT plan FROM query_plan WHERE name = ?1", -1, &select, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db,
+            "INSERT INTO query_plan (name, plan, checked_at, changed_at) VALUES (?1, ?2, ?3, ?3) "
+            "ON CONFLICT(name) DO UPDATE SET checked_at = excluded.checked_at, "
+            "changed_at = CASE WHEN plan = excluded.plan THEN changed_at ELSE excluded.changed_at END, "
+            "plan = excluded.plan", -1, &upsert, NULL) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Query plan check failed: %s", sqlite3_errmsg(msg_db));
+        sqlite3_finalize(select);
+        return;
+    }
+
+    sqlite3_int64 now = (sqlite3_int64)time(NULL);
+    if (write_begin() != SQLITE_OK) {
+        sqlite3_finalize(select);
+        sqlite3_finalize(upsert);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(canonical_queries) / sizeof(canonical_queries[0]); i++) {
+        char *plan = query_plan_text(canonical_queries[i].sql);
+        if (plan == NULL) {
+            continue;
+        }
+
+        sqlite3_bind_text(select, 1, canonical_queries[i].name, -1, SQLITE_STATIC);
+        if (sqlite3_step(select) == SQLITE_ROW) {
+            const char *old_plan = (const char *)sqlite3_column_text(select, 0);
+            if (strcmp(old_plan, plan) != 0) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Query plan of '%s' changed: %s (was: %s)",
+                                    canonical_queries[i].name, plan, old_plan);
+                atomic_fetch_add(&plan_changes, 1);
+            }
+        }
+        sqlite3_reset(select);
+
+        sqlite3_bind_text(upsert, 1, canonical_queries[i].name, -1, SQLITE_STATIC);
+        sqlite3_bind_text(upsert, 2, plan, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(upsert, 3, now);
+        write_step(upsert);
+        sqlite3_reset(upsert);
+        sqlite3_free(plan);
+    }
+    write_commit();
+    sqlite3_finalize(select);
+    sqlite3_finalize(upsert);
+}
+
+// Refresh the planner statistics every optimize_interval_sec while the queue is empty (worker
+// thread). Tables without statistics are analyzed first, everything else is left to
+// PRAGMA optimize; analysis_limit and a progress handler keep the run within
+// OPTIMIZE_BUDGET_MS. With the handoff sqld runs the same statements as a write script, where
+// only analysis_limit bounds the run. An interrupted or busy run is rolled back and retried
+// after OPTIMIZE_RETRY_SEC
+static void optimize_database(void) {
+    time_t now = time(NULL);
+    if (msg_db == NULL || optimize_interval_sec <= 0 || now < next_optimize || !queue_is_empty()) {
+        return;
+    }
+
+    unsigned long long start_ms = platform_utime(1) / 1000;
+    unsigned long long deadline_ms = start_ms + OPTIMIZE_BUDGET_MS;
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA analysis_limit=%d", OPTIMIZE_ANALYSIS_LIMIT);
+    sqlite3_exec(msg_db, sql, NULL, NULL, NULL);
+
+    // sqlite_stat1 only exists after the first ANALYZE
+    int analyzed = 0;
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(msg_db, "SELECT 1 FROM sqlite_stat1 WHERE tbl = ?1", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, msg_table, -1, SQLITE_STATIC);
+        analyzed = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+
+    char *analyze = analyzed ? NULL : sqlite3_mprintf("ANALYZE \"%w\"", msg_table);
+    int rc = analyzed || analyze != NULL ? SQLITE_OK : SQLITE_NOMEM;
+    if (rc == SQLITE_OK && handoff_socket != NULL) {
+        rc = write_begin();
+        if (rc == SQLITE_OK) {
+            rc = write_sql(sql);
+            if (rc == SQLITE_OK && analyze != NULL) {
+                rc = write_sql(analyze);
+            }
+            if (rc == SQLITE_OK) {
+                rc = write_sql("PRAGMA optimize");
+            }
+            if (rc == SQLITE_OK) {
+                rc = write_commit();
+            } else {
+                write_rollback();
+            }
+        }
+    } else if (rc == SQLITE_OK) {
+        sqlite3_progress_handler(msg_db, 1000, optimize_progress, &deadline_ms);
+        if (analyze != NULL) {
+            rc = sqlite3_exec(msg_db, analyze, NULL, NULL, NULL);
+        }
+        if (rc == SQLITE_OK) {
+            rc = sqlite3_exec(msg_db, "PRAGMA optimize", NULL, NULL, NULL);
+        }
+        sqlite3_progress_handler(msg_db, 0, NULL, NULL);
+    }
+    sqlite3_free(analyze);
+
+    if (rc != SQLITE_OK) {
+        if (rc == SQLITE_INTERRUPT) {
+            LOG_DEBUG("ANALYZE exceeded %dms, continuing later", OPTIMIZE_BUDGET_MS);
+        } else if (!is_transient_error(rc)) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "PRAGMA optimize failed: %s", 
+                                handoff_socket != NULL ? sqlite3_errstr(rc) : sqlite3_errmsg(msg_db));
+        }
+        next_optimize = now + (optimize_interval_sec < OPTIMIZE_RETRY_SEC ? optimize_interval_sec : OPTIMIZE_RETRY_SEC);
+        return;
+    }
+    next_optimize = now + optimize_interval_sec;
+    atomic_fetch_add(&optimize_runs, 1);
+    atomic_store(&optimize_duration_ms, platform_utime(1) / 1000 - start_ms);
+
+    check_query_plans();
+}
+
+// Copy the database into the file at path with the online backup API, a few pages per step.
+// The copy is the snapshot pinned when it starts: rows committed later (worker or sqld) are
+// not in it and do not restart it. progress_pct (optional) follows the copied pages, scaled
+// to progress_max. Returns SQLITE_DONE when the copy is complete and stores its size in *pages
+static int copy_database(const char *path, atomic_int *progress_pct, int progress_max, int *pages) {
+    if (msg_db == NULL) {
+        return SQLITE_CANTOPEN;
+    }
+    // Own read-only connection, one read transaction for the whole copy
+    sqlite3 *src = NULL;
+    if (sqlite3_open_v2(DB_PATH, &src, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+        sqlite3_exec(src, "BEGIN; SELECT count(*) FROM sqlite_master", NULL, NULL, NULL) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Can't read the database for a copy: %s", sqlite3_errmsg(src));
+        sqlite3_close(src);
+        return SQLITE_CANTOPEN;
+    }
+    sqlite3 *dest = NULL;
+    if (sqlite3_open(path, &dest) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Can't open %s: %s", path, sqlite3_errmsg(dest));
+        sqlite3_close(dest);
+        sqlite3_close(src);
+        return SQLITE_CANTOPEN;
+    }
+    // Readers of the copy (sqld) may briefly hold its write lock
+    sqlite3_busy_timeout(dest, BUSY_SLEEP_MAX_MS);
+    
+    sqlite3_backup *backup = sqlite3_backup_init(dest, "main", src, "main");
+    if (backup == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Backup of the database to %s failed to start: %s", path, sqlite3_errmsg(dest));
+        sqlite3_close(dest);
+        sqlite3_close(src);
+        return SQLITE_ERROR;
+    }
+    
+    int rc;
+    int busy_steps = 0;
+    do {
+        rc = sqlite3_backup_step(backup, COPY_STEP_PAGES);
+        if (is_transient_error(rc)) {
+            if (++busy_steps > COPY_MAX_BUSY_STEPS) {
+                break;
+            }
+        } else if (rc != SQLITE_OK) {
+            break;
+        }
+        if (progress_pct != NULL) {
+            int total = sqlite3_backup_pagecount(backup);
+            int done = total - sqlite3_backup_remaining(backup);
+            atomic_store(progress_pct, total > 0 ? (int)((long long)done * progress_max / total) : progress_max);
+        }
+        if (rc == SQLITE_DONE) {
+            break;
+        }
+        usleep(COPY_STEP_PAUSE_MS * 1000);
+    } while (atomic_load(&copy_thread_running));
+    
+    *pages = sqlite3_backup_pagecount(backup);
+    sqlite3_backup_finish(backup);
+    sqlite3_exec(src, "COMMIT", NULL, NULL, NULL);
+    sqlite3_close(src);
+    
+    if (rc == SQLITE_DONE) {
+        // A WAL-mode copy went through its WAL; fold it back so the file stays one copy
+        sqlite3_exec(dest, "PRAGMA wal_checkpoint(TRUNCATE)", NULL, NULL, NULL);
+    }
+    sqlite3_close(dest);
+    return rc;
+}
+
+// Refresh the read snapshot; an interrupted or failed refresh keeps the previous copy
+static void refresh_snapshot(const char *path) {
+    unsigned long long start_ms = platform_utime(1) / 1000;
+    int pages = 0;
+    int rc = copy_database(path, NULL, 0, &pages);
+    
+    if (rc == SQLITE_DONE) {
+        unsigned long long duration_ms = platform_utime(1) / 1000 - start_ms;
+        atomic_store(&snapshot_duration_ms, duration_ms);
+        atomic_store(&snapshot_pages, (unsigned long long)pages);
+        atomic_store(&snapshot_completed_at, (long long)time(NULL));
+        atomic_fetch_add(&snapshot_refreshes, 1);
+        LOG_DEBUG("Snapshot refreshed: %d pages in %llums", pages, duration_ms);
+    } else if (atomic_load(&copy_thread_running)) {
+        atomic_fetch_add(&snapshot_failures, 1);
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Snapshot refresh failed: %s", 
+                            is_transient_error(rc) ? "database busy" : sqlite3_errstr(rc));
+    }
+}
+
+// gzip src into dst; progress_pct moves from its current value to 100 with the input read.
+// With consume, the compressed part of src is freed on the way (hole punching where the
+// file system supports it), so src and dst together need little more than the size of src
+// Returns 0 on success
+static int compress_file(const char *src, const char *dst, atomic_int *progress_pct, int consume) {
+    int fd = open(src, (consume ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Can't read %s: %s", src, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    off_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    int start_pct = atomic_load(progress_pct);
+    
+    gzFile out = gzopen(dst, "wb" BACKUP_GZIP_LEVEL);
+    if (out == NULL) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Can't create %s: %s", dst, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    
+    static char buf[BACKUP_CHUNK_SIZE];  // Copy thread only
+    off_t done = 0;
+    ssize_t n;
+    int rc = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (gzwrite(out, buf, (unsigned)n) != (int)n) {
+            rc = 1;
+            break;
+        }
+#if defined(SYS_fallocate) && defined(FALLOC_FL_PUNCH_HOLE)
+        if (consume && syscall(SYS_fallocate, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, done, (off_t)n) != 0) {
+            LOG_DEBUG("Can't free compressed part of %s: %s", src, strerror(errno));
+            consume = 0;
+        }
+#endif
+        done += n;
+        if (size > 0) {
+            atomic_store(progress_pct, start_pct + (int)((100 - start_pct) * done / size));
+        }
+        if (!atomic_load(&copy_thread_running)) {
+            rc = 1;
+            break;
+        }
+    }
+    if (n < 0) {
+        rc = 1;
+    }
+    close(fd);
+    if (gzclose(out) != Z_OK) {
+        rc = 1;
+    }
+    if (rc != 0 && atomic_load(&copy_thread_running)) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to compress backup %s", dst);
+    }
+    return rc;
+}
+
+static int is_backup_file(const struct dirent *entry) {
+    size_t len = strlen(entry->d_name);
+    return strncmp(entry->d_name, BACKUP_PREFIX, strlen(BACKUP_PREFIX)) == 0 && 
+           len > strlen(BACKUP_SUFFIX) && strcmp(entry->d_name + len - strlen(BACKUP_SUFFIX), BACKUP_SUFFIX) == 0;
+}
+
+// Remove the oldest backups beyond backup_keep (names sort by their timestamp)
+static void prune_backups(void) {
+    if (backup_keep <= 0) {
+        return;
+    }
+    struct dirent **names = NULL;
+    int count = scandir(backup_dir, &names, is_backup_file, alphasort);
+    for (int i = 0; i < count; i++) {
+        if (i < count - backup_keep) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", backup_dir, names[i]->d_name);
+            if (unlink(path) == 0) {
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Removed old backup %s", path);
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+}
+
+// Back up the database to backup_dir/mqbase-<UTC time>.db.gz: a consistent copy is made
+// with copy_database, then compressed off the database path (freeing the copy as it goes)
+// and renamed into place. The caller sets backup_running
+static void run_backup(void) {
+    char stamp[32];
+    char copy_path[PATH_MAX];
+    char tmp_path[PATH_MAX + 4];
+    char path[PATH_MAX];
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", &tm);
+    int len = snprintf(path, sizeof(path), "%s/" BACKUP_PREFIX "%s" BACKUP_SUFFIX, backup_dir, stamp);
+    if (len < 0 || (size_t)len >= sizeof(path) || 
+        snprintf(copy_path, sizeof(copy_path), "%s/.mqbase-%s.db", backup_dir, stamp) >= (int)sizeof(copy_path)) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Backup directory path too long: %s", backup_dir);
+        atomic_fetch_add(&backups_failed, 1);
+        atomic_store(&backup_running, 0);
+        return;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    
+    if (mkdir(backup_dir, 0755) != 0 && errno != EEXIST) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create backup directory %s: %s", backup_dir, strerror(errno));
+        atomic_fetch_add(&backups_failed, 1);
+        atomic_store(&backup_running, 0);
+        return;
+    }
+    
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Backup to %s started", path);
+    atomic_store(&backup_progress_pct, 0);
+    unsigned long long start_ms = platform_utime(1) / 1000;
+    int pages = 0;
+    
+    int rc = copy_database(copy_path, &backup_progress_pct, BACKUP_COPY_PCT, &pages);
+    struct stat st;
+    unsigned long long db_bytes = stat(copy_path, &st) == 0 ? (unsigned long long)st.st_size : 0;
+    if (rc == SQLITE_DONE) {
+        rc = compress_file(copy_path, tmp_path, &backup_progress_pct, 1) == 0 && rename(tmp_path, path) == 0 ? 
+             SQLITE_OK : SQLITE_IOERR;
+    }
+    unlink(copy_path);
+    unlink(tmp_path);
+    
+    if (rc == SQLITE_OK && stat(path, &st) == 0) {
+        unsigned long long duration_ms = platform_utime(1) / 1000 - start_ms;
+        atomic_store(&backup_duration_ms, duration_ms);
+        atomic_store(&backup_size_bytes, (unsigned long long)st.st_size);
+        atomic_store(&backup_throughput_kb_s, duration_ms > 0 ? db_bytes * 1000 / 1024 / duration_ms : db_bytes / 1024);
+        atomic_fetch_add(&backups_completed, 1);
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Backup to %s completed: %d pages, %llu bytes compressed, %llums", 
+                            path, pages, (unsigned long long)st.st_size, duration_ms);
+        prune_backups();
+    } else if (atomic_load(&copy_thread_running)) {
+        atomic_fetch_add(&backups_failed, 1);
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Backup to %s failed: %s", path, 
+                            is_transient_error(rc) ? "database busy" : sqlite3_errstr(rc));
+    }
+    atomic_store(&backup_running, 0);
+}
+
+// Topic tree (topic_tree_mutex held by the callers)
+
+static void topic_node_insert(struct topic_node **children, uint32_t capacity, struct topic_node *child) {
+    uint32_t mask = capacity - 1;
+    uint32_t i = (uint32_t)hash64(child->name, strlen(child->name)) & mask;
+    while (children[i] != NULL) {
+        i = (i + 1) & mask;
+    }
+    children[i] = child;
+}
+
+// Child level of node by name, added if create is set. Returns NULL if missing or out of memory
+static struct topic_node *topic_node_child(struct topic_node *node, const char *name, size_t len, int create) {
+    if (node->child_capacity > 0) {
+        uint32_t mask = node->child_capacity - 1;
+        for (uint32_t i = (uint32_t)hash64(name, len) & mask; node->children[i] != NULL; i = (i + 1) & mask) {
+            struct topic_node *child = node->children[i];
+            if (strncmp(child->name, name, len) == 0 && child->name[len] == '\0') {
+                return child;
+            }
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    
+    // Grow at 3/4 load, so probing always ends at an empty slot
+    if ((node->child_count + 1) * 4 > node->child_capacity * 3) {
+        uint32_t capacity = node->child_capacity > 0 ? node->child_capacity * 2 : TOPIC_TREE_CHILDREN_MIN;
+        struct topic_node **children = calloc(capacity, sizeof(*children));
+        if (children == NULL) {
+            return NULL;
+        }
+        for (uint32_t i = 0; i < node->child_capacity; i++) {
+            if (node->children[i] != NULL) {
+                topic_node_insert(children, capacity, node->children[i]);
+            }
+        }
+        free(node->children);
+        node->children = children;
+        node->child_capacity = capacity;
+    }
+    
+    struct topic_node *child = calloc(1, sizeof(*child));
+    if (child == NULL || (child->name = strndup(name, len)) == NULL) {
+        free(child);
+        return NULL;
+    }
+    child->parent = node;
+    topic_node_insert(node->children, node->child_capacity, child);
+    node->child_count++;
+    atomic_fetch_add(&topic_tree_nodes, 1);
+    return child;
+}
+
+// Level of a topic path, or NULL if the tree has no such level
+static struct topic_node *topic_tree_find(const char *path) {
+    struct topic_node *node = &topic_tree_root;
+    for (const char *level = path; node != NULL; level++) {
+        const char *end = strchr(level, '/');
+        size_t len = end != NULL ? (size_t)(end - level) : strlen(level);
+        node = topic_node_child(node, level, len, 0);
+        if (end == NULL) {
+            break;
+        }
+        level = end;
+    }
+    return node;
+}
+
+// Take a child out of its parent's table; the entries probing past its slot move up
+static void topic_node_remove(struct topic_node *node, struct topic_node *child) {
+    uint32_t mask = node->child_capacity - 1;
+    uint32_t i = (uint32_t)hash64(child->name, strlen(child->name)) & mask;
+    while (node->children[i] != child) {
+        i = (i + 1) & mask;
+    }
+    node->children[i] = NULL;
+    for (i = (i + 1) & mask; node->children[i] != NULL; i = (i + 1) & mask) {
+        struct topic_node *moved = node->children[i];
+        node->children[i] = NULL;
+        topic_node_insert(node->children, node->child_capacity, moved);
+    }
+    node->child_count--;
+}
+
+// Remove a level and its parents for as long as they hold no messages, retained message or children
+static void topic_tree_prune(struct topic_node *node) {
+    while (node != &topic_tree_root && node->messages == 0 && !node->retained && node->child_count == 0) {
+        struct topic_node *parent = node->parent;
+        topic_node_remove(parent, node);
+        free(node->children);
+        free(node->name);
+        free(node);
+        atomic_fetch_sub(&topic_tree_nodes, 1);
+        node = parent;
+    }
+}
+
+// Account count messages (0 for a retained clear) with the newest ULID on a topic, and set
+// its retained flag (1 or 0, -1 leaves it). Writes since startup are newer than anything the
+// database load finds, so the load does not override a retained flag they set
+static void topic_tree_record(const char *topic, uint64_t count, const char *ulid, int retained, int from_database) {
+    // A retained clear of a topic that is not in the tree has nothing to change
+    int create = count > 0 || retained > 0;
+    struct topic_node *node = &topic_tree_root;
+    for (const char *level = topic; ; level++) {
+        const char *end = strchr(level, '/');
+        size_t len = end != NULL ? (size_t)(end - level) : strlen(level);
+        node = topic_node_child(node, level, len, create);
+        if (node == NULL) {
+            return;
+        }
+        if (end == NULL) {
+            break;
+        }
+        level = end;
+    }
+    
+    uint32_t new_topic = node->messages == 0 && count > 0;
+    int retained_delta = 0;
+    if (retained >= 0 && !(from_database && node->retained_live)) {
+        retained_delta = (retained != 0) - node->retained;
+        node->retained = retained != 0;
+        node->retained_live |= !from_database;
+    }
+    node->messages += count;
+    for (struct topic_node *n = node; n != NULL; n = n->parent) {
+        n->subtree_messages += count;
+        n->subtree_topics += new_topic;
+        n->subtree_retained += (uint32_t)retained_delta;
+        if (count > 0 && strcmp(ulid, n->last_ulid) > 0) {
+            snprintf(n->last_ulid, sizeof(n->last_ulid), "%s", ulid);
+        }
+    }
+    topic_tree_prune(node);
+}
+
+// Take count deleted messages off a topic. The newest ULIDs stay, the tree does not know the
+// ones before them
+static void topic_tree_forget(const char *topic, uint64_t count) {
+    struct topic_node *node = topic_tree_find(topic);
+    if (node == NULL) {
+        return;
+    }
+    // Rows deleted while the database load runs may not have been counted yet
+    if (count > node->messages) {
+        count = node->messages;
+    }
+    node->messages -= count;
+    uint32_t lost_topic = count > 0 && node->messages == 0;
+    for (struct topic_node *n = node; n != NULL; n = n->parent) {
+        n->subtree_messages -= count;
+        n->subtree_topics -= lost_topic;
+    }
+    topic_tree_prune(node);
+}
+
+// Free all levels without recursion (topics can be thousands of levels deep)
+static void topic_tree_clear(void) {
+    struct topic_node *node = &topic_tree_root;
+    while (node != NULL) {
+        struct topic_node *child = NULL;
+        while (child == NULL && node->child_capacity > 0) {
+            child = node->children[--node->child_capacity];
+        }
+        if (child != NULL) {
+            node = child;
+            continue;
+        }
+        struct topic_node *parent = node->parent;
+        free(node->children);
+        if (node != &topic_tree_root) {
+            free(node->name);
+            free(node);
+        }
+        node = parent;
+    }
+    memset(&topic_tree_root, 0, sizeof(topic_tree_root));
+    atomic_store(&topic_tree_nodes, 0);
+}
+
+static void topic_node_json(sqlite3_str *out, const struct topic_node *node) {
+    sqlite3_str_appendf(out, "\"messages\":%llu,\"topics\":%u,\"retained\":%u,\"count\":%llu,\"retain\":%s,\"children\":%u,\"last\":", 
+                        (unsigned long long)node->subtree_messages, node->subtree_topics, node->subtree_retained, 
+                        (unsigned long long)node->messages, node->retained ? "true" : "false", node->child_count);
+    if (node->last_ulid[0] != '\0') {
+        sqlite3_str_appendf(out, "\"%s\"", node->last_ulid);
+    } else {
+        sqlite3_str_appendall(out, "null");
+    }
+}
+
+static int topic_node_compare(const void *a, const void *b) {
+    return strcmp((*(struct topic_node * const *)a)->name, (*(struct topic_node * const *)b)->name);
+}
+
+// Summary of one level as JSON: the level itself and its children in name order, at most
+// limit of them after the child named after (for paging). path NULL = the root
+static char *topic_tree_summary(const char *path, const char *after, int limit) {
+    sqlite3_str *out = sqlite3_str_new(NULL);
+    pthread_mutex_lock(&topic_tree_mutex);
+    const struct topic_node *node = path != NULL ? topic_tree_find(path) : &topic_tree_root;
+    struct topic_node **children = node != NULL && node->child_count > 0 ? malloc(node->child_count * sizeof(*children)) : NULL;
+    
+    sqlite3_str_appendall(out, "{\"path\":");
+    if (path != NULL) {
+        sqlite3_str_appendchar(out, 1, '"');
+        json_append_escaped(out, path);
+        sqlite3_str_appendchar(out, 1, '"');
+    } else {
+        sqlite3_str_appendall(out, "null");
+    }
+    sqlite3_str_appendf(out, ",\"loaded\":%s", atomic_load(&topic_tree_loaded) ? "true" : "false");
+    if (node == NULL) {
+        sqlite3_str_appendall(out, ",\"error\":\"not found\"}");
+    } else if (node->child_count > 0 && children == NULL) {
+        sqlite3_str_appendall(out, ",\"error\":\"out of memory\"}");
+    } else {
+        sqlite3_str_appendchar(out, 1, ',');
+        topic_node_json(out, node);
+        
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < node->child_capacity; i++) {
+            if (node->children[i] != NULL && (after == NULL || strcmp(node->children[i]->name, after) > 0)) {
+                children[count++] = node->children[i];
+            }
+        }
+        if (count > 1) {
+            qsort(children, count, sizeof(*children), topic_node_compare);
+        }
+        
+        sqlite3_str_appendall(out, ",\"nodes\":[");
+        uint32_t shown = count < (uint32_t)limit ? count : (uint32_t)limit;
+        for (uint32_t i = 0; i < shown; i++) {
+            sqlite3_str_appendall(out, i > 0 ? ",{\"name\":\"" : "{\"name\":\"");
+            json_append_escaped(out, children[i]->name);
+            sqlite3_str_appendall(out, "\",");
+            topic_node_json(out, children[i]);
+            sqlite3_str_appendchar(out, 1, '}');
+        }
+        sqlite3_str_appendf(out, "],\"more\":%s}", shown < count ? "true" : "false");
+    }
+    pthread_mutex_unlock(&topic_tree_mutex);
+    free(children);
+    return sqlite3_str_finish(out);
+}
+
+// Seed the topic tree with the rows stored before startup (copy thread, own read connection)
+// Written messages are counted from topic_tree_watermark on, so no message is counted twice
+static void load_topic_tree(void) {
+    unsigned long long start_ms = platform_utime(1) / 1000;
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt = NULL;
+    char *sql = NULL;
+    if (sqlite3_open_v2(DB_PATH, &db, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK) {
+        int buckets = 0;
+        int retained = 0;
+        if (sqlite3_prepare_v2(db, "SELECT name FROM sqlite_master WHERE name IN ('msg_bucket', 'msg_retained')", 
+                               -1, &stmt, NULL) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                const char *name = (const char *)sqlite3_column_text(stmt, 0);
+                buckets |= name != NULL && strcmp(name, "msg_bucket") == 0;
+                retained |= name != NULL && strcmp(name, "msg_retained") == 0;
+            }
+        }
+        sqlite3_finalize(stmt);
+        stmt = NULL;
+        // Retained flags come from the retained store, which also holds excluded topics; without
+        // it a topic is retained if its newest row is (bare column with max())
+        retained = retained && restore_retained;
+        sql = sqlite3_mprintf("SELECT topic, count(*), max(ulid), %s FROM \"%w\" WHERE ulid < ?1 GROUP BY topic%s%s", 
+                              retained ? "-1" : "retain", msg_table, 
+                              buckets ? " UNION ALL SELECT topic, sum(count), max(bucket_end), -1 FROM msg_bucket "
+                                        "WHERE bucket_end < ?1 GROUP BY topic" : "", 
+                              retained ? " UNION ALL SELECT topic, 0, ulid, 1 FROM msg_retained" : "");
+    }
+    if (sql == NULL || sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Topic tree not loaded from the database: %s", 
+                            db != NULL ? sqlite3_errmsg(db) : "out of memory");
+        sqlite3_free(sql);
+        sqlite3_close(db);
+        atomic_store(&topic_tree_loaded, 1);
+        return;
+    }
+    sqlite3_free(sql);
+    sqlite3_bind_text(stmt, 1, topic_tree_watermark, -1, SQLITE_STATIC);
+    
+    // Rows are read a batch at a time without the lock, which the broker thread then waits
+    // for only while the batch is merged
+    struct topic_row {
+        char *topic;
+        uint64_t count;
+        char ulid[27];
+        int retained;
+    } *rows = calloc(TOPIC_TREE_LOAD_BATCH, sizeof(*rows));
+    unsigned long long topics = 0;
+    int rc = rows != NULL ? SQLITE_ROW : SQLITE_NOMEM;
+    while (rc == SQLITE_ROW && atomic_load(&copy_thread_running)) {
+        int n = 0;
+        while (n < TOPIC_TREE_LOAD_BATCH && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char *topic = (const char *)sqlite3_column_text(stmt, 0);
+            const char *ulid = (const char *)sqlite3_column_text(stmt, 2);
+            if (topic != NULL && ulid != NULL && (rows[n].topic = strdup(topic)) != NULL) {
+                rows[n].count = (uint64_t)sqlite3_column_int64(stmt, 1);
+                snprintf(rows[n].ulid, sizeof(rows[n].ulid), "%s", ulid);
+                rows[n].retained = sqlite3_column_int(stmt, 3);
+                n++;
+            }
+        }
+        pthread_mutex_lock(&topic_tree_mutex);
+        for (int i = 0; i < n; i++) {
+            topic_tree_record(rows[i].topic, rows[i].count, rows[i].ulid, rows[i].retained, 1);
+        }
+        pthread_mutex_unlock(&topic_tree_mutex);
+        for (int i = 0; i < n; i++) {
+            free(rows[i].topic);
+        }
+        topics += (unsigned long long)n;
+    }
+    free(rows);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Topic tree load stopped: %s", 
+                            rc == SQLITE_NOMEM ? "out of memory" : sqlite3_errmsg(db));
+    } else if (rc == SQLITE_DONE) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Topic tree loaded %llu stored topics in %llums", 
+                            topics, platform_utime(1) / 1000 - start_ms);
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    atomic_store(&topic_tree_loaded, 1);
+}
+
+// Background copy thread: refreshes the read snapshot and runs backups, scheduled or on request
+static void *copy_worker(void *arg) {
+    UNUSED(arg);
+    
+    // Snapshot and backup copies read each page once, they would only evict the writer's pages
+    arena_bypass = 1;
+    
+    // Copies start once the batch worker has opened and migrated the database
+    while (atomic_load(&copy_thread_running) && !atomic_load(&db_ready)) {
+        usleep(COPY_READY_POLL_MS * 1000);
+    }
+    if (topic_tree_enabled && atomic_load(&copy_thread_running)) {
+        load_topic_tree();
+    }
+    
+    char *snapshot_path = snapshot_dir != NULL ? sqlite3_mprintf("%s" SNAPSHOT_DB_PATH, snapshot_dir) : NULL;
+    time_t next_snapshot = time(NULL);
+    time_t next_backup = backup_interval_sec > 0 ? time(NULL) + backup_interval_sec : 0;
+    
+    while (atomic_load(&copy_thread_running)) {
+        time_t now = time(NULL);
+        if (snapshot_path != NULL && now >= next_snapshot) {
+            refresh_snapshot(snapshot_path);
+            next_snapshot = time(NULL) + snapshot_interval_sec;
+        }
+        if (atomic_load(&backup_requested) || (next_backup > 0 && now >= next_backup)) {
+            // Running before the request is cleared, so no second request slips in between
+            atomic_store(&backup_running, 1);
+            atomic_store(&backup_requested, 0);
+            run_backup();
+            if (backup_interval_sec > 0) {
+                next_backup = time(NULL) + backup_interval_sec;
+            }
+        }
+        
+        // Sleep until the next scheduled copy or a backup request
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        time_t wait = COPY_IDLE_WAIT_SEC;
+        now = time(NULL);
+        if (snapshot_path != NULL && next_snapshot - now < wait) {
+            wait = next_snapshot - now;
+        }
+        if (next_backup > 0 && next_backup - now < wait) {
+            wait = next_backup - now;
+        }
+        timeout.tv_sec += wait > 0 ? wait : 0;
+        pthread_mutex_lock(&copy_mutex);
+        while (atomic_load(&copy_thread_running) && !atomic_load(&backup_requested)) {
+            if (pthread_cond_timedwait(&copy_cond, &copy_mutex, &timeout) == ETIMEDOUT) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&copy_mutex);
+    }
+    
+    sqlite3_free(snapshot_path);
+    return NULL;
+}
+
+// Create snapshot_dir/dbs/default for the snapshot file
+static int init_snapshot_dir(void) {
+    char path[PATH_MAX];
+    const char *parts[] = { "", "/dbs", "/dbs/default" };
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        snprintf(path, sizeof(path), "%s%s", snapshot_dir, parts[i]);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create snapshot directory %s: %s", path, strerror(errno));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Background worker thread for batch processing
+static void *batch_worker(void *arg) {
+    UNUSED(arg);
+    
+    struct timespec timeout;
+    
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Batch worker thread started");
+    
+    // Schema migrations and index builds can take a while on a large database; the broker
+    // is already accepting messages, which queue up until the first flush
+    // A writer holding the lock (sqld) delays the migrations; messages stay queued meanwhile
+    pthread_mutex_lock(&db_mutex);
+    while (init_database() != 0 && msg_db != NULL && is_transient_error(sqlite3_errcode(msg_db)) && 
+           atomic_load(&batch_thread_running)) {
+        pthread_mutex_unlock(&db_mutex);
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Database busy, retrying schema setup");
+        usleep(BATCH_RETRY_MAX_MS * 1000);
+        pthread_mutex_lock(&db_mutex);
+    }
+    pthread_mutex_unlock(&db_mutex);
+    unsigned long long init_ms = platform_utime(0) / 1000;
+    init_ms = init_ms > plugin_init_ms ? init_ms - plugin_init_ms : 0;
+    atomic_store(&db_init_ms, init_ms);
+    atomic_store(&db_ready, 1);
+    if (msg_db != NULL) {
+        pthread_mutex_lock(&queue_mutex);
+        int queued = msg_queue_size;
+        pthread_mutex_unlock(&queue_mutex);
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Database ready after %llums, %d messages queued", init_ms, queued);
+    }
+    
+    while (atomic_load(&batch_thread_running)) {
+        // Quiescent point: configs older than this one can be freed
+        const struct runtime_config *cfg = runtime_config_get();
+        atomic_store(&worker_config_generation, cfg->generation);
+        
+        pthread_mutex_lock(&queue_mutex);
+        
+        // Wait for either: queue size threshold or timeout (flush_interval can exceed a second)
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_sec += cfg->flush_interval_ms / 1000;
+        timeout.tv_nsec += (cfg->flush_interval_ms % 1000) * 1000000L;
+        if (timeout.tv_nsec >= 1000000000L) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000L;
+        }
+        
+        // Wait with timeout - will wake up on signal or timeout
+        while (msg_queue_size < cfg->batch_size && atomic_load(&batch_thread_running)) {
+            int rc = pthread_cond_timedwait(&queue_cond, &queue_mutex, &timeout);
+            if (rc == ETIMEDOUT) {
+                break;  // Timeout - flush whatever we have
+            }
+        }
+        
+        pthread_mutex_unlock(&queue_mutex);
+        
+        // Flush accumulated messages; a busy database keeps the batch queued and backs off
+        if (atomic_load(&batch_thread_running) || msg_queue_size > 0) {
+            unsigned long long flush_start_us = platform_utime(0);
+            pthread_mutex_lock(&db_mutex);
+            int requeued = flush_batch();
+            pthread_mutex_unlock(&db_mutex);
+            unsigned long long flush_end_us = platform_utime(0);
+            unsigned long long flush_us = flush_end_us > flush_start_us ? flush_end_us - flush_start_us : 0;
+            unsigned long long max_us = atomic_load(&flush_max_us);
+            while (flush_us > max_us && !atomic_compare_exchange_weak(&flush_max_us, &max_us, flush_us)) {
+            }
+            if (requeued != 0) {
+                if (batch_retry_delay_ms == 0) {
+                    mosquitto_log_printf(MOSQ_LOG_WARNING, "Database busy, keeping %d queued messages for retry", msg_queue_size);
+                }
+                atomic_fetch_add(&batch_retries, 1);
+                batch_retry_delay_ms = batch_retry_delay_ms == 0 ? BATCH_RETRY_MIN_MS : batch_retry_delay_ms * 2;
+                if (batch_retry_delay_ms > BATCH_RETRY_MAX_MS) {
+                    batch_retry_delay_ms = BATCH_RETRY_MAX_MS;
+                }
+                usleep(batch_retry_delay_ms * 1000);
+                continue;
+            }
+            if (batch_retry_delay_ms > 0) {
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Database writable again, queued messages stored");
+                batch_retry_delay_ms = 0;
+            }
+        }
+        
+        // Periodically cleanup old messages (if retention is enabled)
+        if (atomic_load(&batch_thread_running)) {
+            pthread_mutex_lock(&db_mutex);
+            process_retry_queue();
+            replay_dead_letters();
+            flush_buckets(0);
+            sweep_expired_messages();
+            cleanup_old_messages(cfg->retention_days);
+            run_schema_migration();
+            collect_payload_garbage();
+            reclaim_free_pages();
+            optimize_database();
+            pthread_mutex_unlock(&db_mutex);
+            trim_sqlite_heap();
+        }
+    }
+    
+    // Final flush on shutdown (the copy thread has already stopped); a batch holds at most
+    // LANE_DRAIN_MAX entries, so flush until the lanes are empty
+    for (int attempt = 1; !queue_is_empty(); ) {
+        if (flush_batch() == 0) {
+            continue;
+        }
+        if (attempt++ == SHUTDOWN_FLUSH_ATTEMPTS) {
+            pthread_mutex_lock(&queue_mutex);
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Database still busy at shutdown, %d queued messages lost", msg_queue_size);
+            clear_lanes();
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
+        usleep(BATCH_RETRY_MAX_MS * 1000 / SHUTDOWN_FLUSH_ATTEMPTS);
+    }
+    flush_buckets(1);
+    
+    // Operations still waiting for a retry are kept as dead letters
+    if (retry_queue != NULL && msg_db != NULL && store_dead_letters(retry_queue) != 0) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "%d failed operations lost at shutdown", retry_queue_size);
+        free_entries(retry_queue);
+    }
+    retry_queue = NULL;
+    retry_queue_size = 0;
+    atomic_store(&retry_queued, 0);
+    
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Batch worker thread stopped");
+    return NULL;
+}
+
+// Extract user properties from message and format as semicolon-separated key=value string
+// Excludes headers in the exclude_headers list
+// Returns allocated string or NULL if no headers. Caller must free.
+// Optimized: single-pass with dynamic buffer growth
+static char *extract_headers(const struct runtime_config *cfg, const mosquitto_property *properties) {
+    // If header storage is completely disabled, return NULL
+    if (cfg->headers_disabled) {
+        return NULL;
+    }
+    
+    if (properties == NULL) {
+        return NULL;
+    }
+    
+    // Start with reasonable initial capacity
+    size_t capacity = 256;
+    size_t len = 0;
+    char *headers = malloc(capacity);
+    if (headers == NULL) {
+        return NULL;
+    }
+    headers[0] = '\0';
+    
+    // Single pass: build header string with dynamic buffer growth
+    const mosquitto_property *prop = properties;
+    char *prop_name = NULL;
+    char *prop_value = NULL;
+    bool skip_first = false;
+    int header_count = 0;
+    
+    while ((prop = mosquitto_property_read_string_pair(prop, MQTT_PROP_USER_PROPERTY, 
+                                                       &prop_name, &prop_value, skip_first)) != NULL) {
+        if (prop_name != NULL && prop_value != NULL && !is_header_excluded(cfg, prop_name)) {
+            size_t name_len = strlen(prop_name);
+            size_t value_len = strlen(prop_value);
+            // Need: name + '=' + value + ';' (or '\0' for last)
+            size_t needed = name_len + value_len + 2;
+            
+            // Grow buffer if needed
+            if (len + needed + 1 > capacity) {
+                capacity = (len + needed + 1) * 2;
+                char *new_headers = realloc(headers, capacity);
+                if (new_headers == NULL) {
+                    free(headers);
+                    free(prop_name);
+                    free(prop_value);
+                    return NULL;
+                }
+                headers = new_headers;
+            }
+            
+            // Append separator if not first
+            if (header_count > 0) {
+                headers[len++] = ';';
+            }
+            
+            // Append name=value using memcpy (faster than strcat)
+            memcpy(headers + len, prop_name, name_len);
+            len += name_len;
+            headers[len++] = '=';
+            memcpy(headers + len, prop_value, value_len);
+            len += value_len;
+            headers[len] = '\0';
+            
+            header_count++;
+        }
+        if (prop_name) { free(prop_name); prop_name = NULL; }
+        if (prop_value) { free(prop_value); prop_value = NULL; }
+        skip_first = true;
+    }
+    
+    if (header_count == 0) {
+        free(headers);
+        return NULL;
+    }
+    
+    return headers;
+}
+
+// Convert a stored semicolon-separated key=value header string back into user properties
+static void add_headers_as_properties(mosquitto_property **properties, const char *headers) {
+    if (headers == NULL || *headers == '\0') {
+        return;
+    }
+    
+    char *headers_copy = strdup(headers);
+    if (headers_copy == NULL) {
+        return;
+    }
+    
+    char *saveptr = NULL;
+    char *pair = strtok_r(headers_copy, ";", &saveptr);
+    while (pair != NULL) {
+        char *eq = strchr(pair, '=');
+        if (eq != NULL) {
+            *eq = '\0';
+            mosquitto_property_add_string_pair(properties, MQTT_PROP_USER_PROPERTY, pair, eq + 1);
+        }
+        pair = strtok_r(NULL, ";", &saveptr);
+    }
+    
+    free(headers_copy);
+}
+
+// Replay msg_retained into the broker's retained store
+// Called from mosquitto_plugin_init(); the broker queues plugin publishes and
+// delivers them from its main loop, so this runs before any client connects
+static void restore_retained_messages(void) {
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(msg_db, 
+        "SELECT topic, payload, qos, headers, ulid, expires_at FROM msg_retained", 
+        -1, &stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare retained restore statement: %s", sqlite3_errmsg(msg_db));
+        return;
+    }
+    
+    int restored = 0;
+    int failed = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *topic = (const char *)sqlite3_column_text(stmt, 0);
+        const void *payload = sqlite3_column_blob(stmt, 1);
+        int payloadlen = sqlite3_column_bytes(stmt, 1);
+        int qos = sqlite3_column_int(stmt, 2);
+        const char *headers = (const char *)sqlite3_column_text(stmt, 3);
+        const char *ulid = (const char *)sqlite3_column_text(stmt, 4);
+        sqlite3_int64 expires_at = sqlite3_column_int64(stmt, 5);
+        
+        if (topic == NULL || payloadlen == 0) {
+            continue;
+        }
+        
+        // Expired while the broker was down; otherwise only the remaining lifetime is restored
+        uint32_t remaining_sec = 0;
+        if (expires_at > 0) {
+            sqlite3_int64 now_ms = (sqlite3_int64)(platform_utime(0) / 1000);
+            if (expires_at <= now_ms) {
+                continue;
+            }
+            remaining_sec = (uint32_t)((expires_at - now_ms + 999) / 1000);
+        }
+        
+        // Re-attach the original ULID so clients can still clear it by ULID
+        mosquitto_property *properties = NULL;
+        add_headers_as_properties(&properties, headers);
+        if (remaining_sec > 0) {
+            mosquitto_property_add_int32(&properties, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, remaining_sec);
+        }
+        if (ulid != NULL) {
+            mosquitto_property_add_string_pair(&properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
+        }
+        
+        rc = mosquitto_broker_publish_copy(NULL, topic, payloadlen, payload, qos, true, properties);
+        if (rc == MOSQ_ERR_SUCCESS) {
+            restored++;
+        } else {
+            // Properties are only taken over by the broker on success
+            mosquitto_property_free_all(&properties);
+            failed++;
+        }
+    }
+    sqlite3_finalize(stmt);
+    
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Restored %d retained messages from database", restored);
+    if (failed > 0) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to restore %d retained messages", failed);
+    }
+}
+
+// Create msg_retained and prepare its statements
+// The table is not seeded from msg: a clear without a ULID only deletes the newest row, so
+// older retained rows there may belong to messages the broker no longer holds
+static void init_retained_store(void) {
+    char *err_msg = NULL;
+    sqlite3_stmt *stmt = NULL;
+    int exists = 0;
+    
+    if (sqlite3_prepare_v2(msg_db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'msg_retained'", 
+                           -1, &stmt, 0) == SQLITE_OK) {
+        exists = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+    
+    int rc = sqlite3_exec(msg_db, 
+        "CREATE TABLE IF NOT EXISTS msg_retained(topic TEXT PRIMARY KEY, ulid TEXT NOT NULL, payload BLOB NOT NULL, qos INTEGER NOT NULL DEFAULT 0, headers TEXT, expires_at INTEGER);", 
+        NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create retained store: %s", err_msg);
+        sqlite3_free(err_msg);
+        return;
+    }
+    
+    // Retained stores created before message expiry support
+    if (exists && !table_has_column("msg_retained", "expires_at")) {
+        rc = sqlite3_exec(msg_db, "ALTER TABLE msg_retained ADD COLUMN expires_at INTEGER;", NULL, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to add msg_retained.expires_at: %s", err_msg);
+            sqlite3_free(err_msg);
+            return;
+        }
+    }
+    
+    rc = sqlite3_prepare_v2(msg_db, 
+        "INSERT INTO msg_retained (topic, ulid, payload, qos, headers, expires_at) VALUES (?1, ?2, ?3, ?4, ?5, ?6) "
+        "ON CONFLICT(topic) DO UPDATE SET ulid = excluded.ulid, payload = excluded.payload, qos = excluded.qos, "
+        "headers = excluded.headers, expires_at = excluded.expires_at WHERE ?7 = 0 OR excluded.ulid > msg_retained.ulid", 
+        -1, &retained_upsert_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare retained_upsert statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    rc = sqlite3_prepare_v2(msg_db, 
+        "DELETE FROM msg_retained WHERE topic = ?1", 
+        -1, &retained_delete_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare retained_delete statement: %s", sqlite3_errmsg(msg_db));
+    }
+}
+
+// Returns the sqlite_master type of a schema object ("table", "view", ...) or NULL if absent
+// The result must be freed with sqlite3_free()
+static char *schema_object_type(const char *name) {
+    sqlite3_stmt *stmt = NULL;
+    char *type = NULL;
+    
+    if (sqlite3_prepare_v2(msg_db, "SELECT type FROM sqlite_master WHERE name = ?1", -1, &stmt, 0) != SQLITE_OK) {
+        return NULL;
+    }
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        type = sqlite3_mprintf("%s", (const char *)sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    return type;
+}
+
+// Returns 1 if the table has a column with the given name
+static int table_has_column(const char *table, const char *column) {
+    sqlite3_stmt *stmt = NULL;
+    int found = 0;
+    
+    char *sql = sqlite3_mprintf("SELECT 1 FROM pragma_table_info(%Q) WHERE name = %Q", table, column);
+    if (sql == NULL) {
+        return 0;
+    }
+    if (sqlite3_prepare_v2(msg_db, sql, -1, &stmt, 0) == SQLITE_OK) {
+        found = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_free(sql);
+    return found;
+}
+
+// Execute a schema statement; %s in sql_fmt is replaced by the physical message table name
+static int exec_msg_sql(const char *sql_fmt, const char *what) {
+    char *err_msg = NULL;
+    char *sql = sqlite3_mprintf(sql_fmt, msg_table);
+    if (sql == NULL) {
+        return SQLITE_NOMEM;
+    }
+    int rc = sqlite3_exec(msg_db, sql, NULL, 0, &err_msg);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to %s: %s", what, err_msg);
+        sqlite3_free(err_msg);
+    }
+    return rc;
+}
+
+// Prepare a statement on msg_db; %s in sql_fmt is replaced by the physical message table name
+static int prepare_msg_statement(const char *sql_fmt, sqlite3_stmt **stmt) {
+    char *sql = sqlite3_mprintf(sql_fmt, msg_table);
+    if (sql == NULL) {
+        return SQLITE_NOMEM;
+    }
+    int rc = sqlite3_prepare_v2(msg_db, sql, -1, stmt, 0);
+    sqlite3_free(sql);
+    return rc;
+}
+
+// Shared payload store used by the blob and split layouts. Referenced blobs carry a
+// refcount; a trigger on the table holding payload_hash releases references on every
+// delete path (plugin, retention, ad-hoc SQL) and the worker removes blobs that drop to zero
+static int init_payload_blob_table(const char *payload_table) {
+    char *err_msg = NULL;
+    char *sql = sqlite3_mprintf(
+        "CREATE TABLE IF NOT EXISTS payload_blob(hash blob primary key, data text not null, refcount integer not null default 0, location text, size integer) WITHOUT ROWID;"
+        "CREATE INDEX IF NOT EXISTS idx_payload_blob_unreferenced ON payload_blob(hash) WHERE refcount <= 0;"
+        "CREATE TRIGGER IF NOT EXISTS %s_release_payload AFTER DELETE ON %s "
+        "WHEN OLD.payload_hash IS NOT NULL BEGIN "
+        "UPDATE payload_blob SET refcount = refcount - 1 WHERE hash = OLD.payload_hash; END;", 
+        payload_table, payload_table);
+    if (sql == NULL) {
+        return 1;
+    }
+    int rc = sqlite3_exec(msg_db, sql, NULL, 0, &err_msg);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create payload blob store: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    
+    // Offloaded payloads: location is the file path relative to the file store, size the payload length
+    if (!table_has_column("payload_blob", "location")) {
+        rc = sqlite3_exec(msg_db, 
+            "ALTER TABLE payload_blob ADD COLUMN location text;"
+            "ALTER TABLE payload_blob ADD COLUMN size integer;", 
+            NULL, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to add payload_blob location columns: %s", err_msg);
+            sqlite3_free(err_msg);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Blob layout: msg_data + payload_blob, with msg as a view that resolves deduplicated
+// payloads so readers (admin UI, sqld clients) keep querying msg unchanged
+// An existing msg table is renamed in place (schema-only change, no data copy)
+static int init_blob_layout(int msg_exists) {
+    char *err_msg = NULL;
+    int rc;
+    
+    if (msg_exists) {
+        rc = sqlite3_exec(msg_db, "ALTER TABLE msg RENAME TO msg_data;", NULL, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to rename msg to msg_data: %s", err_msg);
+            sqlite3_free(err_msg);
+            return 1;
+        }
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Converted msg table to msg_data for payload deduplication");
+    }
+    
+    rc = sqlite3_exec(msg_db, 
+        "CREATE TABLE IF NOT EXISTS msg_data(ulid text primary key, topic text not null, payload text not null, retain integer not null default 0, qos integer not null default 0, headers text, payload_hash blob);", 
+        NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "SQL error: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    if (!table_has_column("msg_data", "payload_hash")) {
+        rc = sqlite3_exec(msg_db, "ALTER TABLE msg_data ADD COLUMN payload_hash blob;", NULL, 0, &err_msg);
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to add payload_hash column: %s", err_msg);
+            sqlite3_free(err_msg);
+            return 1;
+        }
+    }
+    if (init_payload_blob_table("msg_data") != 0) {
+        return 1;
+    }
+    
+    rc = sqlite3_exec(msg_db, 
+        "CREATE VIEW IF NOT EXISTS msg AS SELECT ulid, topic, "
+        "CASE WHEN payload_hash IS NULL THEN payload ELSE (SELECT data FROM payload_blob WHERE hash = msg_data.payload_hash) END AS payload, "
+        "retain, qos, headers FROM msg_data;"
+        "CREATE TRIGGER IF NOT EXISTS msg_delete INSTEAD OF DELETE ON msg BEGIN "
+        "DELETE FROM msg_data WHERE ulid = OLD.ulid; END;", 
+        NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create msg view: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    
+    msg_table = "msg_data";
+    storage_layout = LAYOUT_BLOB;
+    return 0;
+}
+
+// Split layout: the narrow msg_meta table (clustered by ULID, no payload bytes) serves
+// topic and time-range scans; payloads and headers live in msg_payload under the same ULID
+static int create_split_tables(void) {
+    char *err_msg = NULL;
+    int rc = sqlite3_exec(msg_db, 
+        "CREATE TABLE IF NOT EXISTS msg_meta(ulid text primary key, topic text not null, retain integer not null default 0, qos integer not null default 0) WITHOUT ROWID;"
+        "CREATE TABLE IF NOT EXISTS msg_payload(ulid text primary key, payload text not null, headers text, payload_hash blob);", 
+        NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "SQL error: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    return init_payload_blob_table("msg_payload");
+}
+
+// The msg view of the split layout
+static int create_split_view(void) {
+    char *err_msg = NULL;
+    // LEFT JOIN lets SQLite skip msg_payload entirely for metadata-only queries
+    int rc = sqlite3_exec(msg_db, 
+        "CREATE VIEW IF NOT EXISTS msg AS SELECT m.ulid AS ulid, m.topic AS topic, "
+        "CASE WHEN p.payload_hash IS NULL THEN p.payload ELSE (SELECT data FROM payload_blob WHERE hash = p.payload_hash) END AS payload, "
+        "m.retain AS retain, m.qos AS qos, p.headers AS headers "
+        "FROM msg_meta m LEFT JOIN msg_payload p ON p.ulid = m.ulid;"
+        "CREATE TRIGGER IF NOT EXISTS msg_delete INSTEAD OF DELETE ON msg BEGIN "
+        "DELETE FROM msg_meta WHERE ulid = OLD.ulid; DELETE FROM msg_payload WHERE ulid = OLD.ulid; END;", 
+        NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create msg view: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    return 0;
+}
+
+static int init_split_layout(void) {
+    if (create_split_tables() != 0 || create_split_view() != 0) {
+        return 1;
+    }
+    msg_table = "msg_meta";
+    storage_layout = LAYOUT_SPLIT;
+    return 0;
+}
+
+static void init_split_statements(void);
+
+// Prepare statements used by the blob and split layouts
+static void init_layout_statements(void) {
+    int rc = sqlite3_prepare_v2(msg_db, 
+        "INSERT INTO payload_blob (hash, data, refcount) VALUES (?1, ?2, 1) "
+        "ON CONFLICT(hash) DO UPDATE SET refcount = refcount + 1", 
+        -1, &blob_upsert_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare blob_upsert statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    rc = sqlite3_prepare_v2(msg_db, 
+        "UPDATE payload_blob SET refcount = refcount - 1 WHERE hash = ?1", 
+        -1, &blob_release_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare blob_release statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    rc = sqlite3_prepare_v2(msg_db, 
+        "INSERT INTO payload_blob (hash, data, refcount, location, size) VALUES (?1, ?2, 1, ?3, ?4) "
+        "ON CONFLICT(hash) DO UPDATE SET refcount = refcount + 1", 
+        -1, &file_upsert_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare file_upsert statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    rc = sqlite3_prepare_v2(msg_db, 
+        "SELECT hash, location FROM payload_blob WHERE refcount <= 0 LIMIT ?1", 
+        -1, &payload_gc_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare payload_gc statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    rc = sqlite3_prepare_v2(msg_db, 
+        "DELETE FROM payload_blob WHERE hash = ?1 AND refcount <= 0", 
+        -1, &payload_gc_delete_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare payload_gc_delete statement: %s", sqlite3_errmsg(msg_db));
+        sqlite3_finalize(payload_gc_stmt);
+        payload_gc_stmt = NULL;
+    }
+    
+    // Collect anything left unreferenced before the last shutdown
+    payload_gc_pending = 1;
+    
+    if (storage_layout == LAYOUT_SPLIT) {
+        init_split_statements();
+    }
+}
+
+// Prepare the msg_payload statements of the split layout
+static void init_split_statements(void) {
+    int rc = sqlite3_prepare_v2(msg_db, 
+        "INSERT INTO msg_payload (ulid, payload, headers, payload_hash) VALUES (?1, ?3, ?6, ?7)", 
+        -1, &payload_insert_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare payload_insert statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    rc = sqlite3_prepare_v2(msg_db, 
+        "DELETE FROM msg_payload WHERE ulid = ?1", 
+        -1, &payload_delete_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare payload_delete statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    rc = sqlite3_prepare_v2(msg_db, 
+        "DELETE FROM msg_payload WHERE ulid IN (SELECT ulid FROM msg_payload WHERE ulid < ?1 ORDER BY ulid LIMIT ?2)", 
+        -1, &payload_retention_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare payload_retention statement: %s", sqlite3_errmsg(msg_db));
+    }
+}
+
+// Create msg_bucket and the msg_bucketed view, and prepare the bucket statements
+static void init_bucket_store(void) {
+    char *err_msg = NULL;
+    int rc = sqlite3_exec(msg_db, 
+        "CREATE TABLE IF NOT EXISTS msg_bucket(topic text not null, bucket_start text not null, "
+        "bucket_end text not null, count integer not null, data blob not null, unique(topic, bucket_start));"
+        "CREATE INDEX IF NOT EXISTS idx_msg_bucket_end ON msg_bucket(bucket_end);"
+        "CREATE VIEW IF NOT EXISTS msg_bucketed AS "
+        "SELECT e.ulid AS ulid, b.topic AS topic, e.payload AS payload, e.retain AS retain, e.qos AS qos, e.headers AS headers "
+        "FROM msg_bucket b, msg_bucket_expand(b.data) e;", 
+        NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create bucket store: %s", err_msg);
+        sqlite3_free(err_msg);
+        return;
+    }
+    
+    rc = sqlite3_prepare_v2(msg_db, 
+        "INSERT INTO msg_bucket (topic, bucket_start, bucket_end, count, data) VALUES (?1, ?2, ?3, ?4, ?5) "
+        "ON CONFLICT(topic, bucket_start) DO UPDATE SET bucket_end = excluded.bucket_end, "
+        "count = excluded.count, data = excluded.data", 
+        -1, &bucket_upsert_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare bucket_upsert statement: %s", sqlite3_errmsg(msg_db));
+        return;
+    }
+    
+    rc = sqlite3_prepare_v2(msg_db, 
+        "DELETE FROM msg_bucket WHERE topic = ?1 AND bucket_start >= ?2 AND bucket_start <= ?3", 
+        -1, &bucket_segment_delete_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare bucket_segment_delete statement: %s", sqlite3_errmsg(msg_db));
+        sqlite3_finalize(bucket_upsert_stmt);
+        bucket_upsert_stmt = NULL;
+        return;
+    }
+    
+    // Ordered, so that the topic tree statement selects the same buckets
+    rc = sqlite3_prepare_v2(msg_db, 
+        "DELETE FROM msg_bucket WHERE rowid IN (SELECT rowid FROM msg_bucket WHERE bucket_end < ?1 ORDER BY bucket_end LIMIT ?2)", 
+        -1, &bucket_retention_stmt, 0);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare bucket_retention statement: %s", sqlite3_errmsg(msg_db));
+    }
+    if (topic_tree_enabled && sqlite3_prepare_v2(msg_db, 
+            "SELECT topic, sum(count) FROM (SELECT topic, count FROM msg_bucket WHERE bucket_end < ?1 ORDER BY bucket_end LIMIT ?2) "
+            "GROUP BY topic", -1, &bucket_retention_topics_stmt, 0) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare bucket_retention_topics statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Bucketed storage enabled: window=%llums, max points=%d", 
+                        bucket_window_ms, bucket_max_points);
+}
+
+// Create the Sparkplug B metric tables and prepare their statements
+// Returns 0 if metrics can be stored
+static int init_sparkplug_store(void) {
+    char *err_msg = NULL;
+    // Devices are identified by node_id and device_id together; device_id 0 = the edge node itself
+    int rc = sqlite3_exec(msg_db, 
+        "CREATE TABLE IF NOT EXISTS metric_node(node_id integer primary key, group_id text not null, "
+        "edge_node text not null, unique(group_id, edge_node));"
+        "CREATE TABLE IF NOT EXISTS metric_device(device_id integer primary key, name text not null unique);"
+        "CREATE TABLE IF NOT EXISTS metric_name(metric_id integer primary key, name text not null unique);"
+        "CREATE TABLE IF NOT EXISTS metric(ts integer not null, node_id integer not null, "
+        "device_id integer not null, metric_id integer not null, value_num numeric, value_str text);"
+        "CREATE INDEX IF NOT EXISTS idx_metric_series ON metric(metric_id, node_id, device_id, ts);"
+        "CREATE INDEX IF NOT EXISTS idx_metric_ts ON metric(ts);"
+        "CREATE VIEW IF NOT EXISTS metric_named AS "
+        "SELECT m.ts AS ts, n.group_id AS group_id, n.edge_node AS edge_node, d.name AS device, "
+        "k.name AS metric, m.value_num AS value_num, m.value_str AS value_str "
+        "FROM metric m JOIN metric_node n ON n.node_id = m.node_id JOIN metric_name k ON k.metric_id = m.metric_id "
+        "LEFT JOIN metric_device d ON d.device_id = m.device_id;", 
+        NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create Sparkplug metric tables: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    
+    // Retention walks idx_metric_ts, so rows with a timestamp ahead of the clock (device time)
+    // cannot hold up the deletion of older ones
+    if (sqlite3_prepare_v2(msg_db, 
+            "INSERT INTO metric (ts, node_id, device_id, metric_id, value_num, value_str) VALUES (?1, ?2, ?3, ?4, ?5, ?6)", 
+            -1, &metric_insert_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, 
+            "DELETE FROM metric WHERE rowid IN (SELECT rowid FROM metric WHERE ts < ?3 LIMIT ?2)", 
+            -1, &metric_retention_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "SELECT node_id FROM metric_node WHERE group_id = ?1 AND edge_node = ?2", 
+                           -1, &metric_node_select_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "INSERT INTO metric_node (group_id, edge_node) VALUES (?1, ?2)", 
+                           -1, &metric_node_insert_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "SELECT device_id FROM metric_device WHERE name = ?1", 
+                           -1, &metric_device_select_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "INSERT INTO metric_device (name) VALUES (?1)", 
+                           -1, &metric_device_insert_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "SELECT metric_id FROM metric_name WHERE name = ?1", 
+                           -1, &metric_name_select_stmt, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(msg_db, "INSERT INTO metric_name (name) VALUES (?1)", 
+                           -1, &metric_name_insert_stmt, NULL) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare Sparkplug metric statements: %s", sqlite3_errmsg(msg_db));
+        finalize_sparkplug_store();
+        return 1;
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Sparkplug B payloads decoded into the metric table");
+    return 0;
+}
+
+// Returns the printable name of a storage layout
+static const char *layout_name(int layout) {
+    switch (layout) {
+        case LAYOUT_BLOB:  return "blob";
+        case LAYOUT_SPLIT: return "split";
+        default:           return "inline";
+    }
+}
+
+// msg_by_client: messages with their publisher, found through idx_msg_client. The view takes
+// the metadata from the physical table (which holds client_key) and only joins msg for the
+// payload, so it is recreated with the layout
+static int create_client_view(void) {
+    char *err_msg = NULL;
+    char *sql = sqlite3_mprintf(
+        "DROP VIEW IF EXISTS msg_by_client;"
+        "CREATE VIEW msg_by_client AS SELECT c.client_id AS client_id, NULLIF(c.username, '') AS username, "
+        "k.ulid AS ulid, k.topic AS topic, m.payload AS payload, k.retain AS retain, k.qos AS qos, m.headers AS headers "
+        "FROM msg_client c JOIN \"%w\" k ON k.client_key = c.client_key JOIN msg m ON m.ulid = k.ulid;", msg_table);
+    int rc = sql != NULL ? sqlite3_exec(msg_db, sql, NULL, 0, &err_msg) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create msg_by_client view: %s", err_msg != NULL ? err_msg : sqlite3_errstr(rc));
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    return 0;
+}
+
+// Create msg_client, the client_key column with its index and the msg_by_client view
+// Returns 0 if publishers can be stored
+static int init_client_store(int converted) {
+    char *err_msg = NULL;
+    // Messages without a username use '', so the pair stays unique
+    int rc = sqlite3_exec(msg_db, 
+        "CREATE TABLE IF NOT EXISTS msg_client(client_key integer primary key, client_id text not null, "
+        "username text not null default '', unique(client_id, username));", NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create msg_client: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    if (!table_has_column(msg_table, "client_key") && 
+        exec_msg_sql("ALTER TABLE %s ADD COLUMN client_key integer;", "add client_key column") != SQLITE_OK) {
+        return 1;
+    }
+    // Rows without a publisher (written before store_client was enabled) stay out of the index
+    if (exec_msg_sql(converted ? "CREATE INDEX IF NOT EXISTS idx_msg_meta_client ON %s(client_key, ulid) WHERE client_key IS NOT NULL;"
+                               : "CREATE INDEX IF NOT EXISTS idx_msg_client ON %s(client_key, ulid) WHERE client_key IS NOT NULL;", 
+                     "create client_key index") != SQLITE_OK || create_client_view() != 0) {
+        return 1;
+    }
+    
+    if (client_select_stmt == NULL && 
+        (sqlite3_prepare_v2(msg_db, "SELECT client_key FROM msg_client WHERE client_id = ?1 AND username = ?2", 
+                            -1, &client_select_stmt, NULL) != SQLITE_OK ||
+         sqlite3_prepare_v2(msg_db, "INSERT INTO msg_client (client_id, username) VALUES (?1, ?2)", 
+                            -1, &client_insert_stmt, NULL) != SQLITE_OK)) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare msg_client statements: %s", sqlite3_errmsg(msg_db));
+        sqlite3_finalize(client_select_stmt);
+        client_select_stmt = NULL;
+        return 1;
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Publisher client id and username stored in msg_client");
+    return 0;
+}
+
+// Detect the layout of an existing database, or create the requested one, plus indexes
+// Returns 0 if the message tables are usable
+static int init_message_schema(void) {
+    if (load_schema_version() != 0) {
+        return 1;
+    }
+    
+    char *err_msg = NULL;
+    char *msg_type = schema_object_type("msg");
+    char *meta_type = schema_object_type("msg_meta");
+    int msg_is_table = msg_type != NULL && strcmp(msg_type, "table") == 0;
+    int msg_is_view = msg_type != NULL && strcmp(msg_type, "view") == 0;
+    int fresh = msg_type == NULL;
+    // msg_meta is only filled in the background until the split migration swaps the view
+    int has_meta = meta_type != NULL && !(migration != NULL && migration_phase == MIGRATION_BACKFILL);
+    sqlite3_free(msg_type);
+    sqlite3_free(meta_type);
+    
+    msg_table = "msg";
+    storage_layout = LAYOUT_INLINE;
+    int rc;
+    if (has_meta || (fresh && requested_layout == LAYOUT_SPLIT)) {
+        rc = init_split_layout();
+    } else if (msg_is_view || requested_layout == LAYOUT_BLOB || dedup_min_size > 0 || offload_min_size > 0) {
+        // The blob layout stays in place once created, even if deduplication is turned off again
+        rc = init_blob_layout(msg_is_table);
+    } else {
+		const char *sql = "create table if not exists msg(ulid text primary key, topic text not null, payload text not null, retain integer not null default 0, qos integer not null default 0, headers text);";
+		rc = sqlite3_exec(msg_db, sql, NULL, 0, &err_msg);
+		if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "SQL error: %s", err_msg);
+			sqlite3_free(err_msg);
+		}
+    }
+    if (rc != 0) {
+        return 1;
+    }
+    
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Storage layout: %s", layout_name(storage_layout));
+    if (dedup_min_size > 0) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Payload deduplication enabled for payloads >= %d bytes", dedup_min_size);
+    }
+    
+    // A split layout converted online keeps the indexes built during the copy (idx_msg_meta_*),
+    // the idx_msg_* names belong to the old table until it is dropped
+    char *converted_type = storage_layout == LAYOUT_SPLIT ? schema_object_type("idx_msg_meta_topic") : NULL;
+    int converted = converted_type != NULL;
+    sqlite3_free(converted_type);
+    
+    // Create index on topic for faster topic-based queries
+    if (converted || exec_msg_sql("CREATE INDEX IF NOT EXISTS idx_msg_topic ON %s(topic);", "create topic index") == SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Index on topic column ensured");
+    }
+    
+    // Create compound index for efficient "find latest by topic" queries (ORDER BY ulid DESC)
+    if (!converted) {
+        exec_msg_sql("CREATE INDEX IF NOT EXISTS idx_msg_topic_ulid ON %s(topic, ulid DESC);", "create topic_ulid index");
+    }
+    
+    if (store_client && init_client_store(converted) != 0) {
+        store_client = 0;
+    }
+    
+    if (message_expiry) {
+        // Only messages with an expiry are indexed, so the index stays small
+        if (!table_has_column(msg_table, "expires_at") && 
+            exec_msg_sql("ALTER TABLE %s ADD COLUMN expires_at integer;", "add expires_at column") != SQLITE_OK) {
+            message_expiry = 0;
+        } else {
+            exec_msg_sql(converted ? "CREATE INDEX IF NOT EXISTS idx_msg_meta_expires ON %s(expires_at) WHERE expires_at IS NOT NULL;"
+                                   : "CREATE INDEX IF NOT EXISTS idx_msg_expires ON %s(expires_at) WHERE expires_at IS NOT NULL;", 
+                         "create expires_at index");
+        }
+    }
+    
+    return 0;
+}
+
+// Prepare the expiry sweeper statements (range scan over idx_msg_expires)
+static void init_expiry_statements(void) {
+    if (prepare_msg_statement("SELECT ulid, topic FROM %s WHERE expires_at <= ?1 ORDER BY expires_at LIMIT ?2", 
+                              &expiry_select_stmt) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare expiry_select statement: %s", sqlite3_errmsg(msg_db));
+        return;
+    }
+    if (prepare_msg_statement("DELETE FROM %s WHERE ulid = ?1", &expiry_delete_stmt) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare expiry_delete statement: %s", sqlite3_errmsg(msg_db));
+        sqlite3_finalize(expiry_select_stmt);
+        expiry_select_stmt = NULL;
+        return;
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Message expiry enabled: expired messages are deleted");
+}
+
+// Prepare the statements that write to the physical message table (msg_table)
+static void prepare_message_statements(void) {
+    // Parameters are numbered by column (see step_message_statement)
+    const char *columns = "ulid, topic, payload, retain, qos, headers";
+    const char *values = "?1, ?2, ?3, ?4, ?5, ?6";
+    if (storage_layout == LAYOUT_BLOB) {
+        columns = "ulid, topic, payload, retain, qos, headers, payload_hash";
+        values = "?1, ?2, ?3, ?4, ?5, ?6, ?7";
+    } else if (storage_layout == LAYOUT_SPLIT) {
+        columns = "ulid, topic, retain, qos";
+        values = "?1, ?2, ?4, ?5";
+    }
+    // A handoff script may run twice (see handoff_execute), so sqld skips rows it already has
+    char *insert_sql = sqlite3_mprintf("insert into %%s (%s%s%s) values (%s%s%s)%s", 
+                                       columns, message_expiry ? ", expires_at" : "", store_client ? ", client_key" : "", 
+                                       values, message_expiry ? ", ?8" : "", store_client ? ", ?9" : "", 
+                                       handoff_socket != NULL ? " on conflict(ulid) do nothing" : "");
+    int rc = insert_sql != NULL ? prepare_msg_statement(insert_sql, &insert_stmt) : SQLITE_NOMEM;
+    sqlite3_free(insert_sql);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare insert data statement: %s", sqlite3_errmsg(msg_db));
+    }
+
+    // Prepare delete statement for clearing retained messages
+    // Deletes by topic AND ulid when ULID is known from message properties
+    rc = prepare_msg_statement( 
+        "DELETE FROM %s WHERE topic = ?1 AND ulid = ?2", 
+        &delete_stmt);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare delete statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    // Prepare statement for finding latest message ULID for fallback delete
+    rc = prepare_msg_statement( 
+        "SELECT ulid FROM %s WHERE topic = ?1 ORDER BY ulid DESC LIMIT 1", 
+        &find_latest_stmt);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare find_latest statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    // With the handoff, inserts earlier in the script are not in the local database yet, so the
+    // newest row is looked up by sqld as part of the delete
+    if (handoff_socket != NULL) {
+        char *latest_sql = sqlite3_mprintf(
+            "DELETE FROM %s WHERE topic = ?1 AND ulid = (SELECT max(ulid) FROM %s WHERE topic = ?1)", 
+            msg_table, msg_table);
+        rc = latest_sql != NULL ? sqlite3_prepare_v2(msg_db, latest_sql, -1, &delete_latest_stmt, 0) : SQLITE_NOMEM;
+        sqlite3_free(latest_sql);
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare delete_latest statement: %s", sqlite3_errmsg(msg_db));
+        }
+    }
+    
+    // Prepare statement for retention cleanup (delete a slice of messages older than cutoff)
+    char *retention_sql = sqlite3_mprintf(
+        "DELETE FROM %s WHERE ulid IN (SELECT ulid FROM %s WHERE ulid < ?1 ORDER BY ulid LIMIT ?2)", 
+        msg_table, msg_table);
+    rc = retention_sql != NULL ? sqlite3_prepare_v2(msg_db, retention_sql, -1, &retention_delete_stmt, 0) : SQLITE_NOMEM;
+    sqlite3_free(retention_sql);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare retention_delete statement: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    // The topics of the same slice, taken off the topic tree once it is deleted
+    if (topic_tree_enabled) {
+        char *topics_sql = sqlite3_mprintf(
+            "SELECT topic, count(*) FROM (SELECT topic FROM %s WHERE ulid < ?1 ORDER BY ulid LIMIT ?2) GROUP BY topic", 
+            msg_table);
+        rc = topics_sql != NULL ? sqlite3_prepare_v2(msg_db, topics_sql, -1, &retention_topics_stmt, 0) : SQLITE_NOMEM;
+        sqlite3_free(topics_sql);
+        if (rc != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare retention_topics statement: %s", sqlite3_errmsg(msg_db));
+        }
+    }
+}
+
+// One online migration: rows of the source table are copied into the new tables by ULID range
+struct schema_migration {
+    int version;
+    const char *name;
+    const char *source;                                // Copied, then drained and dropped
+    int (*applies)(void);                              // Start this migration on the opened database
+    int (*prepare)(void);                              // Create the new tables and dual-write triggers
+    int (*copy)(const char *after, const char *last);  // Copy source rows with after < ulid <= last
+    int (*swap)(void);                                 // Drop the triggers, point msg at the new tables
+    void (*activate)(void);                            // Switch the plugin statements to the new tables
+};
+
+// Optional msg_data columns carried over to msg_meta (", expires_at, client_key")
+static char split_copy_columns[64];
+static char split_copy_values[64];
+
+// Existing inline and blob databases move to the split layout when it is requested
+static int split_migration_applies(void) {
+    return requested_layout == LAYOUT_SPLIT && storage_layout != LAYOUT_SPLIT;
+}
+
+// Runs on start and on every resume of the backfill, so it has to be repeatable
+static int split_migration_prepare(void) {
+    // The inline msg table becomes msg_data first (a rename, see init_blob_layout)
+    if (storage_layout == LAYOUT_INLINE && init_blob_layout(1) != 0) {
+        return 1;
+    }
+    if (create_split_tables() != 0) {
+        return 1;
+    }
+    
+    char *err_msg = NULL;
+    int copy_expires = table_has_column("msg_data", "expires_at");
+    int copy_client = table_has_column("msg_data", "client_key");
+    snprintf(split_copy_columns, sizeof(split_copy_columns), "%s%s", 
+             copy_expires ? ", expires_at" : "", copy_client ? ", client_key" : "");
+    snprintf(split_copy_values, sizeof(split_copy_values), "%s%s", 
+             copy_expires ? ", NEW.expires_at" : "", copy_client ? ", NEW.client_key" : "");
+    char *sql = sqlite3_mprintf(
+        "CREATE INDEX IF NOT EXISTS idx_msg_meta_topic ON msg_meta(topic);"
+        "CREATE INDEX IF NOT EXISTS idx_msg_meta_topic_ulid ON msg_meta(topic, ulid DESC);"
+        "%s%s"
+        "DROP TRIGGER IF EXISTS msg_data_migrate_insert;"
+        "CREATE TRIGGER msg_data_migrate_insert AFTER INSERT ON msg_data BEGIN "
+        "INSERT OR IGNORE INTO msg_meta (ulid, topic, retain, qos%s) VALUES (NEW.ulid, NEW.topic, NEW.retain, NEW.qos%s); "
+        "INSERT OR IGNORE INTO msg_payload (ulid, payload, headers, payload_hash) "
+        "VALUES (NEW.ulid, NEW.payload, NEW.headers, NEW.payload_hash); END;"
+        "CREATE TRIGGER IF NOT EXISTS msg_data_migrate_delete AFTER DELETE ON msg_data BEGIN "
+        "DELETE FROM msg_meta WHERE ulid = OLD.ulid; DELETE FROM msg_payload WHERE ulid = OLD.ulid; END;"
+        // Each copy holds its own payload_blob reference, released when the source row is drained
+        "CREATE TRIGGER IF NOT EXISTS msg_payload_migrate_ref AFTER INSERT ON msg_payload "
+        "WHEN NEW.payload_hash IS NOT NULL BEGIN "
+        "UPDATE payload_blob SET refcount = refcount + 1 WHERE hash = NEW.payload_hash; END;", 
+        copy_expires && !table_has_column("msg_meta", "expires_at") ? 
+            "ALTER TABLE msg_meta ADD COLUMN expires_at integer;"
+            "CREATE INDEX IF NOT EXISTS idx_msg_meta_expires ON msg_meta(expires_at) WHERE expires_at IS NOT NULL;" : "", 
+        copy_client && !table_has_column("msg_meta", "client_key") ? 
+            "ALTER TABLE msg_meta ADD COLUMN client_key integer;"
+            "CREATE INDEX IF NOT EXISTS idx_msg_meta_client ON msg_meta(client_key, ulid) WHERE client_key IS NOT NULL;" : "", 
+        split_copy_columns, split_copy_values);
+    int rc = sql != NULL ? sqlite3_exec(msg_db, sql, NULL, 0, &err_msg) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare split migration: %s", err_msg != NULL ? err_msg : sqlite3_errstr(rc));
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    return 0;
+}
+
+static int split_migration_copy(const char *after, const char *last) {
+    char *sql = sqlite3_mprintf(
+        "INSERT OR IGNORE INTO msg_meta (ulid, topic, retain, qos%s) "
+        "SELECT ulid, topic, retain, qos%s FROM msg_data WHERE ulid > %Q AND ulid <= %Q;"
+        "INSERT OR IGNORE INTO msg_payload (ulid, payload, headers, payload_hash) "
+        "SELECT ulid, payload, headers, payload_hash FROM msg_data WHERE ulid > %Q AND ulid <= %Q;", 
+        split_copy_columns, split_copy_columns, after, last, after, last);
+    int rc = sql != NULL ? sqlite3_exec(msg_db, sql, NULL, 0, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    return rc;
+}
+
+static int split_migration_swap(void) {
+    int rc = sqlite3_exec(msg_db, 
+        "DROP TRIGGER IF EXISTS msg_data_migrate_insert;"
+        "DROP TRIGGER IF EXISTS msg_data_migrate_delete;"
+        "DROP TRIGGER IF EXISTS msg_payload_migrate_ref;"
+        "DROP VIEW IF EXISTS msg;", 
+        NULL, 0, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    return create_split_view() == 0 ? SQLITE_OK : SQLITE_ERROR;
+}
+
+// Finalize the statements bound to msg_table
+static void finalize_message_statements(void) {
+    sqlite3_stmt **stmts[] = { &insert_stmt, &delete_stmt, &find_latest_stmt, &delete_latest_stmt, &retention_delete_stmt, 
+                               &retention_topics_stmt, &expiry_select_stmt, &expiry_delete_stmt };
+    for (size_t i = 0; i < sizeof(stmts) / sizeof(stmts[0]); i++) {
+        sqlite3_finalize(*stmts[i]);
+        *stmts[i] = NULL;
+    }
+}
+
+static void split_migration_activate(void) {
+    finalize_message_statements();
+    msg_table = "msg_meta";
+    storage_layout = LAYOUT_SPLIT;
+    prepare_message_statements();
+    init_split_statements();
+    if (message_expiry) {
+        init_expiry_statements();
+    }
+    if (store_client) {
+        create_client_view();
+    }
+}
+
+// Migrations in version order; a version is never reused
+static const struct schema_migration schema_migrations[] = {
+    { 1, "split layout", "msg_data", split_migration_applies, split_migration_prepare, 
+      split_migration_copy, split_migration_swap, split_migration_activate },
+};
+
+// Create schema_version and pick up a migration the last shutdown interrupted
+static int load_schema_version(void) {
+    char *err_msg = NULL;
+    int rc = sqlite3_exec(msg_db, 
+        "CREATE TABLE IF NOT EXISTS schema_version(version integer primary key, name text not null, "
+        "state text not null, cursor text not null default '', rows integer not null default 0, "
+        "started_at integer, finished_at integer);", 
+        NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create schema_version table: %s", err_msg);
+        sqlite3_free(err_msg);
+        return 1;
+    }
+    
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(msg_db, "SELECT version, state, cursor, rows FROM schema_version ORDER BY version", 
+                           -1, &stmt, NULL) != SQLITE_OK) {
+        return 1;
+    }
+    migration = NULL;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int version = sqlite3_column_int(stmt, 0);
+        const char *state = (const char *)sqlite3_column_text(stmt, 1);
+        if (strcmp(state, "done") == 0) {
+            atomic_store(&current_schema_version, version);
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(schema_migrations) / sizeof(schema_migrations[0]); i++) {
+            if (schema_migrations[i].version == version) {
+                migration = &schema_migrations[i];
+            }
+        }
+        if (migration == NULL) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown schema migration %d (%s) left unfinished", version, state);
+            continue;
+        }
+        migration_phase = strcmp(state, "drain") == 0 ? MIGRATION_DRAIN : MIGRATION_BACKFILL;
+        snprintf(migration_cursor, sizeof(migration_cursor), "%s", (const char *)sqlite3_column_text(stmt, 2));
+        atomic_store(&migration_rows, (unsigned long long)sqlite3_column_int64(stmt, 3));
+        break;
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+// Record a migration step in schema_version (inside the step's transaction)
+static int update_schema_version(const char *state) {
+    char *sql = sqlite3_mprintf(
+        "UPDATE schema_version SET state = %Q, cursor = %Q, rows = %llu%s WHERE version = %d", 
+        state, migration_cursor, atomic_load(&migration_rows), 
+        strcmp(state, "done") == 0 ? ", finished_at = strftime('%s', 'now')" : "", migration->version);
+    int rc = sql != NULL ? sqlite3_exec(msg_db, sql, NULL, 0, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    return rc;
+}
+
+// Resume the backfill of an interrupted migration or start the next one that applies
+// (worker thread, after the layout is known and before the statements are prepared)
+static void init_schema_migration(void) {
+    const struct schema_migration *start = NULL;
+    if (migration == NULL) {
+        for (size_t i = 0; i < sizeof(schema_migrations) / sizeof(schema_migrations[0]); i++) {
+            if (schema_migrations[i].version > atomic_load(&current_schema_version) && schema_migrations[i].applies()) {
+                start = &schema_migrations[i];
+                break;
+            }
+        }
+        if (start == NULL) {
+            return;
+        }
+    } else if (migration_phase != MIGRATION_BACKFILL) {
+        atomic_store(&migration_running, 1);
         return;
     }
     
-    if (ulid != NULL) {
-        entry->operation = OP_DELETE;
-        memcpy(entry->ulid, ulid, 27);
+    const struct schema_migration *m = start != NULL ? start : migration;
+    int rc = write_begin();
+    if (rc == SQLITE_OK && m->prepare() != 0) {
+        rc = SQLITE_ERROR;
+    }
+    if (rc == SQLITE_OK && start != NULL) {
+        char *sql = sqlite3_mprintf(
+            "INSERT OR REPLACE INTO schema_version (version, name, state, started_at) VALUES (%d, %Q, 'backfill', strftime('%%s', 'now'))", 
+            start->version, start->name);
+        rc = sql != NULL ? sqlite3_exec(msg_db, sql, NULL, 0, NULL) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+    }
+    if (rc == SQLITE_OK) {
+        rc = write_commit();
     } else {
-        entry->operation = OP_DELETE_FALLBACK;
-        entry->ulid[0] = '\0';
+        write_rollback();
     }
-    entry->topic = strdup(topic);
-    entry->payload = NULL;
-    entry->headers = NULL;
-    entry->retain = 0;
-    entry->qos = 0;
-    entry->next = NULL;
-    
-    if (entry->topic == NULL) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to allocate delete topic string");
-        free(entry);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Schema migration %d (%s) not started: %s", 
+                            m->version, m->name, sqlite3_errstr(rc));
+        // A failed conversion may have changed the layout detected in memory
+        if (start != NULL) {
+            init_message_schema();
+        }
         return;
     }
     
-    pthread_mutex_lock(&queue_mutex);
-    
-    // Add to queue
-    if (msg_queue_tail == NULL) {
-        msg_queue_head = msg_queue_tail = entry;
+    if (start != NULL) {
+        migration = start;
+        migration_phase = MIGRATION_BACKFILL;
+        migration_cursor[0] = '\0';
+        atomic_store(&migration_rows, 0);
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Schema migration %d (%s) started", m->version, m->name);
     } else {
-        msg_queue_tail->next = entry;
-        msg_queue_tail = entry;
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Schema migration %d (%s) resumed after %llu rows", 
+                            m->version, m->name, atomic_load(&migration_rows));
     }
-    msg_queue_size++;
-    
-    // Signal the batch worker immediately for delete operations
-    pthread_cond_signal(&queue_cond);
-    
-    pthread_mutex_unlock(&queue_mutex);
+    atomic_store(&migration_running, 1);
 }
 
-// Flush queued messages to database as a batch
-static void flush_batch(void) {
-    struct msg_entry *batch_head = NULL;
-    int batch_count = 0;
-    
-    pthread_mutex_lock(&queue_mutex);
-    if (msg_queue_size == 0) {
-        pthread_mutex_unlock(&queue_mutex);
-        return;
+// Copy the next chunk of the source table; returns the rows copied or -1 on error
+static int migration_copy_chunk(void) {
+    if (write_begin() != SQLITE_OK) {
+        return -1;
     }
     
-    // Take all messages from queue
-    batch_head = msg_queue_head;
-    batch_count = msg_queue_size;
-    msg_queue_head = msg_queue_tail = NULL;
-    msg_queue_size = 0;
-    pthread_mutex_unlock(&queue_mutex);
+    sqlite3_stmt *stmt = NULL;
+    char *sql = sqlite3_mprintf("SELECT max(ulid), count(*) FROM (SELECT ulid FROM %s WHERE ulid > ?1 ORDER BY ulid LIMIT %d)", 
+                                migration->source, MIGRATION_CHUNK);
+    int rc = sql != NULL ? sqlite3_prepare_v2(msg_db, sql, -1, &stmt, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
     
-    if (batch_count == 0 || msg_db == NULL) {
-        return;
+    char last[27] = "";
+    int count = 0;
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, migration_cursor, -1, SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+            count = sqlite3_column_int(stmt, 1);
+            if (count > 0) {
+                snprintf(last, sizeof(last), "%s", (const char *)sqlite3_column_text(stmt, 0));
+            }
+            rc = SQLITE_OK;
+        }
     }
+    sqlite3_finalize(stmt);
     
-    // Begin transaction for batch operations
-    char *err_msg = NULL;
-    int rc = sqlite3_exec(msg_db, "BEGIN TRANSACTION", NULL, NULL, &err_msg);
+    if (rc == SQLITE_OK && count > 0) {
+        rc = migration->copy(migration_cursor, last);
+        if (rc == SQLITE_OK) {
+            memcpy(migration_cursor, last, sizeof(last));
+            atomic_fetch_add(&migration_rows, (unsigned long long)count);
+            rc = update_schema_version("backfill");
+        }
+    }
     if (rc != SQLITE_OK) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to begin transaction: %s", err_msg);
-        sqlite3_free(err_msg);
-        // Fall through and try individual operations anyway
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Schema migration %d copy failed: %s", migration->version, sqlite3_errmsg(msg_db));
+        write_rollback();
+        // Reload the committed cursor
+        load_schema_version();
+        return -1;
+    }
+    return write_commit() == SQLITE_OK ? count : -1;
+}
+
+// Point msg at the new tables in one transaction; writes go there from the next batch on
+static int migration_swap(void) {
+    if (write_begin() != SQLITE_OK) {
+        return 1;
+    }
+    int rc = migration->swap();
+    if (rc == SQLITE_OK) {
+        rc = update_schema_version("drain");
+    }
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Schema migration %d swap failed: %s", migration->version, sqlite3_errmsg(msg_db));
+        write_rollback();
+        return 1;
+    }
+    if (write_commit() != SQLITE_OK) {
+        return 1;
     }
     
-    // Process all entries in batch
-    struct msg_entry *entry = batch_head;
-    int insert_count = 0;
-    int delete_count = 0;
-    while (entry != NULL) {
-        if (entry->operation == OP_INSERT) {
-            // Insert operation
-            if (insert_stmt != NULL) {
-                sqlite3_bind_text(insert_stmt, 1, entry->ulid, -1, SQLITE_STATIC);
-                sqlite3_bind_text(insert_stmt, 2, entry->topic, -1, SQLITE_STATIC);
-                sqlite3_bind_text(insert_stmt, 3, entry->payload, -1, SQLITE_STATIC);
-                sqlite3_bind_int(insert_stmt, 4, entry->retain);
-                sqlite3_bind_int(insert_stmt, 5, entry->qos);
-                if (entry->headers) {
-                    sqlite3_bind_text(insert_stmt, 6, entry->headers, -1, SQLITE_STATIC);
-                } else {
-                    sqlite3_bind_null(insert_stmt, 6);
-                }
-                
-                rc = sqlite3_step(insert_stmt);
-                if (rc == SQLITE_DONE) {
-                    insert_count++;
-                } else {
-                    mosquitto_log_printf(MOSQ_LOG_ERR, "Batch insert failed for topic %s: %s", 
-                                       entry->topic, sqlite3_errmsg(msg_db));
-                }
-                sqlite3_reset(insert_stmt);
-            }
-        } else if (entry->operation == OP_DELETE) {
-            // Delete with specific ULID
-            if (delete_stmt != NULL) {
-                sqlite3_bind_text(delete_stmt, 1, entry->topic, -1, SQLITE_STATIC);
-                sqlite3_bind_text(delete_stmt, 2, entry->ulid, -1, SQLITE_STATIC);
-                
-                rc = sqlite3_step(delete_stmt);
-                if (rc == SQLITE_DONE) {
-                    int changes = sqlite3_changes(msg_db);
-                    if (changes > 0) {
-                        delete_count++;
-                        mosquitto_log_printf(MOSQ_LOG_INFO, "Deleted message for topic: %s (ulid: %s)", 
-                                            entry->topic, entry->ulid);
-                    }
-                } else {
-                    mosquitto_log_printf(MOSQ_LOG_ERR, "Delete failed for topic %s: %s", 
-                                       entry->topic, sqlite3_errmsg(msg_db));
-                }
-                sqlite3_reset(delete_stmt);
-            }
-        } else if (entry->operation == OP_DELETE_FALLBACK) {
-            // Delete most recent message for topic (fallback when no ULID provided)
-            if (find_latest_stmt != NULL) {
-                sqlite3_bind_text(find_latest_stmt, 1, entry->topic, -1, SQLITE_STATIC);
-                if (sqlite3_step(find_latest_stmt) == SQLITE_ROW) {
-                    const char *found_ulid = (const char *)sqlite3_column_text(find_latest_stmt, 0);
-                    if (delete_stmt != NULL && found_ulid != NULL) {
-                        sqlite3_bind_text(delete_stmt, 1, entry->topic, -1, SQLITE_STATIC);
-                        sqlite3_bind_text(delete_stmt, 2, found_ulid, -1, SQLITE_TRANSIENT);
-                        
-                        rc = sqlite3_step(delete_stmt);
-                        if (rc == SQLITE_DONE && sqlite3_changes(msg_db) > 0) {
-                            delete_count++;
-                            mosquitto_log_printf(MOSQ_LOG_INFO, "Deleted most recent message for topic: %s (ulid: %s)", 
-                                                entry->topic, found_ulid);
-                        }
-                        sqlite3_reset(delete_stmt);
-                    }
-                } else {
-                    mosquitto_log_printf(MOSQ_LOG_WARNING, "No message found to delete for topic: %s", entry->topic);
-                }
-                sqlite3_reset(find_latest_stmt);
-            }
+    migration->activate();
+    migration_phase = MIGRATION_DRAIN;
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Schema migration %d (%s): %llu rows copied, msg switched to the new tables", 
+                        migration->version, migration->name, atomic_load(&migration_rows));
+    return 0;
+}
+
+// Delete a slice of the old table, dropping it once empty; returns 1 when the migration is done
+static int migration_drain_chunk(void) {
+    if (write_begin() != SQLITE_OK) {
+        return -1;
+    }
+    char *sql = sqlite3_mprintf("DELETE FROM %s WHERE rowid IN (SELECT rowid FROM %s LIMIT %d)", 
+                                migration->source, migration->source, MIGRATION_CHUNK);
+    int rc = sql != NULL ? sqlite3_exec(msg_db, sql, NULL, 0, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    int done = rc == SQLITE_OK && sqlite3_changes(msg_db) == 0;
+    if (done) {
+        sql = sqlite3_mprintf("DROP TABLE %s", migration->source);
+        rc = sql != NULL ? sqlite3_exec(msg_db, sql, NULL, 0, NULL) : SQLITE_NOMEM;
+        sqlite3_free(sql);
+        if (rc == SQLITE_OK) {
+            rc = update_schema_version("done");
         }
-        
-        entry = entry->next;
     }
-    
-    // Commit transaction
-    rc = sqlite3_exec(msg_db, "COMMIT", NULL, NULL, &err_msg);
     if (rc != SQLITE_OK) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to commit transaction: %s", err_msg);
-        sqlite3_free(err_msg);
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Schema migration %d cleanup failed: %s", migration->version, sqlite3_errmsg(msg_db));
+        write_rollback();
+        return -1;
     }
-    
-    if (insert_count > 0 || delete_count > 0) {
-        LOG_DEBUG("Batch: %d inserts, %d deletes committed", 
-                  insert_count, delete_count);
+    if (write_commit() != SQLITE_OK) {
+        return -1;
     }
     
-    // Free batch entries
-    entry = batch_head;
-    while (entry != NULL) {
-        struct msg_entry *next = entry->next;
-        free(entry->topic);
-        free(entry->payload);
-        free(entry->headers);
-        free(entry);
-        entry = next;
+    // Drained rows released their payload references and pages
+    payload_gc_pending = 1;
+    vacuum_pending = 1;
+    if (done) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Schema migration %d (%s) finished, %s dropped", 
+                            migration->version, migration->name, migration->source);
+        atomic_store(&current_schema_version, migration->version);
+        atomic_store(&migration_running, 0);
+        migration = NULL;
+        migration_phase = 0;
     }
+    return done;
 }
 
-// Generate ULID prefix (first 10 chars) from timestamp in milliseconds
-// Used for time-based queries since ULIDs are lexicographically sortable by time
-static void timestamp_to_ulid_prefix(unsigned long long ts_ms, char prefix[11]) {
-    static const char set[] = "0123456789ABCDEFGHJKMNPQRSTVWXYZ";
-    
-    // ULID timestamp is stored in first 6 bytes (48 bits), encoded as 10 base32 chars
-    unsigned char bytes[6];
-    bytes[0] = ts_ms >> 40;
-    bytes[1] = ts_ms >> 32;
-    bytes[2] = ts_ms >> 24;
-    bytes[3] = ts_ms >> 16;
-    bytes[4] = ts_ms >> 8;
-    bytes[5] = ts_ms >> 0;
+// Advance the migration in progress for at most MIGRATION_BUDGET_MS (worker thread)
+// After an error the migration pauses for MIGRATION_RETRY_SEC
+static void run_schema_migration(void) {
+    if (migration == NULL || time(NULL) < migration_paused_until) {
+        return;
+    }
     
-    // Encode to base32 (same as ulid_encode but only first 10 chars)
-    prefix[0] = set[bytes[0] >> 5];
-    prefix[1] = set[bytes[0] & 0x1f];
-    prefix[2] = set[bytes[1] >> 3];
-    prefix[3] = set[(bytes[1] << 2 | bytes[2] >> 6) & 0x1f];
-    prefix[4] = set[(bytes[2] >> 1) & 0x1f];
-    prefix[5] = set[(bytes[2] << 4 | bytes[3] >> 4) & 0x1f];
-    prefix[6] = set[(bytes[3] << 1 | bytes[4] >> 7) & 0x1f];
-    prefix[7] = set[(bytes[4] >> 2) & 0x1f];
-    prefix[8] = set[(bytes[4] << 3 | bytes[5] >> 5) & 0x1f];
-    prefix[9] = set[bytes[5] & 0x1f];
-    prefix[10] = '\0';
+    unsigned long long start_ms = platform_utime(1) / 1000;
+    do {
+        int rc;
+        if (migration_phase == MIGRATION_BACKFILL) {
+            rc = migration_copy_chunk();
+            if (rc == 0) {
+                rc = migration_swap() == 0 ? 1 : -1;
+            }
+        } else {
+            rc = migration_drain_chunk();
+        }
+        if (rc < 0) {
+            migration_paused_until = time(NULL) + MIGRATION_RETRY_SEC;
+            return;
+        }
+    } while (migration != NULL && platform_utime(1) / 1000 - start_ms < MIGRATION_BUDGET_MS);
 }
 
-// Delete messages older than retention_days
-// Uses ULID prefix comparison for efficient deletion (ULIDs are lexicographically sortable)
-static void cleanup_old_messages(void) {
-    if (retention_days <= 0 || msg_db == NULL) {
+// Seed the hybrid logical clock with the newest stored ULID. Runs before the schema is
+// migrated (plugin init), so it reads whichever message tables the file already has
+static void seed_ulid_clock(void) {
+    // Physical tables only: msg is a view in the blob and split layouts
+    static const char *const sources[][2] = {
+        { "msg", "ulid" }, { "msg_data", "ulid" }, { "msg_meta", "ulid" }, { "msg_bucket", "bucket_end" },
+    };
+    
+    char *sql = NULL;
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        char *type = schema_object_type(sources[i][0]);
+        int is_table = type != NULL && strcmp(type, "table") == 0;
+        sqlite3_free(type);
+        if (!is_table) {
+            continue;
+        }
+        sql = sql == NULL ? sqlite3_mprintf("SELECT max(%s) AS m FROM %s", sources[i][1], sources[i][0]) 
+                          : sqlite3_mprintf("%z UNION ALL SELECT max(%s) AS m FROM %s", sql, sources[i][1], sources[i][0]);
+        if (sql == NULL) {
+            return;
+        }
+    }
+    if (sql == NULL) {
         return;
     }
     
-    time_t now = time(NULL);
-    
-    // Only run cleanup periodically (every RETENTION_CHECK_INTERVAL_SEC)
-    if (now - last_retention_check < RETENTION_CHECK_INTERVAL_SEC) {
+    sqlite3_stmt *stmt = NULL;
+    char *max_sql = sqlite3_mprintf("SELECT max(m) FROM (%s)", sql);
+    sqlite3_free(sql);
+    int rc = max_sql != NULL ? sqlite3_prepare_v2(msg_db, max_sql, -1, &stmt, NULL) : SQLITE_NOMEM;
+    sqlite3_free(max_sql);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to read newest ULID: %s", sqlite3_errmsg(msg_db));
         return;
     }
-    last_retention_check = now;
-    
-    // Calculate cutoff timestamp in milliseconds
-    unsigned long long cutoff_ms = ((unsigned long long)now - (retention_days * 24 * 60 * 60)) * 1000ULL;
     
-    // Generate ULID prefix for cutoff time
-    char cutoff_prefix[11];
-    timestamp_to_ulid_prefix(cutoff_ms, cutoff_prefix);
-    
-    // Use prepared statement for safe deletion
-    if (retention_delete_stmt != NULL) {
-        sqlite3_bind_text(retention_delete_stmt, 1, cutoff_prefix, -1, SQLITE_STATIC);
-        int rc = sqlite3_step(retention_delete_stmt);
-        if (rc != SQLITE_DONE) {
-            mosquitto_log_printf(MOSQ_LOG_ERR, "Retention cleanup failed: %s", sqlite3_errmsg(msg_db));
-        } else {
-            int deleted = sqlite3_changes(msg_db);
-            if (deleted > 0) {
-                mosquitto_log_printf(MOSQ_LOG_INFO, "Retention cleanup: deleted %d messages older than %d days", 
-                                    deleted, retention_days);
-            }
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+        const char *newest = (const char *)sqlite3_column_text(stmt, 0);
+        char now_prefix[11];
+        timestamp_to_ulid_prefix(platform_utime(0) / 1000 + ULID_SEED_MAX_AHEAD_MS, now_prefix);
+        if (strncmp(newest, now_prefix, 10) > 0) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Newest stored ULID %s is far ahead of the clock, not used as ULID clock base", newest);
+        } else if (ulid_generator_seed(&ulid_gen, newest) == 0) {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "ULID clock continues after %s", newest);
         }
-        sqlite3_reset(retention_delete_stmt);
     }
+    sqlite3_finalize(stmt);
 }
 
-// Background worker thread for batch processing
-static void *batch_worker(void *arg) {
-    UNUSED(arg);
-    
-    struct timespec timeout;
+// Publish one metric as a retained $SYS message (broker thread only)
+static void publish_stat(const char *name, unsigned long long value) {
+    char topic[128];
+    char payload[32];
+    snprintf(topic, sizeof(topic), "$SYS/broker/sql/%s", name);
+    int len = snprintf(payload, sizeof(payload), "%llu", value);
+    mosquitto_broker_publish_copy(NULL, topic, len, payload, 0, true, NULL);
+}
+
+static int on_tick_callback(int event, void *event_data, void *userdata) {
+    UNUSED(event);
+    UNUSED(userdata);
+    struct mosquitto_evt_tick *ed = event_data;
     
-    mosquitto_log_printf(MOSQ_LOG_INFO, "Batch worker thread started");
+    if (persist_policy_count > 0) {
+        sweep_policy_states(ed->now_s);
+    }
+    if (stats_interval_sec == 0 || ed->now_s - last_stats_publish < stats_interval_sec) {
+        return MOSQ_ERR_SUCCESS;
+    }
+    last_stats_publish = ed->now_s;
     
-    while (atomic_load(&batch_thread_running)) {
-        pthread_mutex_lock(&queue_mutex);
-        
-        // Wait for either: queue size threshold or timeout
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_nsec += flush_interval_ms * 1000000L;
-        if (timeout.tv_nsec >= 1000000000L) {
-            timeout.tv_sec++;
-            timeout.tv_nsec -= 1000000000L;
+    publish_stat("ready", atomic_load(&db_ready));
+    if (atomic_load(&db_ready)) {
+        publish_stat("startup/init_ms", atomic_load(&db_init_ms));
+    }
+    unsigned long long pages = atomic_load(&db_page_count);
+    if (pages > 0) {
+        unsigned long long free_pages = atomic_load(&db_free_pages);
+        publish_stat("vacuum/free_pages", free_pages);
+        publish_stat("vacuum/free_pct", free_pages * 100 / pages);
+        publish_stat("vacuum/pages_released", atomic_load(&vacuum_pages_released));
+    }
+    if (optimize_interval_sec > 0) {
+        publish_stat("optimize/runs", atomic_load(&optimize_runs));
+        publish_stat("optimize/duration_ms", atomic_load(&optimize_duration_ms));
+        publish_stat("optimize/plan_changes", atomic_load(&plan_changes));
+    }
+    publish_stat("schema/version", atomic_load(&current_schema_version));
+    publish_stat("schema/migrating", atomic_load(&migration_running));
+    if (atomic_load(&migration_running)) {
+        publish_stat("schema/migration_rows", atomic_load(&migration_rows));
+    }
+    publish_stat("ulid/clock_corrections", atomic_load(&ulid_clock_corrections));
+    publish_stat("ulid/clock_max_step_back_ms", atomic_load(&ulid_clock_max_step_back_ms));
+    publish_stat("expiry/deleted", atomic_load(&expired_deleted));
+    int lane_depth[LANE_COUNT];
+    pthread_mutex_lock(&queue_mutex);
+    for (int l = 0; l < LANE_COUNT; l++) {
+        lane_depth[l] = msg_lanes[l].size;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    for (int l = 0; l < LANE_COUNT; l++) {
+        char name[64];
+        snprintf(name, sizeof(name), "queue/%s/depth", msg_lanes[l].name);
+        publish_stat(name, (unsigned long long)lane_depth[l]);
+        snprintf(name, sizeof(name), "queue/%s/dropped", msg_lanes[l].name);
+        publish_stat(name, atomic_load(&msg_lanes[l].dropped));
+    }
+    if (quota_clients != NULL || topic_quota_count > 0) {
+        publish_stat("quota/over_limit", atomic_load(&quota_over_limit));
+        publish_stat("quota/shed", atomic_load(&quota_shed));
+        publish_stat("quota/clients", atomic_load(&quota_clients_tracked));
+    }
+    if (persist_policy_count > 0) {
+        publish_stat("policy/topics", policy_state_count);
+        publish_stat("policy/evicted", atomic_load(&policy_states_evicted));
+    }
+    sqlite3_int64 mem_used = 0;
+    sqlite3_int64 mem_highwater = 0;
+    sqlite3_int64 malloc_size = 0;
+    sqlite3_int64 malloc_size_highwater = 0;
+    sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &mem_used, &mem_highwater, 0);
+    sqlite3_status64(SQLITE_STATUS_MALLOC_SIZE, &malloc_size, &malloc_size_highwater, 0);
+    publish_stat("sqlite/memory_used", (unsigned long long)mem_used);
+    publish_stat("sqlite/memory_highwater", (unsigned long long)mem_highwater);
+    publish_stat("sqlite/malloc_max", (unsigned long long)malloc_size_highwater);
+    if (sqlite_heap_installed) {
+        pthread_mutex_lock(&heap_mutex);
+        unsigned long long used = heap_used;
+        pthread_mutex_unlock(&heap_mutex);
+        publish_stat("heap/size", (unsigned long long)heap_atoms * SQLITE_HEAP_ATOM);
+        publish_stat("heap/used", used);
+        publish_stat("heap/fallbacks", atomic_load(&heap_fallbacks));
+    }
+    if (page_cache_installed) {
+        pthread_mutex_lock(&arena_mutex);
+        unsigned int slots = arena_slots;
+        unsigned int slots_used = arena_slots - arena_free_count;
+        pthread_mutex_unlock(&arena_mutex);
+        publish_stat("pcache/hits", atomic_load(&pcache_hits));
+        publish_stat("pcache/misses", atomic_load(&pcache_misses));
+        publish_stat("pcache/evictions", atomic_load(&pcache_evictions));
+        publish_stat("pcache/overflow", atomic_load(&pcache_overflow));
+        publish_stat("pcache/pages", slots);
+        publish_stat("pcache/pages_used", slots_used);
+        publish_stat("pcache/huge_pages", (unsigned long long)arena_huge);
+    }
+    if (store_client) {
+        publish_stat("client/cache_misses", atomic_load(&client_cache_misses));
+        publish_stat("client/added", atomic_load(&clients_added));
+    }
+    if (sparkplug_enabled) {
+        publish_stat("sparkplug/payloads", atomic_load(&sparkplug_payloads));
+        publish_stat("sparkplug/metrics", atomic_load(&sparkplug_metrics));
+        publish_stat("sparkplug/malformed", atomic_load(&sparkplug_malformed));
+        publish_stat("sparkplug/unresolved_aliases", atomic_load(&sparkplug_unresolved));
+        publish_stat("sparkplug/skipped", atomic_load(&sparkplug_skipped));
+    }
+    if (topic_tree_enabled) {
+        pthread_mutex_lock(&topic_tree_mutex);
+        unsigned long long tree_topics = topic_tree_root.subtree_topics;
+        unsigned long long tree_retained = topic_tree_root.subtree_retained;
+        pthread_mutex_unlock(&topic_tree_mutex);
+        publish_stat("tree/nodes", atomic_load(&topic_tree_nodes));
+        publish_stat("tree/topics", tree_topics);
+        publish_stat("tree/retained", tree_retained);
+        publish_stat("tree/requests", atomic_load(&topic_tree_requests));
+    }
+    publish_stat("writer/busy_waits", atomic_load(&busy_waits));
+    publish_stat("writer/busy_wait_ms", atomic_load(&busy_wait_ms));
+    publish_stat("writer/batch_retries", atomic_load(&batch_retries));
+    publish_stat("writer/batch_failures", atomic_load(&batch_failures));
+    publish_stat("writer/retry_queued", (unsigned long long)atomic_load(&retry_queued));
+    publish_stat("writer/retried", atomic_load(&operations_retried));
+    publish_stat("writer/dropped", atomic_load(&operations_dropped));
+    if (atomic_load(&deadletter_rows) >= 0) {
+        publish_stat("deadletter/rows", (unsigned long long)atomic_load(&deadletter_rows));
+        publish_stat("deadletter/stored", atomic_load(&deadletters_stored));
+        publish_stat("deadletter/replayed", atomic_load(&deadletters_replayed));
+    }
+    publish_stat("writer/flush_max_ms", atomic_exchange(&flush_max_us, 0) / 1000);
+    if (backup_interval_sec > 0 || atomic_load(&backups_completed) + atomic_load(&backups_failed) > 0 || 
+        atomic_load(&backup_running)) {
+        publish_stat("backup/completed", atomic_load(&backups_completed));
+        publish_stat("backup/failed", atomic_load(&backups_failed));
+        publish_stat("backup/running", atomic_load(&backup_running));
+        publish_stat("backup/progress_pct", atomic_load(&backup_progress_pct));
+        publish_stat("backup/duration_ms", atomic_load(&backup_duration_ms));
+        publish_stat("backup/size_bytes", atomic_load(&backup_size_bytes));
+        publish_stat("backup/throughput_kb_s", atomic_load(&backup_throughput_kb_s));
+    }
+    if (snapshot_dir != NULL) {
+        long long completed_at = atomic_load(&snapshot_completed_at);
+        publish_stat("snapshot/refreshes", atomic_load(&snapshot_refreshes));
+        publish_stat("snapshot/failures", atomic_load(&snapshot_failures));
+        publish_stat("snapshot/duration_ms", atomic_load(&snapshot_duration_ms));
+        publish_stat("snapshot/pages", atomic_load(&snapshot_pages));
+        if (completed_at > 0) {
+            publish_stat("snapshot/age_s", ed->now_s > completed_at ? (unsigned long long)(ed->now_s - completed_at) : 0);
         }
-        
-        // Wait with timeout - will wake up on signal or timeout
-        while (msg_queue_size < batch_size && atomic_load(&batch_thread_running)) {
-            int rc = pthread_cond_timedwait(&queue_cond, &queue_mutex, &timeout);
-            if (rc == ETIMEDOUT) {
-                break;  // Timeout - flush whatever we have
-            }
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+// Format cfg as "key value" lines for a control response
+static char *format_runtime_config(const struct runtime_config *cfg) {
+    return sqlite3_mprintf("generation %llu\nbatch_size %d\nflush_interval %d\nretention_days %d\n"
+                           "exclude_topics %s\nexclude_headers %s\n", 
+                           cfg->generation, cfg->batch_size, cfg->flush_interval_ms, cfg->retention_days, 
+                           cfg->exclude_topics ? cfg->exclude_topics : "", 
+                           cfg->exclude_headers ? cfg->exclude_headers : "");
+}
+
+// Apply "key value" lines (same keys as plugin_opt_*) on top of the current config
+// Returns NULL with *error set if a line is rejected; nothing is changed in that case
+static struct runtime_config *runtime_config_from_text(const char *text, size_t len, char **error) {
+    struct runtime_config *cfg = runtime_config_new(runtime_config_get());
+    char *copy = malloc(len + 1);
+    if (cfg == NULL || copy == NULL) {
+        runtime_config_free(cfg);
+        free(copy);
+        *error = sqlite3_mprintf("out of memory");
+        return NULL;
+    }
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    
+    char *saveptr = NULL;
+    for (char *line = strtok_r(copy, "\r\n", &saveptr); line != NULL; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        while (*line == ' ' || *line == '\t') line++;
+        if (*line == '\0' || *line == '#') {
+            continue;
         }
-        
-        pthread_mutex_unlock(&queue_mutex);
-        
-        // Flush accumulated messages
-        if (atomic_load(&batch_thread_running) || msg_queue_size > 0) {
-            flush_batch();
+        char *value = line + strcspn(line, " \t");
+        if (*value != '\0') {
+            *value++ = '\0';
+            while (*value == ' ' || *value == '\t') value++;
         }
-        
-        // Periodically cleanup old messages (if retention is enabled)
-        if (atomic_load(&batch_thread_running)) {
-            cleanup_old_messages();
+        int applied = runtime_config_set(cfg, line, value);
+        if (applied <= 0) {
+            *error = sqlite3_mprintf(applied < 0 ? "invalid value for %s: %s" : "%s cannot be changed at runtime", line, value);
+            runtime_config_free(cfg);
+            free(copy);
+            return NULL;
         }
     }
+    free(copy);
     
-    // Final flush on shutdown
-    flush_batch();
-    
-    mosquitto_log_printf(MOSQ_LOG_INFO, "Batch worker thread stopped");
-    return NULL;
+    runtime_config_compile(cfg);
+    return cfg;
 }
 
-// Extract user properties from message and format as semicolon-separated key=value string
-// Excludes headers in the exclude_headers list
-// Returns allocated string or NULL if no headers. Caller must free.
-// Optimized: single-pass with dynamic buffer growth
-static char *extract_headers(const mosquitto_property *properties) {
-    // If header storage is completely disabled, return NULL
-    if (headers_disabled) {
-        return NULL;
-    }
+// Messages on CONTROL_TOPIC carry "key value" lines to change; an empty payload only queries.
+// The resulting config (or the error) is published to CONTROL_RESPONSE_TOPIC
+static int on_control_callback(int event, void *event_data, void *userdata) {
+    UNUSED(event);
+    UNUSED(userdata);
+    struct mosquitto_evt_control *ed = event_data;
+    char *response = NULL;
     
-    if (properties == NULL) {
-        return NULL;
+    // "backup" starts a backup on the copy thread instead of changing the configuration
+    if (ed->payloadlen >= (int)strlen(CONTROL_BACKUP) && 
+        strncmp(ed->payload, CONTROL_BACKUP, strlen(CONTROL_BACKUP)) == 0 && 
+        strspn((const char *)ed->payload + strlen(CONTROL_BACKUP), " \r\n") == (size_t)ed->payloadlen - strlen(CONTROL_BACKUP)) {
+        if (!atomic_load(&copy_thread_running)) {
+            response = sqlite3_mprintf("error backups unavailable\n");
+        } else if (atomic_load(&backup_running) || atomic_exchange(&backup_requested, 1)) {
+            response = sqlite3_mprintf("error backup already running\n");
+        } else {
+            pthread_mutex_lock(&copy_mutex);
+            pthread_cond_signal(&copy_cond);
+            pthread_mutex_unlock(&copy_mutex);
+            response = sqlite3_mprintf("backup started %s\n", backup_dir);
+        }
+        if (response != NULL) {
+            mosquitto_broker_publish_copy(NULL, CONTROL_RESPONSE_TOPIC, (int)strlen(response), response, 1, false, NULL);
+            sqlite3_free(response);
+        }
+        return MOSQ_ERR_SUCCESS;
     }
     
-    // Start with reasonable initial capacity
-    size_t capacity = 256;
-    size_t len = 0;
-    char *headers = malloc(capacity);
-    if (headers == NULL) {
-        return NULL;
+    // "replay" puts the dead letters back into the queue
+    if (ed->payloadlen >= (int)strlen(CONTROL_REPLAY) && 
+        strncmp(ed->payload, CONTROL_REPLAY, strlen(CONTROL_REPLAY)) == 0 && 
+        strspn((const char *)ed->payload + strlen(CONTROL_REPLAY), " \r\n") == (size_t)ed->payloadlen - strlen(CONTROL_REPLAY)) {
+        long long rows = atomic_load(&deadletter_rows);
+        if (!atomic_load(&db_ready)) {
+            response = sqlite3_mprintf("error database not ready\n");
+        } else if (rows <= 0) {
+            response = sqlite3_mprintf("error no dead letters\n");
+        } else {
+            atomic_store(&replay_requested, 1);
+            pthread_cond_signal(&queue_cond);
+            response = sqlite3_mprintf("replay started %lld\n", rows);
+        }
+        if (response != NULL) {
+            mosquitto_broker_publish_copy(NULL, CONTROL_RESPONSE_TOPIC, (int)strlen(response), response, 1, false, NULL);
+            sqlite3_free(response);
+        }
+        return MOSQ_ERR_SUCCESS;
     }
-    headers[0] = '\0';
     
-    // Single pass: build header string with dynamic buffer growth
-    const mosquitto_property *prop = properties;
-    char *prop_name = NULL;
-    char *prop_value = NULL;
-    bool skip_first = false;
-    int header_count = 0;
+    if (ed->payloadlen > 0) {
+        char *error = NULL;
+        struct runtime_config *cfg = runtime_config_from_text(ed->payload, ed->payloadlen, &error);
+        if (cfg == NULL) {
+            const char *client_id = mosquitto_client_id(ed->client);
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Rejected runtime configuration from %s: %s", 
+                                client_id ? client_id : "(unknown)", error);
+            response = sqlite3_mprintf("error %s\n", error);
+            sqlite3_free(error);
+        } else {
+            runtime_config_publish(cfg);
+        }
+    }
+    if (response == NULL) {
+        response = format_runtime_config(runtime_config_get());
+    }
+    if (response != NULL) {
+        mosquitto_broker_publish_copy(NULL, CONTROL_RESPONSE_TOPIC, (int)strlen(response), response, 1, false, NULL);
+        sqlite3_free(response);
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+// Requests on TOPIC_TREE_TOPIC carry "key value" lines: "path <topic levels>" selects the level
+// (the root without it), "after <name>" and "limit <n>" page through its children. The summary
+// goes to the request's MQTT v5 response topic (under TOPIC_TREE_RESPONSE_TOPIC, which is
+// also the default) with its correlation data
+static int on_topic_tree_callback(int event, void *event_data, void *userdata) {
+    UNUSED(event);
+    UNUSED(userdata);
+    struct mosquitto_evt_control *ed = event_data;
+    atomic_fetch_add(&topic_tree_requests, 1);
     
-    while ((prop = mosquitto_property_read_string_pair(prop, MQTT_PROP_USER_PROPERTY, 
-                                                       &prop_name, &prop_value, skip_first)) != NULL) {
-        if (prop_name != NULL && prop_value != NULL && !is_header_excluded(prop_name)) {
-            size_t name_len = strlen(prop_name);
-            size_t value_len = strlen(prop_value);
-            // Need: name + '=' + value + ';' (or '\0' for last)
-            size_t needed = name_len + value_len + 2;
-            
-            // Grow buffer if needed
-            if (len + needed + 1 > capacity) {
-                capacity = (len + needed + 1) * 2;
-                char *new_headers = realloc(headers, capacity);
-                if (new_headers == NULL) {
-                    free(headers);
-                    free(prop_name);
-                    free(prop_value);
-                    return NULL;
-                }
-                headers = new_headers;
-            }
-            
-            // Append separator if not first
-            if (header_count > 0) {
-                headers[len++] = ';';
-            }
-            
-            // Append name=value using memcpy (faster than strcat)
-            memcpy(headers + len, prop_name, name_len);
-            len += name_len;
-            headers[len++] = '=';
-            memcpy(headers + len, prop_value, value_len);
-            len += value_len;
-            headers[len] = '\0';
-            
-            header_count++;
+    char *request = malloc((size_t)ed->payloadlen + 1);
+    if (request == NULL) {
+        return MOSQ_ERR_NOMEM;
+    }
+    memcpy(request, ed->payload, ed->payloadlen);
+    request[ed->payloadlen] = '\0';
+    
+    const char *path = NULL;
+    const char *after = NULL;
+    int limit = TOPIC_TREE_MAX_CHILDREN;
+    char *error = NULL;
+    char *save = NULL;
+    for (char *line = strtok_r(request, "\n", &save); line != NULL && error == NULL; line = strtok_r(NULL, "\n", &save)) {
+        line[strcspn(line, "\r")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        char *value = strchr(line, ' ');
+        if (value != NULL) {
+            *value++ = '\0';
+        } else {
+            value = line + strlen(line);
+        }
+        if (strcmp(line, "path") == 0) {
+            path = value;
+        } else if (strcmp(line, "after") == 0) {
+            after = value;
+        } else if (strcmp(line, "limit") == 0 && atoi(value) > 0) {
+            limit = atoi(value) < TOPIC_TREE_MAX_CHILDREN ? atoi(value) : TOPIC_TREE_MAX_CHILDREN;
+        } else {
+            sqlite3_str *out = sqlite3_str_new(NULL);
+            sqlite3_str_appendall(out, "{\"error\":\"invalid request line '");
+            json_append_escaped(out, line);
+            sqlite3_str_appendall(out, "'\"}");
+            error = sqlite3_str_finish(out);
         }
-        if (prop_name) { free(prop_name); prop_name = NULL; }
-        if (prop_value) { free(prop_value); prop_value = NULL; }
-        skip_first = true;
     }
+    char *response = error != NULL ? error : topic_tree_summary(path, after, limit);
+    free(request);
     
-    if (header_count == 0) {
-        free(headers);
-        return NULL;
+    // Responses only go to topics below TOPIC_TREE_RESPONSE_TOPIC, so a request cannot make the
+    // plugin publish anywhere else
+    char *response_topic = NULL;
+    size_t prefix_len = strlen(TOPIC_TREE_RESPONSE_TOPIC);
+    if (mosquitto_property_read_string(ed->properties, MQTT_PROP_RESPONSE_TOPIC, &response_topic, false) != NULL && 
+        (strncmp(response_topic, TOPIC_TREE_RESPONSE_TOPIC, prefix_len) != 0 || 
+         (response_topic[prefix_len] != '\0' && response_topic[prefix_len] != '/'))) {
+        free(response_topic);
+        response_topic = NULL;
+    }
+    mosquitto_property *props = NULL;
+    void *correlation = NULL;
+    uint16_t correlation_len = 0;
+    if (mosquitto_property_read_binary(ed->properties, MQTT_PROP_CORRELATION_DATA, &correlation, &correlation_len, false) != NULL) {
+        mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA, correlation, correlation_len);
+        free(correlation);
     }
     
-    return headers;
+    if (response != NULL) {
+        mosquitto_broker_publish_copy(NULL, response_topic != NULL ? response_topic : TOPIC_TREE_RESPONSE_TOPIC, 
+                                      (int)strlen(response), response, 1, false, props);
+    } else {
+        mosquitto_property_free_all(&props);
+    }
+    sqlite3_free(response);
+    free(response_topic);
+    return MOSQ_ERR_SUCCESS;
+}
+
+// SIGHUP: the broker re-reads mosquitto.conf and passes the plugin options again. Runtime
+// options are rebuilt from them (unset ones fall back to defaults); others need a restart
+static int on_reload_callback(int event, void *event_data, void *userdata) {
+    UNUSED(event);
+    UNUSED(userdata);
+    struct mosquitto_evt_reload *ed = event_data;
+    
+    if (ed->options == NULL) {
+        return MOSQ_ERR_SUCCESS;
+    }
+    struct runtime_config *cfg = runtime_config_new(NULL);
+    if (cfg == NULL) {
+        return MOSQ_ERR_NOMEM;
+    }
+    for (int i = 0; i < ed->option_count; i++) {
+        if (runtime_config_set(cfg, ed->options[i].key, ed->options[i].value) < 0) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Invalid value for %s: %s, keeping the current configuration", 
+                                ed->options[i].key, ed->options[i].value);
+            runtime_config_free(cfg);
+            return MOSQ_ERR_SUCCESS;
+        }
+    }
+    runtime_config_compile(cfg);
+    runtime_config_publish(cfg);
+    return MOSQ_ERR_SUCCESS;
 }
 
 static int on_message_callback(int event, void *event_data, void *userdata) {
@@ -968,12 +8283,26 @@ static int on_message_callback(int event, void *event_data, void *userdata) {
     
     // Thread-safe ULID generation
     pthread_mutex_lock(&ulid_mutex);
-    ulid_generate(&ulid_gen, ulid);
+    unsigned long long now_ms = ulid_generate(&ulid_gen, ulid);
     pthread_mutex_unlock(&ulid_mutex);
 
+    const struct runtime_config *cfg = runtime_config_get();
+
     // Check if topic should be excluded from persistence
-    if (is_topic_excluded(ed->topic)) {
+    if (is_topic_excluded(cfg, ed->topic)) {
         LOG_DEBUG("Excluded topic from persistence: %s", ed->topic);
+        // The retained store still follows excluded topics, the broker snapshot may be relaxed
+        if (ed->retain && restore_retained && atomic_load(&batch_thread_running)) {
+            char *headers = ed->payloadlen > 0 ? extract_headers(cfg, ed->properties) : NULL;
+            uint32_t expiry_interval = 0;
+            unsigned long long expires_at = 0;
+            if (mosquitto_property_read_int32(ed->properties, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, &expiry_interval, false) != NULL) {
+                expires_at = now_ms + (unsigned long long)expiry_interval * 1000ULL;
+            }
+            enqueue_message(OP_RETAINED, ulid, ed->topic, (char *)ed->payload, ed->payloadlen, headers, 
+                            1, ed->qos, expires_at, NULL, NULL, 0);
+            free(headers);
+        }
         // Still add ULID property but don't store in database
         return mosquitto_property_add_string_pair(&ed->properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
     }
@@ -1021,13 +8350,34 @@ static int on_message_callback(int event, void *event_data, void *userdata) {
         return mosquitto_property_add_string_pair(&ed->properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
     }
 
+    // Apply persistence policy (sampling, rate limit, dedup, deadband)
+    // Retained messages skipped by the policy still update the retained store
+    int operation = OP_INSERT;
+    if (!policy_allows_persist(ed->topic, (const char *)ed->payload, ed->payloadlen, now_ms)) {
+        if (!(ed->retain && restore_retained)) {
+            LOG_DEBUG("Persistence policy skipped topic: %s", ed->topic);
+            return mosquitto_property_add_string_pair(&ed->properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
+        }
+        operation = OP_RETAINED;
+    }
+
     // Extract headers from message properties (excludes configured headers)
-    char *headers = extract_headers(ed->properties);
+    char *headers = extract_headers(cfg, ed->properties);
+    
+    // MQTT v5 message expiry, kept for the retained store and (if enabled) the expiry sweeper
+    uint32_t expiry_interval = 0;
+    unsigned long long expires_at = 0;
+    if (mosquitto_property_read_int32(ed->properties, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, &expiry_interval, false) != NULL) {
+        expires_at = now_ms + (unsigned long long)expiry_interval * 1000ULL;
+    }
 
     // Enqueue message for batch insert (non-blocking)
     if (atomic_load(&batch_thread_running)) {
-        enqueue_message(ulid, ed->topic, (char *)ed->payload, ed->payloadlen,
-                        headers, ed->retain ? 1 : 0, ed->qos);
+        int over_quota = (quota_clients != NULL || topic_quota_count > 0) && 
+                         quota_exceeded(mosquitto_client_id(ed->client), ed->topic, now_ms);
+        enqueue_message(operation, ulid, ed->topic, (char *)ed->payload, ed->payloadlen, headers, ed->retain ? 1 : 0, ed->qos, expires_at, 
+                        store_client ? mosquitto_client_id(ed->client) : NULL, 
+                        store_client ? mosquitto_client_username(ed->client) : NULL, over_quota);
         LOG_DEBUG("Enqueued: topic=%s retain=%d qos=%d headers=%s", 
                   ed->topic, ed->retain, ed->qos, headers ? headers : "(none)");
     }
@@ -1037,6 +8387,12 @@ static int on_message_callback(int event, void *event_data, void *userdata) {
     return mosquitto_property_add_string_pair(&ed->properties, MQTT_PROP_USER_PROPERTY, "ulid", ulid);
 }
 
+// Boolean plugin options accept true/false, yes/no, on/off or 1/0
+static int option_is_true(const char *value) {
+    return value != NULL && (strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0 || 
+                             strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0);
+}
+
 int mosquitto_plugin_version(int supported_version_count, const int *supported_versions) {
 	int i;
 	for (i=0; i<supported_version_count; i++) {
@@ -1047,135 +8403,441 @@ int mosquitto_plugin_version(int supported_version_count, const int *supported_v
 	return -1;
 }
 
+// Open the message database and apply the connection settings; msg_db stays NULL on failure
+static void open_database(void) {
+    int rc = sqlite3_open(DB_PATH, &msg_db);
+    if (rc) {
+        mosquitto_log_printf(MOSQ_LOG_ERR, "Can't open database: %s\n", sqlite3_errmsg(msg_db));
+        sqlite3_close(msg_db);
+        msg_db = NULL;
+        return;
+    }
+    mosquitto_log_printf(MOSQ_LOG_INFO, "Opened database: " DB_PATH);
+    
+    // msg_bucket_expand() for the msg_bucketed view
+    if (msg_bucket_register(msg_db) != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to register msg_bucket_expand: %s", sqlite3_errmsg(msg_db));
+    }
+    
+    // Wait for sqld's write lock with backoff instead of failing with SQLITE_BUSY
+    sqlite3_busy_handler(msg_db, on_busy, NULL);
+
+    // Only takes effect on a new database (before the first table) or with the next VACUUM
+    if (auto_vacuum_option != AUTO_VACUUM_NONE) {
+        sqlite3_exec(msg_db, "PRAGMA auto_vacuum=INCREMENTAL", NULL, 0, NULL);
+    }
+    
+    // Enable WAL mode for better concurrent read/write performance
+    char *err_msg = 0;
+    rc = sqlite3_exec(msg_db, "PRAGMA journal_mode=WAL", NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to enable WAL mode: %s", err_msg);
+        sqlite3_free(err_msg);
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "SQLite WAL mode enabled");
+    }
+    
+    // Set synchronous=NORMAL for better performance (safe with WAL)
+    rc = sqlite3_exec(msg_db, "PRAGMA synchronous=NORMAL", NULL, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to set synchronous=NORMAL: %s", err_msg);
+        sqlite3_free(err_msg);
+    }
+}
+
+// Convert an existing database to auto_vacuum=INCREMENTAL when requested. SQLite can only add
+// the pointer-map pages this needs by rewriting the whole file, so this is an offline
+// conversion: VACUUM runs here, before the database is ready, and holds the write lock
+// (sqld included) until it is done while messages queue up
+static void init_auto_vacuum(void) {
+    long long mode = pragma_int("PRAGMA auto_vacuum");
+    if (mode == 0 && auto_vacuum_option == AUTO_VACUUM_STARTUP) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Converting database to auto_vacuum=INCREMENTAL, messages are queued until VACUUM completes");
+        unsigned long long start_ms = platform_utime(0) / 1000;
+        char *err_msg = NULL;
+        if (sqlite3_exec(msg_db, "VACUUM", NULL, 0, &err_msg) != SQLITE_OK) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Database conversion to auto_vacuum=INCREMENTAL failed: %s", err_msg);
+            sqlite3_free(err_msg);
+        } else {
+            mode = pragma_int("PRAGMA auto_vacuum");
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Database converted to auto_vacuum=INCREMENTAL in %llums", 
+                                platform_utime(0) / 1000 - start_ms);
+        }
+    } else if (mode == 0 && auto_vacuum_option != AUTO_VACUUM_NONE) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Database has auto_vacuum=NONE, free pages are reused but not released "
+                            "(plugin_opt_auto_vacuum vacuum_at_startup converts it offline)");
+    }
+    auto_vacuum_incremental = mode == 2 && auto_vacuum_option != AUTO_VACUUM_NONE;
+    vacuum_pending = 1;
+}
+
+// Schema migrations, index builds and prepared statements; runs on the worker thread before
+// the first flush, so a large database does not hold up broker startup
+// Returns 1 if the schema could not be set up
+static int init_database(void) {
+    if (msg_db == NULL) {
+        open_database();
+    }
+    if (msg_db == NULL) {
+        return 1;
+    }
+    init_auto_vacuum();
+    if (init_message_schema() != 0) {
+        return 1;
+    }
+    // Handoff scripts only cover the inline layout. Schema migrations read back what they copied
+    // (cursor, changes) and msg_client and Sparkplug dictionary keys are taken from the local
+    // insert (last_insert_rowid), none of which a script sent to sqld can report back
+    if (handoff_socket != NULL) {
+        if (storage_layout != LAYOUT_INLINE || requested_layout != LAYOUT_INLINE || migration != NULL || 
+            store_client || sparkplug_enabled) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "sqld_socket needs a database in the inline layout without a pending "
+                                "schema migration, writing locally instead");
+            free(handoff_socket);
+            handoff_socket = NULL;
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Writes handed off to sqld via %s", handoff_socket);
+        }
+    }
+    init_schema_migration();
+    next_optimize = 0;
+    
+    prepare_message_statements();
+    
+    if (storage_layout != LAYOUT_INLINE) {
+        init_layout_statements();
+    }
+    
+    if (message_expiry) {
+        init_expiry_statements();
+    }
+    
+    if (bucket_pattern_count > 0) {
+        init_bucket_store();
+    }
+    
+    if (sparkplug_enabled && init_sparkplug_store() != 0) {
+        sparkplug_enabled = 0;
+    }
+    
+    // Dead letters left by earlier runs stay until they are replayed. With the handoff the
+    // table is created now, with the rest of the schema, as dead letters are written by sqld
+    char *type = schema_object_type("msg_deadletter");
+    if ((type != NULL || handoff_socket != NULL) && open_deadletter_store() == 0) {
+        atomic_store(&deadletter_rows, pragma_int("SELECT count(*) FROM msg_deadletter"));
+    }
+    sqlite3_free(type);
+    return 0;
+}
+
 int mosquitto_plugin_init(mosquitto_plugin_id_t *identifier, void **user_data, struct mosquitto_opt *opts, int opt_count) {
 	UNUSED(user_data);
 
+    plugin_init_ms = platform_utime(0) / 1000;
+    
+    struct runtime_config *cfg = runtime_config_new(NULL);
+    if (cfg == NULL) {
+        return MOSQ_ERR_NOMEM;
+    }
+    
     // Parse plugin options
     for (int i = 0; i < opt_count; i++) {
-        if (strcmp(opts[i].key, "exclude_topics") == 0) {
-            parse_exclude_patterns(opts[i].value);
-        } else if (strcmp(opts[i].key, "batch_size") == 0) {
+        int applied = runtime_config_set(cfg, opts[i].key, opts[i].value);
+        if (applied < 0) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Invalid value for %s: %s", opts[i].key, opts[i].value);
+        } else if (applied > 0) {
+            continue;
+        } else if (strcmp(opts[i].key, "persist_policy") == 0) {
+            parse_persist_policies(opts[i].value);
+        } else if (strcmp(opts[i].key, "client_quota") == 0) {
+            if (parse_quota_rate(opts[i].value, &client_quota) != 0) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Ignoring invalid client quota: %s", opts[i].value);
+                client_quota.interval_us = 0;
+            }
+        } else if (strcmp(opts[i].key, "topic_quotas") == 0) {
+            parse_topic_quotas(opts[i].value);
+        } else if (strcmp(opts[i].key, "queue_lanes") == 0) {
+            parse_queue_lanes(opts[i].value);
+        } else if (strcmp(opts[i].key, "bucket_topics") == 0) {
+            parse_bucket_patterns(opts[i].value);
+        } else if (strcmp(opts[i].key, "bucket_window") == 0) {
+            unsigned long long val = parse_duration_ms(opts[i].value);
+            if (val > 0) {
+                bucket_window_ms = val;
+            }
+        } else if (strcmp(opts[i].key, "bucket_max_points") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0) {
+                bucket_max_points = val;
+            }
+        } else if (strcmp(opts[i].key, "storage_layout") == 0) {
+            if (strcmp(opts[i].value, "split") == 0) {
+                requested_layout = LAYOUT_SPLIT;
+            } else if (strcmp(opts[i].value, "blob") == 0) {
+                requested_layout = LAYOUT_BLOB;
+            } else if (strcmp(opts[i].value, "inline") == 0) {
+                requested_layout = LAYOUT_INLINE;
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown storage layout '%s', using inline", opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "dedup_min_size") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 0) {
+                dedup_min_size = val;
+            }
+        } else if (strcmp(opts[i].key, "offload_min_size") == 0) {
+            long long val = atoll(opts[i].value);
+            if (val >= 0) {
+                offload_min_size = val;
+            }
+        } else if (strcmp(opts[i].key, "offload_dir") == 0) {
+            free(offload_dir);
+            offload_dir = strdup(opts[i].value);
+        } else if (strcmp(opts[i].key, "ulid_clock") == 0) {
+            if (strcmp(opts[i].value, "wall") == 0) {
+                ulid_clock_hlc = 0;
+            } else if (strcmp(opts[i].value, "hlc") == 0) {
+                ulid_clock_hlc = 1;
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown ulid_clock '%s', using hlc", opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "auto_vacuum") == 0) {
+            if (strcmp(opts[i].value, "none") == 0) {
+                auto_vacuum_option = AUTO_VACUUM_NONE;
+            } else if (strcmp(opts[i].value, "incremental") == 0) {
+                auto_vacuum_option = AUTO_VACUUM_INCREMENTAL;
+            } else if (strcmp(opts[i].value, "vacuum_at_startup") == 0) {
+                auto_vacuum_option = AUTO_VACUUM_STARTUP;
+            } else if (strcmp(opts[i].value, "convert") == 0) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "auto_vacuum 'convert' is now 'vacuum_at_startup' (a blocking VACUUM), "
+                                    "using incremental");
+            } else {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Unknown auto_vacuum '%s', using incremental", opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "node_id") == 0) {
+            ulid_node_id = parse_node_id(opts[i].value);
+        } else if (strcmp(opts[i].key, "stats_interval") == 0) {
             int val = atoi(opts[i].value);
-            if (val > 0 && val <= MAX_QUEUE_SIZE) {
-                batch_size = val;
-                mosquitto_log_printf(MOSQ_LOG_INFO, "Batch size set to: %d", batch_size);
+            if (val >= 0) {
+                stats_interval_sec = val;
             }
-        } else if (strcmp(opts[i].key, "flush_interval") == 0) {
+        } else if (strcmp(opts[i].key, "busy_timeout") == 0) {
             int val = atoi(opts[i].value);
-            if (val > 0 && val <= 10000) {
-                flush_interval_ms = val;
-                mosquitto_log_printf(MOSQ_LOG_INFO, "Flush interval set to: %dms", flush_interval_ms);
+            if (val >= 0) {
+                busy_timeout_ms = val;
             }
-        } else if (strcmp(opts[i].key, "retention_days") == 0) {
+        } else if (strcmp(opts[i].key, "sqld_socket") == 0) {
+            struct sockaddr_un addr;
+            free(handoff_socket);
+            handoff_socket = NULL;
+            if (strlen(opts[i].value) >= sizeof(addr.sun_path)) {
+                mosquitto_log_printf(MOSQ_LOG_ERR, "sqld_socket path too long: %s", opts[i].value);
+            } else if (*opts[i].value != '\0') {
+                handoff_socket = strdup(opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "snapshot_dir") == 0) {
+            free(snapshot_dir);
+            snapshot_dir = *opts[i].value != '\0' ? strdup(opts[i].value) : NULL;
+        } else if (strcmp(opts[i].key, "snapshot_interval") == 0) {
             int val = atoi(opts[i].value);
-            if (val >= 0 && val <= 3650) {  // Max 10 years
-                retention_days = val;
-                if (retention_days > 0) {
-                    mosquitto_log_printf(MOSQ_LOG_INFO, "Data retention set to: %d days", retention_days);
-                } else {
-                    mosquitto_log_printf(MOSQ_LOG_INFO, "Data retention disabled (keeping all messages)");
-                }
+            if (val > 0) {
+                snapshot_interval_sec = val;
+            }
+        } else if (strcmp(opts[i].key, "backup_dir") == 0) {
+            free(backup_dir);
+            backup_dir = *opts[i].value != '\0' ? strdup(opts[i].value) : NULL;
+        } else if (strcmp(opts[i].key, "backup_interval") == 0) {
+            backup_interval_sec = (long long)(parse_duration_ms(opts[i].value) / 1000);
+        } else if (strcmp(opts[i].key, "retry_attempts") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0) {
+                retry_attempts = val;
+            }
+        } else if (strcmp(opts[i].key, "optimize_interval") == 0) {
+            optimize_interval_sec = (long long)(parse_duration_ms(opts[i].value) / 1000);
+        } else if (strcmp(opts[i].key, "backup_keep") == 0) {
+            int val = atoi(opts[i].value);
+            if (val >= 0) {
+                backup_keep = val;
+            }
+        } else if (strcmp(opts[i].key, "startup_queue_size") == 0) {
+            int val = atoi(opts[i].value);
+            if (val > 0) {
+                startup_queue_size = val;
+            }
+        } else if (strcmp(opts[i].key, "page_cache_size") == 0) {
+            page_cache_size = parse_size_bytes(opts[i].value);
+            if (page_cache_size == 0 && strcmp(opts[i].value, "0") != 0) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Invalid page_cache_size '%s', using SQLite's page cache", opts[i].value);
             }
-        } else if (strcmp(opts[i].key, "exclude_headers") == 0) {
-            parse_exclude_headers(opts[i].value);
+        } else if (strcmp(opts[i].key, "page_cache_huge_pages") == 0) {
+            page_cache_huge_pages = option_is_true(opts[i].value);
+        } else if (strcmp(opts[i].key, "sqlite_heap_size") == 0) {
+            sqlite_heap_size = parse_size_bytes(opts[i].value);
+            if (sqlite_heap_size == 0 && strcmp(opts[i].value, "0") != 0) {
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Invalid sqlite_heap_size '%s', using malloc", opts[i].value);
+            }
+        } else if (strcmp(opts[i].key, "message_expiry") == 0) {
+            message_expiry = option_is_true(opts[i].value);
+        } else if (strcmp(opts[i].key, "store_client") == 0) {
+            store_client = option_is_true(opts[i].value);
+        } else if (strcmp(opts[i].key, "sparkplug") == 0) {
+            sparkplug_enabled = option_is_true(opts[i].value);
+        } else if (strcmp(opts[i].key, "topic_tree") == 0) {
+            topic_tree_enabled = option_is_true(opts[i].value);
+        } else if (strcmp(opts[i].key, "restore_retained") == 0) {
+            restore_retained = option_is_true(opts[i].value);
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Retained message restore %s", restore_retained ? "enabled" : "disabled");
         }
     }
-
-    int rc = sqlite3_open("/mosquitto/data/dbs/default/data", &msg_db);
-    if (rc) {
-        mosquitto_log_printf(MOSQ_LOG_ERR, "Can't open database: %s\n", sqlite3_errmsg(msg_db));
-		sqlite3_close(msg_db);
-	} else {
-        mosquitto_log_printf(MOSQ_LOG_INFO, "Opened database: /mosquitto/data/dbs/default/data");
-
-        // Enable WAL mode for better concurrent read/write performance
-        char *err_msg = 0;
-        rc = sqlite3_exec(msg_db, "PRAGMA journal_mode=WAL", NULL, 0, &err_msg);
-        if (rc != SQLITE_OK) {
-            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to enable WAL mode: %s", err_msg);
-            sqlite3_free(err_msg);
+    
+    runtime_config_compile(cfg);
+    runtime_config_publish(cfg);
+    if (cfg->retention_days > 0) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Data retention set to: %d days", cfg->retention_days);
+    } else {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "Data retention disabled (keeping all messages)");
+    }
+    
+    if (client_quota.interval_us > 0) {
+        quota_clients = calloc(QUOTA_CLIENT_SLOTS, sizeof(struct quota_slot));
+        if (quota_clients == NULL) {
+            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to allocate client quota table, client quota disabled");
         } else {
-            mosquitto_log_printf(MOSQ_LOG_INFO, "SQLite WAL mode enabled");
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Client quota: %.1f messages/s, burst %llu", 
+                                1000000.0 / (double)client_quota.interval_us, 
+                                client_quota.tolerance_us / client_quota.interval_us + 1);
         }
-        
-        // Set synchronous=NORMAL for better performance (safe with WAL)
-        rc = sqlite3_exec(msg_db, "PRAGMA synchronous=NORMAL", NULL, 0, &err_msg);
-        if (rc != SQLITE_OK) {
-            mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to set synchronous=NORMAL: %s", err_msg);
-            sqlite3_free(err_msg);
+    }
+
+    // Options the handoff scripts cannot carry are refused here; an existing database in another
+    // layout or with a pending migration is only known to init_database()
+    if (handoff_socket != NULL) {
+        const char *conflict = store_client ? "store_client" : sparkplug_enabled ? "sparkplug" : 
+                               requested_layout != LAYOUT_INLINE ? "storage_layout" : 
+                               dedup_min_size > 0 ? "dedup_min_size" : offload_min_size > 0 ? "offload_min_size" : NULL;
+        if (conflict != NULL) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "sqld_socket cannot be combined with %s, writing locally instead", conflict);
+            free(handoff_socket);
+            handoff_socket = NULL;
         }
+    }
+    
+    if (offload_dir == NULL) {
+        offload_dir = strdup(DEFAULT_OFFLOAD_DIR);
+    }
 
-		const char *sql = "create table if not exists msg(ulid text primary key, topic text not null, payload text not null, retain integer not null default 0, qos integer not null default 0, headers text);";
-		rc = sqlite3_exec(msg_db, sql, NULL, 0, &err_msg);
-		if (rc != SQLITE_OK) {
-            mosquitto_log_printf(MOSQ_LOG_ERR, "SQL error: %s", err_msg);
-			sqlite3_free(err_msg);
-		} else {
-            // Create index on topic for faster topic-based queries
-            const char *idx_topic_sql = "CREATE INDEX IF NOT EXISTS idx_msg_topic ON msg(topic);";
-            rc = sqlite3_exec(msg_db, idx_topic_sql, NULL, 0, &err_msg);
-            if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to create topic index: %s", err_msg);
-                sqlite3_free(err_msg);
-            } else {
-                mosquitto_log_printf(MOSQ_LOG_INFO, "Index on topic column ensured");
-            }
-            
-            // Create compound index for efficient "find latest by topic" queries (ORDER BY ulid DESC)
-            const char *idx_topic_ulid_sql = "CREATE INDEX IF NOT EXISTS idx_msg_topic_ulid ON msg(topic, ulid DESC);";
-            rc = sqlite3_exec(msg_db, idx_topic_ulid_sql, NULL, 0, &err_msg);
-            if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to create topic_ulid index: %s", err_msg);
-                sqlite3_free(err_msg);
-            }
-            
-    		rc = sqlite3_prepare_v2(msg_db, "insert into msg (ulid, topic, payload, retain, qos, headers) values (?1, ?2, ?3, ?4, ?5, ?6)", -1, &insert_stmt, 0);
-    		if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare insert data statement: %s", sqlite3_errmsg(msg_db));
-			}
-
-            // Prepare delete statement for clearing retained messages
-            // Deletes by topic AND ulid when ULID is known from message properties
-            rc = sqlite3_prepare_v2(msg_db, 
-                "DELETE FROM msg WHERE topic = ?1 AND ulid = ?2", 
-                -1, &delete_stmt, 0);
-            if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare delete statement: %s", sqlite3_errmsg(msg_db));
-            }
-            
-            // Prepare statement for finding latest message ULID for fallback delete
-            rc = sqlite3_prepare_v2(msg_db, 
-                "SELECT ulid FROM msg WHERE topic = ?1 ORDER BY ulid DESC LIMIT 1", 
-                -1, &find_latest_stmt, 0);
-            if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare find_latest statement: %s", sqlite3_errmsg(msg_db));
-            }
-            
-            // Prepare statement for retention cleanup (delete messages older than cutoff)
-            rc = sqlite3_prepare_v2(msg_db, 
-                "DELETE FROM msg WHERE ulid < ?1", 
-                -1, &retention_delete_stmt, 0);
-            if (rc != SQLITE_OK) {
-                mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to prepare retention_delete statement: %s", sqlite3_errmsg(msg_db));
+    // Create the payload file store before the first message can be offloaded
+    if (offload_min_size > 0) {
+        if (mkdir(offload_dir, 0755) != 0 && errno != EEXIST) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create payload file store %s: %s", offload_dir, strerror(errno));
+            offload_min_size = 0;
+        } else {
+            mosquitto_log_printf(MOSQ_LOG_INFO, "Payloads >= %lld bytes offloaded to %s", offload_min_size, offload_dir);
+            atomic_store(&spool_thread_running, 1);
+            if (pthread_create(&spool_thread, NULL, spool_worker, NULL) != 0) {
+                // The worker writes the files itself
+                mosquitto_log_printf(MOSQ_LOG_WARNING, "Failed to create payload spool thread");
+                atomic_store(&spool_thread_running, 0);
             }
-		}
-	}
+        }
+    }
+    
+    // Before the first connection, SQLite's memory cannot be configured afterwards
+    if (sqlite_heap_size > 0) {
+        init_sqlite_heap();
+    }
+    if (page_cache_size > 0) {
+        init_page_cache();
+    }
+    // SQLite recycles cache pages before the heap runs full (initializes SQLite)
+    if (sqlite_heap_installed) {
+        sqlite3_soft_heap_limit64((sqlite3_int64)(heap_bytes / 100 * SQLITE_HEAP_SOFT_LIMIT_PCT));
+    }
+    
+    // Retained messages have to be in the broker before clients subscribe, so the retained
+    // store is read here; the rest of the database setup runs on the worker thread
+    if (restore_retained) {
+        open_database();
+        if (msg_db != NULL) {
+            init_retained_store();
+            restore_retained_messages();
+        }
+    }
 
-	if (ulid_generator_init(&ulid_gen, ULID_PARANOID) != 0) {
+	if (ulid_generator_init(&ulid_gen, ULID_PARANOID | (ulid_clock_hlc ? ULID_MONOTONIC : 0)) != 0) {
         mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to init ULID generator");
     }
-
+    if (ulid_node_id == ULID_NODE_NONE) {
+        ulid_node_id = parse_node_id(getenv(ULID_NODE_ENV));
+    }
+    ulid_gen.node_id = ulid_node_id;
+    if (ulid_node_id != ULID_NODE_NONE) {
+        mosquitto_log_printf(MOSQ_LOG_INFO, "ULID node id: %d", ulid_node_id);
+    }
+    // The clock has to continue after the stored rows before the first message is stamped;
+    // opening the file and reading max(ulid) is quick, migrations wait for the worker
+    if (ulid_clock_hlc) {
+        if (msg_db == NULL) {
+            open_database();
+        }
+        if (msg_db != NULL) {
+            seed_ulid_clock();
+        }
+    }
+    // Messages from here on are counted as they are written, the copy thread loads the rows before this ULID
+    if (topic_tree_enabled) {
+        pthread_mutex_lock(&ulid_mutex);
+        ulid_generate(&ulid_gen, topic_tree_watermark);
+        pthread_mutex_unlock(&ulid_mutex);
+        atomic_store(&topic_tree_loaded, 0);
+    }
     // Start batch worker thread
     atomic_store(&batch_thread_running, 1);
     if (pthread_create(&batch_thread, NULL, batch_worker, NULL) != 0) {
         mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create batch worker thread");
         atomic_store(&batch_thread_running, 0);
+        init_database();
+        atomic_store(&db_ready, 1);
     } else {
         mosquitto_log_printf(MOSQ_LOG_INFO, "Batch insert enabled: size=%d, interval=%dms", 
-                            batch_size, flush_interval_ms);
+                            cfg->batch_size, cfg->flush_interval_ms);
+    }
+    
+    // Start the copy thread (read snapshot and backups)
+    if (snapshot_dir != NULL && init_snapshot_dir() != 0) {
+        free(snapshot_dir);
+        snapshot_dir = NULL;
+    }
+    if (backup_dir == NULL) {
+        backup_dir = strdup(DEFAULT_BACKUP_DIR);
+    }
+    if (backup_dir != NULL) {
+        atomic_store(&copy_thread_running, 1);
+        if (pthread_create(&copy_thread, NULL, copy_worker, NULL) != 0) {
+            mosquitto_log_printf(MOSQ_LOG_ERR, "Failed to create copy thread");
+            atomic_store(&copy_thread_running, 0);
+        } else {
+            if (snapshot_dir != NULL) {
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Read snapshot %s" SNAPSHOT_DB_PATH " refreshed every %ds", 
+                                    snapshot_dir, snapshot_interval_sec);
+            }
+            if (backup_interval_sec > 0) {
+                mosquitto_log_printf(MOSQ_LOG_INFO, "Backups to %s every %llds, keeping %d", 
+                                    backup_dir, backup_interval_sec, backup_keep);
+            }
+        }
     }
 
 	mosq_pid = identifier;
+    if (stats_interval_sec > 0 || persist_policy_count > 0) {
+        mosquitto_callback_register(mosq_pid, MOSQ_EVT_TICK, on_tick_callback, NULL, NULL);
+    }
+    mosquitto_callback_register(mosq_pid, MOSQ_EVT_CONTROL, on_control_callback, CONTROL_TOPIC, NULL);
+    if (topic_tree_enabled) {
+        mosquitto_callback_register(mosq_pid, MOSQ_EVT_CONTROL, on_topic_tree_callback, TOPIC_TREE_TOPIC, NULL);
+    }
+    mosquitto_callback_register(mosq_pid, MOSQ_EVT_RELOAD, on_reload_callback, NULL, NULL);
 	return mosquitto_callback_register(mosq_pid, MOSQ_EVT_MESSAGE, on_message_callback, NULL, NULL);
 }
 
@@ -1183,7 +8845,35 @@ int mosquitto_plugin_cleanup(void *user_data, struct mosquitto_opt *opts, int op
 	UNUSED(user_data);
 	UNUSED(opts);
 	UNUSED(opt_count);
+    // Policies are freed before the callbacks are unregistered
+    int tick_registered = stats_interval_sec > 0 || persist_policy_count > 0;
 
+    // Stop the copy thread first, an interrupted snapshot refresh or backup leaves the previous files
+    if (atomic_load(&copy_thread_running)) {
+        pthread_mutex_lock(&copy_mutex);
+        atomic_store(&copy_thread_running, 0);
+        pthread_cond_signal(&copy_cond);
+        pthread_mutex_unlock(&copy_mutex);
+        pthread_join(copy_thread, NULL);
+    }
+    
+    // Stop the spool thread; the worker writes the payloads it has not reached
+    if (atomic_load(&spool_thread_running)) {
+        pthread_mutex_lock(&queue_mutex);
+        atomic_store(&spool_thread_running, 0);
+        pthread_cond_signal(&spool_cond);
+        pthread_mutex_unlock(&queue_mutex);
+        pthread_join(spool_thread, NULL);
+        pthread_mutex_lock(&queue_mutex);
+        for (struct msg_entry *entry = spool_head, *next; entry != NULL; entry = next) {
+            next = entry->spool_next;
+            entry->spool_next = NULL;
+            entry->spool = SPOOL_NONE;
+        }
+        spool_head = spool_tail = NULL;
+        pthread_mutex_unlock(&queue_mutex);
+    }
+    
     // Stop batch worker thread
     if (atomic_load(&batch_thread_running)) {
         atomic_store(&batch_thread_running, 0);
@@ -1191,9 +8881,21 @@ int mosquitto_plugin_cleanup(void *user_data, struct mosquitto_opt *opts, int op
         pthread_join(batch_thread, NULL);
     }
 
-    // Free exclusion patterns
-    free_exclude_patterns();
-    free_exclude_headers();
+    // The worker has stopped, so no reader is left
+    runtime_config_free(atomic_exchange(&active_config, NULL));
+    reclaim_retired_configs(1);
+    free_persist_policies();
+    last_policy_sweep = 0;
+    free_quotas();
+    free_bucket_patterns();
+    free(offload_dir);
+    offload_dir = NULL;
+    free(handoff_socket);
+    handoff_socket = NULL;
+    free(snapshot_dir);
+    snapshot_dir = NULL;
+    free(backup_dir);
+    backup_dir = NULL;
 
 	if (insert_stmt != NULL) {
 		sqlite3_finalize(insert_stmt);
@@ -1207,13 +8909,117 @@ int mosquitto_plugin_cleanup(void *user_data, struct mosquitto_opt *opts, int op
         sqlite3_finalize(find_latest_stmt);
     }
     
+    if (delete_latest_stmt != NULL) {
+        sqlite3_finalize(delete_latest_stmt);
+        delete_latest_stmt = NULL;
+    }
+    
     if (retention_delete_stmt != NULL) {
         sqlite3_finalize(retention_delete_stmt);
     }
+    
+    if (retention_topics_stmt != NULL) {
+        sqlite3_finalize(retention_topics_stmt);
+        retention_topics_stmt = NULL;
+    }
+    
+    if (retained_upsert_stmt != NULL) {
+        sqlite3_finalize(retained_upsert_stmt);
+    }
+    
+    if (retained_delete_stmt != NULL) {
+        sqlite3_finalize(retained_delete_stmt);
+    }
+    
+    if (blob_upsert_stmt != NULL) {
+        sqlite3_finalize(blob_upsert_stmt);
+    }
+    
+    if (payload_gc_stmt != NULL) {
+        sqlite3_finalize(payload_gc_stmt);
+    }
+    
+    if (blob_release_stmt != NULL) {
+        sqlite3_finalize(blob_release_stmt);
+    }
+    
+    if (file_upsert_stmt != NULL) {
+        sqlite3_finalize(file_upsert_stmt);
+    }
+    
+    if (payload_gc_delete_stmt != NULL) {
+        sqlite3_finalize(payload_gc_delete_stmt);
+    }
+    
+    if (expiry_select_stmt != NULL) {
+        sqlite3_finalize(expiry_select_stmt);
+    }
+    
+    if (expiry_delete_stmt != NULL) {
+        sqlite3_finalize(expiry_delete_stmt);
+    }
+    
+    if (bucket_upsert_stmt != NULL) {
+        sqlite3_finalize(bucket_upsert_stmt);
+    }
+    
+    if (bucket_segment_delete_stmt != NULL) {
+        sqlite3_finalize(bucket_segment_delete_stmt);
+    }
+    
+    if (bucket_retention_stmt != NULL) {
+        sqlite3_finalize(bucket_retention_stmt);
+    }
+    
+    if (bucket_retention_topics_stmt != NULL) {
+        sqlite3_finalize(bucket_retention_topics_stmt);
+        bucket_retention_topics_stmt = NULL;
+    }
+    
+    if (payload_insert_stmt != NULL) {
+        sqlite3_finalize(payload_insert_stmt);
+    }
+    
+    if (payload_delete_stmt != NULL) {
+        sqlite3_finalize(payload_delete_stmt);
+    }
+    
+    if (payload_retention_stmt != NULL) {
+        sqlite3_finalize(payload_retention_stmt);
+    }
+    
+    sqlite3_finalize(deadletter_insert_stmt);
+    deadletter_insert_stmt = NULL;
+    atomic_store(&deadletter_rows, -1);
+    
+    sqlite3_finalize(client_select_stmt);
+    sqlite3_finalize(client_insert_stmt);
+    client_select_stmt = NULL;
+    client_insert_stmt = NULL;
+    client_cache_clear();
+    finalize_sparkplug_store();
+    // The copy thread, which loads the tree, has stopped
+    pthread_mutex_lock(&topic_tree_mutex);
+    topic_tree_clear();
+    pthread_mutex_unlock(&topic_tree_mutex);
+    free(topic_changes);
+    topic_changes = NULL;
+    topic_change_capacity = 0;
 
 	if (msg_db != NULL) {
 		sqlite3_close(msg_db);
+		msg_db = NULL;
 	}
+    atomic_store(&db_ready, 0);
+    release_sqlite_memory();
 
+    if (tick_registered) {
+        mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_TICK, on_tick_callback, NULL);
+    }
+    mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_CONTROL, on_control_callback, CONTROL_TOPIC);
+    if (topic_tree_enabled) {
+        mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_CONTROL, on_topic_tree_callback, TOPIC_TREE_TOPIC);
+    }
+    mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_RELOAD, on_reload_callback, NULL);
 	return mosquitto_callback_unregister(mosq_pid, MOSQ_EVT_MESSAGE, on_message_callback, NULL);
 }
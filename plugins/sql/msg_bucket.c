@@ -0,0 +1,318 @@
+// msg_bucket_expand(data): table-valued function expanding a msg_bucket blob into one
+// row per message. Built into the SQL plugin (SQLITE_CORE) and as a loadable extension
+// (msg_bucket.so) so sqld and the sqlite3 shell can query bucketed topics:
+//
+//   SELECT e.ulid, b.topic, e.payload
+//   FROM msg_bucket b, msg_bucket_expand(b.data) e
+//   WHERE b.topic = 'sensors/1/temp';
+
+#ifdef SQLITE_CORE
+#include "sqlite3.h"
+#else
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT1
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "msg_bucket.h"
+
+#define COL_ULID      0
+#define COL_TIMESTAMP 1
+#define COL_PAYLOAD   2
+#define COL_RETAIN    3
+#define COL_QOS       4
+#define COL_HEADERS   5
+#define COL_DATA      6  // Hidden argument column
+
+struct expand_cursor {
+    sqlite3_vtab_cursor base;
+    unsigned char *data;            // Copy of the bucket blob
+    const unsigned char *next;      // Start of the next encoded message
+    const unsigned char *end;
+    sqlite3_int64 rowid;
+    int eof;
+    // Current message
+    uint64_t timestamp;
+    const unsigned char *random;
+    int flags;
+    const unsigned char *payload;
+    size_t payloadlen;
+    const unsigned char *headers;
+    size_t headerslen;
+};
+
+static void encode_ulid(char str[27], uint64_t timestamp, const unsigned char random[MSG_BUCKET_RANDOM_LEN]) {
+    static const char set[] = "0123456789ABCDEFGHJKMNPQRSTVWXYZ";
+    unsigned char bytes[16];
+    for (int i = 0; i < 6; i++) {
+        bytes[i] = (unsigned char)(timestamp >> (40 - 8 * i));
+    }
+    memcpy(bytes + 6, random, MSG_BUCKET_RANDOM_LEN);
+
+    // 128 bits as 26 base32 characters, most significant first (leading 2 bits are zero)
+    int bit = -2;
+    for (int i = 0; i < 26; i++, bit += 5) {
+        int value = 0;
+        for (int b = bit; b < bit + 5; b++) {
+            value <<= 1;
+            if (b >= 0) {
+                value |= (bytes[b >> 3] >> (7 - (b & 7))) & 1;
+            }
+        }
+        str[i] = set[value];
+    }
+    str[26] = '\0';
+}
+
+// Decode the message at cur->next; sets eof at the end of the blob
+// Returns SQLITE_CORRUPT if the blob is truncated
+static int expand_decode(struct expand_cursor *cur) {
+    if (cur->next >= cur->end) {
+        cur->eof = 1;
+        return SQLITE_OK;
+    }
+
+    const unsigned char *p = cur->next;
+    uint64_t delta, len;
+    if (msg_bucket_get_varint(&p, cur->end, &delta) != 0 ||
+        (size_t)(cur->end - p) < MSG_BUCKET_RANDOM_LEN + 1) {
+        return SQLITE_CORRUPT;
+    }
+    cur->timestamp += (uint64_t)msg_bucket_unzigzag(delta);
+    cur->random = p;
+    p += MSG_BUCKET_RANDOM_LEN;
+    cur->flags = *p++;
+
+    if (msg_bucket_get_varint(&p, cur->end, &len) != 0 || len > (uint64_t)(cur->end - p)) {
+        return SQLITE_CORRUPT;
+    }
+    cur->payload = p;
+    cur->payloadlen = (size_t)len;
+    p += len;
+
+    cur->headers = NULL;
+    cur->headerslen = 0;
+    if (cur->flags & MSG_BUCKET_FLAG_HEADERS) {
+        if (msg_bucket_get_varint(&p, cur->end, &len) != 0 || len > (uint64_t)(cur->end - p)) {
+            return SQLITE_CORRUPT;
+        }
+        cur->headers = p;
+        cur->headerslen = (size_t)len;
+        p += len;
+    }
+
+    cur->next = p;
+    return SQLITE_OK;
+}
+
+static int expand_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                          sqlite3_vtab **vtab, char **err) {
+    (void)aux; (void)argc; (void)argv; (void)err;
+
+    int rc = sqlite3_declare_vtab(db,
+        "CREATE TABLE x(ulid TEXT, timestamp INTEGER, payload TEXT, retain INTEGER, "
+        "qos INTEGER, headers TEXT, data HIDDEN)");
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+
+    *vtab = sqlite3_malloc(sizeof(sqlite3_vtab));
+    if (*vtab == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(*vtab, 0, sizeof(sqlite3_vtab));
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+    return SQLITE_OK;
+}
+
+static int expand_disconnect(sqlite3_vtab *vtab) {
+    sqlite3_free(vtab);
+    return SQLITE_OK;
+}
+
+// The data argument is required; without a usable equality constraint on it the plan is rejected
+static int expand_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    (void)vtab;
+    int data_seen = 0;
+
+    for (int i = 0; i < info->nConstraint; i++) {
+        const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+        if (c->iColumn != COL_DATA) {
+            continue;
+        }
+        data_seen = 1;
+        if (c->usable && c->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            info->aConstraintUsage[i].argvIndex = 1;
+            info->aConstraintUsage[i].omit = 1;
+            info->estimatedCost = 100;
+            info->estimatedRows = 1000;
+            return SQLITE_OK;
+        }
+    }
+
+    if (data_seen) {
+        return SQLITE_CONSTRAINT;
+    }
+    info->estimatedCost = 1e12;
+    info->estimatedRows = 0;
+    return SQLITE_OK;
+}
+
+static int expand_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+    (void)vtab;
+    struct expand_cursor *cur = sqlite3_malloc(sizeof(*cur));
+    if (cur == NULL) {
+        return SQLITE_NOMEM;
+    }
+    memset(cur, 0, sizeof(*cur));
+    cur->eof = 1;
+    *cursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static int expand_close(sqlite3_vtab_cursor *cursor) {
+    struct expand_cursor *cur = (struct expand_cursor *)cursor;
+    sqlite3_free(cur->data);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int expand_filter(sqlite3_vtab_cursor *cursor, int idx_num, const char *idx_str,
+                         int argc, sqlite3_value **argv) {
+    (void)idx_num; (void)idx_str;
+    struct expand_cursor *cur = (struct expand_cursor *)cursor;
+
+    sqlite3_free(cur->data);
+    cur->data = NULL;
+    cur->next = cur->end = NULL;
+    cur->rowid = 0;
+    cur->timestamp = 0;
+    cur->eof = 1;
+
+    if (argc < 1 || sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        return SQLITE_OK;
+    }
+
+    const unsigned char *blob = sqlite3_value_blob(argv[0]);
+    int len = sqlite3_value_bytes(argv[0]);
+    if (blob == NULL || len < 1) {
+        return SQLITE_OK;
+    }
+    if (blob[0] == MSG_BUCKET_FORMAT_DEFLATE) {
+        // Closed bucket: inflate the message stream
+        const unsigned char *p = blob + 1;
+        uint64_t plain;
+        if (msg_bucket_get_varint(&p, blob + len, &plain) != 0 || plain == 0 || plain > MSG_BUCKET_MAX_INFLATED) {
+            return SQLITE_CORRUPT;
+        }
+        cur->data = sqlite3_malloc((int)plain);
+        if (cur->data == NULL) {
+            return SQLITE_NOMEM;
+        }
+        uLongf inflated = (uLongf)plain;
+        if (uncompress(cur->data, &inflated, p, (uLong)(blob + len - p)) != Z_OK || inflated != plain) {
+            return SQLITE_CORRUPT;
+        }
+        cur->next = cur->data;
+        cur->end = cur->data + plain;
+    } else if (blob[0] == MSG_BUCKET_FORMAT) {
+        cur->data = sqlite3_malloc(len);
+        if (cur->data == NULL) {
+            return SQLITE_NOMEM;
+        }
+        memcpy(cur->data, blob, len);
+        cur->next = cur->data + 1;
+        cur->end = cur->data + len;
+    } else {
+        cursor->pVtab->zErrMsg = sqlite3_mprintf("unsupported msg_bucket format %d", blob[0]);
+        return SQLITE_ERROR;
+    }
+    cur->eof = 0;
+    return expand_decode(cur);
+}
+
+static int expand_next(sqlite3_vtab_cursor *cursor) {
+    struct expand_cursor *cur = (struct expand_cursor *)cursor;
+    cur->rowid++;
+    return expand_decode(cur);
+}
+
+static int expand_eof(sqlite3_vtab_cursor *cursor) {
+    return ((struct expand_cursor *)cursor)->eof;
+}
+
+static int expand_column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int col) {
+    struct expand_cursor *cur = (struct expand_cursor *)cursor;
+
+    switch (col) {
+        case COL_ULID: {
+            char ulid[27];
+            encode_ulid(ulid, cur->timestamp, cur->random);
+            sqlite3_result_text(ctx, ulid, 26, SQLITE_TRANSIENT);
+            break;
+        }
+        case COL_TIMESTAMP:
+            sqlite3_result_int64(ctx, (sqlite3_int64)cur->timestamp);
+            break;
+        case COL_PAYLOAD:
+            // Same representation as msg.payload
+            sqlite3_result_text(ctx, (const char *)cur->payload, (int)cur->payloadlen, SQLITE_TRANSIENT);
+            break;
+        case COL_RETAIN:
+            sqlite3_result_int(ctx, (cur->flags & MSG_BUCKET_FLAG_RETAIN) ? 1 : 0);
+            break;
+        case COL_QOS:
+            sqlite3_result_int(ctx, cur->flags & MSG_BUCKET_QOS_MASK);
+            break;
+        case COL_HEADERS:
+            if (cur->headers != NULL) {
+                sqlite3_result_text(ctx, (const char *)cur->headers, (int)cur->headerslen, SQLITE_TRANSIENT);
+            } else {
+                sqlite3_result_null(ctx);
+            }
+            break;
+        default:
+            sqlite3_result_null(ctx);
+            break;
+    }
+    return SQLITE_OK;
+}
+
+static int expand_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    *rowid = ((struct expand_cursor *)cursor)->rowid;
+    return SQLITE_OK;
+}
+
+// Eponymous-only (no xCreate), read-only
+static sqlite3_module expand_module = {
+    .iVersion = 0,
+    .xConnect = expand_connect,
+    .xBestIndex = expand_best_index,
+    .xDisconnect = expand_disconnect,
+    .xOpen = expand_open,
+    .xClose = expand_close,
+    .xFilter = expand_filter,
+    .xNext = expand_next,
+    .xEof = expand_eof,
+    .xColumn = expand_column,
+    .xRowid = expand_rowid,
+};
+
+int msg_bucket_register(sqlite3 *db) {
+    return sqlite3_create_module(db, "msg_bucket_expand", &expand_module, NULL);
+}
+
+#ifndef SQLITE_CORE
+// Entry point for load_extension('msg_bucket')
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_msgbucket_init(sqlite3 *db, char **err, const sqlite3_api_routines *api) {
+    (void)err;
+    SQLITE_EXTENSION_INIT2(api);
+    return msg_bucket_register(db);
+}
+#endif
@@ -0,0 +1,79 @@
+#ifndef MSG_BUCKET_H
+#define MSG_BUCKET_H
+
+// Bucketed time-series rows (msg_bucket table)
+//
+// A bucket packs the messages of one topic into a single blob, written by the SQL plugin
+// and expanded back into rows by the msg_bucket_expand() table-valued function. The
+// function is compiled into the plugin and also built as a loadable extension for sqld.
+//
+// Blob layout:
+//   byte     format version (MSG_BUCKET_FORMAT)
+//   repeated for every message, in arrival order:
+//     varint   zigzag delta of the ULID timestamp (ms) to the previous message (first: to 0)
+//     10 bytes ULID randomness
+//     byte     flags: qos (bits 0-1), retain, headers present
+//     varint   payload length, followed by the payload bytes
+//     varint   headers length, followed by the headers (only with MSG_BUCKET_FLAG_HEADERS)
+//
+// Varints are LEB128 (7 bits per byte, least significant group first).
+//
+// A closed bucket is stored deflated when that makes it smaller:
+//   byte     MSG_BUCKET_FORMAT_DEFLATE
+//   varint   length of the message stream above (without its format byte)
+//   zlib stream of the message stream
+// Open buckets are written as segments in the plain format, one row per batch commit.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MSG_BUCKET_FORMAT 1
+#define MSG_BUCKET_FORMAT_DEFLATE 2
+#define MSG_BUCKET_MAX_INFLATED (1 << 30)  // Larger inflated sizes are treated as corrupt
+#define MSG_BUCKET_RANDOM_LEN 10
+#define MSG_BUCKET_QOS_MASK 0x03
+#define MSG_BUCKET_FLAG_RETAIN 0x04
+#define MSG_BUCKET_FLAG_HEADERS 0x08
+#define MSG_BUCKET_MAX_VARINT 10
+
+// Write v as varint, returns the number of bytes written (at most MSG_BUCKET_MAX_VARINT)
+static inline size_t msg_bucket_put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+// Read a varint at *p, advancing it. Returns 0 on success, 1 if the input is truncated
+static inline int msg_bucket_get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    uint64_t result = 0;
+    int shift = 0;
+    while (*p < end && shift < 64) {
+        unsigned char byte = *(*p)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *v = result;
+            return 0;
+        }
+        shift += 7;
+    }
+    return 1;
+}
+
+static inline uint64_t msg_bucket_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t msg_bucket_unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+struct sqlite3;
+
+// Register msg_bucket_expand() on a connection (plugin side)
+int msg_bucket_register(struct sqlite3 *db);
+
+#endif
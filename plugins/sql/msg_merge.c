@@ -0,0 +1,450 @@
+// msg_merge: k-way merge of per-node message databases into one ULID-ordered archive
+//
+//   msg_merge [-b batch] [-p payload_dir ...] archive.db node1.db node2.db ...
+//
+// Every input is read as sorted runs (SELECT ... ORDER BY ulid uses the ULID primary key,
+// and one run per bucketed topic walks its msg_bucket rows in bucket_start order through the
+// unique index), and the runs are merged through a binary heap, so rows are appended to the
+// archive in ULID order without re-sorting.
+// The archive uses the inline msg layout; rows whose ULID is already present are skipped,
+// so merging the same node database again is harmless. A skipped row whose topic or payload
+// differs is counted as a conflict: two nodes issued the same ULID, which only happens when
+// they share a node id (plugin_opt_node_id, e.g. host names hashing to the same 16 bits).
+//
+// Offloaded payloads (plugin_opt_offload_dir) are read from the payload directories given
+// with -p and stored inline; references whose file is not found are copied as they are.
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqlite3.h"
+#include "msg_bucket.h"
+
+#define DEFAULT_BATCH_ROWS 10000
+#define MAX_PAYLOAD_DIRS 16
+#define MAX_CONFLICTS_SHOWN 10
+#define PAYLOAD_HASH_LEN 16
+#define PAYLOAD_REFERENCE_LEN (9 + 3 + 2 * PAYLOAD_HASH_LEN)  // "payloads/hh/<32 hex>"
+
+struct run {
+    sqlite3 *db;            // Input connection (shared by the runs of one input)
+    sqlite3_stmt *stmt;     // Positioned on the current row while active
+    sqlite3_stmt *offload;  // Offloaded payload lookup of the input, NULL without a file store
+    const char *source;
+};
+
+static sqlite3 **inputs = NULL;
+static int input_open = 0;
+static sqlite3_stmt **offload_lookups = NULL;  // One per input
+static struct run *runs = NULL;
+static int run_count = 0;
+static int run_capacity = 0;
+static int *heap = NULL;    // Indices into runs, ordered by the current ULID
+static int heap_size = 0;
+static const char *payload_dirs[MAX_PAYLOAD_DIRS];
+static int payload_dir_count = 0;
+
+static const char *run_ulid(int r) {
+    return (const char *)sqlite3_column_text(runs[r].stmt, 0);
+}
+
+static int run_less(int a, int b) {
+    return strcmp(run_ulid(a), run_ulid(b)) < 0;
+}
+
+static void heap_sift_down(int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < heap_size && run_less(heap[left], heap[smallest])) {
+            smallest = left;
+        }
+        if (right < heap_size && run_less(heap[right], heap[smallest])) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        int tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static int table_exists(sqlite3 *db, const char *name) {
+    sqlite3_stmt *stmt = NULL;
+    int exists = 0;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE name = ?1", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        exists = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    return exists;
+}
+
+static int column_exists(sqlite3 *db, const char *table, const char *column) {
+    sqlite3_stmt *stmt = NULL;
+    int exists = 0;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info(?1) WHERE name = ?2", -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, column, -1, SQLITE_STATIC);
+        exists = sqlite3_step(stmt) == SQLITE_ROW;
+    }
+    sqlite3_finalize(stmt);
+    return exists;
+}
+
+// Start a sorted run (with ?1 bound to topic if given); runs without rows are dropped right away
+static int add_run(sqlite3 *db, const char *sql, const char *topic, sqlite3_stmt *offload, const char *source) {
+    if (run_count == run_capacity) {
+        int capacity = run_capacity > 0 ? 2 * run_capacity : 16;
+        struct run *grown_runs = realloc(runs, capacity * sizeof(*runs));
+        if (grown_runs == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        runs = grown_runs;
+        int *grown_heap = realloc(heap, capacity * sizeof(*heap));
+        if (grown_heap == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        heap = grown_heap;
+        run_capacity = capacity;
+    }
+
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", source, sqlite3_errmsg(db));
+        return 1;
+    }
+    if (topic != NULL) {
+        sqlite3_bind_text(stmt, 1, topic, -1, SQLITE_TRANSIENT);
+    }
+
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+    if (rc != SQLITE_ROW) {
+        fprintf(stderr, "%s: %s\n", source, sqlite3_errmsg(db));
+        sqlite3_finalize(stmt);
+        return 1;
+    }
+
+    runs[run_count].db = db;
+    runs[run_count].stmt = stmt;
+    runs[run_count].offload = offload;
+    runs[run_count].source = source;
+    heap[heap_size++] = run_count++;
+    return 0;
+}
+
+static int open_input(const char *path) {
+    sqlite3 *db = NULL;
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return 1;
+    }
+    inputs[input_open++] = db;
+    msg_bucket_register(db);
+
+    if (!table_exists(db, "msg")) {
+        fprintf(stderr, "%s: no msg table, skipped\n", path);
+        return 0;
+    }
+
+    // Offloaded payloads are registered in payload_blob with their file location
+    sqlite3_stmt *offload = NULL;
+    if (column_exists(db, "payload_blob", "location") && 
+        sqlite3_prepare_v2(db, "SELECT location FROM payload_blob WHERE hash = ?1 AND data = ?2 AND location IS NOT NULL", 
+                           -1, &offload, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+        return 1;
+    }
+    offload_lookups[input_open - 1] = offload;
+
+    int rc = add_run(db, "SELECT ulid, topic, payload, retain, qos, headers FROM msg ORDER BY ulid", NULL, offload, path);
+    if (rc != 0 || !table_exists(db, "msg_bucket")) {
+        return rc;
+    }
+
+    // A bucket holds its messages in ULID order and buckets of a topic follow each other, so
+    // walking a topic's buckets through the (topic, bucket_start) index yields a sorted run.
+    // Expanding all buckets at once would need a full sort of the expanded rows
+    sqlite3_stmt *topics = NULL;
+    if (sqlite3_prepare_v2(db, "SELECT DISTINCT topic FROM msg_bucket", -1, &topics, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", path, sqlite3_errmsg(db));
+        return 1;
+    }
+    while (rc == 0 && sqlite3_step(topics) == SQLITE_ROW) {
+        rc = add_run(db, 
+            "SELECT e.ulid, b.topic, e.payload, e.retain, e.qos, e.headers "
+            "FROM msg_bucket b, msg_bucket_expand(b.data) e WHERE b.topic = ?1 ORDER BY b.bucket_start", 
+            (const char *)sqlite3_column_text(topics, 0), NULL, path);
+    }
+    sqlite3_finalize(topics);
+    return rc;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// Read the file behind an offloaded payload reference ("payloads/hh/<32 hex>") of the current
+// row of a run. Returns a malloc'd copy of the payload, or NULL if the row is not offloaded
+// (*missing = 0) or its file is not in any payload directory (*missing = 1)
+static unsigned char *read_offloaded(const struct run *r, size_t *size, int *missing) {
+    *missing = 0;
+    const char *payload = (const char *)sqlite3_column_text(r->stmt, 2);
+    if (r->offload == NULL || payload == NULL || sqlite3_column_bytes(r->stmt, 2) != PAYLOAD_REFERENCE_LEN || 
+        strncmp(payload, "payloads/", 9) != 0) {
+        return NULL;
+    }
+
+    unsigned char hash[PAYLOAD_HASH_LEN];
+    for (int i = 0; i < PAYLOAD_HASH_LEN; i++) {
+        int hi = hex_value(payload[12 + 2 * i]);
+        int lo = hex_value(payload[13 + 2 * i]);
+        if (hi < 0 || lo < 0) {
+            return NULL;
+        }
+        hash[i] = (unsigned char)(hi << 4 | lo);
+    }
+
+    sqlite3_bind_blob(r->offload, 1, hash, PAYLOAD_HASH_LEN, SQLITE_STATIC);
+    sqlite3_bind_text(r->offload, 2, payload, -1, SQLITE_STATIC);
+    unsigned char *data = NULL;
+    if (sqlite3_step(r->offload) == SQLITE_ROW) {
+        *missing = 1;
+        const char *location = (const char *)sqlite3_column_text(r->offload, 0);
+        for (int i = 0; i < payload_dir_count && data == NULL; i++) {
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%s", payload_dirs[i], location) >= (int)sizeof(path)) {
+                continue;
+            }
+            FILE *file = fopen(path, "rb");
+            if (file == NULL) {
+                continue;
+            }
+            long len = -1;
+            if (fseek(file, 0, SEEK_END) == 0 && (len = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+                data = malloc(len > 0 ? (size_t)len : 1);
+                if (data != NULL && fread(data, 1, (size_t)len, file) != (size_t)len) {
+                    free(data);
+                    data = NULL;
+                }
+            }
+            fclose(file);
+            if (data != NULL) {
+                *size = (size_t)len;
+                *missing = 0;
+            }
+        }
+    }
+    sqlite3_reset(r->offload);
+    return data;
+}
+
+static int exec_sql(sqlite3 *db, const char *sql) {
+    char *err = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", err);
+        sqlite3_free(err);
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b batch_rows] [-p payload_dir ...] archive.db input.db [input.db ...]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int batch_rows = DEFAULT_BATCH_ROWS;
+    int arg = 1;
+
+    while (arg + 1 < argc && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-b") == 0) {
+            batch_rows = atoi(argv[arg + 1]);
+        } else if (strcmp(argv[arg], "-p") == 0 && payload_dir_count < MAX_PAYLOAD_DIRS) {
+            payload_dirs[payload_dir_count++] = argv[arg + 1];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        arg += 2;
+    }
+    if (argc - arg < 2 || batch_rows <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *archive_path = argv[arg++];
+    int input_count = argc - arg;
+
+    inputs = calloc(input_count, sizeof(*inputs));
+    offload_lookups = calloc(input_count, sizeof(*offload_lookups));
+    if (inputs == NULL || offload_lookups == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (int i = arg; i < argc; i++) {
+        if (open_input(argv[i]) != 0) {
+            return 1;
+        }
+    }
+
+    sqlite3 *out = NULL;
+    if (sqlite3_open(archive_path, &out) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open %s: %s\n", archive_path, sqlite3_errmsg(out));
+        return 1;
+    }
+    // The archive is rebuilt from the inputs if the merge fails, so favour load speed
+    if (exec_sql(out,
+            "PRAGMA journal_mode=WAL;"
+            "PRAGMA synchronous=OFF;"
+            "CREATE TABLE IF NOT EXISTS msg(ulid text primary key, topic text not null, payload text not null, "
+            "retain integer not null default 0, qos integer not null default 0, headers text);") != 0) {
+        return 1;
+    }
+
+    sqlite3_stmt *insert = NULL;
+    if (sqlite3_prepare_v2(out,
+            "INSERT OR IGNORE INTO msg (ulid, topic, payload, retain, qos, headers) VALUES (?1, ?2, ?3, ?4, ?5, ?6)",
+            -1, &insert, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(out));
+        return 1;
+    }
+
+    sqlite3_stmt *existing = NULL;
+    if (sqlite3_prepare_v2(out, "SELECT topic = ?2 AND payload = ?3 FROM msg WHERE ulid = ?1", 
+                           -1, &existing, NULL) != SQLITE_OK) {
+        fprintf(stderr, "%s\n", sqlite3_errmsg(out));
+        return 1;
+    }
+
+    for (int i = heap_size / 2 - 1; i >= 0; i--) {
+        heap_sift_down(i);
+    }
+
+    long long merged = 0;
+    long long skipped = 0;
+    long long conflicts = 0;
+    long long inlined = 0;
+    long long missing_files = 0;
+    int in_batch = 0;
+    int rc = exec_sql(out, "BEGIN");
+
+    while (rc == 0 && heap_size > 0) {
+        struct run *r = &runs[heap[0]];
+
+        for (int col = 0; col < 6; col++) {
+            sqlite3_bind_value(insert, col + 1, sqlite3_column_value(r->stmt, col));
+        }
+        size_t size = 0;
+        int missing = 0;
+        unsigned char *file_payload = read_offloaded(r, &size, &missing);
+        if (file_payload != NULL) {
+            sqlite3_bind_text(insert, 3, (const char *)file_payload, (int)size, free);
+            inlined++;
+        }
+        missing_files += missing;
+        if (sqlite3_step(insert) != SQLITE_DONE) {
+            fprintf(stderr, "Insert failed: %s\n", sqlite3_errmsg(out));
+            rc = 1;
+            break;
+        }
+        if (sqlite3_changes(out) > 0) {
+            merged++;
+        } else {
+            // Same ULID: the row merged before, or another node with the same node id
+            skipped++;
+            sqlite3_bind_value(existing, 1, sqlite3_column_value(r->stmt, 0));
+            sqlite3_bind_value(existing, 2, sqlite3_column_value(r->stmt, 1));
+            if (file_payload != NULL) {
+                sqlite3_bind_text(existing, 3, (const char *)file_payload, (int)size, SQLITE_STATIC);
+            } else {
+                sqlite3_bind_value(existing, 3, sqlite3_column_value(r->stmt, 2));
+            }
+            if (sqlite3_step(existing) == SQLITE_ROW && sqlite3_column_int(existing, 0) == 0 && 
+                conflicts++ < MAX_CONFLICTS_SHOWN) {
+                fprintf(stderr, "%s: ULID %s already used by a different message\n", 
+                        r->source, (const char *)sqlite3_column_text(r->stmt, 0));
+            }
+            sqlite3_reset(existing);
+        }
+        sqlite3_reset(insert);
+        sqlite3_clear_bindings(insert);
+
+        if (++in_batch >= batch_rows) {
+            rc = exec_sql(out, "COMMIT; BEGIN");
+            in_batch = 0;
+        }
+
+        // Advance the run; finished runs leave the heap
+        int step = sqlite3_step(r->stmt);
+        if (step != SQLITE_ROW) {
+            if (step != SQLITE_DONE) {
+                fprintf(stderr, "%s: %s\n", r->source, sqlite3_errmsg(r->db));
+                rc = 1;
+            }
+            sqlite3_finalize(r->stmt);
+            r->stmt = NULL;
+            heap[0] = heap[--heap_size];
+        }
+        heap_sift_down(0);
+    }
+
+    if (rc == 0) {
+        rc = exec_sql(out, "COMMIT");
+    }
+    if (rc == 0) {
+        // Indexes are built once after the load
+        rc = exec_sql(out,
+            "CREATE INDEX IF NOT EXISTS idx_msg_topic ON msg(topic);"
+            "CREATE INDEX IF NOT EXISTS idx_msg_topic_ulid ON msg(topic, ulid DESC);");
+    }
+
+    sqlite3_finalize(insert);
+    sqlite3_finalize(existing);
+    sqlite3_close(out);
+    for (int i = 0; i < run_count; i++) {
+        sqlite3_finalize(runs[i].stmt);
+    }
+    for (int i = 0; i < input_open; i++) {
+        sqlite3_finalize(offload_lookups[i]);
+        sqlite3_close(inputs[i]);
+    }
+    free(inputs);
+    free(offload_lookups);
+    free(runs);
+    free(heap);
+
+    if (rc == 0) {
+        printf("Merged %lld messages from %d databases into %s (%lld already present, %lld offloaded payloads inlined)\n",
+               merged, input_count, archive_path, skipped, inlined);
+        if (missing_files > 0) {
+            fprintf(stderr, "%lld offloaded payloads not found in the payload directories (-p), "
+                    "copied as references\n", missing_files);
+        }
+        if (conflicts > 0) {
+            fprintf(stderr, "%lld messages skipped because their ULID was used by a different message: "
+                    "give every node a distinct numeric plugin_opt_node_id\n", conflicts);
+        }
+    }
+    return rc;
+}
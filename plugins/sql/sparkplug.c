@@ -0,0 +1,199 @@
+// Sparkplug B payload decoding (protobuf wire format), see sparkplug.h
+
+#include <string.h>
+
+#include "sparkplug.h"
+
+#define WIRE_VARINT  0
+#define WIRE_FIXED64 1
+#define WIRE_BYTES   2
+#define WIRE_FIXED32 5
+
+// One protobuf field: number, wire type and value (varint/fixed) or bytes
+struct pb_field {
+    uint32_t number;
+    int wire_type;
+    uint64_t value;
+    const unsigned char *bytes;
+    size_t len;
+};
+
+// Read a varint at *p, advancing it. Returns 0 on success, -1 if truncated or too long
+static int pb_varint(const unsigned char **p, const unsigned char *end, uint64_t *v) {
+    uint64_t result = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *v = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint64_t pb_fixed(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+// Read the next field at *p. Returns 0 on success, -1 if malformed (groups are not used by
+// Sparkplug and count as malformed)
+static int pb_next(const unsigned char **p, const unsigned char *end, struct pb_field *field) {
+    uint64_t key;
+    if (pb_varint(p, end, &key) != 0 || (key >> 3) == 0 || (key >> 3) > UINT32_MAX) {
+        return -1;
+    }
+    field->number = (uint32_t)(key >> 3);
+    field->wire_type = (int)(key & 7);
+    field->bytes = NULL;
+    field->len = 0;
+
+    switch (field->wire_type) {
+        case WIRE_VARINT:
+            return pb_varint(p, end, &field->value);
+        case WIRE_FIXED64:
+            if (end - *p < 8) {
+                return -1;
+            }
+            field->value = pb_fixed(*p, 8);
+            *p += 8;
+            return 0;
+        case WIRE_FIXED32:
+            if (end - *p < 4) {
+                return -1;
+            }
+            field->value = pb_fixed(*p, 4);
+            *p += 4;
+            return 0;
+        case WIRE_BYTES: {
+            uint64_t len;
+            if (pb_varint(p, end, &len) != 0 || len > (uint64_t)(end - *p)) {
+                return -1;
+            }
+            field->bytes = *p;
+            field->len = (size_t)len;
+            *p += len;
+            return 0;
+        }
+        default:
+            return -1;
+    }
+}
+
+static int decode_metric(const unsigned char *p, const unsigned char *end, struct sparkplug_metric *metric) {
+    memset(metric, 0, sizeof(*metric));
+    struct pb_field field;
+    while (p < end) {
+        if (pb_next(&p, end, &field) != 0) {
+            return -1;
+        }
+        int is_bytes = field.wire_type == WIRE_BYTES;
+        switch (field.number) {
+            case 1:
+                if (!is_bytes) {
+                    return -1;
+                }
+                metric->name = (const char *)field.bytes;
+                metric->name_len = field.len;
+                break;
+            case 2:
+                metric->alias = field.value;
+                metric->has_alias = 1;
+                break;
+            case 3:
+                metric->timestamp = field.value;
+                break;
+            case 4:
+                metric->datatype = (uint32_t)field.value;
+                break;
+            case 7:
+                metric->is_null = field.value != 0;
+                break;
+            case SPARKPLUG_VALUE_INT:
+            case SPARKPLUG_VALUE_LONG:
+            case SPARKPLUG_VALUE_BOOLEAN:
+                if (is_bytes) {
+                    return -1;
+                }
+                metric->value_field = (int)field.number;
+                metric->int_value = field.number == SPARKPLUG_VALUE_INT ? (uint32_t)field.value : field.value;
+                break;
+            case SPARKPLUG_VALUE_FLOAT: {
+                if (field.wire_type != WIRE_FIXED32) {
+                    return -1;
+                }
+                uint32_t bits = (uint32_t)field.value;
+                float f;
+                memcpy(&f, &bits, sizeof(f));
+                metric->value_field = SPARKPLUG_VALUE_FLOAT;
+                metric->double_value = f;
+                break;
+            }
+            case SPARKPLUG_VALUE_DOUBLE: {
+                if (field.wire_type != WIRE_FIXED64) {
+                    return -1;
+                }
+                double d;
+                memcpy(&d, &field.value, sizeof(d));
+                metric->value_field = SPARKPLUG_VALUE_DOUBLE;
+                metric->double_value = d;
+                break;
+            }
+            case SPARKPLUG_VALUE_STRING:
+            case 16:
+            case 17:
+            case 18:
+            case 19:
+                if (!is_bytes) {
+                    return -1;
+                }
+                metric->value_field = (int)field.number;
+                metric->bytes = field.bytes;
+                metric->bytes_len = field.len;
+                break;
+            default:
+                // is_historical, is_transient, metadata, properties
+                break;
+        }
+    }
+    return 0;
+}
+
+int sparkplug_decode(const unsigned char *data, size_t len, uint64_t *timestamp,
+                     sparkplug_metric_fn fn, void *arg) {
+    const unsigned char *end = data + len;
+    const unsigned char *p = data;
+    struct pb_field field;
+
+    // The payload timestamp applies to all metrics, wherever it is in the message
+    *timestamp = 0;
+    while (p < end) {
+        if (pb_next(&p, end, &field) != 0) {
+            return -1;
+        }
+        if (field.number == 1 && field.wire_type == WIRE_VARINT) {
+            *timestamp = field.value;
+        }
+    }
+
+    p = data;
+    while (p < end) {
+        pb_next(&p, end, &field);
+        if (field.number != 2) {
+            continue;
+        }
+        struct sparkplug_metric metric;
+        if (field.wire_type != WIRE_BYTES || decode_metric(field.bytes, field.bytes + field.len, &metric) != 0) {
+            return -1;
+        }
+        int rc = fn(&metric, arg);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
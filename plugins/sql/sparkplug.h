@@ -0,0 +1,70 @@
+#ifndef SPARKPLUG_H
+#define SPARKPLUG_H
+
+// Sparkplug B payload decoding
+//
+// Decodes the protobuf wire format of org.eclipse.tahu.protobuf.Payload without a protobuf
+// runtime. Only the fields the SQL plugin stores are read; properties, metadata, datasets
+// and templates are skipped. Field numbers:
+//
+//   Payload: 1 timestamp (uint64), 2 metrics (Metric, repeated), 3 seq, 4 uuid, 5 body
+//   Metric:  1 name (string), 2 alias (uint64), 3 timestamp (uint64), 4 datatype (uint32),
+//            7 is_null (bool), 10 int_value (uint32), 11 long_value (uint64),
+//            12 float_value, 13 double_value, 14 boolean_value, 15 string_value,
+//            16 bytes_value, 17 dataset_value, 18 template_value, 19 extension_value
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sparkplug B data types (Metric.datatype)
+#define SPARKPLUG_TYPE_INT8      1
+#define SPARKPLUG_TYPE_INT16     2
+#define SPARKPLUG_TYPE_INT32     3
+#define SPARKPLUG_TYPE_INT64     4
+#define SPARKPLUG_TYPE_UINT8     5
+#define SPARKPLUG_TYPE_UINT16    6
+#define SPARKPLUG_TYPE_UINT32    7
+#define SPARKPLUG_TYPE_UINT64    8
+#define SPARKPLUG_TYPE_FLOAT     9
+#define SPARKPLUG_TYPE_DOUBLE    10
+#define SPARKPLUG_TYPE_BOOLEAN   11
+#define SPARKPLUG_TYPE_STRING    12
+#define SPARKPLUG_TYPE_DATETIME  13
+#define SPARKPLUG_TYPE_TEXT      14
+#define SPARKPLUG_TYPE_UUID      15
+
+// Metric value fields (Metric.value oneof)
+#define SPARKPLUG_VALUE_NONE     0
+#define SPARKPLUG_VALUE_INT      10   // int_value: integers up to 32 bits
+#define SPARKPLUG_VALUE_LONG     11   // long_value: 64-bit integers and DateTime
+#define SPARKPLUG_VALUE_FLOAT    12
+#define SPARKPLUG_VALUE_DOUBLE   13
+#define SPARKPLUG_VALUE_BOOLEAN  14
+#define SPARKPLUG_VALUE_STRING   15
+// Fields 16-19 (bytes, dataset, template, extension) are reported with their raw bytes
+
+struct sparkplug_metric {
+    const char *name;               // Not NUL-terminated, NULL if the metric only has an alias
+    size_t name_len;
+    uint64_t alias;
+    int has_alias;
+    uint64_t timestamp;             // ms since the epoch, 0 if absent
+    uint32_t datatype;              // SPARKPLUG_TYPE_*, 0 if absent (usual in DATA messages)
+    int is_null;
+    int value_field;                // SPARKPLUG_VALUE_* or 16-19, SPARKPLUG_VALUE_NONE if absent
+    uint64_t int_value;             // int_value, long_value and boolean_value
+    double double_value;            // float_value and double_value
+    const unsigned char *bytes;     // string_value and fields 16-19
+    size_t bytes_len;
+};
+
+// Called for every metric in payload order; a non-zero return stops decoding
+typedef int (*sparkplug_metric_fn)(const struct sparkplug_metric *metric, void *arg);
+
+// Decode a payload. *timestamp receives the payload timestamp (0 if absent) before the first
+// metric is reported. Returns 0 on success, -1 if the payload is malformed (metrics before
+// the malformed one have been reported) or the return value of fn if it stopped decoding
+int sparkplug_decode(const unsigned char *data, size_t len, uint64_t *timestamp,
+                     sparkplug_metric_fn fn, void *arg);
+
+#endif